@@ -45,6 +45,8 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <string.h>
 
 #include "backup_internal.h"
+#include "backup_manifest.h"
+#include "call_gate.h"
 #include "glassbox.h"
 #include "manager.h"
 #include "raii-malloc.h"
@@ -68,6 +70,11 @@ manager the_manager;
 //
 // Interposed public API:
 //
+// Each call passes through the_call_gate.  While no backup is
+// running the gate is idle and the call goes straight to the system;
+// the backup manager finds out about the files that were opened in
+// the meanwhile when the next backup starts.
+//
 //***************************************
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -79,6 +86,10 @@ manager the_manager;
 //     Either creates or opens a file in both the source directory
 // and the backup directory.
 //
+//     Opening an existing file can block (on a FIFO, say), so when
+// there is no O_CREAT only the bookkeeping after the open is part of
+// the call as far as the gate is concerned.
+//
 extern "C" int open(const char* file, int oflag, ...) {
     int fd = 0;
     TRACE("open() intercepted, file = ", file);
@@ -87,16 +98,26 @@ extern "C" int open(const char* file, int oflag, ...) {
         va_start(ap, oflag);
         mode_t mode = va_arg(ap, mode_t);
         va_end(ap);
+        with_call_gate gate(-1);
+        if (!gate.tracking || !the_manager.is_alive()) {
+            return call_real_open(file, oflag, mode);
+        }
         the_manager.lock_file_op();
+        the_manager.lock_open_close();
         fd = call_real_open(file, oflag, mode);
-        if (fd >= 0 && the_manager.is_alive()) { 
+        if (fd >= 0) { 
             int ignore __attribute__((unused)) = the_manager.open(fd, file, oflag); // if there's an error in this call, it's been reported.  The application doesn't want to see the error.
         }
 
+        the_manager.unlock_open_close();
         the_manager.unlock_file_op();
     } else {
         fd = call_real_open(file, oflag);
         if (fd >= 0) {
+            with_call_gate gate(fd);
+            if (!gate.tracking || !the_manager.is_alive()) {
+                goto out;
+            }
             struct stat stats;
             int r = fstat(fd, &stats);
             if(r != 0) {
@@ -104,8 +125,10 @@ extern "C" int open(const char* file, int oflag, ...) {
             }
 
             // TODO: What happens if we can't tell that the file is a FIFO?  Should we just the backup?  Skip this file?
-            if (!S_ISFIFO(stats.st_mode) && the_manager.is_alive()) {
+            if (!S_ISFIFO(stats.st_mode)) {
+                the_manager.lock_open_close();
                 int ignore __attribute__((unused)) = the_manager.open(fd, file, oflag); // if there's an error in the call, it's reported.  The application doesn't want to hear about it.
+                the_manager.unlock_open_close();
             }
         }
     }
@@ -127,11 +150,15 @@ out:
 extern "C" int close(int fd) {
     int r = 0;
     TRACE("close() intercepted, fd = ", fd);
-    if (the_manager.is_alive()) {
+    with_call_gate gate(fd);
+    if (gate.tracking && the_manager.is_alive()) {
+        the_manager.lock_open_close();
         the_manager.close(fd); // The application doesn't want to hear about problems. The backup manager has been notified.
+        r = call_real_close(fd);
+        the_manager.unlock_open_close();
+    } else {
+        r = call_real_close(fd);
     }
-
-    r = call_real_close(fd);
     return r;
 }
 
@@ -145,11 +172,18 @@ extern "C" int close(int fd) {
 //     Writes to the file associated with the given file descriptor
 // in both the source and backup directories.
 //
+// Note:
+//
+//     read() and lseek() aren't interposed.  The backup manager asks
+// the system for the file offset when it needs one, in write(), so
+// reads and seeks cost nothing extra during a backup.
+//
 extern "C" ssize_t write(int fd, const void *buf, size_t nbyte) {
     TRACE("write() intercepted, fd = ", fd);
 
     ssize_t r = 0;
-    if (the_manager.is_alive()) {
+    with_call_gate gate(fd);
+    if (gate.tracking && the_manager.is_alive()) {
         // Moved the write down into manager where a lock can be obtained.
         r = the_manager.write(fd, buf, nbyte);
     } else {
@@ -160,34 +194,6 @@ extern "C" ssize_t write(int fd, const void *buf, size_t nbyte) {
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// read() -
-//
-// Description: 
-//
-//     Reads data into the given buffer from the source directory.
-// 
-// Note:
-//
-//     The backup manager needs to know that the offset for the 
-// given file descriptor has changed, even though no bytes are
-// read from the backup copy of the same file.
-//
-extern "C" ssize_t read(int fd, void *buf, size_t nbyte) {
-    TRACE("read() intercepted, fd = ", fd);
-    ssize_t r = 0;
-    if (the_manager.is_alive()) {
-        // Moved the read down into manager, where a lock can be obtained.
-        r = the_manager.read(fd, buf, nbyte);        
-    } else {
-        r = call_real_read(fd, buf, nbyte);
-    }
-
-    return r;
-}
-
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // pwrite() -
@@ -200,7 +206,8 @@ extern "C" ssize_t read(int fd, void *buf, size_t nbyte) {
 extern "C" ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
     TRACE("pwrite() intercepted, fd = ", fd);
     ssize_t r = 0;
-    if (the_manager.is_alive()) {
+    with_call_gate gate(fd);
+    if (gate.tracking && the_manager.is_alive()) {
         r = the_manager.pwrite(fd, buf, nbyte, offset);
     } else {
         r = call_real_pwrite(fd, buf, nbyte, offset);
@@ -211,39 +218,48 @@ extern "C" ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-off_t lseek(int fd, off_t offset, int whence) {
-    TRACE("lseek() intercepted fd =", fd);
-    off_t r = 0;
-    if (the_manager.is_alive()) {
-        r = the_manager.lseek(fd, offset, whence);
+// ftruncate() -
+//
+// Description: 
+//
+//     Deletes a portion of the file based on the given file descriptor.
+//
+extern "C" int ftruncate(int fd, off_t length) {
+    TRACE("ftruncate() intercepted, fd = ", fd);
+    int r = 0;
+    with_call_gate gate(fd);
+    if (gate.tracking && the_manager.is_alive()) {
+        r = the_manager.ftruncate(fd, length);
     } else {
-        r = call_real_lseek(fd, offset, whence);
+        r = call_real_ftruncate(fd, length);
     }
 
     return r;
 }
 
+
 ///////////////////////////////////////////////////////////////////////////////
 //
-// ftruncate() -
+// fallocate() -
 //
 // Description: 
 //
-//     Deletes a portion of the file based on the given file descriptor.
+//     Allocates, zeroes, or punches holes in a range of the file
+//     based on the given file descriptor.
 //
-extern "C" int ftruncate(int fd, off_t length) {
-    TRACE("ftruncate() intercepted, fd = ", fd);
+extern "C" int fallocate(int fd, int mode, off_t offset, off_t len) {
+    TRACE("fallocate() intercepted, fd = ", fd);
     int r = 0;
-    if (the_manager.is_alive()) {
-        r = the_manager.ftruncate(fd, length);
+    with_call_gate gate(fd);
+    if (gate.tracking && the_manager.is_alive()) {
+        r = the_manager.fallocate(fd, mode, offset, len);
     } else {
-        r = call_real_ftruncate(fd, length);
+        r = call_real_fallocate(fd, mode, offset, len);
     }
 
     return r;
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // truncate() -
@@ -255,7 +271,8 @@ extern "C" int ftruncate(int fd, off_t length) {
 extern "C" int truncate(const char *path, off_t length) {
     int r = 0;
     TRACE("truncate() intercepted, path = ", path);
-    if (the_manager.is_alive()) {
+    with_call_gate gate(-1);
+    if (gate.tracking && the_manager.is_alive()) {
         r = the_manager.truncate(path, length);
     } else {
         r = call_real_truncate(path, length);
@@ -274,7 +291,8 @@ extern "C" int truncate(const char *path, off_t length) {
 extern "C" int unlink(const char *path) {
     int r = 0;
     TRACE("unlink() intercepted, path = ", path);
-    if (the_manager.is_alive()) {
+    with_call_gate gate(-1);
+    if (gate.tracking && the_manager.is_alive()) {
         the_manager.lock_file_op();
         r = the_manager.unlink(path);
         the_manager.unlock_file_op();
@@ -297,7 +315,8 @@ extern "C" int rename(const char *oldpath, const char *newpath) {
     TRACE("-> oldpath = ", oldpath);
     TRACE("-> newpath = ", newpath);
     
-    if (the_manager.is_alive()) {
+    with_call_gate gate(-1);
+    if (gate.tracking && the_manager.is_alive()) {
         the_manager.lock_file_op();
         r = the_manager.rename(oldpath, newpath);
         the_manager.unlock_file_op();
@@ -317,8 +336,9 @@ extern "C" int rename(const char *oldpath, const char *newpath) {
 int mkdir(const char *pathname, mode_t mode) {
     int r = 0;
     TRACE("mkidr() intercepted", pathname);
+    with_call_gate gate(-1);
     r = call_real_mkdir(pathname, mode);
-    if (r == 0 && the_manager.is_alive()) {
+    if (r == 0 && gate.tracking && the_manager.is_alive()) {
         // Don't try to write if there was an error in the application.
         the_manager.mkdir(pathname);
     }
@@ -410,6 +430,51 @@ extern "C" void tokubackup_throttle_backup(unsigned long bytes_per_second) throw
     the_manager.set_throttle(bytes_per_second);
 }
 
+extern "C" void tokubackup_set_throttle_burst(unsigned long n_bytes) throw() {
+    the_manager.set_throttle_burst(n_bytes);
+}
+
+extern "C" void tokubackup_set_copy_threads(unsigned int n_threads) throw() {
+    the_manager.set_copy_threads(n_threads);
+}
+
+extern "C" void tokubackup_set_io_depth(unsigned int depth) throw() {
+    the_manager.set_io_depth(depth);
+}
+
+extern "C" int tokubackup_set_device_limits(const char *path, unsigned int concurrency, unsigned int io_depth) throw() {
+    return the_manager.set_device_limits(path, concurrency, io_depth);
+}
+
+extern "C" void tokubackup_set_huge_pages(int use_huge_pages) throw() {
+    the_manager.set_huge_pages(use_huge_pages != 0);
+}
+
+extern "C" void tokubackup_set_capture_journal(int use_journal) throw() {
+    the_manager.set_capture_journal(use_journal != 0);
+}
+
+extern "C" void tokubackup_set_dirty_tracking(int track_dirty_blocks) throw() {
+    the_manager.set_dirty_tracking(track_dirty_blocks != 0);
+}
+
+extern "C" int tokubackup_set_incremental_base(const char *base_dirs[], int dir_count) throw() {
+    return the_manager.set_incremental_bases(base_dirs, dir_count);
+}
+
+extern "C" void tokubackup_get_stats(struct tokubackup_stats *stats) throw() {
+    the_manager.get_stats(stats);
+}
+
+extern "C" unsigned int tokubackup_get_device_stats(struct tokubackup_device_stats *stats, unsigned int n_stats) throw() {
+    return the_manager.get_device_stats(stats, n_stats);
+}
+
+extern "C" int tokubackup_verify_backup(const char *backup_dir) throw() {
+    backup_manifest manifest;
+    return manifest.verify(backup_dir);
+}
+
 unsigned long get_throttle(void) throw() {
     return the_manager.get_throttle();
 }
@@ -444,4 +509,7 @@ bool backup_done_copying(void) throw() {
 void backup_set_start_copying(bool b) throw() {
     the_manager.set_start_copying(b);
 }
+void backup_set_copy_chunk_size(uint64_t chunk_size) throw() {
+    the_manager.set_copy_chunk_size(chunk_size);
+}
 #endif
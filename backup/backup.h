@@ -124,9 +124,225 @@ void tokubackup_throttle_backup(unsigned long bytes_per_second) throw() __attrib
 //   at a high rate, then the destination directory will receive those modifications
 //   at the same rate, plus receive the throttled read data from the source.
 
+void tokubackup_set_throttle_burst(unsigned long n_bytes) throw() __attribute__((visibility("default")));
+// Effect: Let the backup read up to n_bytes faster than the throttle set
+//   by tokubackup_throttle_backup() allows, to make up for a time when
+//   it read less.  The throttle is a budget for the backup as a whole,
+//   which fills at the throttle's rate, up to n_bytes, and which every
+//   copy thread's reads are taken out of.
+//   This function can be called by any thread at any time, and affects
+//   any currently running backup as well as future ones.
+//  The default is 0, which holds the backup to the rate at all times.
+
+void tokubackup_set_copy_threads(unsigned int n_threads) throw() __attribute__((visibility("default")));
+// Effect: Set the number of threads that copy files during a backup.
+//   This function can be called by any thread at any time.  It affects
+//   backups started afterwards; a backup that is already copying keeps
+//   the number of threads it started with.
+//  The default is 1.  Passing 0 is the same as passing 1, and values
+//   larger than 256 are treated as 256.
+//  With more than one thread, the exclude_copy callback is called
+//   concurrently from the copy threads, but the poll and error callbacks
+//   are only ever called from the thread running tokubackup_create_backup().
+//  The throttle set by tokubackup_throttle_backup() applies to the backup
+//   as a whole, not to each thread.
+
+void tokubackup_set_io_depth(unsigned int depth) throw() __attribute__((visibility("default")));
+// Effect: Set how many reads (and as many writes) each copy thread keeps
+//   in flight when copying a file.  With a depth of more than 1 the copy
+//   threads use io_uring, if the kernel supports it, and
+//   tokubackup_get_stats() tells what queue depth they achieved.
+//   This function can be called by any thread at any time.  It affects
+//   backups started afterwards.
+//  The default is 1, which copies synchronously.  Passing 0 is the same
+//   as passing 1, and values larger than 64 are treated as 64.
+
+int tokubackup_set_device_limits(const char *path, unsigned int concurrency, unsigned int io_depth) throw() __attribute__((visibility("default")));
+// Effect: Limit the copying of later backups on the device that holds
+//   path (any file or directory on it).  At most concurrency files whose
+//   source or destination is on the device are copied at once, however
+//   many copy threads there are, and each of them keeps io_depth reads
+//   (and as many writes) in flight.  A file copied from one device to
+//   another gets the smaller of the two limits.
+//  Zero for either means that the backup picks it: a rotational disk
+//   gets one file at a time, since the seeks between files cost it more
+//   than the extra threads gain, and anything else gets no limit.  The
+//   io depth is the one set by tokubackup_set_io_depth().
+//   tokubackup_get_device_stats() tells what the backup did on each
+//   device.
+//  This function can be called by any thread at any time.  It affects
+//   backups started afterwards.  Values larger than 256 (for
+//   concurrency) and 64 (for io_depth) are treated as those.
+//  Returns 0, or the error number if path could not be stat'd.
+
+void tokubackup_set_huge_pages(int use_huge_pages) throw() __attribute__((visibility("default")));
+// Effect: If use_huge_pages is nonzero, back the copy buffers with huge
+//   pages: explicit ones if the system has any reserved, and otherwise
+//   transparent ones.  This function can be called by any thread at
+//   any time.  It affects backups started afterwards.
+//  The default is 0.
+
+void tokubackup_set_capture_journal(int use_journal) throw() __attribute__((visibility("default")));
+// Effect: If use_journal is nonzero, a (full) backup appends the writes,
+//   truncates and fallocates that it captures to a journal file (named
+//   tokubackup_capture_journal) in its first destination directory,
+//   instead of applying each one to the backup copy as it happens.  The
+//   journal is applied to the backup copies, and removed, after capture
+//   stops.  Captured writes then cost one sequential append each, at the
+//   price of a longer end of the backup.  Incremental backups ignore it.
+//   This function can be called by any thread at any time.  It affects
+//   backups started afterwards.
+//  The default is 0.
+
+void tokubackup_set_dirty_tracking(int track_dirty_blocks) throw() __attribute__((visibility("default")));
+// Effect: If track_dirty_blocks is nonzero, a (full) backup doesn't put
+//   the writes it captures into the backup copies while it copies.  It
+//   just marks the 4KB blocks they touch as dirty, and once the copy is
+//   done copies the dirty blocks again, pass after pass, until only a
+//   few megabytes are dirty.  Then captured writes go into the backup
+//   copies again while the last of the dirty blocks are copied.  This
+//   takes nearly all of the cost of the backup off the application's
+//   writes.  Incremental backups ignore it, and it takes precedence over
+//   tokubackup_set_capture_journal().
+//   This function can be called by any thread at any time.  It affects
+//   backups started afterwards.
+//  The default is 0.
+
+int tokubackup_set_incremental_base(const char *base_dirs[], int dir_count) throw() __attribute__((visibility("default")));
+// Effect: Make later backups incremental.  base_dirs[i] names an earlier
+//   backup of the same data that went into dest_dirs[i] (which may be
+//   NULL if there is none).  An incremental backup compares each block of
+//   each file with the manifest that the base backup left in its
+//   directory, and writes only the blocks that changed, leaving holes for
+//   the others.  It then writes its own manifest (named
+//   tokubackup.manifest) into each destination directory, recording
+//   which blocks it holds, so that it can be the base of the next one.
+//   A base directory without a manifest is fine: everything is copied,
+//   and the new backup gets a manifest.
+//  To restore a file from an incremental backup, restore it from the
+//   base backup, and then take the blocks that the manifest says are
+//   present from the incremental backup.
+//  This function can be called by any thread at any time.  It affects
+//   backups started afterwards.  Pass a dir_count of 0 to go back to
+//   full backups, which is the default.
+//  Returns 0, or ENOMEM if we could not remember the directories.
+
+int tokubackup_verify_backup(const char *backup_dir) throw() __attribute__((visibility("default")));
+// Effect: Check a directory of a backup made with a manifest (see
+//   tokubackup_set_incremental_base()) against that manifest, without
+//   looking at the source.  Every block that the manifest says is present
+//   in the backup is read and compared with the checksum that was taken
+//   when it was copied; blocks that an incremental backup left out are
+//   checked by verifying its base.  Each mismatch is reported on stderr.
+//  This function can be called by any thread at any time, but not on a
+//   directory that a backup is still writing.
+//  Returns 0 if everything matches, EBADMSG if something doesn't (or the
+//   manifest is damaged), ENOENT if there is no manifest, or another
+//   error number if we could not read the backup.
+
+struct tokubackup_stats {
+    // The copy threads (see tokubackup_set_copy_threads()).
+    unsigned long copy_threads;          // the most threads that copied one directory.
+    unsigned long copy_threads_used;     // the most of those that copied at least one file (or chunk of one).
+    unsigned long work_steals;           // files (and chunks) that a copy thread took from another one's queue.
+    unsigned long chunked_files;         // files big enough to be split into chunks that several threads copy.
+    unsigned long chunks;                // the chunks they were split into.
+    unsigned long helper_chunks;         // of those, the ones copied by a thread other than the one that split the file.
+
+    // The copy buffers (see tokubackup_set_huge_pages()).
+    unsigned long buffer_reuses;         // times a copy buffer was reused, rather than allocated.
+    unsigned long buffer_allocations;    // copy buffers that had to be allocated.
+    unsigned long huge_page_buffers;     // of those, the ones backed by explicit huge pages.
+    unsigned long buffer_peak_bytes;     // the most bytes of copy buffers that one directory's copy had mapped at once.
+
+    // The copies made with io_uring (see tokubackup_set_io_depth()).
+    unsigned long io_uring_bytes;        // bytes copied with io_uring.
+    unsigned long io_uring_usecs;        // the time the copy threads took to copy them, added up.
+    unsigned long io_uring_waits;        // times a copy thread waited for its requests to complete.
+    unsigned long io_uring_in_flight;    // the requests (reads and writes) in flight at each of those times, added
+                                         //  up, so that io_uring_in_flight / io_uring_waits is the average queue depth.
+    unsigned long io_uring_max_in_flight; // the most requests that one copy thread had in flight at once (at most
+                                         //  twice the io depth).
+
+    // The writes captured while the backup was running.
+    unsigned long captured_writes;       // captured writes queued for the capture threads.
+    unsigned long captured_bytes;        // the bytes in them.
+    unsigned long captured_max_bytes;    // the most bytes that one file had queued at once.
+    unsigned long captured_sync_writes;  // captured writes that went straight into the backup copy instead.
+    unsigned long capture_stalls;        // application writes that had to wait for room in their file's queue.
+    unsigned long capture_stall_usecs;   // the time they waited, added up.
+    unsigned long captured_elided_bytes; // captured bytes left out of the backup copies because the copy had yet to
+                                         //  read them.
+
+    // Dirty block tracking (see tokubackup_set_dirty_tracking()).
+    unsigned long dirty_marked_bytes;    // the bytes of captured writes that were only marked dirty.
+    unsigned long dirty_files;           // the files with dirty blocks.
+    unsigned long dirty_passes;          // passes over the dirty blocks, including the final one.
+    unsigned long dirty_copied_bytes;    // the dirty bytes those passes copied.
+    unsigned long dirty_final_bytes;     // of those, the ones the final pass copied.
+
+    // The range locks that keep the copy and the application's writes to a file from interleaving.
+    unsigned long copy_range_locks;      // ranges that the copy threads locked.
+    unsigned long copy_range_lock_waits; // of those, the ones that had to wait for a write.
+    unsigned long copy_range_lock_wait_usecs; // the time they waited, added up.
+    unsigned long write_range_locks;     // ranges that the application's writes (and truncates) locked while the
+                                         //  backup ran.
+    unsigned long write_range_lock_waits; // of those, the ones that had to wait for the copy or another write.
+    unsigned long write_range_lock_wait_usecs; // the time they waited, added up.
+    unsigned long range_lock_max_waiters; // the most lockers waiting on one file at once.
+
+    // The copies made by cloning, on a filesystem that shares blocks between files (such as XFS or btrfs).
+    unsigned long cloned_bytes;          // bytes that were cloned into the backup instead of copied.
+
+    // An incremental backup (see tokubackup_set_incremental_base()).
+    unsigned long unchanged_bytes;       // bytes left out because they match the base backup.
+    unsigned long changed_bytes;         // bytes copied because they don't.
+    unsigned long taken_files;           // unchanged files taken from the base backup without reading them.
+    unsigned long taken_bytes;           // the bytes in them.
+    unsigned long taken_cloned_files;    // of those files, the ones cloned from the base backup's copies.
+
+    // The copies made without holding the range lock.
+    unsigned long optimistic_bytes;      // bytes copied without the range lock.
+    unsigned long recopied_bytes;        // bytes copied again, with it, because they were written meanwhile.
+    unsigned long locked_copies;         // ranges copied holding the lock (in an incremental backup, or while the
+                                         //  file was being resized).
+};
+
+void tokubackup_get_stats(struct tokubackup_stats *stats) throw() __attribute__((visibility("default")));
+// Effect: Fill in *stats with what the most recent backup to finish did,
+//   or with zeros if none has.  A backup that failed has them too, as far
+//   as it got.
+//   This function can be called by any thread at any time.
+
+// What the most recent backup did on one device.
+struct tokubackup_device_stats {
+    unsigned long device;                // the device, as in st_dev.
+    const char *tuning;                  // where its limits came from: "configured", "rotational", "non-rotational"
+                                         //  or "default".
+    unsigned int concurrency;            // files that could be copied at once, or 0 for no limit.
+    unsigned int io_depth;               // reads (and as many writes) that each copy kept in flight.
+    unsigned long files_copied;          // files whose source or destination is on the device.
+    unsigned long bytes_read;            // the bytes read from the device.
+    unsigned long busy_usecs;            // how long at least one copy was running on the device.
+    unsigned long waits;                 // copies that had to wait for their turn.
+    unsigned long wait_usecs;            // the time they waited, added up.
+    unsigned long ios;                   // reads and writes of one copy buffer.
+    unsigned long io_usecs;              // the time they took, added up.
+    unsigned long max_io_usecs;          // the longest that one of them took.
+};
+
+unsigned int tokubackup_get_device_stats(struct tokubackup_device_stats *stats, unsigned int n_stats) throw() __attribute__((visibility("default")));
+// Effect: Fill in stats[0] to stats[n_stats-1] with what the most recent
+//   backup to finish did on each device it copied from or to, as far as
+//   there is room.
+//   This function can be called by any thread at any time.
+//  Returns the number of devices, which may be more than n_stats.
+
 const extern char *tokubackup_version_string  __attribute__((visibility("default")));
 
 const int BACKUP_SUCCESS = 0;
+const unsigned int MAX_COPY_THREADS = 256;
+const unsigned int MAX_IO_DEPTH = 64;
 }
 
 #endif // end of header guardian.
@@ -37,6 +37,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "backup.h"
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 extern "C" int tokubackup_create_backup(const char *source_dirs[]  __attribute__((unused)),
                                         const char *dest_dirs[]    __attribute__((unused)),
@@ -53,4 +54,51 @@ extern "C" void tokubackup_throttle_backup(unsigned long bytes_per_second __attr
     fprintf(stderr, "Sorry, backup is not implemented\n");
 }
 
+extern "C" void tokubackup_set_throttle_burst(unsigned long n_bytes __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_copy_threads(unsigned int n_threads __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_io_depth(unsigned int depth __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" int tokubackup_set_device_limits(const char *path __attribute__((unused)), unsigned int concurrency __attribute__((unused)), unsigned int io_depth __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+    return ENOSYS;
+}
+
+extern "C" void tokubackup_set_huge_pages(int use_huge_pages __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_capture_journal(int use_journal __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_dirty_tracking(int track_dirty_blocks __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" int tokubackup_set_incremental_base(const char *base_dirs[] __attribute__((unused)), int dir_count __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+    return ENOSYS;
+}
+
+extern "C" void tokubackup_get_stats(struct tokubackup_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+extern "C" unsigned int tokubackup_get_device_stats(struct tokubackup_device_stats *stats __attribute__((unused)), unsigned int n_stats __attribute__((unused))) {
+    return 0;
+}
+
+extern "C" int tokubackup_verify_backup(const char *backup_dir __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+    return ENOSYS;
+}
+
 const char tokubackup_sql_suffix[] = "";
@@ -147,6 +147,9 @@ bool should_pause(int flag) throw() {
         case CAPTURE_OPEN:
             result = CAPTURE_OPEN & PAUSE_POINTS;
             break;
+        case CAPTURE_QUEUE_WRITE:
+            result = CAPTURE_QUEUE_WRITE & PAUSE_POINTS;
+            break;
         default:
             break;
     }
@@ -88,6 +88,7 @@ const int MANAGER_IN_DISABLE                = 0x10;
 const int COPIER_AFTER_OPEN_SOURCE          = 0x20;
 const int OPEN_DESTINATION_FILE             = 0x40;
 const int CAPTURE_OPEN                      = 0x80;
+const int CAPTURE_QUEUE_WRITE               = 0x100;
 
 bool should_pause(int) throw();
 void toggle_pause_point(int) throw();
@@ -37,6 +37,9 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "backup_directory.h"
 #include "description.h"
 #include "backup_debug.h"
+#include "check.h"
+#include "manager.h"
+#include "mutex.h"
 #include "raii-malloc.h"
 #include "real_syscalls.h"
 
@@ -45,34 +48,336 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 //////////////////////////////////////////////////////////////////////////////
 //
 backup_session::backup_session(directory_set *dirs, backup_callbacks *calls, file_hash_table * const file) throw()
-    : m_dirs(dirs), m_copier(calls, file)
+    : m_dirs(dirs), m_calls(calls), m_table(file), m_copier(calls, file), m_copy_error(0), m_manifest(NULL), m_journal(NULL), m_dirty(NULL)
 {
+    int r = pthread_mutex_init(&m_groups_mutex, NULL);
+    check(r==0);
+    m_copier.set_completed_files(&m_completed);
+    m_copier.set_stats(&m_stats);
+    m_copier.set_shared_error(&m_copy_error);
+    m_copier.set_progress(&m_progress);
+    m_copier.set_scheduler(&m_scheduler);
+    the_manager.get_incremental_bases(&m_bases);
+    if (!m_bases.empty()) {
+        m_manifest = new backup_manifest;
+    }
+    m_base_manifests.resize(m_bases.size(), NULL);
+    // An incremental backup's manifest has to see each change as it
+    // goes into the backup copy, so it can't track dirty blocks or
+    // have a journal.
+    if (m_manifest == NULL && the_manager.get_dirty_tracking()) {
+        m_dirty = new dirty_set(file);
+    }
+    if (m_manifest == NULL && m_dirty == NULL && the_manager.get_capture_journal() && m_dirs->number_of_directories() > 0) {
+        m_journal = new capture_journal;
+        if (m_journal->open(m_dirs->destination_directory_at(0)) != 0) {
+            // The error has been reported, which stops the backup.
+            delete m_journal;
+            m_journal = NULL;
+        }
+    }
+    m_copier.set_journal(m_journal);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //
 backup_session::~backup_session() throw() {
+    for (size_t i = 0; i < m_bases.size(); ++i) {
+        free(m_bases[i]);
+        delete m_base_manifests[i];
+    }
+    delete m_manifest;
+    delete m_journal;
+    delete m_dirty;
+    int r = pthread_mutex_destroy(&m_groups_mutex);
+    check(r==0);
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// Loop through the directory set, copying one directory at a
-// time.
+//
+// directory_group:
+//
+// Description:
+//
+//     The directories of a backup whose sources are on one device,
+// other than the device of the first directory.  They are copied one
+// after another, by their own copier on their own thread, while the
+// other devices' directories are copied.
+//
+struct directory_group {
+    directory_group(backup_session *session, dev_t device, backup_callbacks *calls, file_hash_table *table) throw()
+        : m_session(session), m_device(device), m_copier(calls, table), m_started(false), m_result(0), m_done(false) {}
+    backup_session * const m_session;
+    const dev_t m_device;
+    std::vector<int> m_dirs;          // indexes into the directory_set.
+    copier m_copier;
+    pthread_t m_thread;
+    bool m_started;                   // m_thread is running.
+    int m_result;
+    std::atomic<bool> m_done;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// do_copy() -
+//
+// Description:
+//
+//     Copies the directory set.  The directories are grouped by the
+// device their source is on, and the groups are copied at the same
+// time, so that each device is read in parallel.  The first
+// directory's group is copied on this thread, which also keeps calling
+// the poll function until the other groups are done.  Directories on
+// the same device are copied one at a time.
 //
 int backup_session::do_copy() throw() {
     int r = 0;
+    std::vector<int> first_group;
+    this->group_directories(&first_group);
+    for (size_t g = 0; g < m_groups.size(); ++g) {
+        directory_group *group = m_groups[g];
+        int cr = pthread_create(&group->m_thread, NULL, backup_session::start_group, group);
+        if (cr != 0) {
+            // Copy this group on our own thread after all.
+            fprintf(stderr, "%s:%d could not start a copy thread for %s, errno=%d (%s)\n", __FILE__, __LINE__, m_dirs->source_directory_at(group->m_dirs[0]), cr, strerror(cr));
+            first_group.insert(first_group.end(), group->m_dirs.begin(), group->m_dirs.end());
+            group->m_dirs.clear();
+            group->m_done = true;
+            continue;
+        }
+        group->m_started = true;
+    }
+
+    r = this->copy_directories(&m_copier, first_group);
+    int gr = this->wait_for_groups();
+    if (r == 0) {
+        r = gr;
+    }
+    {
+        std::vector<tokubackup_device_stats> devices;
+        m_scheduler.get_stats(&devices);
+        m_stats.set_devices(devices);
+    }
+
+    if (m_dirty != NULL) {
+        if (r == 0) {
+            r = this->copy_dirty_files();
+        }
+        m_dirty->finish_marking();
+        m_dirty->release_files();
+    }
+    return r;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// group_directories() -
+//
+// Description:
+//
+//     Puts the directories whose source is on the same device as the
+// first directory's into first_group, and makes a directory_group for
+// each of the other devices.  A directory we can't stat goes into
+// first_group, whose copier will report the problem.
+//
+void backup_session::group_directories(std::vector<int> *first_group) throw() {
+    dev_t first_device = 0;
     for (int i = 0; i < m_dirs->number_of_directories(); ++i) {
-        m_copier.set_directories(m_dirs->source_directory_at(i),
-                                 m_dirs->destination_directory_at(i));
-        r = m_copier.do_copy();
+        struct stat sbuf;
+        const bool have_device = (stat(m_dirs->source_directory_at(i), &sbuf) == 0);
+        if (i == 0 && have_device) {
+            first_device = sbuf.st_dev;
+        }
+        if (i == 0 || !have_device || sbuf.st_dev == first_device) {
+            first_group->push_back(i);
+            continue;
+        }
+        directory_group *group = NULL;
+        for (size_t g = 0; g < m_groups.size(); ++g) {
+            if (m_groups[g]->m_device == sbuf.st_dev) {
+                group = m_groups[g];
+                break;
+            }
+        }
+        if (group == NULL) {
+            group = new directory_group(this, sbuf.st_dev, m_calls, m_table);
+            group->m_copier.set_completed_files(&m_completed);
+            group->m_copier.set_stats(&m_stats);
+            group->m_copier.set_shared_error(&m_copy_error);
+            group->m_copier.set_progress(&m_progress);
+            group->m_copier.set_scheduler(&m_scheduler);
+            group->m_copier.set_journal(m_journal);
+            group->m_copier.set_may_call_back(false);
+            with_mutex_locked gm(&m_groups_mutex, BACKTRACE(NULL));
+            m_groups.push_back(group);
+        }
+        group->m_dirs.push_back(i);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+void *backup_session::start_group(void *arg) throw() {
+    directory_group *group = static_cast<directory_group *>(arg);
+    group->m_result = group->m_session->copy_directories(&group->m_copier, group->m_dirs);
+    group->m_done = true;
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// copy_directories() -
+//
+// Description:
+//
+//     Copies the given directories one at a time with the given
+// copier.  The first error stops every copier.
+//
+int backup_session::copy_directories(copier *the_copier, const std::vector<int> &dirs) throw() {
+    int r = 0;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        r = m_copy_error;
         if (r != 0) {
             break;
         }
+        r = this->copy_directory(the_copier, dirs[i]);
+        if (r != 0) {
+            this->stop_copying(r);
+            break;
+        }
     }
+    return r;
+}
 
+//////////////////////////////////////////////////////////////////////////////
+//
+int backup_session::copy_directory(copier *the_copier, int i) throw() {
+    the_copier->set_directories(m_dirs->source_directory_at(i),
+                                m_dirs->destination_directory_at(i));
+    if (m_manifest != NULL) {
+        backup_manifest *base = NULL;
+        const char *base_dir = NULL;
+        if ((size_t)i < m_bases.size() && m_bases[i] != NULL) {
+            base_dir = m_bases[i];
+            base = m_base_manifests[i] = new backup_manifest;
+            int r = base->read(m_bases[i]);
+            if (r != 0) {
+                the_manager.backup_error(r, "Could not read the manifest of the base backup %s", m_bases[i]);
+                return r;
+            }
+        }
+        the_copier->set_manifests(m_manifest, base, base_dir);
+    }
+    return the_copier->do_copy();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// stop_copying() -
+//
+// Description:
+//
+//     Records the first error, and stops every copier, including any
+// that is between two directories.
+//
+void backup_session::stop_copying(int error) throw() {
+    int expected = 0;
+    m_copy_error.compare_exchange_strong(expected, error);
+    m_copier.set_error(error);
+    for (size_t g = 0; g < m_groups.size(); ++g) {
+        m_groups[g]->m_copier.set_error(error);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// wait_for_groups() -
+//
+// Description:
+//
+//     Waits for the other devices' copies to finish, calling the poll
+// function as the copier does, so that the user sees the progress of
+// all of them and can still abort the backup.  Once the user aborts,
+// the copiers stop at their next file or chunk, so we just join them.
+// Returns the first error any of them hit.
+//
+int backup_session::wait_for_groups(void) throw() {
+    int r = 0;
+    for (size_t g = 0; g < m_groups.size(); ++g) {
+        directory_group *group = m_groups[g];
+        while (r == 0 && !group->m_done) {
+            char string[1000];
+            snprintf(string, sizeof(string), "Backup progress %ld bytes, %ld files.  Waiting for the copy of %s.", m_progress.m_bytes_backed_up.load(), m_progress.m_files_backed_up.load(), m_dirs->source_directory_at(group->m_dirs[0]));
+            r = m_calls->poll(m_progress.fraction(), string);
+            if (r != 0) {
+                this->stop_copying(r);
+                break;
+            }
+            usleep(100 * 1000);
+        }
+        if (group->m_started) {
+            int jr = pthread_join(group->m_thread, NULL);
+            check(jr==0);
+        }
+        if (r == 0) {
+            r = group->m_result;
+        }
+    }
+    with_mutex_locked gm(&m_groups_mutex, BACKTRACE(NULL));
+    for (size_t g = 0; g < m_groups.size(); ++g) {
+        delete m_groups[g];
+    }
+    m_groups.clear();
+    return r;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// copy_dirty_files() -
+//
+// Description:
+//
+//     Copies the blocks that were written after the copier read them,
+// pass after pass, while the application keeps dirtying more, until
+// there are few enough left (or we have made DIRTY_MAX_PASSES passes,
+// in case the application dirties them faster than we copy them).
+// Then captured writes go into the backup copies again, and a final
+// pass copies whatever is still dirty.
+//
+int backup_session::copy_dirty_files(void) throw() {
+    int r = 0;
+    std::vector<source_file *> files;
+    for (int pass = 0; r == 0 && pass < DIRTY_MAX_PASSES && m_dirty->dirty_bytes() > DIRTY_FINAL_BYTES; ++pass) {
+        uint64_t n_pass = 0;
+        m_dirty->get_files(&files);
+        for (size_t i = 0; r == 0 && i < files.size(); ++i) {
+            uint64_t n = 0;
+            r = m_copier.copy_dirty_blocks(files[i], &n);
+            n_pass += n;
+        }
+        m_dirty->note_pass(n_pass, false);
+    }
+    if (r != 0) {
+        return r;
+    }
+
+    m_dirty->finish_marking();
+    uint64_t n_final = 0;
+    m_dirty->get_files(&files);
+    for (size_t i = 0; r == 0 && i < files.size(); ++i) {
+        uint64_t n = 0;
+        r = m_copier.copy_dirty_blocks(files[i], &n);
+        n_final += n;
+    }
+    m_dirty->note_pass(n_final, true);
+    dirty_set_stats stats;
+    m_dirty->get_stats(&stats);
+    m_stats.add_dirty(stats, files.size());
     return r;
 }
 
@@ -290,8 +595,36 @@ int backup_session::capture_mkdir(const char *pathname) throw() {
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-void backup_session::add_to_copy_todo_list(const char *file_path) throw() {
-     m_copier.add_file_to_todo(file_path);
+// add_to_copy_todo_list() -
+//
+// Description:
+//
+//     The copier's todo list holds names relative to the directory it
+// is copying, so the source directory is stripped off.  Only a copier
+// that is copying that directory takes the name.  Returns true if one
+// did.
+//
+bool backup_session::add_to_copy_todo_list(const char *source_path) throw() {
+    const int index = m_dirs->find_index_matching_prefix(source_path);
+    if (index == -1) {
+        return false;
+    }
+    const char *source_dir = m_dirs->source_directory_at(index);
+    const char *file = source_path + strlen(source_dir);
+    while (*file == '/') {
+        file++;
+    }
+    if (*file == '\0') {
+        return false;
+    }
+    bool taken = m_copier.add_file_to_todo(source_dir, file);
+    with_mutex_locked gm(&m_groups_mutex, BACKTRACE(NULL));
+    for (size_t g = 0; g < m_groups.size(); ++g) {
+        if (m_groups[g]->m_copier.add_file_to_todo(source_dir, file)) {
+            taken = true;
+        }
+    }
+    return taken;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -303,3 +636,83 @@ void backup_session::cleanup(void) throw() {
 bool backup_session::file_is_excluded(const char *backup_file) throw() {
     return m_copier.file_should_be_excluded(backup_file);
 }
+
+//////////////////////////////////////////////////////////////////////////////
+//
+backup_manifest *backup_session::get_manifest(void) throw() {
+    return m_manifest;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_manifest_rename(const char *old_dest, const char *new_dest) throw() {
+    if (m_manifest != NULL) {
+        m_manifest->rename(old_dest, new_dest);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_manifest_unlink(const char *dest) throw() {
+    if (m_manifest != NULL) {
+        m_manifest->remove(dest);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+capture_journal *backup_session::get_journal(void) throw() {
+    return m_journal;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+capture_journal *backup_session::release_journal(void) throw() {
+    capture_journal *journal = m_journal;
+    m_journal = NULL;
+    return journal;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+dirty_set *backup_session::get_dirty_set(void) throw() {
+    return m_dirty;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+completed_files *backup_session::get_completed_files(void) throw() {
+    return &m_completed;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+backup_stats *backup_session::get_stats(void) throw() {
+    return &m_stats;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// write_manifests() -
+//
+// Description:
+//
+//     Writes the manifest of each destination directory of an
+// incremental backup.  Capture must have stopped, so that the backup
+// copies don't change any more.
+//
+int backup_session::write_manifests(void) throw() {
+    if (m_manifest == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < m_dirs->number_of_directories(); ++i) {
+        const char *dest = m_dirs->destination_directory_at(i);
+        const char *base = ((size_t)i < m_bases.size()) ? m_bases[i] : NULL;
+        int r = m_manifest->write(dest, base);
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not write the manifest of %s", dest);
+            return r;
+        }
+    }
+    return 0;
+}
@@ -43,11 +43,20 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "copier.h"
 #include "backup_callbacks.h"
 #include "directory_set.h"
+#include "backup_manifest.h"
+#include "backup_stats.h"
+#include "capture_journal.h"
+#include "completed_files.h"
+#include "device_scheduler.h"
+#include "dirty_set.h"
 
 #include <pthread.h>
+#include <atomic>
 #include <vector>
 #include <pthread.h>
 
+struct directory_group;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 class backup_session
@@ -69,12 +78,53 @@ public:
     // Capture interface.
     int capture_open(const char *file, char **result) throw() __attribute__((warn_unused_result)); // if any errors occur, report them, and return the error code.  Otherwise return 0 and store the malloc'd name of the dest file  in *result.  If the file isn't in the destspace return 0 and set *result=NULL.
     int capture_mkdir(const char *pathname) throw() __attribute__((warn_unused_result)); // return 0 on success, error otherwise.
-    void add_to_copy_todo_list(const char *file_path) throw();
+    bool add_to_copy_todo_list(const char *source_path) throw(); // source_path is the realpath of a file or directory in a source directory.  Returns true if a copier took it.
     void cleanup(void) throw();
     bool file_is_excluded(const char *) throw();
+
+    // Incremental backups.
+    backup_manifest *get_manifest(void) throw(); // NULL unless this is an incremental backup.
+    void capture_manifest_rename(const char *old_dest, const char *new_dest) throw();
+    void capture_manifest_unlink(const char *dest) throw();
+    int write_manifests(void) throw() __attribute__((warn_unused_result)); // returns the error code (not in errno), having reported it.
+
+    // Journaled capture.
+    capture_journal *get_journal(void) throw();     // NULL unless captured changes go to a journal.
+    capture_journal *release_journal(void) throw(); // The caller gets the journal, to apply it after the session.
+
+    // Dirty block tracking.
+    dirty_set *get_dirty_set(void) throw();         // NULL unless captured writes are only marked dirty until the copier is done.
+
+    // The files whose backup copies have all their data, so that renaming them needn't copy them again.
+    completed_files *get_completed_files(void) throw();
+
+    // What the session did, for tokubackup_get_stats().
+    backup_stats *get_stats(void) throw();
 private:
+    void group_directories(std::vector<int> *first_group) throw();
+    int copy_directories(copier *the_copier, const std::vector<int> &dirs) throw() __attribute__((warn_unused_result)); // returns the error code (not in errno)
+    int copy_directory(copier *the_copier, int i) throw() __attribute__((warn_unused_result)); // returns the error code (not in errno)
+    void stop_copying(int error) throw();
+    int wait_for_groups(void) throw() __attribute__((warn_unused_result)); // returns the error code (not in errno)
+    static void *start_group(void *arg) throw();
+    int copy_dirty_files(void) throw() __attribute__((warn_unused_result)); // returns the error code (not in errno), having reported it.
+
     const directory_set * const m_dirs;
-    copier m_copier;
+    backup_callbacks * const m_calls;
+    file_hash_table * const m_table;
+    copier m_copier;                                 // copies the directories on the device of the first one, on the backup's thread.
+    copy_progress m_progress;                        // shared by all the copiers.
+    std::vector<directory_group *> m_groups;         // the directories on each of the other devices, each copied by its own copier and thread.
+    pthread_mutex_t m_groups_mutex;                  // held while m_groups changes, and by capture while it looks at the groups' copiers.
+    std::atomic<int> m_copy_error;                   // the first error any of the copiers hit.
+    std::vector<char *> m_bases;                     // the base backup of each destination directory, or NULL.
+    std::vector<backup_manifest *> m_base_manifests; // the manifests of those base backups (NULL if not read yet).
+    backup_manifest *m_manifest;                     // the manifest we are making.
+    capture_journal *m_journal;                      // where captured changes go, or NULL to put them straight into the backup copies.
+    dirty_set *m_dirty;                              // the files with dirty blocks to copy again, or NULL.
+    completed_files m_completed;                     // the files the copier has finished, or that were captured since they were empty.
+    backup_stats m_stats;                            // what the copiers (and capture) did.
+    device_scheduler m_scheduler;                    // shared by all the copiers, so that each device's limits hold for the whole backup.
 };
 
 #endif // End of header guardian.
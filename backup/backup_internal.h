@@ -40,6 +40,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup.h"
 #include "sys/types.h"
+#include <stdint.h>
 class backup_callbacks; // need a forward reference for this.
 
 
@@ -60,6 +61,7 @@ void backup_pause_disable(bool b) throw();
 void backup_set_start_copying(bool b) throw(); // When the backup has started and is about to start copying, wait for this boolean to be true (true by default).
 bool backup_is_capturing(void) throw();        // Return true if the backup has started capturing.
 bool backup_done_copying(void) throw();          // Return true if the backup has finished copying.  This goes true sometime after is_capturing goes true. 
+void backup_set_copy_chunk_size(uint64_t chunk_size) throw(); // Split files of at least twice this size into chunks of this size (0 means the usual size).
 void backup_set_keep_capturing(bool b) throw();
 // Effect:  By default, when a backup finishes, it disables capturing.  If before the backup finishes, someone calls backup_set_keep_capturing(true)
 //  then the capturing will keep running until someone calls backup_set_capturing(false).
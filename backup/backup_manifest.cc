@@ -0,0 +1,725 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "backup_manifest.h"
+#include "check.h"
+#include "manager.h"
+#include "mutex.h"
+#include "raii-malloc.h"
+#include "real_syscalls.h"
+#include "xxhash64.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MANIFEST_MAGIC[8] = {'T', 'O', 'K', 'U', 'B', 'M', 'F', '1'};
+static const uint32_t MANIFEST_VERSION = 3;
+static const uint8_t MANIFEST_SAVED_FLAGS = MANIFEST_BLOCK_PRESENT | MANIFEST_BLOCK_CHECKSUMED;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t manifest_checksum(const void *buf, size_t len) throw() {
+    return xxhash64(buf, len, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static uint64_t n_blocks_for(uint64_t size) throw() {
+    return (size + MANIFEST_BLOCK_SIZE - 1) / MANIFEST_BLOCK_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static int write_fully(int fd, const char *buf, size_t len, uint64_t offset) throw() {
+    size_t n_wrote = 0;
+    while (n_wrote < len) {
+        ssize_t n = call_real_pwrite(fd, buf + n_wrote, len - n_wrote, offset + n_wrote);
+        if (n < 0) {
+            return errno;
+        }
+        n_wrote += n;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_file::manifest_file(const char *path, const manifest_file *base) throw()
+    : m_size(0), m_path(const_cast<char *>(path)), m_base(base)
+{
+    memset(&m_fingerprint, 0, sizeof(m_fingerprint));
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_file::~manifest_file(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+    free(m_path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const char *manifest_file::path(void) const throw() {
+    return m_path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest_file::set_path(const char *path) throw() {
+    free(m_path);
+    m_path = const_cast<char *>(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool manifest_file::block_is_unchanged(uint64_t block, uint64_t checksum, size_t len) const throw() {
+    if (m_base == NULL || block >= m_base->m_flags.size()) {
+        return false;
+    }
+    // The base's last block may be short, in which case ours must be
+    // just as short.
+    const uint64_t base_len = m_base->m_size - block * MANIFEST_BLOCK_SIZE;
+    if ((base_len < MANIFEST_BLOCK_SIZE ? base_len : MANIFEST_BLOCK_SIZE) != len) {
+        return false;
+    }
+    return (m_base->m_flags[block] & MANIFEST_BLOCK_CHECKSUMED) && m_base->m_checksums[block] == checksum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest_file::set_block(uint64_t block, int flags, uint64_t checksum) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (block >= m_flags.size()) {
+        m_flags.resize(block + 1, 0);
+        m_checksums.resize(block + 1, 0);
+    }
+    m_flags[block] = flags | MANIFEST_BLOCK_VISITED;
+    m_checksums[block] = checksum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// capture_change() -
+//
+// Description:
+//
+//     A block that the copier left out is in the base backup, not in
+// this one.  If the application overwrites all of it, the backup copy
+// gets all of the new data, so we only have to say that the block is
+// present now.  If it changes part of the block, the rest must come
+// from the source before the change goes into the backup copy.
+//
+//     Two writers can change different parts of one block at once,
+// since their range locks don't conflict.  The mutex makes sure that
+// only the first of them copies the block, and that the second one
+// doesn't write its own change into the backup copy until the block
+// has been copied.  Whichever copies the block reads the source after
+// its own change, so neither change is lost.
+//
+int manifest_file::capture_change(const char *source_path, int dest_fd, uint64_t lo, uint64_t hi) throw() {
+    int r = 0;
+    int src_fd = -1;
+    char *buf = NULL;
+    with_mutex_locked ml(&m_mutex);
+    const uint64_t first = lo / MANIFEST_BLOCK_SIZE;
+    uint64_t end = n_blocks_for(hi);
+    if (end > m_flags.size()) {
+        end = m_flags.size();
+    }
+    for (uint64_t block = first; block < end; ++block) {
+        const uint8_t flags = m_flags[block];
+        if (!(flags & MANIFEST_BLOCK_VISITED)) {
+            // The copier will compare it with the base backup later.
+            continue;
+        }
+        const uint64_t block_lo = block * MANIFEST_BLOCK_SIZE;
+        const uint64_t block_hi = block_lo + MANIFEST_BLOCK_SIZE;
+        if (!(flags & MANIFEST_BLOCK_PRESENT) && (block_lo < lo || hi < block_hi)) {
+            if (src_fd < 0) {
+                src_fd = call_real_open(source_path, O_RDONLY);
+                if (src_fd < 0) {
+                    r = errno;
+                    the_manager.backup_error(r, "Could not open %s to copy a changed block", source_path);
+                    goto out;
+                }
+                buf = (char *) malloc(MANIFEST_BLOCK_SIZE);
+                if (buf == NULL) {
+                    r = errno;
+                    the_manager.backup_error(r, "Could not allocate a buffer to copy a changed block of %s", source_path);
+                    goto out;
+                }
+            }
+            ssize_t n_read = call_real_pread(src_fd, buf, MANIFEST_BLOCK_SIZE, block_lo);
+            if (n_read < 0) {
+                r = errno;
+                the_manager.backup_error(r, "Could not read a changed block of %s", source_path);
+                goto out;
+            }
+            r = write_fully(dest_fd, buf, n_read, block_lo);
+            if (r != 0) {
+                the_manager.backup_error(r, "Could not write a changed block of %s to %s", source_path, m_path);
+                goto out;
+            }
+        }
+        m_flags[block] = (flags | MANIFEST_BLOCK_PRESENT) & ~MANIFEST_BLOCK_CHECKSUMED;
+    }
+
+out:
+    if (src_fd >= 0) {
+        ignore(call_real_close(src_fd));
+    }
+    free(buf);
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_fingerprint() -
+//
+// Description:
+//
+//     The kernel stamps a change with a clock that can lag the real
+// time by a tick, and some filesystems keep only whole seconds.  A
+// file whose ctime is a second or more before the backup started
+// can't be changed again without getting a later ctime, but a file
+// changed just before we started might be, so we don't fingerprint
+// it.
+//
+void manifest_file::set_fingerprint(const struct stat *sbuf, time_t backup_start) throw() {
+    with_mutex_locked ml(&m_mutex);
+    memset(&m_fingerprint, 0, sizeof(m_fingerprint));
+    if (sbuf->st_ctim.tv_sec + 1 >= backup_start) {
+        return;
+    }
+    m_fingerprint.m_ino = sbuf->st_ino;
+    m_fingerprint.m_size = sbuf->st_size;
+    m_fingerprint.m_mtime_sec = sbuf->st_mtim.tv_sec;
+    m_fingerprint.m_mtime_nsec = sbuf->st_mtim.tv_nsec;
+    m_fingerprint.m_ctime_sec = sbuf->st_ctim.tv_sec;
+    m_fingerprint.m_ctime_nsec = sbuf->st_ctim.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool manifest_file::matches_base_fingerprint(const struct stat *sbuf) const throw() {
+    if (m_base == NULL || m_base->m_fingerprint.m_ino == 0) {
+        return false;
+    }
+    const manifest_fingerprint &f = m_base->m_fingerprint;
+    return f.m_ino == (uint64_t)sbuf->st_ino &&
+           f.m_size == (uint64_t)sbuf->st_size &&
+           f.m_size == m_base->m_size &&
+           f.m_mtime_sec == sbuf->st_mtim.tv_sec &&
+           f.m_mtime_nsec == sbuf->st_mtim.tv_nsec &&
+           f.m_ctime_sec == sbuf->st_ctim.tv_sec &&
+           f.m_ctime_nsec == sbuf->st_ctim.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest_file::take_base_blocks(bool have_data) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_size = m_base->m_size;
+    m_checksums = m_base->m_checksums;
+    m_flags = m_base->m_flags;
+    for (size_t block = 0; block < m_flags.size(); ++block) {
+        uint8_t flags = m_flags[block] & MANIFEST_BLOCK_CHECKSUMED;
+        if (have_data) {
+            flags |= m_base->m_flags[block] & MANIFEST_BLOCK_PRESENT;
+        }
+        m_flags[block] = flags | MANIFEST_BLOCK_VISITED;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int manifest_file::finish(int fd, uint64_t size) throw() {
+    int r = 0;
+    char *buf = NULL;
+    with_mutex_locked ml(&m_mutex);
+    m_size = size;
+    const uint64_t n_blocks = n_blocks_for(size);
+    m_flags.resize(n_blocks, 0);
+    m_checksums.resize(n_blocks, 0);
+    for (uint64_t block = 0; block < n_blocks; ++block) {
+        if (!(m_flags[block] & MANIFEST_BLOCK_VISITED)) {
+            m_flags[block] = MANIFEST_BLOCK_PRESENT;
+        }
+        m_flags[block] &= MANIFEST_SAVED_FLAGS;
+        if (m_flags[block] != MANIFEST_BLOCK_PRESENT) {
+            continue;
+        }
+        // Capture changed the block since the copier checksummed it.
+        if (buf == NULL) {
+            buf = (char *) malloc(MANIFEST_BLOCK_SIZE);
+            if (buf == NULL) {
+                r = errno;
+                break;
+            }
+        }
+        ssize_t n = call_real_pread(fd, buf, MANIFEST_BLOCK_SIZE, block * MANIFEST_BLOCK_SIZE);
+        if (n < 0) {
+            r = errno;
+            break;
+        }
+        m_checksums[block] = manifest_checksum(buf, n);
+        m_flags[block] |= MANIFEST_BLOCK_CHECKSUMED;
+    }
+    free(buf);
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+backup_manifest::backup_manifest(void) throw()
+    : m_base_dir(NULL)
+{
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+backup_manifest::~backup_manifest(void) throw() {
+    for (std::map<std::string, manifest_file *>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        delete it->second;
+    }
+    for (size_t i = 0; i < m_removed.size(); ++i) {
+        delete m_removed[i];
+    }
+    free(m_base_dir);
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static bool in_file(uint64_t offset, uint64_t len, uint64_t file_size) throw() {
+    return offset <= file_size && len <= file_size - offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static char *manifest_path(const char *dir) throw() {
+    return malloc_snprintf(strlen(dir) + sizeof(MANIFEST_NAME) + 2, "%s/%s", dir, MANIFEST_NAME);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int backup_manifest::read(const char *dir) throw() {
+    with_object_to_free<char *> path(manifest_path(dir));
+    if (path.value == NULL) {
+        return ENOMEM;
+    }
+    int r = this->read_file(path.value);
+    return (r == ENOENT) ? 0 : r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// read_file() -
+//
+// Description:
+//
+//     Maps the manifest and makes a record of each file from it,
+// checking the manifest's checksum and that everything it points at
+// is inside it.  Returns EINVAL if anything is wrong with it.
+//
+int backup_manifest::read_file(const char *path) throw() {
+    int r = 0;
+    const char *map = (const char *) MAP_FAILED;
+    const manifest_header *header;
+    const manifest_entry *entries;
+    uint64_t size = 0;
+    const size_t checked_from = offsetof(manifest_header, m_version);
+    struct stat sbuf;
+
+    int fd = call_real_open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    if (fstat(fd, &sbuf) != 0) {
+        r = errno;
+        goto out;
+    }
+    size = sbuf.st_size;
+    if (size < sizeof(manifest_header)) {
+        r = EINVAL;
+        goto out;
+    }
+    map = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        r = errno;
+        goto out;
+    }
+
+    header = (const manifest_header *) map;
+    if (memcmp(header->m_magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0 ||
+        header->m_version != MANIFEST_VERSION ||
+        header->m_block_size != MANIFEST_BLOCK_SIZE ||
+        header->m_size != size ||
+        header->m_checksum != xxhash64(map + checked_from, size - checked_from, 0) ||
+        header->m_n_files > (size - sizeof(manifest_header)) / sizeof(manifest_entry) ||
+        !in_file(header->m_base_offset, header->m_base_len, size)) {
+        r = EINVAL;
+        goto out;
+    }
+    if (header->m_base_len > 0) {
+        m_base_dir = strndup(map + header->m_base_offset, header->m_base_len);
+        if (m_base_dir == NULL) {
+            r = ENOMEM;
+            goto out;
+        }
+    }
+
+    entries = (const manifest_entry *) (map + sizeof(manifest_header));
+    for (uint64_t i = 0; i < header->m_n_files; ++i) {
+        const manifest_entry &entry = entries[i];
+        if (entry.m_n_blocks != n_blocks_for(entry.m_size) ||
+            entry.m_n_blocks > size ||
+            entry.m_checksums_offset % sizeof(uint64_t) != 0 ||
+            !in_file(entry.m_path_offset, entry.m_path_len, size) ||
+            !in_file(entry.m_checksums_offset, entry.m_n_blocks * sizeof(uint64_t), size) ||
+            !in_file(entry.m_flags_offset, entry.m_n_blocks, size)) {
+            r = EINVAL;
+            goto out;
+        }
+        char *file_path = strndup(map + entry.m_path_offset, entry.m_path_len);
+        if (file_path == NULL) {
+            r = ENOMEM;
+            goto out;
+        }
+        manifest_file *file = new manifest_file(file_path, NULL);
+        file->m_size = entry.m_size;
+        file->m_fingerprint = entry.m_fingerprint;
+        const uint64_t *checksums = (const uint64_t *) (map + entry.m_checksums_offset);
+        const uint8_t *flags = (const uint8_t *) (map + entry.m_flags_offset);
+        file->m_checksums.assign(checksums, checksums + entry.m_n_blocks);
+        file->m_flags.assign(flags, flags + entry.m_n_blocks);
+        manifest_file *&slot = m_files[file_path];
+        delete slot;
+        slot = file;
+    }
+
+out:
+    if (map != MAP_FAILED) {
+        ignore(munmap(const_cast<char *>(map), size));
+    }
+    ignore(call_real_close(fd));
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void append(std::string *out, const void *data, size_t len) throw() {
+    out->append((const char *) data, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void align(std::string *out) throw() {
+    out->resize((out->size() + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// write() -
+//
+// Description:
+//
+//     Writes the manifest of one destination directory.  A backup copy
+// that the application has unlinked since we started to copy it is
+// left out, as is the part of one that it truncated.  The records are
+// in path order, since the map is.
+//
+int backup_manifest::write(const char *dir, const char *base_dir) throw() {
+    with_mutex_locked ml(&m_mutex);
+    std::string prefix(dir);
+    prefix += '/';
+
+    std::vector<manifest_file *> files;
+    for (std::map<std::string, manifest_file *>::iterator it = m_files.lower_bound(prefix); it != m_files.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+        int fd = call_real_open(it->first.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat sbuf;
+        int r = fstat(fd, &sbuf);
+        if (r == 0) {
+            r = it->second->finish(fd, sbuf.st_size);
+        } else {
+            r = errno;
+        }
+        ignore(call_real_close(fd));
+        if (r != 0) {
+            return r;
+        }
+        files.push_back(it->second);
+    }
+
+    // Lay out the data after the header and the entries.
+    std::string data(sizeof(manifest_header) + files.size() * sizeof(manifest_entry), 0);
+    std::vector<manifest_entry> entries(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        const manifest_file *file = files[i];
+        manifest_entry &entry = entries[i];
+        const char *relative = file->path() + prefix.size();
+        entry.m_n_blocks = file->m_flags.size();
+        entry.m_size = file->m_size;
+        entry.m_fingerprint = file->m_fingerprint;
+        entry.m_checksums_offset = data.size();
+        append(&data, file->m_checksums.data(), entry.m_n_blocks * sizeof(uint64_t));
+        entry.m_flags_offset = data.size();
+        append(&data, file->m_flags.data(), entry.m_n_blocks);
+        entry.m_path_offset = data.size();
+        entry.m_path_len = strlen(relative);
+        append(&data, relative, entry.m_path_len);
+        align(&data);
+    }
+    manifest_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    header.m_version = MANIFEST_VERSION;
+    header.m_block_size = MANIFEST_BLOCK_SIZE;
+    header.m_n_files = files.size();
+    header.m_base_offset = data.size();
+    header.m_base_len = base_dir ? strlen(base_dir) : 0;
+    append(&data, base_dir, header.m_base_len);
+    align(&data);
+    header.m_size = data.size();
+    if (!entries.empty()) {
+        data.replace(sizeof(header), entries.size() * sizeof(manifest_entry), (const char *) entries.data(), entries.size() * sizeof(manifest_entry));
+    }
+    data.replace(0, sizeof(header), (const char *) &header, sizeof(header));
+    const size_t checked_from = offsetof(manifest_header, m_version);
+    header.m_checksum = xxhash64(data.data() + checked_from, data.size() - checked_from, 0);
+    data.replace(offsetof(manifest_header, m_checksum), sizeof(header.m_checksum), (const char *) &header.m_checksum, sizeof(header.m_checksum));
+
+    with_object_to_free<char *> path(manifest_path(dir));
+    if (path.value == NULL) {
+        return ENOMEM;
+    }
+    int fd = call_real_open(path.value, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    int r = write_fully(fd, data.data(), data.size(), 0);
+    if (call_real_close(fd) != 0 && r == 0) {
+        r = errno;
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// verify() -
+//
+// Description:
+//
+//     Checks a backup directory against its own manifest.  Only the
+// blocks that are present can be checked; the others are checked by
+// verifying the base backup.
+//
+int backup_manifest::verify(const char *dir) throw() {
+    with_object_to_free<char *> path(manifest_path(dir));
+    if (path.value == NULL) {
+        return ENOMEM;
+    }
+    int r = this->read_file(path.value);
+    if (r == EINVAL) {
+        fprintf(stderr, "Toku Hot Backup: the manifest %s is damaged.\n", path.value);
+        return EBADMSG;
+    }
+    if (r != 0) {
+        return r;
+    }
+    char *buf = (char *) malloc(MANIFEST_BLOCK_SIZE);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    uint64_t n_bad = 0;
+    for (std::map<std::string, manifest_file *>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+        const manifest_file *file = it->second;
+        with_object_to_free<char *> file_path(malloc_snprintf(strlen(dir) + it->first.size() + 2, "%s/%s", dir, it->first.c_str()));
+        if (file_path.value == NULL) {
+            r = ENOMEM;
+            break;
+        }
+        int fd = call_real_open(file_path.value, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Toku Hot Backup: could not open %s to verify it, errno=%d (%s).\n", file_path.value, errno, strerror(errno));
+            n_bad++;
+            continue;
+        }
+        for (uint64_t block = 0; block < file->m_flags.size(); ++block) {
+            const uint8_t wanted = MANIFEST_BLOCK_PRESENT | MANIFEST_BLOCK_CHECKSUMED;
+            if ((file->m_flags[block] & wanted) != wanted) {
+                continue;
+            }
+            const uint64_t offset = block * MANIFEST_BLOCK_SIZE;
+            const uint64_t len = (file->m_size - offset < MANIFEST_BLOCK_SIZE) ? file->m_size - offset : MANIFEST_BLOCK_SIZE;
+            ssize_t n = call_real_pread(fd, buf, len, offset);
+            if (n != (ssize_t)len || manifest_checksum(buf, len) != file->m_checksums[block]) {
+                fprintf(stderr, "Toku Hot Backup: bytes %lu to %lu of %s don't match the manifest.\n", offset, offset + len, file_path.value);
+                n_bad++;
+            }
+        }
+        ignore(call_real_close(fd));
+    }
+    free(buf);
+    if (r == 0 && n_bad > 0) {
+        r = EBADMSG;
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const char *backup_manifest::base_dir(void) const throw() {
+    return m_base_dir;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_file *backup_manifest::find_locked(const char *path) const throw() {
+    std::map<std::string, manifest_file *>::const_iterator it = m_files.find(path);
+    return (it == m_files.end()) ? NULL : it->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const manifest_file *backup_manifest::find(const char *path) const throw() {
+    // A manifest that we read is never changed, so this needs no lock.
+    return this->find_locked(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_file *backup_manifest::find_or_add(const char *path, const manifest_file *base) throw() {
+    with_mutex_locked ml(&m_mutex);
+    manifest_file *file = this->find_locked(path);
+    if (file == NULL) {
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            return NULL;
+        }
+        file = new manifest_file(copy, base);
+        m_files[path] = file;
+    }
+    return file;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int backup_manifest::capture_change(const char *dest_path, const char *source_path, int dest_fd, uint64_t lo, uint64_t hi) throw() {
+    manifest_file *file;
+    {
+        with_mutex_locked ml(&m_mutex);
+        file = this->find_locked(dest_path);
+    }
+    if (file == NULL) {
+        return 0;
+    }
+    return file->capture_change(source_path, dest_fd, lo, hi);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_manifest::rename(const char *old_path, const char *new_path) throw() {
+    with_mutex_locked ml(&m_mutex);
+    this->rename_locked(old_path, new_path);
+
+    const std::string old_prefix = std::string(old_path) + "/";
+    std::vector<std::string> beneath;
+    for (std::map<std::string, manifest_file *>::iterator it = m_files.lower_bound(old_prefix);
+         it != m_files.end() && it->first.compare(0, old_prefix.size(), old_prefix) == 0;
+         ++it) {
+        beneath.push_back(it->first);
+    }
+    for (size_t i = 0; i < beneath.size(); ++i) {
+        this->rename_locked(beneath[i], new_path + beneath[i].substr(old_prefix.size() - 1));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_manifest::rename_locked(const std::string &old_path, const std::string &new_path) throw() {
+    std::map<std::string, manifest_file *>::iterator it = m_files.find(old_path);
+    if (it == m_files.end()) {
+        return;
+    }
+    char *copy = strdup(new_path.c_str());
+    if (copy == NULL) {
+        // Without a record, the renamed copy would look complete.
+        the_manager.backup_error(ENOMEM, "Could not rename the manifest record of %s", old_path.c_str());
+        return;
+    }
+    manifest_file *file = it->second;
+    m_files.erase(it);
+    file->set_path(copy);
+    manifest_file *&slot = m_files[new_path];
+    if (slot != NULL) {
+        m_removed.push_back(slot);
+    }
+    slot = file;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_manifest::remove(const char *path) throw() {
+    with_mutex_locked ml(&m_mutex);
+    std::map<std::string, manifest_file *>::iterator it = m_files.find(path);
+    if (it == m_files.end()) {
+        return;
+    }
+    m_removed.push_back(it->second);
+    m_files.erase(it);
+}
@@ -0,0 +1,265 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef BACKUP_MANIFEST_H
+#define BACKUP_MANIFEST_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// The name of the manifest that an incremental backup writes into each
+// of its destination directories.
+#define MANIFEST_NAME "tokubackup.manifest"
+
+// Files are compared with the base backup in blocks of this size.  It
+// divides the copier's buffer size, so a copied range never splits a
+// block.
+const uint64_t MANIFEST_BLOCK_SIZE = 64 << 10;
+
+// What we know about each block of a file.  Only the first two bits
+// are written to the manifest.
+enum {
+    MANIFEST_BLOCK_PRESENT    = 1, // the block's data is in this backup.  Otherwise it is the same as in the base backup.
+    MANIFEST_BLOCK_CHECKSUMED = 2, // the checksum is the checksum of the block's data.
+    MANIFEST_BLOCK_VISITED    = 4  // the copier has compared the block with the base backup.
+};
+
+uint64_t manifest_checksum(const void *buf, size_t len) throw();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// manifest_fingerprint:
+//
+// Description:
+//
+//     What stat() said about a source file when we started to copy it.
+// If a later backup finds the same inode, size, mtime and ctime, the
+// file hasn't changed since, and the new backup can take the base
+// backup's copy instead of reading it.  An inode number of zero means
+// that we don't trust the file's times (see set_fingerprint()).
+//
+struct manifest_fingerprint {
+    uint64_t m_ino;
+    uint64_t m_size;
+    int64_t m_mtime_sec;
+    int64_t m_mtime_nsec;
+    int64_t m_ctime_sec;
+    int64_t m_ctime_nsec;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// manifest_file:
+//
+// Description:
+//
+//     The manifest's record of one file: its size, and the checksum and
+// flags of each of its blocks.  While a backup runs, the copier fills
+// it in block by block (comparing with the base backup's record of the
+// same file), and capture marks the blocks that the application changes
+// afterwards.  Blocks the copier left out because they were unchanged
+// must be put into the backup before the application changes them, so
+// capture copies them from the source first.
+//
+class manifest_file {
+  public:
+    manifest_file(const char *path, const manifest_file *base) throw();
+    ~manifest_file(void) throw();
+
+    const char *path(void) const throw();
+    void set_path(const char *path) throw(); // Takes ownership of path.
+
+    bool block_is_unchanged(uint64_t block, uint64_t checksum, size_t len) const throw();
+    // Effect: Return true if the base backup has this block with the
+    //  given checksum and length.
+
+    void set_block(uint64_t block, int flags, uint64_t checksum) throw();
+    // Effect: Record what the copier did with the block.
+
+    int capture_change(const char *source_path, int dest_fd, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    // Effect: The application has changed [lo,hi) of the source file,
+    //  and we are about to make the same change to the backup copy
+    //  (which is open on dest_fd).  First copy any partly-changed
+    //  blocks that the copier left out from the source, and forget the
+    //  checksums of all the changed blocks.  Requires: [lo,hi) is range
+    //  locked.  Returns 0 or an error number, having reported it.
+
+    void set_fingerprint(const struct stat *sbuf, time_t backup_start) throw();
+    // Effect: Remember sbuf as the source's fingerprint, unless its ctime
+    //  is too close to backup_start to tell it apart from a change made
+    //  during (or after) this backup.
+
+    bool matches_base_fingerprint(const struct stat *sbuf) const throw();
+    // Effect: Return true if the base backup's record has a fingerprint
+    //  and sbuf matches it.
+
+    void take_base_blocks(bool have_data) throw();
+    // Effect: The file is unchanged since the base backup, so give it
+    //  the base's size, checksums and flags.  If have_data, the backup
+    //  copy is a clone of the base's copy, so the same blocks are
+    //  present in it; otherwise none are.
+
+    int finish(int fd, uint64_t size) throw() __attribute__((warn_unused_result));
+    // Effect: The backup copy, open on fd, ended up size bytes long.  Any
+    //  block that the copier never looked at was written by capture, so
+    //  it is present.  Blocks that capture changed are read back from fd
+    //  to checksum them, so that every present block has a checksum.
+    //  Returns 0 or an error number.
+
+    // The manifest's own access to the file's record.
+    uint64_t m_size;
+    manifest_fingerprint m_fingerprint;
+    std::vector<uint64_t> m_checksums;
+    std::vector<uint8_t> m_flags;
+
+  private:
+    char *m_path;
+    const manifest_file *m_base;
+    pthread_mutex_t m_mutex;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The manifest file's layout (version 3, in the machine's byte order).
+// Everything is at a multiple of 8 bytes, so a tool can mmap() the
+// manifest and use it in place.  The header comes first:
+//
+struct manifest_header {
+    char m_magic[8];          // "TOKUBMF1"
+    uint64_t m_checksum;      // xxhash64() of the rest of the file, from m_version on.
+    uint32_t m_version;
+    uint32_t m_block_size;
+    uint64_t m_size;          // of the whole file.
+    uint64_t m_n_files;
+    uint64_t m_base_offset;   // where the base backup's path is, if m_base_len isn't zero.
+    uint64_t m_base_len;
+    uint64_t m_reserved;
+};
+//
+// followed by an entry for each file, sorted by path,
+//
+struct manifest_entry {
+    uint64_t m_path_offset;   // the path is relative to the manifest's directory, and not NUL-terminated.
+    uint64_t m_path_len;
+    uint64_t m_size;
+    uint64_t m_n_blocks;
+    uint64_t m_checksums_offset; // m_n_blocks checksums of 8 bytes each.
+    uint64_t m_flags_offset;     // m_n_blocks flag bytes.
+    manifest_fingerprint m_fingerprint;
+};
+//
+// and then the paths, checksums and flags that the entries point at.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// backup_manifest:
+//
+// Description:
+//
+//     The records of a set of files, keyed by path.  A manifest read
+// from a base backup is keyed by the path relative to its directory.
+// The manifest of the backup being made is keyed by the full path of
+// the backup copies, so that capture can find a file's record, and is
+// written into each destination directory (with relative paths) when
+// the backup finishes.  Its checksums are computed by the copier from
+// the buffers it has just read, and by finish() for blocks that
+// capture changed, so a backup can be verified without the source.
+//
+//     To restore a file, start with the base backup's copy restored the
+// same way, take each PRESENT block from this backup, and cut the
+// result to the recorded size.  Files in the backup that the manifest
+// doesn't mention are complete.
+//
+class backup_manifest {
+  public:
+    backup_manifest(void) throw();
+    ~backup_manifest(void) throw();
+
+    int read(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Read the manifest in dir.  A directory without a manifest
+    //  gives an empty manifest.  Returns 0 or an error number.
+
+    int write(const char *dir, const char *base_dir) throw() __attribute__((warn_unused_result));
+    // Effect: Write the records of the files in dir into dir's
+    //  manifest, noting that it is relative to base_dir.  Returns 0 or
+    //  an error number.
+
+    int verify(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Read dir's manifest, and check every block that it says
+    //  is present in dir against its checksum, reporting each one that
+    //  doesn't match on stderr.  Returns 0 if they all match, EBADMSG
+    //  if any doesn't (or the manifest itself is damaged), or another
+    //  error number.
+
+    const char *base_dir(void) const throw(); // The base of the manifest we read, or NULL.
+
+    const manifest_file *find(const char *path) const throw();
+    manifest_file *find_or_add(const char *path, const manifest_file *base) throw() __attribute__((warn_unused_result));
+    // Effect: Return the record for path, making a new one (compared
+    //  with base, which may be NULL) if there is none.  Returns NULL if
+    //  we run out of memory.
+
+    int capture_change(const char *dest_path, const char *source_path, int dest_fd, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    // Effect: Do manifest_file::capture_change() for dest_path's
+    //  record, if it has one.
+
+    void rename(const char *old_path, const char *new_path) throw();
+    void remove(const char *path) throw();
+    // Effect: Follow the application's renames and unlinks of backup
+    //  copies.  The records beneath a renamed directory move with it.
+    //  Records stay allocated until the manifest is destroyed, since
+    //  the copier may still be using one.
+
+  private:
+    int read_file(const char *path) throw() __attribute__((warn_unused_result));
+    manifest_file *find_locked(const char *path) const throw();
+    void rename_locked(const std::string &old_path, const std::string &new_path) throw();
+
+    pthread_mutex_t m_mutex;
+    char *m_base_dir;
+    std::map<std::string, manifest_file *> m_files;
+    std::vector<manifest_file *> m_removed;
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,240 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_stats.h"
+#include "check.h"
+#include "mutex.h"
+
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+backup_stats::backup_stats(void) throw() {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+backup_stats::~backup_stats(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::get(tokubackup_stats *stats) throw() {
+    with_mutex_locked ml(&m_mutex);
+    this->get_locked(stats);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::get_locked(tokubackup_stats *stats) throw() {
+    *stats = m_stats;
+    stats->copy_range_locks += m_copy_locks.m_n_locks;
+    stats->copy_range_lock_waits += m_copy_locks.m_n_waits;
+    stats->copy_range_lock_wait_usecs += m_copy_locks.m_wait_usecs;
+    if (m_copy_locks.m_max_waiters > stats->range_lock_max_waiters) {
+        stats->range_lock_max_waiters = m_copy_locks.m_max_waiters;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+unsigned int backup_stats::get_devices(tokubackup_device_stats *stats, unsigned int n_stats) throw() {
+    with_mutex_locked ml(&m_mutex);
+    for (unsigned int i = 0; i < n_stats && i < m_devices.size(); ++i) {
+        stats[i] = m_devices[i];
+    }
+    return m_devices.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::set(backup_stats *other) throw() {
+    tokubackup_stats stats;
+    std::vector<tokubackup_device_stats> devices;
+    {
+        with_mutex_locked ml(&other->m_mutex);
+        other->get_locked(&stats);
+        devices = other->m_devices;
+    }
+    with_mutex_locked ml(&m_mutex);
+    m_stats = stats;
+    m_devices.swap(devices);
+    m_copy_locks.reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_workers(uint64_t n_workers, uint64_t n_busy, uint64_t n_steals) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (n_workers > m_stats.copy_threads) {
+        m_stats.copy_threads = n_workers;
+    }
+    if (n_busy > m_stats.copy_threads_used) {
+        m_stats.copy_threads_used = n_busy;
+    }
+    m_stats.work_steals += n_steals;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_chunks(uint64_t n_files, uint64_t n_chunks, uint64_t n_helper_chunks) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.chunked_files += n_files;
+    m_stats.chunks += n_chunks;
+    m_stats.helper_chunks += n_helper_chunks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// add_buffers() -
+//
+// Description:
+//
+//     Each copier has its own buffer pool, so the peak is the most that
+// any one of them had mapped at once.
+//
+void backup_stats::add_buffers(const buffer_pool_stats &stats) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.buffer_reuses += stats.m_hits;
+    m_stats.buffer_allocations += stats.m_misses;
+    m_stats.huge_page_buffers += stats.m_huge;
+    if (stats.m_peak_footprint > m_stats.buffer_peak_bytes) {
+        m_stats.buffer_peak_bytes = stats.m_peak_footprint;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_io_ring(uint64_t n_bytes, uint64_t usecs, uint64_t n_waits, uint64_t in_flight, uint64_t max_in_flight) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.io_uring_bytes += n_bytes;
+    m_stats.io_uring_usecs += usecs;
+    m_stats.io_uring_waits += n_waits;
+    m_stats.io_uring_in_flight += in_flight;
+    if (max_in_flight > m_stats.io_uring_max_in_flight) {
+        m_stats.io_uring_max_in_flight = max_in_flight;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_capture(const capture_queue_stats &stats) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.captured_writes += stats.m_n_writes;
+    m_stats.captured_bytes += stats.m_n_bytes;
+    if (stats.m_max_bytes > m_stats.captured_max_bytes) {
+        m_stats.captured_max_bytes = stats.m_max_bytes;
+    }
+    m_stats.captured_sync_writes += stats.m_n_sync;
+    m_stats.capture_stalls += stats.m_n_stalls;
+    m_stats.capture_stall_usecs += stats.m_stall_usecs;
+    m_stats.captured_elided_bytes += stats.m_elided_bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_dirty(const dirty_set_stats &stats, uint64_t n_files) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.dirty_marked_bytes += stats.m_marked_bytes;
+    m_stats.dirty_files += n_files;
+    m_stats.dirty_passes += stats.m_n_passes;
+    m_stats.dirty_copied_bytes += stats.m_copied_bytes;
+    m_stats.dirty_final_bytes += stats.m_final_bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::set_devices(const std::vector<tokubackup_device_stats> &devices) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_devices = devices;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock_stats *backup_stats::get_copy_lock_stats(void) throw() {
+    return &m_copy_locks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_write_locks(const range_lock_stats &stats) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.write_range_locks += stats.m_n_locks;
+    m_stats.write_range_lock_waits += stats.m_n_waits;
+    m_stats.write_range_lock_wait_usecs += stats.m_wait_usecs;
+    if (stats.m_max_waiters > m_stats.range_lock_max_waiters) {
+        m_stats.range_lock_max_waiters = stats.m_max_waiters;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_optimistic(uint64_t n_bytes, uint64_t n_recopied, uint64_t n_locked) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.optimistic_bytes += n_bytes;
+    m_stats.recopied_bytes += n_recopied;
+    m_stats.locked_copies += n_locked;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_cloned(uint64_t n_bytes) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.cloned_bytes += n_bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_incremental(uint64_t n_unchanged, uint64_t n_changed) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.unchanged_bytes += n_unchanged;
+    m_stats.changed_bytes += n_changed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void backup_stats::add_taken(uint64_t n_files, uint64_t n_bytes, uint64_t n_cloned) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stats.taken_files += n_files;
+    m_stats.taken_bytes += n_bytes;
+    m_stats.taken_cloned_files += n_cloned;
+}
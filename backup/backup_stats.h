@@ -0,0 +1,91 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef BACKUP_STATS_H
+#define BACKUP_STATS_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup.h"
+#include "buffer_pool.h"
+#include "capture_queue.h"
+#include "dirty_set.h"
+#include "range_lock.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// backup_stats:
+//
+// Description:
+//
+//     What one backup session did, for tokubackup_get_stats().  The
+// copiers of a session, which may copy different directories at the
+// same time, each add what they did when they finish a directory,
+// except for their range locks, which they count as they take them.
+//
+class backup_stats {
+  private:
+    pthread_mutex_t m_mutex;       // protects m_stats and m_devices.
+    tokubackup_stats m_stats;
+    std::vector<tokubackup_device_stats> m_devices;
+    range_lock_stats m_copy_locks; // its counts are atomic, so it needs no mutex.
+    void get_locked(tokubackup_stats *stats) throw();
+  public:
+    backup_stats(void) throw();
+    ~backup_stats(void) throw();
+    void get(tokubackup_stats *stats) throw();
+    unsigned int get_devices(tokubackup_device_stats *stats, unsigned int n_stats) throw();
+    void set(backup_stats *other) throw();
+    // Effect: Replace what we hold with what other holds.
+    void add_workers(uint64_t n_workers, uint64_t n_busy, uint64_t n_steals) throw();
+    void add_chunks(uint64_t n_files, uint64_t n_chunks, uint64_t n_helper_chunks) throw();
+    void add_buffers(const buffer_pool_stats &stats) throw();
+    void add_io_ring(uint64_t n_bytes, uint64_t usecs, uint64_t n_waits, uint64_t in_flight, uint64_t max_in_flight) throw();
+    void add_capture(const capture_queue_stats &stats) throw();
+    void add_dirty(const dirty_set_stats &stats, uint64_t n_files) throw();
+    void set_devices(const std::vector<tokubackup_device_stats> &devices) throw();
+    range_lock_stats *get_copy_lock_stats(void) throw();  // Where the copiers' range locks count.
+    void add_optimistic(uint64_t n_bytes, uint64_t n_recopied, uint64_t n_locked) throw();
+    void add_cloned(uint64_t n_bytes) throw();
+    void add_incremental(uint64_t n_unchanged, uint64_t n_changed) throw();
+    void add_taken(uint64_t n_files, uint64_t n_bytes, uint64_t n_cloned) throw();
+    void add_write_locks(const range_lock_stats &stats) throw();
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,97 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "brlock.h"
+#include "check.h"
+#include "rwlock.h"
+
+#include <sched.h>
+
+// The slot this thread holds read locks in, and how many it holds.
+static __thread int brlock_reader_slot;
+static __thread int brlock_reader_depth = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+brlock::brlock(void) throw() {
+    for (int i = 0; i < BRLOCK_SLOTS; ++i) {
+        int r = pthread_rwlock_init(&m_slots[i].m_rwlock, NULL);
+        check(r == 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// rdlock() -
+//
+// Description:
+//
+//     Read-locks the slot of the CPU we are on (or the slot we already
+// hold) and returns it.
+//
+int brlock::rdlock(void) throw() {
+    if (brlock_reader_depth == 0) {
+        int cpu = sched_getcpu();
+        brlock_reader_slot = (cpu < 0) ? 0 : cpu % BRLOCK_SLOTS;
+    }
+    brlock_reader_depth++;
+    const int slot = brlock_reader_slot;
+    prwlock_rdlock(&m_slots[slot].m_rwlock);
+    return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void brlock::rdunlock(int slot) throw() {
+    prwlock_unlock(&m_slots[slot].m_rwlock);
+    brlock_reader_depth--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void brlock::wrlock(const backtrace bt) throw() {
+    for (int i = 0; i < BRLOCK_SLOTS; ++i) {
+        prwlock_wrlock(&m_slots[i].m_rwlock, BACKTRACE(&bt));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void brlock::wrunlock(const backtrace bt) throw() {
+    for (int i = BRLOCK_SLOTS - 1; i >= 0; --i) {
+        prwlock_unlock(&m_slots[i].m_rwlock, BACKTRACE(&bt));
+    }
+}
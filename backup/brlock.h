@@ -0,0 +1,107 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef BRLOCK_H
+#define BRLOCK_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+
+#include "backtrace.h"
+
+const int BRLOCK_SLOTS = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// brlock:
+//
+// Description:
+//
+//     A big-reader lock: a reader/writer lock for data that is read on
+// every captured call and written about twice per backup.  Each CPU
+// gets its own rwlock, on its own cache line, so readers on different
+// CPUs don't touch each other's memory.  A reader locks the slot of
+// the CPU it is running on and must hand that slot back to
+// rdunlock(), since it may have moved by then.  A writer locks every
+// slot, in order.
+//
+//     A thread that already holds a read lock reuses its slot, so
+// nested readers can't deadlock against a writer that has taken the
+// other slots.
+//
+//     The locks are never destroyed: a brlock lives as long as the
+// process, and a backup may still be ending while it exits.
+//
+class brlock {
+  private:
+    struct padded_rwlock {
+        pthread_rwlock_t m_rwlock;
+    } __attribute__((aligned(64)));
+    padded_rwlock m_slots[BRLOCK_SLOTS];
+  public:
+    brlock(void) throw();
+    int rdlock(void) throw() __attribute__((warn_unused_result)); // Returns the slot to give to rdunlock().
+    void rdunlock(int slot) throw();
+    void wrlock(const backtrace bt) throw();
+    void wrunlock(const backtrace bt) throw();
+};
+
+class with_brlock_rdlocked {
+  private:
+    brlock *m_lock;
+    const int m_slot;
+  public:
+    with_brlock_rdlocked(brlock *lock): m_lock(lock), m_slot(lock->rdlock()) {
+    }
+    ~with_brlock_rdlocked(void) {
+        m_lock->rdunlock(m_slot);
+    }
+};
+
+class with_brlock_wrlocked {
+  private:
+    brlock *m_lock;
+    const backtrace m_backtrace;
+  public:
+    with_brlock_wrlocked(brlock *lock, const backtrace bt): m_lock(lock), m_backtrace(bt) {
+        m_lock->wrlock(m_backtrace);
+    }
+    ~with_brlock_wrlocked(void) {
+        m_lock->wrunlock(m_backtrace);
+    }
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,233 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "buffer_pool.h"
+#include "check.h"
+#include "mutex.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+template class std::vector<copy_buffer *>;
+
+// How many free buffers a worker keeps for itself.  One is enough to
+// copy with, and the second covers a large file's chunks.
+static const int MAX_FREE_PER_WORKER = 2;
+
+// The size of an explicit huge page.
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+buffer_pool::buffer_pool(size_t buffer_size, size_t poll_string_size) throw()
+    : m_buffer_size(buffer_size),
+      m_poll_string_size(poll_string_size),
+      m_huge_pages(false),
+      m_shared_free(NULL),
+      m_hits(0),
+      m_misses(0),
+      m_huge(0),
+      m_footprint(0),
+      m_peak_footprint(0)
+{
+    int r = pthread_mutex_init(&m_shared_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+buffer_pool::~buffer_pool(void) throw() {
+    this->set_n_workers(0);
+    while (m_shared_free != NULL) {
+        copy_buffer *buffer = m_shared_free;
+        m_shared_free = buffer->m_next;
+        this->release(buffer);
+    }
+    int r = pthread_mutex_destroy(&m_shared_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::set_n_workers(int n_workers) throw() {
+    with_mutex_locked sm(&m_shared_mutex);
+    for (size_t i = n_workers; i < m_free.size(); ++i) {
+        while (m_free[i] != NULL) {
+            copy_buffer *buffer = m_free[i];
+            m_free[i] = buffer->m_next;
+            buffer->m_next = m_shared_free;
+            m_shared_free = buffer;
+        }
+    }
+    m_free.resize(n_workers, NULL);
+    m_n_free.resize(n_workers, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::set_huge_pages(bool use_huge_pages) throw() {
+    m_huge_pages = use_huge_pages;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_buffer *buffer_pool::get(int worker) throw() {
+    copy_buffer *buffer = m_free[worker];
+    if (buffer != NULL) {
+        m_free[worker] = buffer->m_next;
+        m_n_free[worker]--;
+    } else {
+        with_mutex_locked sm(&m_shared_mutex);
+        buffer = m_shared_free;
+        if (buffer != NULL) {
+            m_shared_free = buffer->m_next;
+        }
+    }
+
+    if (buffer != NULL) {
+        m_hits++;
+    } else {
+        m_misses++;
+        buffer = this->allocate();
+        if (buffer == NULL) {
+            return NULL;
+        }
+    }
+    buffer->m_next = NULL;
+    return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::put(int worker, copy_buffer *buffer) throw() {
+    if (m_n_free[worker] < MAX_FREE_PER_WORKER) {
+        buffer->m_next = m_free[worker];
+        m_free[worker] = buffer;
+        m_n_free[worker]++;
+    } else {
+        with_mutex_locked sm(&m_shared_mutex);
+        buffer->m_next = m_shared_free;
+        m_shared_free = buffer;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::get_stats(buffer_pool_stats *stats) const throw() {
+    stats->m_hits = m_hits;
+    stats->m_misses = m_misses;
+    stats->m_huge = m_huge;
+    stats->m_footprint = m_footprint;
+    stats->m_peak_footprint = m_peak_footprint;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::reset_stats(void) throw() {
+    m_hits = 0;
+    m_misses = 0;
+    m_huge = 0;
+    m_peak_footprint = m_footprint.load();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// allocate() -
+//
+// Description:
+//
+//     Maps a new buffer.  The caller is the worker that will use it,
+// so its pages are placed on that worker's NUMA node when the worker
+// first touches them.
+//
+copy_buffer *buffer_pool::allocate(void) throw() {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = (m_buffer_size + m_poll_string_size + page_size - 1) / page_size * page_size;
+    void *mapping = MAP_FAILED;
+    bool is_huge = false;
+    if (m_huge_pages) {
+        const size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        mapping = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) {
+            size = huge_size;
+            is_huge = true;
+        }
+    }
+    if (mapping == MAP_FAILED) {
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (m_huge_pages) {
+            // No huge pages are reserved, so settle for transparent
+            // ones.  This is only advice, so ignore any error.
+            ignore(madvise(mapping, size, MADV_HUGEPAGE));
+        }
+#endif
+    }
+
+    copy_buffer *buffer = new copy_buffer;
+    buffer->m_data = (char *)mapping;
+    buffer->m_size = m_buffer_size;
+    buffer->m_poll_string = (char *)mapping + m_buffer_size;
+    buffer->m_poll_string_size = m_poll_string_size;
+    buffer->m_mapping = mapping;
+    buffer->m_mapping_size = size;
+    buffer->m_next = NULL;
+
+    if (is_huge) {
+        m_huge++;
+    }
+    const uint64_t footprint = (m_footprint += size);
+    uint64_t peak = m_peak_footprint;
+    while (footprint > peak && !m_peak_footprint.compare_exchange_weak(peak, footprint)) {
+    }
+    return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void buffer_pool::release(copy_buffer *buffer) throw() {
+    m_footprint -= buffer->m_mapping_size;
+    int r = munmap(buffer->m_mapping, buffer->m_mapping_size);
+    check(r==0);
+    delete buffer;
+}
@@ -0,0 +1,142 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_buffer:
+//
+// Description:
+//
+//     One buffer handed out by the buffer_pool: m_size bytes of page
+// aligned data (good enough for O_DIRECT), followed by a string for
+// building poll and error messages.
+//
+struct copy_buffer {
+    char *m_data;
+    size_t m_size;
+    char *m_poll_string;
+    size_t m_poll_string_size;
+    void *m_mapping;        // what we got from mmap().
+    size_t m_mapping_size;
+    copy_buffer *m_next;    // the next free buffer.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// buffer_pool_stats:
+//
+struct buffer_pool_stats {
+    uint64_t m_hits;            // buffers that were reused.
+    uint64_t m_misses;          // buffers that had to be allocated.
+    uint64_t m_huge;            // allocated buffers backed by explicit huge pages.
+    uint64_t m_footprint;       // bytes mapped right now.
+    uint64_t m_peak_footprint;  // the most bytes ever mapped at once.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// buffer_pool:
+//
+// Description:
+//
+//     The copy buffers used by the copier's workers.  Allocating and
+// faulting in a fresh megabyte for every file costs more than copying
+// a small file, so buffers are kept once allocated and reused.
+//
+//     Each worker has its own free list, which it alone touches, so a
+// worker normally gets back a buffer that it allocated itself.  Since
+// the kernel places a page on the NUMA node of the thread that first
+// touches it, that keeps each worker's buffer local to it without
+// depending on libnuma.  Buffers beyond a couple per worker go to a
+// shared list, from which any worker can take them.
+//
+//     Buffers are mapped with mmap().  If huge pages are enabled, we
+// first ask for explicit huge pages and otherwise ask the kernel to
+// back the buffer with transparent huge pages.
+//
+class buffer_pool {
+  public:
+    buffer_pool(size_t buffer_size, size_t poll_string_size) throw();
+    ~buffer_pool(void) throw();
+
+    void set_n_workers(int n_workers) throw();
+    // Effect: Make room for the given number of free lists.  Buffers
+    //  on lists that are no longer needed move to the shared list.
+    //  Requires: no worker is using the pool.
+
+    void set_huge_pages(bool use_huge_pages) throw();
+    // Effect: Back buffers allocated from now on with huge pages.
+
+    copy_buffer *get(int worker) throw() __attribute__((warn_unused_result));
+    // Effect: Return a buffer for the given worker, or NULL (with errno
+    //  set) if we could not allocate one.
+
+    void put(int worker, copy_buffer *buffer) throw();
+    // Effect: Give back a buffer that the given worker got from get().
+
+    void get_stats(buffer_pool_stats *stats) const throw();
+    void reset_stats(void) throw(); // The footprint isn't reset, but its peak becomes the current footprint.
+
+  private:
+    copy_buffer *allocate(void) throw();
+    void release(copy_buffer *buffer) throw();
+
+    const size_t m_buffer_size;
+    const size_t m_poll_string_size;
+    bool m_huge_pages;
+    std::vector<copy_buffer *> m_free;         // each worker's free list.
+    std::vector<int> m_n_free;                 // the length of each worker's free list.
+    pthread_mutex_t m_shared_mutex;
+    copy_buffer *m_shared_free;                // buffers that any worker can take.
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_huge;
+    std::atomic<uint64_t> m_footprint;
+    std::atomic<uint64_t> m_peak_footprint;
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,202 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "call_gate.h"
+#include "check.h"
+#include "mutex.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_MEMBARRIER
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+call_gate the_call_gate;
+
+__thread call_gate_thread *call_gate_my_thread __attribute__((tls_model("initial-exec"))) = NULL;
+
+// Until the process has registered for expedited membarriers, the
+// calls have to order their own counter bump and flag load.
+bool call_gate_calls_need_fence = true;
+
+static pthread_once_t gate_once = PTHREAD_ONCE_INIT;
+static pthread_key_t gate_key;
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// init_once() -
+//
+// Description:
+//
+//     Creates the key whose destructor hands an exiting thread's
+// record back, and registers the process for the membarrier() that
+// lets the calls skip their fence.
+//
+void call_gate::init_once(void) throw() {
+    int r = pthread_key_create(&gate_key, call_gate::release_thread);
+    check(r == 0);
+#ifdef HAVE_MEMBARRIER
+    if (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        call_gate_calls_need_fence = false;
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// register_thread() -
+//
+// Description:
+//
+//     Gives the calling thread a record, reusing one that an exited
+// thread gave back if there is one.
+//
+call_gate_thread *call_gate::register_thread(void) throw() {
+    int r = pthread_once(&gate_once, call_gate::init_once);
+    check(r == 0);
+    call_gate_thread *t = NULL;
+    pmutex_lock(&gate_mutex, BACKTRACE(NULL));
+    for (t = m_threads.load(std::memory_order_relaxed); t != NULL; t = t->m_next) {
+        if (!t->m_in_use.load(std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        t = new call_gate_thread;
+        t->m_calls.store(0, std::memory_order_relaxed);
+        t->m_fd.store(-1, std::memory_order_relaxed);
+        t->m_in_use.store(true, std::memory_order_relaxed);
+        t->m_next = m_threads.load(std::memory_order_relaxed);
+        m_threads.store(t, std::memory_order_release);
+    } else {
+        t->m_in_use.store(true, std::memory_order_relaxed);
+    }
+    pmutex_unlock(&gate_mutex, BACKTRACE(NULL));
+    t->m_depth = 0;
+    r = pthread_setspecific(gate_key, t);
+    check(r == 0);
+    call_gate_my_thread = t;
+    return t;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// release_thread() -
+//
+// Description:
+//
+//     The key destructor: runs on the exiting thread, which is not in
+// an interposed call, so its count is even and the record can go to
+// the next thread.
+//
+void call_gate::release_thread(void *record) throw() {
+    call_gate_thread *t = static_cast<call_gate_thread *>(record);
+    call_gate_my_thread = NULL;
+    pmutex_lock(&gate_mutex, BACKTRACE(NULL));
+    t->m_in_use.store(false, std::memory_order_relaxed);
+    pmutex_unlock(&gate_mutex, BACKTRACE(NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void call_gate::start_tracking(void) throw() {
+    m_tracking.store(true, std::memory_order_seq_cst);
+    this->wait_for_calls();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void call_gate::stop_tracking(void) throw() {
+    m_tracking.store(false, std::memory_order_seq_cst);
+    this->wait_for_calls();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool call_gate::is_tracking(void) throw() {
+    return m_tracking.load(std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// wait_for_calls() -
+//
+// Description:
+//
+//     Waits until every thread that is inside an interposed call now
+// has left it.  A thread whose call is on a file descriptor that is
+// not a regular file (a socket, a pipe...) may be blocked for good,
+// so we don't wait for it.  The membarrier() makes every other thread
+// either see our store to m_tracking or show us that it is in a call.
+//
+void call_gate::wait_for_calls(void) throw() {
+    int r = pthread_once(&gate_once, call_gate::init_once);
+    check(r == 0);
+    if (call_gate_calls_need_fence) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } else {
+#ifdef HAVE_MEMBARRIER
+        r = syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        check(r == 0);
+#endif
+    }
+    const call_gate_thread *me = call_gate_my_thread;
+    for (call_gate_thread *t = m_threads.load(std::memory_order_acquire); t != NULL; t = t->m_next) {
+        if (t == me) {
+            continue;
+        }
+        const uint64_t calls = t->m_calls.load(std::memory_order_acquire);
+        if (calls % 2 == 0) {
+            continue;
+        }
+        const int fd = t->m_fd.load(std::memory_order_relaxed);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+        }
+        while (t->m_calls.load(std::memory_order_acquire) == calls) {
+            sched_yield();
+        }
+    }
+}
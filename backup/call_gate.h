@@ -0,0 +1,146 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef CALL_GATE_H
+#define CALL_GATE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// call_gate_thread:
+//
+// Description:
+//
+//     What the call gate knows about one application thread.  The
+// thread bumps m_calls as it enters and leaves an interposed call, so
+// the count is odd while it is inside one, and m_fd says which file
+// descriptor that call is working on (-1 for calls that take a path).
+// Records are never freed: when a thread exits its record goes back
+// to the pool for the next thread.
+//
+struct call_gate_thread {
+    std::atomic<uint64_t> m_calls;
+    std::atomic<int> m_fd;
+    std::atomic<bool> m_in_use;
+    int m_depth;                    // interposed calls can nest (e.g. open() inside a library call).  Only the owner touches this.
+    call_gate_thread *m_next;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// call_gate:
+//
+// Description:
+//
+//     Lets the interposed calls skip the backup manager entirely when
+// no backup is running.  While the gate is idle, an interposed call
+// costs a thread-local counter bump and one relaxed load before it
+// goes straight to the real system call, and the manager keeps no
+// state about the application's files at all.
+//
+//     Turning tracking on or off waits for the calls that may have
+// read the old setting, so that once start_tracking() returns every
+// call goes through the manager, and once stop_tracking() returns
+// none of them does.  The waiting side pays for this with a
+// membarrier() (or, where that isn't available, the calls pay for a
+// full fence).  Calls blocked on something other than a regular file,
+// such as a read() from a socket, may never finish, so they aren't
+// waited for: they can't change anything the backup cares about.
+//
+extern __thread call_gate_thread *call_gate_my_thread __attribute__((tls_model("initial-exec")));
+extern bool call_gate_calls_need_fence;
+
+class call_gate {
+  private:
+    std::atomic<bool> m_tracking;
+    std::atomic<call_gate_thread *> m_threads;  // every record ever made, newest first.
+    call_gate_thread *register_thread(void) throw();
+    static void release_thread(void *record) throw();
+    static void init_once(void) throw();
+  public:
+    // constexpr, so that the gate works for calls made by other libraries' constructors, before ours have run.
+    constexpr call_gate(void) throw() : m_tracking(false), m_threads(nullptr) {
+    }
+    bool enter(int fd) throw() __attribute__((warn_unused_result)); // Returns true if the call must go through the backup manager.
+    void exit(void) throw();
+    void start_tracking(void) throw();
+    void stop_tracking(void) throw();
+    bool is_tracking(void) throw();
+    void wait_for_calls(void) throw(); // Wait for the calls in progress now to finish.
+};
+
+extern call_gate the_call_gate;
+
+// enter() and exit() are on the path of every interposed call, so they are inline.
+inline bool call_gate::enter(int fd) throw() {
+    call_gate_thread *t = call_gate_my_thread;
+    if (t == NULL) {
+        t = this->register_thread();
+    }
+    if (t->m_depth++ == 0) {
+        t->m_fd.store(fd, std::memory_order_relaxed);
+        t->m_calls.store(t->m_calls.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        if (call_gate_calls_need_fence) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        } else {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+    }
+    return m_tracking.load(std::memory_order_relaxed);
+}
+
+inline void call_gate::exit(void) throw() {
+    call_gate_thread *t = call_gate_my_thread;
+    if (--t->m_depth == 0) {
+        t->m_calls.store(t->m_calls.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+}
+
+class with_call_gate {
+  public:
+    const bool tracking;
+    with_call_gate(int fd) : tracking(the_call_gate.enter(fd)) {
+    }
+    ~with_call_gate(void) {
+        the_call_gate.exit();
+    }
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,622 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "capture_journal.h"
+#include "check.h"
+#include "destination_file.h"
+#include "manager.h"
+#include "mutex.h"
+#include "raii-malloc.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_journal::capture_journal(void) throw()
+    : m_path(NULL), m_fd(-1), m_end(0), m_buffer(NULL), m_n_buffered(0), m_next_id(1) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_journal::~capture_journal(void) throw() {
+    if (m_fd >= 0) {
+        ignore(call_real_close(m_fd));
+        ignore(call_real_unlink(m_path));
+    }
+    free(m_path);
+    free(m_buffer);
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::open(const char *dir) throw() {
+    m_path = malloc_snprintf(strlen(dir) + sizeof(CAPTURE_JOURNAL_NAME) + 1, "%s/%s", dir, CAPTURE_JOURNAL_NAME);
+    m_buffer = (char *) malloc(CAPTURE_JOURNAL_BUFFER_SIZE);
+    if (m_path == NULL || m_buffer == NULL) {
+        int r = ENOMEM;
+        the_manager.backup_error(r, "Could not allocate the capture journal for %s", dir);
+        return r;
+    }
+    m_fd = call_real_open(m_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (m_fd < 0) {
+        int r = errno;
+        the_manager.backup_error(r, "Could not create the capture journal %s", m_path);
+        return r;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::flush_locked(void) throw() {
+    size_t n_wrote = 0;
+    const uint64_t offset = m_end - m_n_buffered;
+    while (n_wrote < m_n_buffered) {
+        ssize_t n = call_real_pwrite(m_fd, m_buffer + n_wrote, m_n_buffered - n_wrote, offset + n_wrote);
+        if (n < 0) {
+            int r = errno;
+            the_manager.backup_error(r, "Could not write the capture journal %s", m_path);
+            return r;
+        }
+        n_wrote += n;
+    }
+    m_n_buffered = 0;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// append_locked() -
+//
+// Description:
+//
+//     Appends a record to the buffer, writing the buffer out whenever
+// it fills up.  A big write's data goes through the buffer a piece at
+// a time, so the journal is only ever written sequentially.
+//
+int capture_journal::append_locked(const capture_journal_record *record, const char *path, const char *path2, const void *data) throw() {
+    const struct {
+        const void *m_bytes;
+        size_t m_length;
+    } pieces[] = {
+        { record, sizeof(*record) },
+        { path, record->m_path_length },
+        { path2, record->m_path2_length },
+        { data, record->m_type == JOURNAL_WRITE ? (size_t) record->m_length : 0 },
+    };
+    for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i) {
+        const char *bytes = (const char *) pieces[i].m_bytes;
+        size_t length = pieces[i].m_length;
+        while (length > 0) {
+            if (m_n_buffered == CAPTURE_JOURNAL_BUFFER_SIZE) {
+                int r = this->flush_locked();
+                if (r != 0) {
+                    return r;
+                }
+            }
+            size_t n = CAPTURE_JOURNAL_BUFFER_SIZE - m_n_buffered;
+            if (n > length) {
+                n = length;
+            }
+            memcpy(m_buffer + m_n_buffered, bytes, n);
+            m_n_buffered += n;
+            m_end += n;
+            bytes += n;
+            length -= n;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::id_of_locked(destination_file *dest, uint64_t *id) throw() {
+    if (dest->get_journal_id() == 0) {
+        const char *path = dest->get_path();
+        capture_journal_record record;
+        memset(&record, 0, sizeof(record));
+        record.m_type = JOURNAL_OPEN;
+        record.m_id = m_next_id;
+        record.m_path_length = strlen(path);
+        int r = this->append_locked(&record, path, NULL, NULL);
+        if (r != 0) {
+            return r;
+        }
+        dest->set_journal_id(m_next_id++);
+    }
+    *id = dest->get_journal_id();
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::append_change(uint32_t type, destination_file *dest, int mode, uint64_t offset, uint64_t length, const void *data) throw() {
+    with_mutex_locked ml(&m_mutex);
+    capture_journal_record record;
+    memset(&record, 0, sizeof(record));
+    int r = this->id_of_locked(dest, &record.m_id);
+    if (r != 0) {
+        return r;
+    }
+    record.m_type = type;
+    record.m_mode = mode;
+    record.m_offset = offset;
+    record.m_length = length;
+    return this->append_locked(&record, NULL, NULL, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::write(destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() {
+    return this->append_change(JOURNAL_WRITE, dest, 0, offset, nbyte, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::truncate(destination_file *dest, off_t length) throw() {
+    return this->append_change(JOURNAL_TRUNCATE, dest, 0, length, 0, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::fallocate(destination_file *dest, int mode, off_t offset, off_t len) throw() {
+    return this->append_change(JOURNAL_FALLOCATE, dest, mode, offset, len, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::rename(const char *old_dest, const char *new_dest) throw() {
+    with_mutex_locked ml(&m_mutex);
+    capture_journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.m_type = JOURNAL_RENAME;
+    record.m_path_length = strlen(old_dest);
+    record.m_path2_length = strlen(new_dest);
+    return this->append_locked(&record, old_dest, new_dest, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::unlink(const char *dest) throw() {
+    with_mutex_locked ml(&m_mutex);
+    capture_journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.m_type = JOURNAL_UNLINK;
+    record.m_path_length = strlen(dest);
+    return this->append_locked(&record, dest, NULL, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int capture_journal::start_copy(destination_file *dest) throw() {
+    return this->append_change(JOURNAL_COPY, dest, 0, 0, 0, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// journal_reader:
+//
+// Description:
+//
+//     Reads the journal from the start, a buffer at a time.
+//
+class journal_reader {
+  private:
+    int m_fd;
+    uint64_t m_offset;   // where the unread bytes in the buffer came from.
+    char *m_buffer;
+    size_t m_pos;
+    size_t m_n_read;
+  public:
+    journal_reader(int fd, char *buffer) throw()
+        : m_fd(fd), m_offset(0), m_buffer(buffer), m_pos(0), m_n_read(0) {
+    }
+    // Make up to n bytes (and at least one) readable at *bytes.
+    int next(size_t n, const char **bytes, size_t *n_got) throw() {
+        if (m_pos == m_n_read) {
+            m_offset += m_n_read;
+            m_pos = 0;
+            m_n_read = 0;
+        }
+        if (m_n_read - m_pos < n && m_n_read - m_pos < CAPTURE_JOURNAL_BUFFER_SIZE) {
+            // Move what is left to the front and read some more.
+            memmove(m_buffer, m_buffer + m_pos, m_n_read - m_pos);
+            m_offset += m_pos;
+            m_n_read -= m_pos;
+            m_pos = 0;
+            ssize_t r = call_real_pread(m_fd, m_buffer + m_n_read, CAPTURE_JOURNAL_BUFFER_SIZE - m_n_read, m_offset + m_n_read);
+            if (r < 0) {
+                return errno;
+            }
+            m_n_read += r;
+        }
+        size_t available = m_n_read - m_pos;
+        if (available == 0) {
+            return EIO; // The journal ends in the middle of a record.
+        }
+        if (available > n) {
+            available = n;
+        }
+        *bytes = m_buffer + m_pos;
+        *n_got = available;
+        m_pos += available;
+        return 0;
+    }
+    // Read exactly n bytes (at most a buffer's worth).
+    int read(void *out, size_t n) throw() {
+        const char *bytes;
+        size_t n_got;
+        int r = this->next(n, &bytes, &n_got);
+        if (r == 0 && n_got < n) {
+            r = EIO;
+        }
+        if (r == 0) {
+            memcpy(out, bytes, n);
+        }
+        return r;
+    }
+    uint64_t offset(void) const throw() {
+        return m_offset + m_pos;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static int read_path(journal_reader *reader, uint32_t length, std::string *path) throw() {
+    path->clear();
+    while (length > 0) {
+        const char *bytes;
+        size_t n_got;
+        int r = reader->next(length, &bytes, &n_got);
+        if (r != 0) {
+            return r;
+        }
+        path->append(bytes, n_got);
+        length -= n_got;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static int skip_bytes(journal_reader *reader, uint64_t length) throw() {
+    while (length > 0) {
+        const char *bytes;
+        size_t n_got;
+        int r = reader->next(length < CAPTURE_JOURNAL_BUFFER_SIZE ? length : CAPTURE_JOURNAL_BUFFER_SIZE, &bytes, &n_got);
+        if (r != 0) {
+            return r;
+        }
+        length -= n_got;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// rename_paths() -
+//
+// Description:
+//
+//     Whatever was at new_path has been renamed over, and whatever was
+// at old_path, or below it if it is a directory, is now at new_path.
+//
+static void rename_paths(std::map<uint64_t, std::string> *paths, const std::string &old_path, const std::string &new_path) throw() {
+    if (old_path == new_path) {
+        return;
+    }
+    for (std::map<uint64_t, std::string>::iterator it = paths->begin(); it != paths->end(); ) {
+        if (it->second == new_path) {
+            it = paths->erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (std::map<uint64_t, std::string>::iterator it = paths->begin(); it != paths->end(); ++it) {
+        std::string &path = it->second;
+        if (path == old_path) {
+            path = new_path;
+        } else if (path.size() > old_path.size() && path.compare(0, old_path.size(), old_path) == 0 && path[old_path.size()] == '/') {
+            path = new_path + path.substr(old_path.size());
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// journal_cut:
+//
+// Description:
+//
+//     A truncate or fallocate of a backup copy, which has already been
+// done to it, and which the replay applies only to the writes recorded
+// before it.
+//
+struct journal_cut {
+    uint64_t m_index;   // the record's position in the journal.
+    uint32_t m_type;
+    int32_t m_mode;
+    uint64_t m_offset;
+    uint64_t m_length;
+};
+
+// The part of a recorded write that still goes into the backup copy.
+struct journal_piece {
+    uint64_t m_offset;      // where it goes in the backup copy.
+    uint64_t m_data_offset; // where it starts in the write's data.
+    uint64_t m_length;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void split_pieces(std::vector<journal_piece> *pieces, uint64_t at) throw() {
+    for (size_t i = 0; i < pieces->size(); ++i) {
+        journal_piece piece = (*pieces)[i];
+        if (piece.m_offset < at && at < piece.m_offset + piece.m_length) {
+            const uint64_t n = at - piece.m_offset;
+            (*pieces)[i].m_length = n;
+            journal_piece rest = { at, piece.m_data_offset + n, piece.m_length - n };
+            pieces->insert(pieces->begin() + i + 1, rest);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// cut_pieces() -
+//
+// Description:
+//
+//     Does to the pieces of a write what the cut did to the backup
+// copy after the write was recorded: drops what it truncated, punched
+// or zeroed, and moves what it collapsed or inserted a range before.
+//
+static void cut_pieces(std::vector<journal_piece> *pieces, const journal_cut &cut) throw() {
+    uint64_t lo = cut.m_offset;
+    uint64_t hi = lo;
+    int64_t shift = 0;
+    if (cut.m_type == JOURNAL_TRUNCATE) {
+        hi = UINT64_MAX;
+    } else if (cut.m_mode & FALLOC_FL_COLLAPSE_RANGE) {
+        hi = lo + cut.m_length;
+        shift = -(int64_t) cut.m_length;
+    } else if (cut.m_mode & FALLOC_FL_INSERT_RANGE) {
+        shift = cut.m_length;
+    } else if (cut.m_mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        hi = lo + cut.m_length;
+    }
+    split_pieces(pieces, lo);
+    split_pieces(pieces, hi);
+    std::vector<journal_piece> kept;
+    for (size_t i = 0; i < pieces->size(); ++i) {
+        journal_piece piece = (*pieces)[i];
+        if (lo <= piece.m_offset && piece.m_offset < hi) {
+            continue;
+        }
+        if (piece.m_offset >= hi) {
+            piece.m_offset += shift;
+        }
+        kept.push_back(piece);
+    }
+    pieces->swap(kept);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static bool cut_is_earlier(const journal_cut &a, const journal_cut &b) throw() {
+    return a.m_index < b.m_index;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// apply() -
+//
+// Description:
+//
+//     Replays the journal in two passes.  The first follows the opens,
+// renames and unlinks to find where each backup copy ended up, and
+// gathers, for each place, its cuts and when its last copy started.
+// The second writes the recorded writes into the copies that are still
+// there, in the order they were recorded, less what a later cut
+// removed, and leaving out those from before the copy started.  A copy
+// that isn't there any more (because its directory was removed, say)
+// is skipped.
+//
+int capture_journal::apply(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    int r = this->flush_locked();
+    if (r != 0) {
+        return r;
+    }
+
+    std::map<uint64_t, std::string> paths;
+    std::map<uint64_t, std::vector<journal_cut> > cuts_of_id;
+    std::map<uint64_t, uint64_t> copy_start_of_id;
+    std::string path, path2;
+    capture_journal_record record;
+    {
+        journal_reader reader(m_fd, m_buffer);
+        for (uint64_t index = 0; reader.offset() < m_end; ++index) {
+            r = reader.read(&record, sizeof(record));
+            if (r == 0) r = read_path(&reader, record.m_path_length, &path);
+            if (r == 0) r = read_path(&reader, record.m_path2_length, &path2);
+            if (r == 0 && record.m_type == JOURNAL_WRITE) r = skip_bytes(&reader, record.m_length);
+            if (r != 0) {
+                the_manager.backup_error(r, "Could not read the capture journal %s", m_path);
+                return r;
+            }
+            switch (record.m_type) {
+            case JOURNAL_OPEN:
+                paths[record.m_id] = path;
+                break;
+            case JOURNAL_TRUNCATE:
+            case JOURNAL_FALLOCATE: {
+                journal_cut cut = { index, record.m_type, record.m_mode, record.m_offset, record.m_length };
+                cuts_of_id[record.m_id].push_back(cut);
+                break;
+            }
+            case JOURNAL_COPY:
+                copy_start_of_id[record.m_id] = index;
+                break;
+            case JOURNAL_RENAME:
+                rename_paths(&paths, path, path2);
+                break;
+            case JOURNAL_UNLINK:
+                for (std::map<uint64_t, std::string>::iterator it = paths.begin(); it != paths.end(); ) {
+                    if (it->second == path) {
+                        it = paths.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Several ids may have ended up in one place, when the source file
+    // was closed and opened again, so gather their cuts, and their
+    // copies' starts, by place.
+    std::map<std::string, std::vector<journal_cut> > cuts;
+    std::map<std::string, uint64_t> copy_starts;
+    for (std::map<uint64_t, std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        std::map<uint64_t, std::vector<journal_cut> >::const_iterator id_cuts = cuts_of_id.find(it->first);
+        if (id_cuts != cuts_of_id.end()) {
+            std::vector<journal_cut> *place_cuts = &cuts[it->second];
+            place_cuts->insert(place_cuts->end(), id_cuts->second.begin(), id_cuts->second.end());
+            std::sort(place_cuts->begin(), place_cuts->end(), cut_is_earlier);
+        }
+        std::map<uint64_t, uint64_t>::const_iterator id_start = copy_start_of_id.find(it->first);
+        if (id_start != copy_start_of_id.end()) {
+            uint64_t *start = &copy_starts[it->second];
+            if (*start < id_start->second) {
+                *start = id_start->second;
+            }
+        }
+    }
+
+    std::map<uint64_t, destination_file *> copies;
+    std::vector<journal_piece> pieces;
+    journal_reader reader(m_fd, m_buffer);
+    for (uint64_t index = 0; r == 0 && reader.offset() < m_end; ++index) {
+        r = reader.read(&record, sizeof(record));
+        if (r == 0) r = skip_bytes(&reader, (uint64_t) record.m_path_length + record.m_path2_length);
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not read the capture journal %s", m_path);
+            break;
+        }
+        if (record.m_type != JOURNAL_WRITE) {
+            continue;
+        }
+        destination_file *dest = NULL;
+        pieces.clear();
+        std::map<uint64_t, std::string>::const_iterator where = paths.find(record.m_id);
+        if (where != paths.end()) {
+            std::map<std::string, uint64_t>::const_iterator start = copy_starts.find(where->second);
+            if (start == copy_starts.end() || start->second < index) {
+                journal_piece whole = { record.m_offset, 0, record.m_length };
+                pieces.push_back(whole);
+                std::map<std::string, std::vector<journal_cut> >::const_iterator place_cuts = cuts.find(where->second);
+                if (place_cuts != cuts.end()) {
+                    for (size_t i = 0; i < place_cuts->second.size() && !pieces.empty(); ++i) {
+                        if (place_cuts->second[i].m_index > index) {
+                            cut_pieces(&pieces, place_cuts->second[i]);
+                        }
+                    }
+                }
+            }
+        }
+        if (!pieces.empty()) {
+            std::map<uint64_t, destination_file *>::iterator it = copies.find(record.m_id);
+            if (it != copies.end()) {
+                dest = it->second;
+            } else {
+                int fd = call_real_open(where->second.c_str(), O_WRONLY);
+                if (fd >= 0) {
+                    dest = new destination_file(fd, where->second.c_str());
+                }
+                copies[record.m_id] = dest;
+            }
+        }
+        uint64_t data_offset = 0;
+        while (r == 0 && data_offset < record.m_length) {
+            const uint64_t length = record.m_length - data_offset;
+            const char *bytes;
+            size_t n_got;
+            r = reader.next(length < CAPTURE_JOURNAL_BUFFER_SIZE ? length : CAPTURE_JOURNAL_BUFFER_SIZE, &bytes, &n_got);
+            if (r != 0) {
+                the_manager.backup_error(r, "Could not read the capture journal %s", m_path);
+                break;
+            }
+            for (size_t i = 0; r == 0 && dest != NULL && i < pieces.size(); ++i) {
+                const journal_piece &piece = pieces[i];
+                const uint64_t lo = std::max(piece.m_data_offset, data_offset);
+                const uint64_t hi = std::min(piece.m_data_offset + piece.m_length, data_offset + n_got);
+                if (lo < hi) {
+                    r = dest->pwrite(bytes + (lo - data_offset), hi - lo, piece.m_offset + (lo - piece.m_data_offset));
+                }
+            }
+            data_offset += n_got;
+        }
+    }
+
+    for (std::map<uint64_t, destination_file *>::iterator it = copies.begin(); it != copies.end(); ++it) {
+        if (it->second != NULL) {
+            int r2 = it->second->close();
+            if (r == 0) {
+                r = r2;
+            }
+            delete it->second;
+        }
+    }
+    return r;
+}
@@ -0,0 +1,141 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef CAPTURE_JOURNAL_H
+#define CAPTURE_JOURNAL_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+class destination_file;
+
+#define CAPTURE_JOURNAL_NAME "tokubackup_capture_journal"
+
+const size_t CAPTURE_JOURNAL_BUFFER_SIZE = 1024 * 1024; // records are gathered into this much before they are written.
+
+// What the journal records, in the order it records them.
+enum capture_journal_record_type {
+    JOURNAL_OPEN = 1,   // a backup copy gets an id: m_id, path.
+    JOURNAL_WRITE,      // m_length bytes of data at m_offset of backup copy m_id.
+    JOURNAL_TRUNCATE,   // backup copy m_id was truncated to m_offset.
+    JOURNAL_FALLOCATE,  // fallocate(m_mode, m_offset, m_length) was done on backup copy m_id.
+    JOURNAL_RENAME,     // the backup copy (or directory) at path was renamed to path2.
+    JOURNAL_UNLINK,     // the backup copy at path was unlinked.
+    JOURNAL_COPY,       // the copier started to copy backup copy m_id.
+};
+
+// Each record is this header, then the paths (without their NULs),
+// then the data of a write.
+struct capture_journal_record {
+    uint32_t m_type;
+    int32_t m_mode;
+    uint64_t m_id;
+    uint64_t m_offset;
+    uint64_t m_length;
+    uint32_t m_path_length;
+    uint32_t m_path2_length;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// capture_journal:
+//
+// Description:
+//
+//     Instead of writing captured changes into the backup copies where
+// they belong, which is random I/O all over the backup, a journal
+// appends them to one file in the first destination directory.  When
+// the copy is done and capture has stopped, apply() replays the
+// journal onto the copied tree and removes it.
+//
+//     Renames and unlinks still happen to the backup copies at once,
+// since the copier works by name, so the journal records them only to
+// know where each backup copy ends up.  So do truncates and
+// fallocates, since the copier may yet write past them: replaying one
+// after the copy could throw away newer data that the copier read.
+// The journal records them so that the replay can leave out (or move)
+// what earlier writes put where they cut.  Data records name a backup
+// copy by an id, which the journal gives each destination_file the
+// first time it records a change to it.  A replay first works out
+// where each id ends up (or that it was unlinked or renamed over), and
+// then writes the data records of the ids that survive, in order.
+//
+//     Writes recorded before the copier starts on a file are older than
+// what it reads, so the copier records when it starts (see
+// start_copy()), and the replay leaves out the records of that file
+// that came before.
+//
+//     The callers of the methods that take a destination_file hold the
+// source file's name lock (so that its path can't change), and the
+// range lock of what they change.
+//
+class capture_journal {
+  private:
+    pthread_mutex_t m_mutex;
+    char *m_path;
+    int m_fd;
+    uint64_t m_end;       // the journal's length, including what is buffered.
+    char *m_buffer;
+    size_t m_n_buffered;
+    uint64_t m_next_id;
+
+    int append_locked(const capture_journal_record *record, const char *path, const char *path2, const void *data) throw() __attribute__((warn_unused_result));
+    int flush_locked(void) throw() __attribute__((warn_unused_result));
+    int id_of_locked(destination_file *dest, uint64_t *id) throw() __attribute__((warn_unused_result));
+    int append_change(uint32_t type, destination_file *dest, int mode, uint64_t offset, uint64_t length, const void *data) throw() __attribute__((warn_unused_result));
+  public:
+    capture_journal(void) throw();
+    ~capture_journal(void) throw(); // Removes the journal.
+    int open(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Create the journal in dir.  Returns 0 or an error number, having reported the error.
+
+    // Each of these returns 0 or an error number, having reported the error.
+    int write(destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    int truncate(destination_file *dest, off_t length) throw() __attribute__((warn_unused_result));
+    int fallocate(destination_file *dest, int mode, off_t offset, off_t len) throw() __attribute__((warn_unused_result));
+    int rename(const char *old_dest, const char *new_dest) throw() __attribute__((warn_unused_result));
+    int unlink(const char *dest) throw() __attribute__((warn_unused_result));
+    int start_copy(destination_file *dest) throw() __attribute__((warn_unused_result));
+
+    int apply(void) throw() __attribute__((warn_unused_result));
+    // Effect: Replay the journal onto the backup copies.  Nothing may be
+    //   recorded any more.  Returns 0 or an error number, having reported the error.
+};
+
+#endif // End of header guardian.
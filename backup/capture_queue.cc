@@ -0,0 +1,379 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "capture_queue.h"
+#include "check.h"
+#include "destination_file.h"
+#include "mutex.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+#if defined(PAUSE_POINTS_ON)
+#define PAUSE(number) while(HotBackup::should_pause(number)) { sleep(2); } //printf("Resuming from Pause Point.\n");
+#else
+#define PAUSE(number)
+#endif
+
+// One queued write, with a copy of its data.
+struct captured_write {
+    captured_write *m_next;
+    destination_file *m_dest;
+    off_t m_offset;
+    size_t m_size;
+    char m_data[];
+};
+
+static std::atomic<uint64_t> total_writes(0);
+static std::atomic<uint64_t> total_bytes(0);
+static std::atomic<uint64_t> total_sync(0);
+static std::atomic<uint64_t> total_stalls(0);
+static std::atomic<uint64_t> total_stall_usecs(0);
+static std::atomic<uint64_t> total_max_bytes(0);
+static std::atomic<uint64_t> total_elided_bytes(0);
+
+static uint64_t usecs_since(const struct timespec &start) throw() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_list::capture_list(void) throw()
+    : m_first(NULL), m_last(NULL), m_bytes(0), m_scheduled(false) {
+    {
+        int r = pthread_mutex_init(&m_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_cond, NULL);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_list::~capture_list(void) throw() {
+    check(m_first == NULL && !m_scheduled);
+    {
+        int r = pthread_cond_destroy(&m_cond);
+        check(r==0);
+    }
+    {
+        int r = pthread_mutex_destroy(&m_mutex);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_list::wait_until_empty(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    while (m_scheduled) {
+        int r = pthread_cond_wait(&m_cond, &m_mutex);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_queue::capture_queue(void) throw()
+    : m_n_scheduled(0), m_running(false), m_stopping(false) {
+    {
+        int r = pthread_mutex_init(&m_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_ready_cond, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_idle_cond, NULL);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+capture_queue::~capture_queue(void) throw() {
+    this->stop();
+    {
+        int r = pthread_cond_destroy(&m_idle_cond);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_destroy(&m_ready_cond);
+        check(r==0);
+    }
+    {
+        int r = pthread_mutex_destroy(&m_mutex);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::start(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_running) {
+        return;
+    }
+    m_stopping = false;
+    for (int i = 0; i < CAPTURE_QUEUE_THREADS; ++i) {
+        pthread_t thread;
+        int r = pthread_create(&thread, NULL, capture_queue::start_thread, this);
+        if (r != 0) {
+            // Carry on with the threads we have.  With none, every
+            // capture is synchronous.
+            fprintf(stderr, "%s:%d could not start capture thread %d, errno=%d (%s)\n", __FILE__, __LINE__, i, r, strerror(r));
+            continue;
+        }
+        m_threads.push_back(thread);
+    }
+    m_running = !m_threads.empty();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::stop(void) throw() {
+    this->drain();
+    {
+        with_mutex_locked ml(&m_mutex);
+        m_running = false;
+        m_stopping = true;
+        int r = pthread_cond_broadcast(&m_ready_cond);
+        check(r==0);
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i) {
+        int r = pthread_join(m_threads[i], NULL);
+        check(r==0);
+    }
+    m_threads.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::drain(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    while (m_n_scheduled > 0) {
+        int r = pthread_cond_wait(&m_idle_cond, &m_mutex);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// enqueue() -
+//
+// Description:
+//
+//     Appends a copy of the write to the file's list, first waiting
+// for room if the list is full (a single write bigger than the limit
+// just waits for the list to be empty).  The first write on a list
+// puts it on the ready list for the capture threads.
+//
+bool capture_queue::enqueue(capture_list *list, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() {
+    if (!m_running) {
+        return false;
+    }
+    captured_write *w = (captured_write *) malloc(sizeof(captured_write) + nbyte);
+    if (w == NULL) {
+        return false;
+    }
+    w->m_next = NULL;
+    w->m_dest = dest;
+    w->m_offset = offset;
+    w->m_size = nbyte;
+    memcpy(w->m_data, buf, nbyte);
+
+    bool schedule = false;
+    {
+        with_mutex_locked ml(&list->m_mutex);
+        if (list->m_bytes > 0 && list->m_bytes + nbyte > CAPTURE_LIST_MAX_BYTES) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (list->m_bytes > 0 && list->m_bytes + nbyte > CAPTURE_LIST_MAX_BYTES) {
+                int r = pthread_cond_wait(&list->m_cond, &list->m_mutex);
+                check(r==0);
+            }
+            total_stalls++;
+            total_stall_usecs += usecs_since(start);
+        }
+        if (list->m_last != NULL) {
+            list->m_last->m_next = w;
+        } else {
+            list->m_first = w;
+        }
+        list->m_last = w;
+        list->m_bytes += nbyte;
+        uint64_t max_bytes = total_max_bytes.load();
+        while (list->m_bytes > max_bytes && !total_max_bytes.compare_exchange_weak(max_bytes, list->m_bytes)) {
+        }
+        if (!list->m_scheduled) {
+            list->m_scheduled = true;
+            schedule = true;
+        }
+    }
+    total_writes++;
+    total_bytes += nbyte;
+
+    if (schedule) {
+        with_mutex_locked ml(&m_mutex);
+        m_ready.push_back(list);
+        m_n_scheduled++;
+        int r = pthread_cond_signal(&m_ready_cond);
+        check(r==0);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void *capture_queue::start_thread(void *arg) throw() {
+    capture_queue *queue = (capture_queue *) arg;
+    queue->run_thread();
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::run_thread(void) throw() {
+    while (true) {
+        capture_list *list = NULL;
+        {
+            with_mutex_locked ml(&m_mutex);
+            while (m_ready.empty() && !m_stopping) {
+                int r = pthread_cond_wait(&m_ready_cond, &m_mutex);
+                check(r==0);
+            }
+            if (m_ready.empty()) {
+                return;
+            }
+            list = m_ready.front();
+            m_ready.pop_front();
+        }
+
+        this->write_list(list);
+
+        with_mutex_locked ml(&m_mutex);
+        m_n_scheduled--;
+        if (m_n_scheduled == 0) {
+            int r = pthread_cond_broadcast(&m_idle_cond);
+            check(r==0);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// write_list() -
+//
+// Description:
+//
+//     Writes the list's writes into the backup copy until it is empty,
+// including any that are queued meanwhile.  Once it is empty and no
+// longer scheduled we don't touch it again, since its file may go
+// away as soon as we unlock it.  Errors have been reported to the
+// manager by destination_file::pwrite(), which stops the backup.
+//
+void capture_queue::write_list(capture_list *list) throw() {
+    pmutex_lock(&list->m_mutex);
+    while (list->m_first != NULL) {
+        captured_write *w = list->m_first;
+        pmutex_unlock(&list->m_mutex);
+
+        PAUSE(HotBackup::CAPTURE_QUEUE_WRITE);
+        ignore(w->m_dest->pwrite(w->m_data, w->m_size, w->m_offset));
+
+        pmutex_lock(&list->m_mutex);
+        list->m_first = w->m_next;
+        if (list->m_first == NULL) {
+            list->m_last = NULL;
+        }
+        list->m_bytes -= w->m_size;
+        free(w);
+        int r = pthread_cond_broadcast(&list->m_cond);
+        check(r==0);
+    }
+    list->m_scheduled = false;
+    int r = pthread_cond_broadcast(&list->m_cond);
+    check(r==0);
+    pmutex_unlock(&list->m_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::note_sync_write(void) throw() {
+    total_sync++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::note_elided_bytes(uint64_t n_bytes) throw() {
+    total_elided_bytes += n_bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::get_total_stats(capture_queue_stats *stats) throw() {
+    stats->m_n_writes = total_writes.load();
+    stats->m_n_bytes = total_bytes.load();
+    stats->m_n_sync = total_sync.load();
+    stats->m_n_stalls = total_stalls.load();
+    stats->m_stall_usecs = total_stall_usecs.load();
+    stats->m_max_bytes = total_max_bytes.load();
+    stats->m_elided_bytes = total_elided_bytes.load();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void capture_queue::reset_total_stats(void) throw() {
+    total_writes = 0;
+    total_bytes = 0;
+    total_sync = 0;
+    total_stalls = 0;
+    total_stall_usecs = 0;
+    total_max_bytes = 0;
+    total_elided_bytes = 0;
+}
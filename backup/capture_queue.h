@@ -0,0 +1,142 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef CAPTURE_QUEUE_H
+#define CAPTURE_QUEUE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+class destination_file;
+
+const int CAPTURE_QUEUE_THREADS = 2;                    // the threads that write queued captures into the backup copies.
+const size_t CAPTURE_LIST_MAX_BYTES = 4 * 1024 * 1024;  // the most bytes one file may have queued before its writers wait.
+
+// What the capture queue has done since the stats were last reset.
+struct capture_queue_stats {
+    uint64_t m_n_writes;     // captured writes queued.
+    uint64_t m_n_bytes;      // the bytes in them.
+    uint64_t m_n_sync;       // captured writes that went straight into the backup copy.
+    uint64_t m_n_stalls;     // writes that had to wait for room in their file's queue.
+    uint64_t m_stall_usecs;  // the time spent waiting, summed over those.
+    uint64_t m_max_bytes;    // the most bytes one file had queued at once.
+    uint64_t m_elided_bytes; // captured bytes left out because the copier had yet to read them.
+};
+
+struct captured_write;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// capture_list:
+//
+// Description:
+//
+//     The captured writes of one source file that are waiting to go
+// into its backup copy, oldest first.  They are written in that order,
+// by one capture thread at a time, so two writes to the same bytes
+// reach the backup copy in the order they reached the source.  The
+// list is "scheduled" from when its first write is queued until a
+// capture thread has emptied it, and the source file must not go away
+// (nor its backup copy be closed) until it has been emptied: see
+// wait_until_empty().
+//
+class capture_list {
+  private:
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;     // signalled whenever the list gets shorter.
+    captured_write *m_first;
+    captured_write *m_last;
+    size_t m_bytes;
+    bool m_scheduled;          // on the capture queue's ready list, or being written by a capture thread.
+
+    friend class capture_queue;
+  public:
+    capture_list(void) throw();
+    ~capture_list(void) throw();
+    void wait_until_empty(void) throw(); // Wait until every queued write is in the backup copy.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// capture_queue:
+//
+// Description:
+//
+//     Writes captured writes into the backup copies in the background,
+// so that an application write only pays for copying its data into
+// the queue.  A file's queue is bounded, and a writer that finds it
+// full waits for the capture threads to catch up.  Queued writes are
+// for ranges that the copier has already read (see
+// source_file::copy_will_read()), or for files whose copy hasn't
+// started, whose queues are emptied before it starts (see
+// source_file::start_copy()).  Everything else that changes a backup
+// copy waits for its file's queue to be empty first.
+//
+class capture_queue {
+  private:
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_ready_cond;    // signalled when a list is scheduled, or the threads should stop.
+    pthread_cond_t m_idle_cond;     // signalled when a scheduled list has been emptied.
+    std::deque<capture_list *> m_ready;
+    uint64_t m_n_scheduled;
+    std::atomic<bool> m_running;    // capture threads are running, so enqueue() may queue writes.
+    bool m_stopping;
+    std::vector<pthread_t> m_threads;
+
+    static void *start_thread(void *arg) throw();
+    void run_thread(void) throw();
+    void write_list(capture_list *list) throw();
+  public:
+    capture_queue(void) throw();
+    ~capture_queue(void) throw();
+    void start(void) throw();  // Start the capture threads.  If none can be started, nothing is queued.
+    void stop(void) throw();   // Wait for every queued write, and stop the threads.
+    bool enqueue(capture_list *list, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    // Effect: Queue a copy of the write for the backup copy.  Returns false (having done nothing) if the write should be made synchronously instead.
+    void drain(void) throw();  // Wait until every list is empty.
+    static void note_sync_write(void) throw();
+    static void note_elided_bytes(uint64_t n_bytes) throw();
+    static void get_total_stats(capture_queue_stats *stats) throw();
+    static void reset_total_stats(void) throw();
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,139 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "check.h"
+#include "completed_files.h"
+#include "mutex.h"
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+static std::atomic<uint64_t> total_completed(0);
+static std::atomic<uint64_t> total_renames_kept(0);
+static std::atomic<uint64_t> total_renames_recopied(0);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+completed_files::completed_files(void) throw() {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+completed_files::~completed_files(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void completed_files::add(const char *source) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_names.insert(source).second) {
+        total_completed++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void completed_files::remove(const char *source) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_names.erase(source);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// rename() -
+//
+// Description:
+//
+//     Whatever was at the new name has been replaced, so its
+// completion goes in any case.  If a directory was renamed, the names
+// beneath it move with it.
+//
+bool completed_files::rename(const char *old_source, const char *new_source) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_names.erase(new_source);
+    const bool complete = (m_names.erase(old_source) != 0);
+    if (complete) {
+        m_names.insert(new_source);
+    }
+
+    const std::string old_prefix = std::string(old_source) + "/";
+    std::vector<std::string> moved;
+    std::set<std::string>::iterator it = m_names.lower_bound(old_prefix);
+    while (it != m_names.end() && it->compare(0, old_prefix.size(), old_prefix) == 0) {
+        moved.push_back(new_source + it->substr(old_prefix.size() - 1));
+        it = m_names.erase(it);
+    }
+    m_names.insert(moved.begin(), moved.end());
+    return complete;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool completed_files::contains(const char *source) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return m_names.find(source) != m_names.end();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void completed_files::note_rename(bool kept) throw() {
+    if (kept) {
+        total_renames_kept++;
+    } else {
+        total_renames_recopied++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void completed_files::get_total_stats(completed_files_stats *stats) throw() {
+    stats->m_n_completed = total_completed.load();
+    stats->m_n_renames_kept = total_renames_kept.load();
+    stats->m_n_renames_recopied = total_renames_recopied.load();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void completed_files::reset_total_stats(void) throw() {
+    total_completed = 0;
+    total_renames_kept = 0;
+    total_renames_recopied = 0;
+}
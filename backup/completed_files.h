@@ -0,0 +1,88 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef COMPLETED_FILES_H
+#define COMPLETED_FILES_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+
+// What copy-completion tracking has done since the stats were last reset.
+struct completed_files_stats {
+    uint64_t m_n_completed;        // files whose backup copies became complete.
+    uint64_t m_n_renames_kept;     // renames that only renamed the backup copy.
+    uint64_t m_n_renames_recopied; // renames whose new name had to be copied again.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// completed_files:
+//
+// Description:
+//
+//     The source files, by full path, whose backup copies hold all of
+// their data: the copier has finished copying them, or the
+// application created (or truncated) them while the backup was
+// capturing, so everything they hold was captured.  Captured changes
+// keep such a copy up to date, so renaming the source only has to
+// rename the backup copy, rather than copy the file all over again.
+//
+//     A source_file object only lives while someone has it open, so
+// the names are kept here, for the whole backup session.  Renames and
+// unlinks of the sources keep the names up to date.
+//
+class completed_files {
+  private:
+    pthread_mutex_t m_mutex;      // protects m_names.
+    std::set<std::string> m_names;
+  public:
+    completed_files(void) throw();
+    ~completed_files(void) throw();
+    void add(const char *source) throw();
+    void remove(const char *source) throw();
+    bool rename(const char *old_source, const char *new_source) throw();
+    // Effect: Move the old name's completion (and that of anything beneath it, if it is a directory) to the new name.
+    //  Returns true if the old name's copy was complete.  Otherwise the new name's copy isn't either.
+    bool contains(const char *source) throw();
+    static void note_rename(bool kept) throw();
+    static void get_total_stats(completed_files_stats *stats) throw();
+    static void reset_total_stats(void) throw();
+};
+
+#endif // End of header guardian.
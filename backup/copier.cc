@@ -35,18 +35,26 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include "backup_debug.h"
+#include "backup_manifest.h"
+#include "backup_stats.h"
 #include "check.h"
+#include "completed_files.h"
+#include "copy_engine.h"
+#include "copy_job.h"
 #include "copier.h"
+#include "device_scheduler.h"
 #include "file_hash_table.h"
 #include "manager.h"
 #include "mutex.h"
 #include "raii-malloc.h"
+#include "range_lock.h"
 #include "real_syscalls.h"
 #include "source_file.h"
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +62,10 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(HAVE_FICLONERANGE)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include <vector>
 
 template class std::vector<char *>;
@@ -93,6 +105,18 @@ static bool is_dot(struct dirent const *entry)
 
 pthread_mutex_t copier::m_todo_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Each range lock covers at most one buffer of this size.
+static const uint64_t COPY_BUFFER_SIZE = 1024 * 1024;
+
+// The room for poll and error messages that comes with each buffer.
+static const size_t POLL_STRING_SIZE = 2000;
+
+// Files of at least twice this size are copied by several workers.
+static const uint64_t DEFAULT_CHUNK_SIZE = 64 * COPY_BUFFER_SIZE;
+
+// A throttled worker sleeps at most this long before polling again.
+static const uint64_t THROTTLE_SLEEP_USECS = 100 * 1000;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // copier() - 
@@ -104,11 +128,80 @@ pthread_mutex_t copier::m_todo_mutex = PTHREAD_MUTEX_INITIALIZER;
 copier::copier(backup_callbacks *calls, file_hash_table * const table) throw()
     : m_source(NULL), 
       m_dest(NULL), 
+      m_copying(false),
       m_calls(calls), 
       m_table(table),
-      m_total_bytes_backed_up(0),
-      m_total_files_backed_up(0)
-{}
+      m_buffers(COPY_BUFFER_SIZE, POLL_STRING_SIZE),
+      m_manifest(NULL),
+      m_base_manifest(NULL),
+      m_base_dir(NULL),
+      m_start_time(0),
+      m_completed(NULL),
+      m_stats(NULL),
+      m_lock_stats(NULL),
+      m_scheduler(NULL),
+      m_journal(NULL),
+      m_dest_device(0),
+      m_have_dest_device(false),
+      m_progress(&m_own_progress),
+      m_n_workers(1),
+      m_io_depth(1),
+      m_chunk_size(DEFAULT_CHUNK_SIZE),
+      m_poll_thread(pthread_self()),
+      m_may_call_back(true),
+      m_n_outstanding(0),
+      m_work_generation(0),
+      m_error(0),
+      m_shared_error(NULL),
+      m_n_steals(0),
+      m_chunked_files(0),
+      m_n_chunks(0),
+      m_helper_chunks(0),
+      m_cloned_bytes(0),
+      m_ring_bytes(0),
+      m_ring_usecs(0),
+      m_ring_n_waits(0),
+      m_ring_in_flight(0),
+      m_ring_max_in_flight(0),
+      m_unchanged_bytes(0),
+      m_changed_bytes(0),
+      m_taken_files(0),
+      m_taken_bytes(0),
+      m_taken_cloned_files(0),
+      m_optimistic_bytes(0),
+      m_recopied_bytes(0),
+      m_locked_copies(0)
+{
+    {
+        int r = pthread_mutex_init(&m_idle_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_idle_cond, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_mutex_init(&m_stats_mutex, NULL);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copier::~copier(void) throw() {
+    {
+        int r = pthread_mutex_destroy(&m_idle_mutex);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_destroy(&m_idle_cond);
+        check(r==0);
+    }
+    {
+        int r = pthread_mutex_destroy(&m_stats_mutex);
+        check(r==0);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -124,6 +217,109 @@ void copier::set_directories(const char *source, const char *dest) throw() {
     m_dest = dest;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_manifests() -
+//
+// Description: 
+//
+//     Makes the copy of the current directories incremental: each
+// file's blocks are compared with the base backup's manifest (if
+// there is one) and recorded in the given manifest.  Files that the
+// base's fingerprints say are unchanged are taken from base_dir.
+//
+void copier::set_manifests(backup_manifest *manifest, const backup_manifest *base, const char *base_dir) throw() {
+    m_manifest = manifest;
+    m_base_manifest = base;
+    m_base_dir = base_dir;
+    m_start_time = time(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_chunk_size() -
+//
+// Description: 
+//
+//     Sets the size of the chunks that large files are split into.
+// The size is rounded up to a whole number of copy buffers, so that
+// chunk boundaries never split a range lock.
+//
+void copier::set_chunk_size(uint64_t chunk_size) throw() {
+    if (chunk_size < COPY_BUFFER_SIZE) {
+        chunk_size = COPY_BUFFER_SIZE;
+    }
+    m_chunk_size = (chunk_size + COPY_BUFFER_SIZE - 1) / COPY_BUFFER_SIZE * COPY_BUFFER_SIZE;
+}
+
+struct copier_worker_args {
+    copier *m_copier;
+    int m_worker;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_completed_files(completed_files *completed) throw() {
+    m_completed = completed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_stats(backup_stats *stats) throw() {
+    m_stats = stats;
+    m_lock_stats = (stats != NULL) ? stats->get_copy_lock_stats() : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_progress(copy_progress *progress) throw() {
+    m_progress = progress;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_may_call_back(bool may_call_back) throw() {
+    m_may_call_back = may_call_back;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_scheduler(device_scheduler *scheduler) throw() {
+    m_scheduler = scheduler;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_journal(capture_journal *journal) throw() {
+    m_journal = journal;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::set_error(int error) throw() {
+    int expected = 0;
+    m_error.compare_exchange_strong(expected, error);
+    if (m_shared_error != NULL) {
+        expected = 0;
+        m_shared_error->compare_exchange_strong(expected, error);
+    }
+    this->work_was_added();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_shared_error() -
+//
+// Description:
+//
+//     The copiers of a backup that copy at the same time share their
+// first error, so that each of them stops between two files, or two
+// chunks of a file, as soon as any of them fails or the user aborts.
+//
+void copier::set_shared_error(std::atomic<int> *error) throw() {
+    m_shared_error = error;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // start_copy() -
@@ -131,65 +327,297 @@ void copier::set_directories(const char *source, const char *dest) throw() {
 // Description: 
 //
 //     Loops through all files and subdirectories of the current 
-// directory that has been selected for backup.
+// directory that has been selected for backup.  The calling thread
+// becomes worker 0 and the remaining workers (if any) run on their own
+// threads until every known file has been copied.
 //
 int copier::do_copy(void) throw() {
-    m_total_bytes_to_back_up = dirsum(m_source);
-    int r = 0;
-    char *fname = 0;
-    size_t n_known = 0;
+    m_progress->m_bytes_to_back_up += dirsum(m_source);
+    {
+        struct stat sbuf;
+        m_have_dest_device = (stat(m_dest, &sbuf) == 0);
+        m_dest_device = m_have_dest_device ? sbuf.st_dev : 0;
+    }
+    m_poll_thread = pthread_self();
+    m_n_workers = the_manager.get_copy_threads();
+    m_io_depth = the_manager.get_io_depth();
+    {
+        const uint64_t chunk_size = the_manager.get_copy_chunk_size();
+        if (chunk_size != 0) {
+            this->set_chunk_size(chunk_size);
+        }
+    }
+    m_work.set_n_workers(m_n_workers);
+    m_worker_tasks.assign(m_n_workers, 0);
+    m_buffers.set_n_workers(m_n_workers);
+    m_buffers.set_huge_pages(the_manager.get_huge_pages());
     {
         with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
         // Start with "."
         m_todo.push_back(strdup("."));
-        n_known = m_todo.size();
+        m_n_outstanding = m_todo.size();
+        m_copying = true;
     }
-    while (n_known != 0) {
 
-        if (!the_manager.copy_is_enabled()) goto out;
-        
-        {
-            with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            fname = m_todo.front();
-        }
-        TRACE("Copying: ", fname);
-        
-        char *msg = malloc_snprintf(strlen(fname)+100, "Backup progress %ld bytes, %ld files.  %ld more files known of. Copying file %s",  m_total_bytes_backed_up, m_total_files_backed_up, n_known, fname);
-        // Use n_done/n_files.   We need to do a better estimate involving n_bytes_copied/n_bytes_total
-        // This one is very wrongu
-        r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), msg);
-        free(msg);
+    std::vector<pthread_t> threads;
+    std::vector<copier_worker_args> args(m_n_workers);
+    for (int i = 1; i < m_n_workers; ++i) {
+        pthread_t thread;
+        args[i].m_copier = this;
+        args[i].m_worker = i;
+        int r = pthread_create(&thread, NULL, copier::start_worker, &args[i]);
         if (r != 0) {
-            fprintf(stderr, "%s:%d poll error r=%d\n", __FILE__, __LINE__, r);
-            goto out;
+            // Carry on with the workers we have.  Anything queued on
+            // the missing worker's deque gets stolen by the others.
+            fprintf(stderr, "%s:%d could not start copy worker %d, errno=%d (%s)\n", __FILE__, __LINE__, i, r, strerror(r));
+            continue;
         }
+        threads.push_back(thread);
+    }
 
-        {
-            with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            m_todo.pop_front();
+    int r = this->run_worker(0);
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        int jr = pthread_join(threads[i], NULL);
+        check(jr==0);
+    }
+    if (r == 0) {
+        r = m_error;
+    }
+
+    this->report_copy_stats();
+    this->cleanup();
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void *copier::start_worker(void *arg) throw() {
+    copier_worker_args *args = static_cast<copier_worker_args *>(arg);
+    // Errors have been recorded in m_error by run_worker().
+    ignore(args->m_copier->run_worker(args->m_worker));
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// run_worker() -
+//
+// Description:
+//
+//     The main loop of one copy worker: take a task, do it, and
+// repeat until there is nothing left to copy or some worker has hit
+// an error.  The first error is saved in m_error so that the other
+// workers stop too.
+//
+int copier::run_worker(int worker) throw() {
+    int r = 0;
+    while (!this->should_stop()) {
+        const uint64_t generation = m_work_generation;
+        copy_task *task = this->take_work(worker);
+        if (task == NULL) {
+            if (m_n_outstanding == 0) {
+                break;
+            }
+            // Some other worker is still copying and may yet add work.
+            r = this->wait_for_work(generation);
+            if (r != 0) {
+                break;
+            }
+            continue;
         }
-        
-        r = this->copy_stripped_file(fname);
+
+        if (task->m_job != NULL) {
+            // Help copy the chunks of a large file that another worker
+            // has split up.  Errors are reported to the job's owner.
+            this->help_with_job(task->m_job, worker);
+            delete task;
+            m_worker_tasks[worker]++;
+            this->finish_work();
+            continue;
+        }
+
+        char *fname = task->m_name;
+        TRACE("Copying: ", fname);
+
+        if (this->is_poll_thread()) {
+            char *msg = malloc_snprintf(strlen(fname)+100, "Backup progress %ld bytes, %ld files.  %ld more files known of. Copying file %s",  m_progress->m_bytes_backed_up.load(), m_progress->m_files_backed_up.load(), m_n_outstanding.load(), fname);
+            // Use n_done/n_files.   We need to do a better estimate involving n_bytes_copied/n_bytes_total
+            // This one is very wrongu
+            r = this->poll(msg);
+            free(msg);
+            if (r != 0) {
+                fprintf(stderr, "%s:%d poll error r=%d\n", __FILE__, __LINE__, r);
+                delete task;
+                this->finish_work();
+                break;
+            }
+        }
+
+        r = this->copy_stripped_file(fname, worker);
         if(r != 0) {
             fprintf(stderr, "%s:%d copy error fname=%s r=%d\n", __FILE__, __LINE__, fname, r);
-            free((void*)fname);
-            fname = NULL;
-            goto out;
+            delete task;
+            this->finish_work();
+            break;
         }
-        free((void*)fname);
-        fname = NULL;
+        delete task;
 
-        m_total_files_backed_up++;
-        
+        m_progress->m_files_backed_up++;
+        m_worker_tasks[worker]++;
+        this->finish_work();
+    }
+
+    if (r != 0) {
+        // Wake up any idle workers so that they notice the error.
+        this->set_error(r);
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// take_work() -
+//
+// Description:
+//
+//     Returns the next task for the given worker, or NULL if there is
+// none right now.  The worker's own deque comes first, then the files
+// added by capture, and finally whatever can be stolen from the other
+// workers.
+//
+copy_task *copier::take_work(int worker) throw() {
+    copy_task *task = m_work.pop(worker);
+    if (task == NULL) {
+        char *fname = NULL;
         {
             with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            n_known = m_todo.size();
+            if (!m_todo.empty()) {
+                fname = m_todo.front();
+                m_todo.pop_front();
+            }
+        }
+        if (fname != NULL) {
+            task = new copy_task(fname, NULL);
+        }
+    }
+    if (task == NULL) {
+        task = m_work.steal(worker);
+        if (task != NULL) {
+            m_n_steals++;
         }
     }
+    return task;
+}
 
-out:
-    this->cleanup();
-    return r;
+////////////////////////////////////////////////////////////////////////////////
+//
+void copier::work_was_added(void) throw() {
+    with_mutex_locked ml(&m_idle_mutex, BACKTRACE(NULL));
+    m_work_generation++;
+    int r = pthread_cond_broadcast(&m_idle_cond);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// finish_work() -
+//
+// Description:
+//
+//     Called when a worker is done with a file (after it has queued
+// any directory entries it found).  When the last outstanding file is
+// done, the idle workers are woken so that they can exit.
+//
+void copier::finish_work(void) throw() {
+    if (--m_n_outstanding == 0) {
+        this->work_was_added();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// wait_for_work() -
+//
+// Description:
+//
+//     Blocks an idle worker until more work is added, the copy
+// finishes, or a short timeout expires.  The poll thread keeps calling
+// the poll function while it waits, so that the user can still abort
+// the backup while the other workers are busy with large files.
+//
+int copier::wait_for_work(uint64_t generation) throw() {
+    if (this->is_poll_thread()) {
+        char string[1000];
+        snprintf(string, sizeof(string), "Backup progress %ld bytes, %ld files.  %ld more files known of. Waiting for the other copy workers.", m_progress->m_bytes_backed_up.load(), m_progress->m_files_backed_up.load(), m_n_outstanding.load());
+        int r = this->poll(string);
+        if (r != 0) {
+            fprintf(stderr, "%s:%d poll error r=%d\n", __FILE__, __LINE__, r);
+            return r;
+        }
+    }
+
+    with_mutex_locked ml(&m_idle_mutex, BACKTRACE(NULL));
+    if (m_work_generation == generation && m_n_outstanding != 0 && !this->should_stop()) {
+        struct timespec ts;
+        int r = clock_gettime(CLOCK_REALTIME, &ts);
+        check(r==0);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        r = pthread_cond_timedwait(&m_idle_cond, &m_idle_mutex, &ts);
+        check(r==0 || r==ETIMEDOUT);
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool copier::should_stop(void) const throw() {
+    return !the_manager.copy_is_enabled() || m_error != 0 || (m_shared_error != NULL && *m_shared_error != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool copier::is_poll_thread(void) const throw() {
+    return m_may_call_back && pthread_equal(m_poll_thread, pthread_self());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// poll() -
+//
+// Description:
+//
+//     Calls the user's poll function if we are on the thread that
+// called do_copy().  The other workers cannot call it, and just
+// return 0.
+//
+int copier::poll(const char *progress_string) throw() {
+    if (!this->is_poll_thread()) {
+        return 0;
+    }
+    return m_calls->poll(m_progress->fraction(), progress_string);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// report_error() -
+//
+// Description:
+//
+//     Reports an error to the user directly if we are on the poll
+// thread.  The other workers hand the error to the backup manager,
+// which saves it for the backup thread and disables the copy.
+//
+void copier::report_error(int error_number, const char *error_string) throw() {
+    if (this->is_poll_thread()) {
+        m_calls->report_error(error_number, error_string);
+    } else {
+        the_manager.backup_error(error_number, "%s", error_string);
+    }
 }
 
 
@@ -213,12 +641,12 @@ static void pathcat(char *dest, size_t destlen, const char *a, int alen, const c
 // destination directory members to determine the exact location
 // of the file in both the original and backup locations.
 //
-int copier::copy_stripped_file(const char *file) throw() {
+int copier::copy_stripped_file(const char *file, int worker) throw() {
     int r = 0;
     bool is_dot = (strcmp(file, ".") == 0);
     if (is_dot) {
         // Just copy the root of the backup tree.
-        r = this->copy_full_path(m_source, m_dest, "");
+        r = this->copy_full_path(m_source, m_dest, "", worker);
         if (r != 0) {
             goto out;
         }
@@ -235,7 +663,7 @@ int copier::copy_stripped_file(const char *file) throw() {
         char full_dest_file_path[dlen];
         pathcat(full_dest_file_path, dlen, m_dest, m_dest_len, file);
         
-        r = this->copy_full_path(full_source_file_path, full_dest_file_path, file);
+        r = this->copy_full_path(full_source_file_path, full_dest_file_path, file, worker);
         if(r != 0) {
             goto out;
         }
@@ -257,7 +685,7 @@ out:
 // determine the relative location of the file in the directory
 // heirarchy.
 //
-int copier::copy_full_path(const char *source, const char* dest, const char *file) throw() {
+int copier::copy_full_path(const char *source, const char* dest, const char *file, int worker) throw() {
     if (m_calls->exclude_copy(source))
         return 0;
     int r = 0;
@@ -274,15 +702,32 @@ int copier::copy_full_path(const char *source, const char* dest, const char *fil
 
         r = stat_r;
         char *string = malloc_snprintf(strlen(dest)+100, "Could not stat(\"%s\"), errno=%d (%s) at %s:%d", dest, r, strerror(r), __FILE__, __LINE__);
-        m_calls->report_error(errno, string);
+        this->report_error(r, string);
         free(string);
         goto out;
     }
     
     // See if the source path is a directory or a real file.
     if (S_ISREG(sbuf.st_mode)) {
-        source_info src_info = {-1, source, sbuf.st_size, NULL, O_RDONLY};
+        // A renamed directory comes back through the todo list; the
+        // files beneath it that were already copied are still complete.
+        if (m_completed != NULL && m_completed->contains(source)) {
+            goto out;
+        }
+        source_info src_info = {-1, source, sbuf.st_size, NULL, O_RDONLY, worker, NULL, NULL};
+        device_grant grant;
+        if (m_scheduler != NULL) {
+            bool granted = false;
+            r = this->wait_for_device(source, sbuf.st_dev, &grant, &granted);
+            if (r != 0 || !granted) {
+                goto out;
+            }
+            src_info.m_grant = &grant;
+        }
         r = this->copy_using_source_info(src_info, dest);
+        if (src_info.m_grant != NULL) {
+            m_scheduler->finish_copy(grant);
+        }
         if (r != 0) {
             // The error should already have been reported, so we simply return r.
             goto out;
@@ -305,7 +750,7 @@ int copier::copy_full_path(const char *source, const char* dest, const char *fil
             int mkdir_errno = errno;
             if(mkdir_errno != EEXIST) {
                 char *string = malloc_snprintf(strlen(dest)+100, "error mkdir(\"%s\"), errno=%d (%s) at %s:%d", dest, mkdir_errno, strerror(mkdir_errno), __FILE__, __LINE__);
-                m_calls->report_error(mkdir_errno, string);
+                this->report_error(mkdir_errno, string);
                 free(string);
                 r = mkdir_errno;
                 closedir(dir); // ignore errors from this.
@@ -315,7 +760,7 @@ int copier::copy_full_path(const char *source, const char* dest, const char *fil
             ERROR("Cannot create directory that already exists = ", dest);
         }
 
-        r = this->add_dir_entries_to_todo(dir, file);
+        r = this->add_dir_entries_to_todo(dir, file, worker);
         if (r != 0) {
             closedir(dir); // ignore errors from this.
             goto out;
@@ -338,6 +783,36 @@ out:
     return r;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// wait_for_device() -
+//
+// Description:
+//
+//     Waits until the device scheduler has room for a copy of the
+// given source, which is on the given device, to our destination.
+// Sets *granted if it does.  If the copy is stopped meanwhile, we
+// return without it.  We keep polling while we wait, so that the user
+// can abort the backup, which we report and return.
+//
+int copier::wait_for_device(const char *source, dev_t device, device_grant *grant, bool *granted) throw() {
+    const dev_t dest_device = m_have_dest_device ? m_dest_device : device;
+    while (!m_scheduler->start_copy(device, dest_device, 100, grant)) {
+        if (this->should_stop()) {
+            return 0;
+        }
+        char string[1000];
+        snprintf(string, sizeof(string), "Backup progress %ld bytes, %ld files.  Waiting for the device of %s.", m_progress->m_bytes_backed_up.load(), m_progress->m_files_backed_up.load(), source);
+        int r = this->poll(string);
+        if (r != 0) {
+            this->report_error(r, "User aborted backup");
+            return r;
+        }
+    }
+    *granted = true;
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // copy_regular_file() - 
@@ -370,7 +845,7 @@ int copier::copy_regular_file(source_info src_info, const char *dest) throw() {
 
     //source_info src_info = {srcfd, source, source_file_size, NULL};
     //int result = this->copy_using_source_info(src_info, dest);
-    int result = this->create_destination_and_copy(src_info, dest);
+    int result = this->create_destination_and_copy(&src_info, dest);
     
     int r = call_real_close(src_info.m_fd);
     if (r != 0) {
@@ -398,7 +873,7 @@ int copier::copy_using_source_info(source_info src_info, const char *path) throw
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-int copier::create_destination_and_copy(source_info src_info,  const char *path) throw() {
+int copier::create_destination_and_copy(source_info *src_info, const char *path) throw() {
     TRACE("Creating new destination file", path);
     with_object_to_free<char*> dest_path(strdup(path));
     if (dest_path.value == NULL) {
@@ -406,23 +881,23 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
         return r;
     }
 
-    // Try to create the destination file, using the file hash table
-    // lock to help serialize access.
+    // Try to create the destination file, using the source file's
+    // destination lock to help serialize access.
     bool source_exists = true;
     int result = 0;
     {
-        with_file_hash_table_mutex mtl(m_table);
+        with_source_file_destination_lock dl(src_info->m_file);
 
-        with_source_file_name_write_lock sfl(src_info.m_file);
+        with_source_file_name_write_lock sfl(src_info->m_file);
 
         // Check to see if the real source file still exists.  If it
         // doesn't, it has been unlinked and we should NOT create the
-        // destination file.  We are protected by the table lock here.
+        // destination file.  We are protected by the destination lock here.
         struct stat buf;
-        TRACE("stat'ing file = ", src_info.m_path);
-        int stat_r = lstat(src_info.m_path, &buf);
+        TRACE("stat'ing file = ", src_info->m_path);
+        int stat_r = lstat(src_info->m_path, &buf);
         if (stat_r == 0) {
-            result = src_info.m_file->try_to_create_destination_file(dest_path.value);
+            result = src_info->m_file->try_to_create_destination_file(dest_path.value);
         } else {
             source_exists = false;
         }
@@ -430,26 +905,65 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
         // If the source file was unlinked since the respective
         // source_file object was created and since the stat
         // succeeded, we should not proceed.
-        if (src_info.m_file->get_destination() == NULL) {
+        if (src_info->m_file->get_destination() == NULL) {
             source_exists = false;
         }
     }
 
     if (result != 0) { return result; }
 
-    if (source_exists) {
-        // Actually perform the copy.
+    // A file that hasn't changed since the base backup is taken from it
+    // instead of being copied.
+    bool taken = false;
+    if (source_exists && m_manifest != NULL) {
+        // The base backup's record of this file has the same path,
+        // relative to its directory.
+        const size_t dest_len = strlen(m_dest);
+        const char *relative = NULL;
+        const manifest_file *base = NULL;
+        if (strncmp(path, m_dest, dest_len) == 0 && path[dest_len] == '/') {
+            relative = path + dest_len + 1;
+            if (m_base_manifest != NULL) {
+                base = m_base_manifest->find(relative);
+            }
+        }
+        src_info->m_manifest = m_manifest->find_or_add(path, base);
+        if (src_info->m_manifest == NULL) {
+            int r = ENOMEM;
+            the_manager.backup_error(r, "Could not add %s to the backup manifest", path);
+            return r;
+        }
+        int r = this->take_unchanged_file(src_info, relative, &taken);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    const bool copying = source_exists && !taken;
+    if (copying) {
+        // Actually perform the copy.  Until we have read a range,
+        // writes to it needn't be captured.
+        src_info->m_file->start_copy(m_journal, m_lock_stats);
         int r = this->copy_file_data(src_info);
         if (r!=0) {
+            src_info->m_file->finish_copy();
             return r;
         }
     }
 
-    // Try to destroy the destination file.
+    // Note that the copy is complete, and try to destroy the
+    // destination file.  A rename checks the copy's progress under the
+    // destination lock, so the copy finishes under it too.
     {
-        with_file_hash_table_mutex mtl(m_table);
+        with_source_file_destination_lock dl(src_info->m_file);
 
-        src_info.m_file->try_to_remove_destination();
+        if (source_exists) {
+            this->note_complete(src_info);
+        }
+        if (copying) {
+            src_info->m_file->finish_copy();
+        }
+        src_info->m_file->try_to_remove_destination();
     }
 
     return 0;
@@ -457,23 +971,145 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-static int gettime_reporting_error(struct timespec *ts, backup_callbacks *calls) throw() {
-    int r = clock_gettime(CLOCK_MONOTONIC, ts);
-    if (r!=0) {
-        char string[1000];
-        int er = errno;
-        if (er!=0) {
-            snprintf(string, sizeof(string), "clock_gettime returned an error: errno=%d (%s)", er, strerror(er));
-            calls->report_error(er, string);
-        } else {
-            calls->report_error(-1, "clock_gettime returned an error, but errno==0");
-            er = -1;
-        }
-        return er;
-    } else {
-        return 0;
-    }
-}
+// note_complete() -
+//
+// Description:
+//
+//     Notes that the backup copy of the source file has all of its
+// data, under whatever name the source has now.  If another file has
+// been renamed over that name, the name's copy is that file's, so we
+// leave it alone.  The caller holds the destination lock, which keeps
+// the name from changing.
+//
+void copier::note_complete(source_info *src_info) throw() {
+    if (m_completed == NULL) {
+        return;
+    }
+    struct stat ours, named;
+    if (fstat(src_info->m_fd, &ours) != 0 || lstat(src_info->m_file->name(), &named) != 0) {
+        return;
+    }
+    if (ours.st_dev == named.st_dev && ours.st_ino == named.st_ino) {
+        m_completed->add(src_info->m_file->name());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// clone_whole_file() -
+//
+// Description:
+//
+//     Makes the file open on dest_fd a clone of the file at path,
+// sharing its blocks.  Returns false if that can't be done here, e.g.
+// because the filesystem doesn't support reflinks.
+//
+static bool clone_whole_file(const char *path, int dest_fd) throw() {
+#if defined(HAVE_FICLONERANGE)
+    int fd = call_real_open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    const bool cloned = (ioctl(dest_fd, FICLONE, fd) == 0);
+    ignore(call_real_close(fd));
+    return cloned;
+#else
+    (void) path;
+    (void) dest_fd;
+    return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// take_unchanged_file() -
+//
+// Description:
+//
+//     If the source file has the fingerprint that the base backup
+// recorded for it, it hasn't changed since, so we neither read nor
+// copy it.  The backup copy becomes a clone of the base's copy if the
+// filesystem allows, and otherwise a sparse file of the right size
+// with no blocks present, which restores to the base's copy.  (A hard
+// link would be cheaper still, but captured writes to it would change
+// the base backup.)  Either way the file's record gets the base's
+// checksums and flags, and writes captured later copy the blocks they
+// touch, just as for blocks that copy_changed_blocks() left out.
+//
+//     We lock the whole file while we look, so that the application
+// can't change it between the fstat() and taking the base's record.
+// A file that doesn't match just gets its fingerprint recorded.
+// relative_path is the file's path within the destination directory,
+// or NULL if it has none there, in which case it can't match.
+//
+int copier::take_unchanged_file(source_info *src_info, const char *relative_path, bool *taken) throw() {
+    int r = 0;
+    source_file *file = src_info->m_file;
+    destination_file *dest = file->get_destination();
+    manifest_file *manifest = src_info->m_manifest;
+    struct stat sbuf;
+
+    *taken = false;
+    file->lock_range(0, LLONG_MAX, m_lock_stats);
+    if (fstat(src_info->m_fd, &sbuf) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not stat %s at %s:%d", src_info->m_path, __FILE__, __LINE__);
+        goto unlock;
+    }
+    if (m_base_dir != NULL && relative_path != NULL && manifest->matches_base_fingerprint(&sbuf)) {
+        with_object_to_free<char *> base_path(malloc_snprintf(strlen(m_base_dir) + strlen(relative_path) + 2, "%s/%s", m_base_dir, relative_path));
+        if (base_path.value == NULL) {
+            r = ENOMEM;
+            the_manager.backup_error(r, "Could not allocate the base backup's path of %s", src_info->m_path);
+            goto unlock;
+        }
+        const bool cloned = clone_whole_file(base_path.value, dest->get_fd());
+        if (!cloned) {
+            r = dest->truncate(sbuf.st_size);
+            if (r != 0) {
+                goto unlock;
+            }
+        }
+        manifest->take_base_blocks(cloned);
+        m_taken_files++;
+        m_taken_bytes += sbuf.st_size;
+        if (cloned) {
+            m_taken_cloned_files++;
+        }
+        m_progress->m_bytes_backed_up += sbuf.st_size;
+        *taken = true;
+    }
+    manifest->set_fingerprint(&sbuf, m_start_time);
+
+unlock:
+    {
+        int r2 = file->unlock_range(0, LLONG_MAX);
+        if (r == 0) {
+            r = r2;
+        }
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copier::gettime_reporting_error(struct timespec *ts) throw() {
+    int r = clock_gettime(CLOCK_MONOTONIC, ts);
+    if (r!=0) {
+        char string[1000];
+        int er = errno;
+        if (er!=0) {
+            snprintf(string, sizeof(string), "clock_gettime returned an error: errno=%d (%s)", er, strerror(er));
+            this->report_error(er, string);
+        } else {
+            this->report_error(-1, "clock_gettime returned an error, but errno==0");
+            er = -1;
+        }
+        return er;
+    } else {
+        return 0;
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -489,122 +1125,553 @@ static double tdiff(struct timespec a, struct timespec b) throw()
 //
 // Description:
 //     This section actually copies all the bytes from the source
-// file to our newly created backup copy.
+// file to our newly created backup copy.  Large files are split into
+// chunks that the other workers help to copy.
 //
-int copier::copy_file_data(source_info src_info) throw() {
+int copier::copy_file_data(source_info *src_info) throw() {
+    // A device that may only copy one file at a time doesn't want
+    // several workers copying chunks of it, either.
+    const bool may_split = (src_info->m_grant == NULL || src_info->m_grant->m_concurrency != 1);
+    if (m_n_workers > 1 && may_split && (uint64_t)src_info->m_size >= 2 * m_chunk_size) {
+        return this->copy_file_in_chunks(src_info);
+    }
+    return this->copy_chunk(src_info, 0, UINT64_MAX);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_file_in_chunks() -
+//
+// Description:
+//
+//     Splits a large file into a copy_job, asks some of the other
+// workers to help with it, and copies chunks until there are none
+// left.  We then wait for the chunks claimed by the helpers, since the
+// destination file can only be released once every chunk is done.
+//
+int copier::copy_file_in_chunks(source_info *src_info) throw() {
+    copy_job *job = new copy_job(*src_info, m_chunk_size);
+    int r = job->init(src_info->m_fd);
+    if (r != 0) {
+        the_manager.backup_error(r, "Could not dup source file %s", src_info->m_path);
+        job->remove_reference();
+        return r;
+    }
+
+    // One helper per extra chunk, but there's no point in asking for
+    // more helpers than there are other workers, or than the devices
+    // will copy files at once.
+    const uint64_t n_chunks = (src_info->m_size + m_chunk_size - 1) / m_chunk_size;
+    m_chunked_files++;
+    m_n_chunks += n_chunks;
+    uint64_t n_helpers = n_chunks - 1;
+    if (n_helpers > (uint64_t)(m_n_workers - 1)) {
+        n_helpers = m_n_workers - 1;
+    }
+    if (src_info->m_grant != NULL && src_info->m_grant->m_concurrency != 0 &&
+        n_helpers > src_info->m_grant->m_concurrency - 1) {
+        n_helpers = src_info->m_grant->m_concurrency - 1;
+    }
+    for (uint64_t i = 0; i < n_helpers; ++i) {
+        job->add_reference();
+        m_n_outstanding++;
+        m_work.push(src_info->m_worker, new copy_task(NULL, job));
+    }
+    this->work_was_added();
+
+    this->copy_chunks_of_job(job, src_info);
+
+    // Make sure no helper starts a chunk after we stop waiting.
+    const uint64_t n_claimed = job->stop_claims();
+    while (!job->wait_for_chunks(n_claimed, 100)) {
+        char string[1000];
+        snprintf(string, sizeof(string), "Backup progress %ld bytes, %ld files.  Waiting for the other copy workers to finish %s.", m_progress->m_bytes_backed_up.load(), m_progress->m_files_backed_up.load(), src_info->m_path);
+        ignore(this->poll(string)); // An abort will be noticed by our caller.
+    }
+
+    r = job->get_error();
+    job->remove_reference();
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_chunks_of_job() -
+//
+// Description:
+//
+//     Claims and copies chunks of the given job, using the given
+// source fd, until there are none left or the copy should stop.
+//
+uint64_t copier::copy_chunks_of_job(copy_job *job, source_info *src_info) throw() {
+    uint64_t n_copied = 0;
+    uint64_t lo, hi;
+    while (!this->should_stop() && job->claim_chunk(&lo, &hi)) {
+        int r = this->copy_chunk(src_info, lo, hi);
+        job->chunk_done(r);
+        n_copied++;
+    }
+    return n_copied;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// help_with_job() -
+//
+// Description:
+//
+//     Copies chunks of a large file on behalf of the worker that split
+// it up.  The owner holds the source_file reference and the
+// destination file, so all we need is our own source fd.
+//
+void copier::help_with_job(copy_job *job, int worker) throw() {
+    source_info src_info = job->info();
+    src_info.m_worker = worker;
+    src_info.m_fd = job->open_source();
+    if (src_info.m_fd < 0) {
+        int r = errno;
+        the_manager.backup_error(r, "Could not dup source file %s", src_info.m_path);
+        // Fail the job so that the owner stops handing out chunks.
+        uint64_t lo, hi;
+        if (job->claim_chunk(&lo, &hi)) {
+            job->chunk_done(r);
+        }
+        return;
+    }
+
+    m_helper_chunks += this->copy_chunks_of_job(job, &src_info);
+
+    // The fd is gone if the file was unlinked while we reopened it.
+    if (src_info.m_fd >= 0) {
+        int r = call_real_close(src_info.m_fd);
+        if (r != 0) {
+            r = errno;
+            the_manager.backup_error(r, "Could not close %s at %s:%d", src_info.m_path, __FILE__, __LINE__);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_chunk() -
+//
+// Description:
+//
+//     Copies the range [lo,hi) of the source file to the same range of
+// the destination, one buffer at a time, each under a range lock.  If
+// hi is UINT64_MAX we copy until we read the end of the file.  Holes
+// in the source are skipped, which leaves them as holes in the new
+// destination; a hole at the end of the file is made by extending the
+// destination's size.  Anything the application writes into a hole
+// after we skip it is captured, as usual.  Whatever we read, or skip
+// as a hole, is marked as copied while it is range locked, so that
+// captured writes that land ahead of us can be left out.
+//
+int copier::copy_chunk(source_info *src_info, uint64_t lo, uint64_t hi) throw() {
     int r = 0;
-    // For DirectIO: we need to allocate a mem-aligned buffer.
-    const size_t align = 2<<12; // why 8K?
-    const size_t buf_size = 1024 * 1024;
-    char *buf_base = new char[buf_size + align];
-    char *buf = (char *)(((size_t)buf_base + align) & ~(align-1));
+    // The pool's buffers are page aligned, which is what DirectIO needs.
+    copy_buffer *buffer = m_buffers.get(src_info->m_worker);
+    if (buffer == NULL) {
+        r = errno;
+        the_manager.backup_error(r, "Could not allocate a copy buffer for %s", src_info->m_path);
+        return r;
+    }
+    const size_t buf_size = buffer->m_size;
+    const unsigned int io_depth = (src_info->m_grant != NULL) ? src_info->m_grant->m_io_depth : m_io_depth;
+    copy_engine engine(buffer->m_data, buf_size, io_depth);
 
-    source_file * file = src_info.m_file;
+    source_file * file = src_info->m_file;
     destination_file * dest = file->get_destination();
     TRACE("Copying to file:", dest->get_path());
     // Polling variables.
     ssize_t n_wrote_now = 0;
-    size_t poll_string_size = 2000;
-    char *poll_string = new char [poll_string_size];
-    m_total_written_this_file = 0;
-    struct timespec starttime;
-
-    r = gettime_reporting_error(&starttime, m_calls);
-    if (r!=0) goto out;
-
-    while (1) {
-        if (!the_manager.copy_is_enabled()) goto out;
+    size_t poll_string_size = buffer->m_poll_string_size;
+    char *poll_string = buffer->m_poll_string;
+    uint64_t offset = lo;
+    copy_snapshot snapshot;   // the versions of the range we are copying optimistically.
+
+    while (offset < hi) {
+        if (this->should_stop()) goto out;
+
+        uint64_t data_start, data_end;
+        this->find_data(src_info, offset, &data_start, &data_end);
+        if (data_start >= hi) {
+            // The rest of the chunk is a hole.
+            if (hi == UINT64_MAX) {
+                bool more_data = false;
+                r = this->copy_trailing_hole(src_info, offset, &more_data);
+                if (r != 0 || !more_data) goto out;
+                // Someone wrote past the hole after we looked, so go copy it.
+                continue;
+            }
+            if (!this->skip_hole(src_info, offset, hi)) {
+                continue;
+            }
+            m_progress->m_bytes_backed_up += hi - offset;
+            goto out;
+        }
+        if (src_info->m_manifest != NULL) {
+            // Compare whole blocks with the base backup.
+            data_start -= data_start % MANIFEST_BLOCK_SIZE;
+            if (data_end != UINT64_MAX && data_end % MANIFEST_BLOCK_SIZE != 0) {
+                data_end += MANIFEST_BLOCK_SIZE - data_end % MANIFEST_BLOCK_SIZE;
+            }
+        }
+        if (data_start > offset) {
+            if (!this->skip_hole(src_info, offset, data_start)) {
+                continue;
+            }
+            m_progress->m_bytes_backed_up += data_start - offset;
+            offset = data_start;
+        }
 
         PAUSE(HotBackup::COPIER_BEFORE_READ);
-        const ssize_t lock_start = m_total_written_this_file;
-        const ssize_t lock_end   = m_total_written_this_file + buf_size;
-        file->lock_range(lock_start, lock_end);
-        
+        const uint64_t lock_start = offset;
+        uint64_t lock_end = (hi - offset < buf_size) ? hi : offset + buf_size;
+        if (data_end < lock_end) {
+            lock_end = data_end;
+        }
         copy_result result;
-        result = open_and_lock_file_then_copy_range(src_info, buf, buf_size, poll_string, poll_string_size);
+        // An incremental backup decides about each block with the
+        // range locked, so it doesn't copy optimistically.
+        const bool optimistic = (src_info->m_manifest == NULL &&
+                                 file->start_optimistic_copy(lock_start, lock_end, &snapshot));
+        if (optimistic) {
+            // Copy without the range lock, so that writers to this
+            // range don't wait for our I/O.  Their writes are left out
+            // of the backup copy, since we haven't marked the range
+            // copied, so we copy whatever they changed again below.
+            result = open_and_lock_file_then_copy_range(src_info, &engine, lock_end - lock_start, poll_string, poll_string_size, offset);
+            file->finish_optimistic_copy();
+        }
+        file->lock_range(lock_start, lock_end, m_lock_stats);
+        if (!file->copy_will_read(lock_start, lock_end)) {
+            // Another copy of this file has read this range already, so
+            // captured writes to it may be queued.  Ours must land after them.
+            file->wait_for_captures();
+        }
+        
+        if (!optimistic) {
+            m_locked_copies++;
+            result = open_and_lock_file_then_copy_range(src_info, &engine, lock_end - lock_start, poll_string, poll_string_size, offset);
+        } else if (result.m_result == 0) {
+            m_optimistic_bytes += result.m_n_wrote_now;
+            result.m_result = this->recopy_changed_parts(src_info, &engine, snapshot, lock_start, offset, poll_string, poll_string_size);
+        }
         n_wrote_now = result.m_n_wrote_now;
+        file->mark_copied(lock_start, offset);
 
         r = file->unlock_range(lock_start, lock_end); 
         if (r!=0) goto out;
 
-        // If we hit an error, or have no more bytes to write, 
-        // we are finished and need to return immediately.
-        if (result.m_result != 0 || n_wrote_now == 0)
+        // If we hit an error we are finished and need to return
+        // immediately.
+        if (result.m_result != 0)
         {
             r = result.m_result;
             goto out;
         }
+        // At the end of the file, make sure nobody wrote past it
+        // before the copy is done with the rest.
+        if (n_wrote_now == 0) {
+            bool more_data = false;
+            r = this->copy_trailing_hole(src_info, offset, &more_data);
+            if (r != 0 || !more_data) goto out;
+            continue;
+        }
 
         PAUSE(HotBackup::COPIER_AFTER_WRITE);
-        r = possibly_sleep_or_abort(src_info, m_total_written_this_file, dest, starttime);
+        r = possibly_sleep_or_abort(*src_info, n_wrote_now, offset, dest);
         if (r != 0) {
             goto out;
         }
     }
 
 out:
-    delete[] buf_base;
-    delete[] poll_string;
+    this->add_engine_stats(engine.stats());
+    m_buffers.put(src_info->m_worker, buffer);
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// recopy_changed_parts() -
+//
+// Description:
+//
+//     Called with [lo,hi) range locked, after we copied it without the
+// lock.  Copies the blocks that were written meanwhile again, so that
+// the backup copy has what the source has now.  Returns 0 or an error
+// number, having reported it.
+//
+int copier::recopy_changed_parts(source_info *src_info, copy_engine *engine, const copy_snapshot &snapshot, uint64_t lo, uint64_t hi, char *poll_string, size_t poll_string_size) throw() {
+    std::vector<std::pair<uint64_t, uint64_t> > parts;
+    src_info->m_file->changed_parts(lo, hi, snapshot, &parts);
+    const int dest_fd = src_info->m_file->get_destination()->get_fd();
+    for (size_t i = 0; i < parts.size(); ++i) {
+        uint64_t offset = parts[i].first;
+        while (offset < parts[i].second) {
+            ssize_t n_copied = 0;
+            int r = engine->copy(src_info->m_fd, dest_fd, offset, parts[i].second - offset, &n_copied);
+            if (r != 0) {
+                snprintf(poll_string, poll_string_size, "Could not copy changed blocks of %s at offset %ld using %s, errno=%d (%s) at %s:%d", src_info->m_path, offset, engine->method_name(), r, strerror(r), __FILE__, __LINE__);
+                this->report_error(r, poll_string);
+                return r;
+            }
+            if (n_copied == 0) {
+                break; // The file has been truncated.
+            }
+            offset += n_copied;
+            m_recopied_bytes += n_copied;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// find_data() -
+//
+// Description:
+//
+//     Finds the first byte of data at or after the given offset of the
+// source file, and the hole that ends it.  If there is no more data,
+// data_start is UINT64_MAX.  If the file system can't tell us where
+// the holes are, we say it is all data and let the copy find the end
+// of the file.
+//
+void copier::find_data(source_info *src_info, uint64_t offset, uint64_t *data_start, uint64_t *data_end) throw() {
+    *data_start = offset;
+    *data_end = UINT64_MAX;
+    off_t start = call_real_lseek(src_info->m_fd, offset, SEEK_DATA);
+    if (start < 0) {
+        if (errno == ENXIO) {
+            *data_start = UINT64_MAX;
+        }
+        return;
+    }
+    *data_start = start;
+    off_t end = call_real_lseek(src_info->m_fd, start, SEEK_HOLE);
+    if (end > start) {
+        *data_end = end;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// skip_hole() -
+//
+// Description:
+//
+//     We found no data in [lo,hi) of the source file, without a lock.
+// Look again with the range locked, and if it is still a hole, mark it
+// as copied so that writes into it are captured from now on.  Returns
+// false if the application wrote into it meanwhile, so that the
+// caller looks again.
+//
+bool copier::skip_hole(source_info *src_info, uint64_t lo, uint64_t hi) throw() {
+    source_file * file = src_info->m_file;
+    file->lock_range(lo, hi, m_lock_stats);
+    uint64_t data_start, data_end;
+    this->find_data(src_info, lo, &data_start, &data_end);
+    const bool still_a_hole = (data_start >= hi);
+    if (still_a_hole) {
+        file->mark_copied(lo, hi);
+    }
+    ignore(file->unlock_range(lo, hi)); // It's been reported, and the copy will notice.
+    return still_a_hole;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_trailing_hole() -
+//
+// Description:
+//
+//     There is no data in the source file at or after the given
+// offset, but the file may still be longer than that.  Make the
+// destination just as long, which leaves a hole at its end.  We lock
+// the rest of the file, like ftruncate() does, and then look again in
+// case the application wrote more data first; if it did, more_data is
+// set and we leave the destination alone.  Otherwise the rest of the
+// file is marked as copied.  We also come here when a read finds the
+// end of the file, to close the same race with appending writes.
+//
+int copier::copy_trailing_hole(source_info *src_info, uint64_t offset, bool *more_data) throw() {
+    int r = 0;
+    source_file * file = src_info->m_file;
+    destination_file * dest = file->get_destination();
+    struct stat src_stat, dest_stat;
+
+    file->lock_range(offset, LLONG_MAX, m_lock_stats);
+    uint64_t data_start, data_end;
+    this->find_data(src_info, offset, &data_start, &data_end);
+    if (data_start != UINT64_MAX) {
+        *more_data = true;
+        goto unlock;
+    }
+    if (fstat(src_info->m_fd, &src_stat) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not stat %s at %s:%d", src_info->m_path, __FILE__, __LINE__);
+        goto unlock;
+    }
+    if ((uint64_t)src_stat.st_size <= offset) {
+        goto unlock;
+    }
+    if (fstat(dest->get_fd(), &dest_stat) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not stat %s at %s:%d", dest->get_path(), __FILE__, __LINE__);
+        goto unlock;
+    }
+    if (dest_stat.st_size < src_stat.st_size) {
+        r = dest->truncate(src_stat.st_size);
+        if (r != 0) goto unlock;
+    }
+    m_progress->m_bytes_backed_up += src_stat.st_size - offset;
+
+unlock:
+    if (r == 0 && !*more_data) {
+        file->mark_copied(offset, UINT64_MAX);
+    }
+    {
+        int r2 = file->unlock_range(offset, LLONG_MAX);
+        if (r == 0) {
+            r = r2;
+        }
+    }
     return r;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-copy_result copier::open_and_lock_file_then_copy_range(source_info src_info, 
-                                                       char *buf, 
-                                                       size_t buf_size, 
+void copier::add_engine_stats(const copy_engine_stats &stats) throw() {
+    if (stats.m_cloned_bytes == 0 && stats.m_n_waits == 0) {
+        return;
+    }
+    with_mutex_locked sm(&m_stats_mutex, BACKTRACE(NULL));
+    m_cloned_bytes += stats.m_cloned_bytes;
+    m_ring_bytes += stats.m_bytes;
+    m_ring_usecs += stats.m_usecs;
+    m_ring_n_waits += stats.m_n_waits;
+    m_ring_in_flight += stats.m_in_flight;
+    if (stats.m_max_in_flight > m_ring_max_in_flight) {
+        m_ring_max_in_flight = stats.m_max_in_flight;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// report_copy_stats() -
+//
+// Description:
+//
+//     Adds what we did to the current directory (how many workers
+// took part, how many files they split into chunks, how well the copy buffers were reused, what we cloned,
+// left out or took from the base backup, what we copied without range
+// locks, and what queue depth the workers achieved if they copied with
+// io_uring) to the session's stats.  Then resets the numbers for the
+// next directory.  The workers must have finished.
+//
+void copier::report_copy_stats(void) throw() {
+    if (m_stats != NULL) {
+        uint64_t n_busy = 0;
+        for (size_t i = 0; i < m_worker_tasks.size(); ++i) {
+            if (m_worker_tasks[i] > 0) {
+                n_busy++;
+            }
+        }
+        m_stats->add_workers(m_n_workers, n_busy, m_n_steals);
+        m_stats->add_chunks(m_chunked_files, m_n_chunks, m_helper_chunks);
+        buffer_pool_stats buffer_stats;
+        m_buffers.get_stats(&buffer_stats);
+        m_stats->add_buffers(buffer_stats);
+    }
+    m_n_steals = 0;
+    m_chunked_files = 0;
+    m_n_chunks = 0;
+    m_helper_chunks = 0;
+    m_buffers.reset_stats();
+
+    with_mutex_locked sm(&m_stats_mutex, BACKTRACE(NULL));
+    if (m_stats != NULL) {
+        m_stats->add_cloned(m_cloned_bytes);
+        m_stats->add_incremental(m_unchanged_bytes, m_changed_bytes);
+        m_stats->add_taken(m_taken_files, m_taken_bytes, m_taken_cloned_files);
+        m_stats->add_optimistic(m_optimistic_bytes, m_recopied_bytes, m_locked_copies);
+        m_stats->add_io_ring(m_ring_bytes, m_ring_usecs, m_ring_n_waits, m_ring_in_flight, m_ring_max_in_flight);
+    }
+    m_cloned_bytes = 0;
+    m_unchanged_bytes = 0;
+    m_changed_bytes = 0;
+    m_taken_files = 0;
+    m_taken_bytes = 0;
+    m_taken_cloned_files = 0;
+    m_optimistic_bytes = 0;
+    m_recopied_bytes = 0;
+    m_locked_copies = 0;
+    m_ring_bytes = 0;
+    m_ring_usecs = 0;
+    m_ring_n_waits = 0;
+    m_ring_in_flight = 0;
+    m_ring_max_in_flight = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_result copier::open_and_lock_file_then_copy_range(source_info *src_info, 
+                                                       copy_engine *engine,
+                                                       size_t len,
                                                        char *poll_string, 
-                                                       size_t poll_string_size) throw()
+                                                       size_t poll_string_size,
+                                                       uint64_t & offset) throw()
 {
     copy_result result;
-    with_source_file_fd_lock fdl(src_info.m_file);
-    // We may have to re-open the source file because the Direct I/O
-    // flags may have changed since we last copied a range.
-    if (src_info.m_file->given_flags_are_different(src_info.m_flags)) {
-        // Close the old fd.
-        int r = call_real_close(src_info.m_fd);
-        if (r != 0) {
-            int close_errno = errno;
-            the_manager.backup_error(close_errno, "Could not close %s at %s:%d", src_info.m_path, __FILE__, __LINE__);
-            result.m_result = close_errno;
-        }
-
-        // Open the new fd.
-        int flags = O_RDONLY;
-        if (src_info.m_file->direct_io_flag_is_set()) {
-            flags |= O_DIRECT;
-        }
-
-        src_info.m_fd = call_real_open(src_info.m_path, flags);
-        if (src_info.m_fd < 0) {
-            int open_errno = errno;
-            if (open_errno == ENOENT) {
-                return result;
-            } else {
-                the_manager.backup_error(open_errno, "Could not open source file: %s", src_info.m_path);
-                result.m_result = open_errno;
-                return result;
+    {
+        // The fd lock only protects the source file's flags, so we
+        // don't hold it while we copy.  That lets several workers
+        // copy chunks of the same file at once.
+        with_source_file_fd_lock fdl(src_info->m_file);
+        // We may have to re-open the source file because the Direct I/O
+        // flags may have changed since we last copied a range.
+        if (src_info->m_file->given_flags_are_different(src_info->m_flags)) {
+            // Close the old fd.
+            int r = call_real_close(src_info->m_fd);
+            if (r != 0) {
+                int close_errno = errno;
+                the_manager.backup_error(close_errno, "Could not close %s at %s:%d", src_info->m_path, __FILE__, __LINE__);
+                result.m_result = close_errno;
             }
-        }
 
-        // We have to do a seek because we close and re-open the file
-        // between each range copy.  For host files opened with the
-        // O_DIRECT flag, m_total_written_this_file should line up
-        // with the correct offsets and should not return an error.
-        off_t offset = call_real_lseek(src_info.m_fd, m_total_written_this_file, SEEK_SET);
-        if (offset < 0) {
-            int lseek_errno = errno;
-            the_manager.backup_error(lseek_errno, "Could not lseek file: %s", src_info.m_path);
-            result.m_result = lseek_errno;
-            return result;
+            // Open the new fd.
+            int flags = O_RDONLY;
+            if (src_info->m_file->direct_io_flag_is_set()) {
+                flags |= O_DIRECT;
+            }
+
+            src_info->m_fd = call_real_open(src_info->m_path, flags);
+            if (src_info->m_fd < 0) {
+                int open_errno = errno;
+                if (open_errno == ENOENT) {
+                    return result;
+                } else {
+                    the_manager.backup_error(open_errno, "Could not open source file: %s", src_info->m_path);
+                    result.m_result = open_errno;
+                    return result;
+                }
+            }
+            src_info->m_flags = flags;
+            // We read with pread(), so there is no need to seek the new
+            // fd.  For host files opened with the O_DIRECT flag, our
+            // offsets are multiples of the buffer size, so they line up.
         }
     }
 
     result = copy_file_range(src_info,
-                             buf, 
-                             buf_size, 
+                             engine,
+                             len,
                              poll_string, 
-                             poll_string_size);
+                             poll_string_size,
+                             offset);
 
     return result;
 }
@@ -612,111 +1679,174 @@ copy_result copier::open_and_lock_file_then_copy_range(source_info src_info,
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-copy_result copier::copy_file_range(source_info src_info,
-                                    char * buf, 
-                                    size_t buf_size, 
+copy_result copier::copy_file_range(source_info *src_info,
+                                    copy_engine *engine,
+                                    size_t len,
                                     char *poll_string, 
-                                    size_t poll_string_size) throw()
+                                    size_t poll_string_size,
+                                    uint64_t & offset) throw()
 {
     copy_result result;
     result.m_result = 0;
     result.m_n_wrote_now = 0;
-    destination_file * dest = src_info.m_file->get_destination();
-        ssize_t n_read = call_real_read(src_info.m_fd, buf, buf_size);
-        if (n_read == 0) {
-            // SUCCESS! We are done copying the file.
-            result.m_result = 0;
-            result.m_n_wrote_now = 0;
-            return result;
-        } else if (n_read < 0) {
-            int read_errno = errno;
-            snprintf(poll_string, poll_string_size, "Could not read from %s, n_read=%lu errno=%d (%s) fd=%d at %s:%d", src_info.m_path, n_read, read_errno, strerror(read_errno), src_info.m_fd, __FILE__, __LINE__);
-            m_calls->report_error(read_errno, poll_string);
-            result.m_result = read_errno;
+    destination_file * dest = src_info->m_file->get_destination();
+    int r = 0;
+    // We don't know that we are at the end of the file until the copy
+    // returns zero bytes.  Don't poll for that last empty copy, since
+    // everything we knew about is already backed up.
+    if (offset < (uint64_t)src_info->m_size) {
+        snprintf(poll_string, 
+                 poll_string_size, 
+                 "Backup progress %ld bytes, %ld files.  Copying file: %ld/%ld bytes done of %s to %s.",
+                 m_progress->m_bytes_backed_up.load(), 
+                 m_progress->m_files_backed_up.load(), 
+                 offset, 
+                 src_info->m_size,
+                 src_info->m_path,
+                 dest->get_path());
+        r = this->poll(poll_string);
+        if (r!=0) {
+            this->report_error(r, "User aborted backup");
+            result.m_result = r;
             return result;
         }
+    }
 
-        PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
-        ssize_t n_wrote_this_buf = 0;
-        while (n_wrote_this_buf < n_read) {
-            snprintf(poll_string, 
-                     poll_string_size, 
-                     "Backup progress %ld bytes, %ld files.  Copying file: %ld/%ld bytes done of %s to %s.",
-                     m_total_bytes_backed_up, 
-                     m_total_files_backed_up, 
-                     m_total_written_this_file, 
-                     src_info.m_size,
-                     src_info.m_path,
-                     dest->get_path());
-            int r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), poll_string);
-            if (r!=0) {
-                m_calls->report_error(r, "User aborted backup");
-                result.m_result = r;
-                return result;
-            }
-
-            result.m_n_wrote_now = call_real_write(dest->get_fd(),
-                                                   buf + n_wrote_this_buf,
-                                                   n_read - n_wrote_this_buf);
-            if(result.m_n_wrote_now < 0) {
-                int write_errno = errno;
-                snprintf(poll_string, poll_string_size, "error write to %s, errno=%d (%s) at %s:%d", dest->get_path(), write_errno, strerror(write_errno), __FILE__, __LINE__);
-                m_calls->report_error(write_errno, poll_string);
-                result.m_result = write_errno;
-                return result;
-            }
-
-            n_wrote_this_buf          += result.m_n_wrote_now;
-            m_total_written_this_file += result.m_n_wrote_now;
-            m_total_bytes_backed_up   += result.m_n_wrote_now;
+    PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+    struct timespec io_start;
+    if (src_info->m_grant != NULL) {
+        r = gettime_reporting_error(&io_start);
+        if (r != 0) {
+            result.m_result = r;
+            return result;
         }
+    }
+    if (src_info->m_manifest != NULL) {
+        r = this->copy_changed_blocks(src_info, engine->buffer(), len, offset, &result.m_n_wrote_now);
+    } else {
+        r = engine->copy(src_info->m_fd, dest->get_fd(), offset, len, &result.m_n_wrote_now);
+    }
+    if (src_info->m_grant != NULL && r == 0 && result.m_n_wrote_now > 0) {
+        struct timespec io_end;
+        ignore(clock_gettime(CLOCK_MONOTONIC, &io_end));
+        device_scheduler::note_io(*src_info->m_grant, result.m_n_wrote_now, (uint64_t)(tdiff(io_end, io_start) * 1e6));
+    }
+    if (r != 0) {
+        snprintf(poll_string, poll_string_size, "Could not copy %s to %s at offset %ld using %s, errno=%d (%s) fd=%d at %s:%d", src_info->m_path, dest->get_path(), offset, engine->method_name(), r, strerror(r), src_info->m_fd, __FILE__, __LINE__);
+        this->report_error(r, poll_string);
+        result.m_result = r;
+        result.m_n_wrote_now = 0;
+        return result;
+    }
 
+    // A zero-byte copy means we are done copying the file.
+    offset                  += result.m_n_wrote_now;
+    m_progress->m_bytes_backed_up += result.m_n_wrote_now;
     return result;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_changed_blocks() -
+//
+// Description:
+//
+//     Copies a range of a file for an incremental backup.  We read the
+// range and compare each block's checksum with the base backup's.  We
+// write the blocks that changed, and leave holes where the others go.
+// The range starts on a block boundary, and the caller holds its range
+// lock, so capture can't change the blocks while we decide about them.
+//
+int copier::copy_changed_blocks(source_info *src_info, char *buf, size_t len, uint64_t offset, ssize_t *n_copied) throw() {
+    manifest_file *manifest = src_info->m_manifest;
+    const int dest_fd = src_info->m_file->get_destination()->get_fd();
+    ssize_t n_read = call_real_pread(src_info->m_fd, buf, len, offset);
+    if (n_read < 0) {
+        return errno;
+    }
 
-int copier::possibly_sleep_or_abort(source_info src_info, ssize_t total_written_this_file, destination_file * dest, struct timespec starttime) throw()
-{
-    int r = 0;
-        while (1) {
-            if (!the_manager.copy_is_enabled()) goto out;
-
-            // Sleep until we've used up enough time.  Be sure to keep polling once per second.
-            struct timespec endtime;
-            r = gettime_reporting_error(&endtime, m_calls);
-            if (r!=0) goto out;
-            double actual_time = tdiff(endtime, starttime);
-            unsigned long throttle = m_calls->get_throttle();
-            double budgeted_time = total_written_this_file / (double)throttle;
-            if (budgeted_time <= actual_time) break;
-            double sleep_time = budgeted_time - actual_time;  // if we were supposed to copy 10MB at 2MB/s, then our budget was 5s.  If we took 1s, then sleep 4s.
-            {
-                char string[1000];
-                snprintf(string, 
-                         sizeof(string),
-                         "Backup progress %ld bytes, %ld files.  Throttled: copied %ld/%ld bytes of %s to %s. Sleeping %.2fs for throttling.",
-                         m_total_bytes_backed_up,
-                         m_total_files_backed_up,
-                         total_written_this_file, 
-                         src_info.m_size, 
-                         src_info.m_path, 
-                         dest->get_path(), 
-                         sleep_time);
-                r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), string);
-            }
-            if (r!=0) {
-                m_calls->report_error(r, "User aborted backup");
-                goto out;
-            }
-            if (sleep_time>1) {
-                usleep(1000000);
-            } else {
-                usleep((long)(sleep_time*1e6));
+    bool last_is_unchanged = false;
+    for (ssize_t pos = 0; pos < n_read; pos += MANIFEST_BLOCK_SIZE) {
+        const size_t block_len = (n_read - pos < (ssize_t)MANIFEST_BLOCK_SIZE) ? n_read - pos : MANIFEST_BLOCK_SIZE;
+        const uint64_t block = (offset + pos) / MANIFEST_BLOCK_SIZE;
+        const uint64_t checksum = manifest_checksum(buf + pos, block_len);
+        last_is_unchanged = manifest->block_is_unchanged(block, checksum, block_len);
+        if (last_is_unchanged) {
+            manifest->set_block(block, MANIFEST_BLOCK_CHECKSUMED, checksum);
+            m_unchanged_bytes += block_len;
+            continue;
+        }
+        for (size_t n_wrote = 0; n_wrote < block_len; ) {
+            ssize_t n = call_real_pwrite(dest_fd, buf + pos + n_wrote, block_len - n_wrote, offset + pos + n_wrote);
+            if (n < 0) {
+                return errno;
             }
+            n_wrote += n;
+        }
+        manifest->set_block(block, MANIFEST_BLOCK_PRESENT | MANIFEST_BLOCK_CHECKSUMED, checksum);
+        m_changed_bytes += block_len;
+    }
 
-            if (!the_manager.copy_is_enabled()) goto out;
+    if (last_is_unchanged) {
+        // Make the backup copy long enough by writing the last byte.
+        // Unlike ftruncate(), that can't undo an append that capture
+        // just made beyond our range.
+        if (call_real_pwrite(dest_fd, buf + n_read - 1, 1, offset + n_read - 1) != 1) {
+            return errno;
+        }
+    }
+    *n_copied = n_read;
+    return 0;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// possibly_sleep_or_abort() -
+//
+// Description:
+//
+//     Takes the n_bytes we just read out of the token bucket that the
+// whole backup shares, and sleeps until whatever the backup has read
+// beyond the throttle's rate has been paid off.  We sleep in short
+// steps, polling in between, so that the user can abort the backup or
+// change the throttle while we sleep.
+//
+int copier::possibly_sleep_or_abort(source_info src_info, uint64_t n_bytes, uint64_t offset, destination_file * dest) throw()
+{
+    int r = 0;
+    token_bucket *bucket = &m_progress->m_bucket;
+    const uint64_t burst = the_manager.get_throttle_burst();
+    bucket->take(n_bytes, m_calls->get_throttle(), burst);
+    while (1) {
+        if (this->should_stop()) goto out;
+
+        // Look again every time, since the throttle may have changed,
+        // and other workers may have added to the debt.
+        uint64_t wait_usecs = bucket->usecs_to_wait(m_calls->get_throttle(), burst);
+        if (wait_usecs == 0) break;
+        if (wait_usecs > THROTTLE_SLEEP_USECS) {
+            wait_usecs = THROTTLE_SLEEP_USECS;
+        }
+        {
+            char string[1000];
+            snprintf(string,
+                     sizeof(string),
+                     "Backup progress %ld bytes, %ld files.  Throttled: copied %ld/%ld bytes of %s to %s. Sleeping %.3fs for throttling.",
+                     m_progress->m_bytes_backed_up.load(),
+                     m_progress->m_files_backed_up.load(),
+                     offset,
+                     src_info.m_size,
+                     src_info.m_path,
+                     dest->get_path(),
+                     wait_usecs / 1e6);
+            r = this->poll(string);
+        }
+        if (r!=0) {
+            this->report_error(r, "User aborted backup");
+            goto out;
         }
+        usleep(wait_usecs);
+    }
 out:
     return r;
 }
@@ -728,15 +1858,17 @@ out:
 // Description: 
 //
 //     Loop through each entry, adding directories and regular
-// files to our copy 'todo' list.
+// files to the given worker's deque.  Idle workers are woken every so
+// often, so that they can start stealing from a large directory before
+// we have finished reading it.
 //
-int copier::add_dir_entries_to_todo(DIR *dir, const char *file) throw() {
+int copier::add_dir_entries_to_todo(DIR *dir, const char *file, int worker) throw() {
     TRACE("--Adding all entries in this directory to todo list: ", file);
     int error = 0;
-    with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
+    int n_added = 0;
     struct dirent const *e = NULL;
     while((e = readdir(dir)) != NULL) {
-        if (!the_manager.copy_is_enabled()) break;
+        if (this->should_stop()) break;
         if(is_dot(e)) {
             TRACE("skipping: ", e->d_name);
         } else {
@@ -755,20 +1887,44 @@ int copier::add_dir_entries_to_todo(DIR *dir, const char *file) throw() {
             }
             
             // Add it to our todo list.
-            m_todo.push_back(strdup(new_name));
+            m_n_outstanding++;
+            m_work.push(worker, new copy_task(strdup(new_name), NULL));
             TRACE("~~~Added this file to todo list:", new_name);
+            if (++n_added % 64 == 0) {
+                this->work_was_added();
+            }
         }
     }
     
 out:
+    if (n_added % 64 != 0) {
+        this->work_was_added();
+    }
     return error;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-void copier::add_file_to_todo(const char *file) throw() {
-    with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-    m_todo.push_back(strdup(file));
+// add_file_to_todo() -
+//
+// Description:
+//
+//     Queues a file (or directory) that capture found we must copy,
+// if we are copying the directory it is in.  If we haven't got to that
+// directory yet, we will find the file when we do.  Returns true if
+// the file was queued.
+//
+bool copier::add_file_to_todo(const char *source_dir, const char *file) throw() {
+    {
+        with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
+        if (!m_copying || strcmp(m_source, source_dir) != 0) {
+            return false;
+        }
+        m_todo.push_back(strdup(file));
+        m_n_outstanding++;
+    }
+    this->work_was_added();
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -777,13 +1933,15 @@ void copier::add_file_to_todo(const char *file) throw() {
 //
 // Description:
 //
-//     Frees any strings that are still allocated in our todo list.
+//     Frees any strings that are still allocated in our todo list
+// and in the workers' deques.
 //
 // Notes:
 //
 //     This should only be called if there is no future copy work.
 //
 void copier::cleanup(void) throw() {
+    m_work.clear();
     with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
     for(std::vector<char *>::size_type i = 0; i < m_todo.size(); ++i) {
         char *file = m_todo[i];
@@ -794,6 +1952,102 @@ void copier::cleanup(void) throw() {
         free((void*)file);
         m_todo[i] = NULL;
     }
+    m_todo.clear();
+    m_n_outstanding = 0;
+    m_copying = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_dirty_blocks() -
+//
+// Description:
+//
+//     Copies the file's dirty blocks from the source into its backup
+// copy, one run at a time.  Each run is cleared and read with its
+// range locked, so a write that lands there afterwards marks it dirty
+// again (or, after the final pass has begun, goes into the backup copy
+// itself).  The source is opened by its current name, which follows
+// renames.  If it has gone, so has its backup copy, and there is
+// nothing to copy.  This must be called on the thread that called
+// do_copy().  Returns 0 or an error number, having reported it.
+//
+int copier::copy_dirty_blocks(source_file *file, uint64_t *n_copied) throw() {
+    *n_copied = 0;
+    destination_file *dest;
+    {
+        with_source_file_destination_lock dl(file);
+        dest = file->get_destination();
+    }
+    {
+        char *msg;
+        {
+            with_source_file_name_read_lock snl(file);
+            msg = malloc_snprintf(strlen(file->name()) + 100, "Copying the dirty blocks of %s", file->name());
+        }
+        // Poll without the name lock, since the poll function may rename the file.
+        int r = this->poll(msg);
+        free(msg);
+        if (r != 0) {
+            return r;
+        }
+    }
+    int fd;
+    {
+        with_source_file_name_read_lock snl(file);
+        fd = (dest == NULL) ? -1 : call_real_open(file->name(), O_RDONLY);
+    }
+    if (fd < 0) {
+        int r = (dest == NULL) ? ENOENT : errno;
+        if (r == ENOENT) {
+            file->clear_dirty(0, UINT64_MAX);
+            return 0;
+        }
+        the_manager.backup_error(r, "Could not open %s to copy its dirty blocks", file->name());
+        return r;
+    }
+    copy_buffer *buffer = m_buffers.get(0);
+    if (buffer == NULL) {
+        int r = errno;
+        the_manager.backup_error(r, "Could not allocate a copy buffer for %s", file->name());
+        ignore(call_real_close(fd));
+        return r;
+    }
+
+    int r = 0;
+    uint64_t lo, hi;
+    uint64_t from = 0;
+    while (r == 0 && file->next_dirty(from, buffer->m_size, &lo, &hi)) {
+        file->lock_range(lo, hi, m_lock_stats);
+        file->clear_dirty(lo, hi);
+        file->wait_for_captures();
+        uint64_t n_read = 0;
+        while (lo + n_read < hi) {
+            ssize_t n = call_real_pread(fd, buffer->m_data + n_read, hi - lo - n_read, lo + n_read);
+            if (n < 0) {
+                r = errno;
+                the_manager.backup_error(r, "Could not read the dirty blocks of %s", file->name());
+                break;
+            }
+            if (n == 0) {
+                break; // The file has been truncated since they were written.
+            }
+            n_read += n;
+        }
+        if (r == 0 && n_read > 0) {
+            r = dest->pwrite(buffer->m_data, n_read, lo);
+            *n_copied += n_read;
+        }
+        int r2 = file->unlock_range(lo, hi);
+        if (r2 != 0 && r == 0) {
+            r = r2;
+            the_manager.backup_error(r, "Could not unlock the dirty blocks of %s", file->name());
+        }
+        from = hi;
+    }
+    m_buffers.put(0, buffer);
+    ignore(call_real_close(fd));
+    return r;
 }
 
 bool copier::file_should_be_excluded(const char *file) throw() {
@@ -40,16 +40,34 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup.h"
 #include "backup_callbacks.h"
+#include "buffer_pool.h"
+#include "token_bucket.h"
+#include "work_queue.h"
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <atomic>
 #include <deque>
 #include <dirent.h>
 #include <pthread.h>
+#include <time.h>
+#include <vector>
 
+class backup_manifest;
+class backup_stats;
+struct range_lock_stats;
+class capture_journal;
+class completed_files;
+class copy_engine;
+struct copy_engine_stats;
+class copy_job;
 class file_hash_table;
+class manifest_file;
 class source_file;
+struct copy_snapshot;
 class destination_file;
+class device_scheduler;
+struct device_grant;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -67,6 +85,9 @@ struct source_info {
     off_t m_size;
     source_file * m_file;
     int m_flags;
+    int m_worker;        // the copy worker that owns this file.
+    manifest_file *m_manifest; // the file's record in an incremental backup's manifest, or NULL.
+    const device_grant *m_grant; // what the device scheduler lets the copy do, or NULL if there is no scheduler.
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -89,37 +110,161 @@ struct copy_result {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
+// copy_progress:
+//
+// Description:
+//
+//     What the copiers of a backup have copied, and how much they know
+// there is to copy.  Copiers that copy different directories at the
+// same time share one, so that the poll function sees the progress of
+// the backup as a whole, and so that all of their workers draw on one
+// token bucket for the throttle.
+//
+struct copy_progress {
+    copy_progress() : m_bytes_backed_up(0), m_files_backed_up(0), m_bytes_to_back_up(0) {};
+    std::atomic<uint64_t> m_bytes_backed_up;
+    std::atomic<uint64_t> m_files_backed_up;
+    std::atomic<uint64_t> m_bytes_to_back_up;  // the sizes of the directories the copiers have started on.  This is used for the polling callback.
+    token_bucket m_bucket;                     // what the workers read is taken out of this, so that the backup keeps to the throttle.
+    double fraction(void) const throw() {
+        return (double)(m_bytes_backed_up+1)/(double)(m_bytes_to_back_up+1);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copier:
+//
+// Description:
+//
+//     Copies a source directory tree to its destination using a pool
+// of workers.  The thread that calls do_copy() is worker 0; it is the
+// only worker that calls the poll and error callbacks, and the other
+// workers report their errors through the backup manager.  Each worker
+// has its own deque in m_work and steals from the others when its own
+// runs dry.  Files added by capture (e.g. after a rename) go onto the
+// shared m_todo list, which every worker checks before stealing.  The
+// copy buffers come from m_buffers, which keeps them across files.
+//
 class copier {
   private:
     const char *m_source;
     const char *m_dest;
     std::deque<char *> m_todo;
+    bool m_copying;                           // do_copy() is copying m_source, so m_todo may take names in it (under m_todo_mutex).
+    work_queue m_work;
     backup_callbacks *m_calls;
     file_hash_table * const m_table;
-    size_t m_total_written_this_file;
+    buffer_pool m_buffers;
+    backup_manifest *m_manifest;              // the manifest of an incremental backup, or NULL for a full one.
+    const backup_manifest *m_base_manifest;   // the base backup's manifest for the current directory, or NULL.
+    const char *m_base_dir;                   // the base backup's copy of the current directory, or NULL.
+    time_t m_start_time;                      // when the current directory's copy began, for fingerprints.
+    completed_files *m_completed;             // where finished copies are noted, or NULL.
+    backup_stats *m_stats;                    // where what we did is added up when we finish a directory, or NULL.
+    range_lock_stats *m_lock_stats;           // where our range locks count, or NULL.
+    device_scheduler *m_scheduler;            // decides when each file may be copied, or NULL to copy them all as they come.
+    capture_journal *m_journal;               // where captured changes go, or NULL.
+    dev_t m_dest_device;                      // the device of m_dest.
+    bool m_have_dest_device;                  // false if we couldn't stat m_dest, so we go by the source's device alone.
 public:
     static pthread_mutex_t m_todo_mutex; // make this public so that we can grab the mutex when creating a copier.
 private:
-    uint64_t m_total_bytes_backed_up;
-    uint64_t m_total_files_backed_up;
-    uint64_t m_total_bytes_to_back_up; // the number of files that we will need to back up. This is used for the polling callback.
+    copy_progress m_own_progress;
+    copy_progress *m_progress;                // m_own_progress, unless we share another copier's.
+
+    // Worker pool state.
+    int m_n_workers;
+    unsigned int m_io_depth;                  // reads (and writes) in flight per worker.  Above 1 we try io_uring.
+    uint64_t m_chunk_size;                    // files of at least twice this size are split into chunks of this size, so that several workers can copy them.
+    pthread_t m_poll_thread;                  // the thread running do_copy(), which is the only one that may call m_calls.
+    bool m_may_call_back;                     // false if not even that thread may, because it isn't the backup's thread.
+    std::atomic<uint64_t> m_n_outstanding;    // tasks that are queued or in progress.  The copy is finished when this reaches zero.
+    std::atomic<uint64_t> m_work_generation;  // bumped (under m_idle_mutex) whenever work is added, so idle workers don't miss a wakeup.
+    std::atomic<int> m_error;                 // the first error any worker hit.  Nonzero tells the other workers to stop.
+    std::atomic<int> *m_shared_error;         // the first error any copier of the backup hit, or NULL if we don't share one.
+    pthread_mutex_t m_idle_mutex;
+    pthread_cond_t m_idle_cond;
+    std::vector<uint64_t> m_worker_tasks;     // the tasks each worker has done in the current directory.  Only that worker changes its count.
+    std::atomic<uint64_t> m_n_steals;         // tasks that a worker took from another worker's deque.
+    std::atomic<uint64_t> m_chunked_files;    // files split into chunks.
+    std::atomic<uint64_t> m_n_chunks;         // the chunks they were split into.
+    std::atomic<uint64_t> m_helper_chunks;    // of those, the ones that workers other than the file's own copied.
+
+    // What the workers' clones and io_uring copies achieved, summed over the workers.
+    pthread_mutex_t m_stats_mutex;
+    uint64_t m_cloned_bytes;
+    uint64_t m_ring_bytes;
+    uint64_t m_ring_usecs;
+    uint64_t m_ring_n_waits;
+    uint64_t m_ring_in_flight;
+    uint64_t m_ring_max_in_flight;
+
+    // What incremental backups skipped and copied.
+    std::atomic<uint64_t> m_unchanged_bytes;
+    std::atomic<uint64_t> m_changed_bytes;
+    std::atomic<uint64_t> m_taken_files;      // files whose fingerprints matched the base backup's, so we didn't read them.
+    std::atomic<uint64_t> m_taken_bytes;
+    std::atomic<uint64_t> m_taken_cloned_files; // of those, the ones that are clones of the base backup's copies.
+
+    // What optimistic copies did.
+    std::atomic<uint64_t> m_optimistic_bytes; // bytes copied without the range lock.
+    std::atomic<uint64_t> m_recopied_bytes;   // bytes copied again (with it) because they were written meanwhile.
+    std::atomic<uint64_t> m_locked_copies;    // ranges copied with the range lock.
+
+    int run_worker(int worker) throw() __attribute__((warn_unused_result));
+    static void *start_worker(void *arg) throw();
+    copy_task *take_work(int worker) throw() __attribute__((warn_unused_result));
+    void work_was_added(void) throw();
+    void finish_work(void) throw();
+    int wait_for_work(uint64_t generation) throw() __attribute__((warn_unused_result));
+    bool should_stop(void) const throw();
+    bool is_poll_thread(void) const throw();
+    int poll(const char *progress_string) throw() __attribute__((warn_unused_result));
+    void report_error(int error_number, const char *error_string) throw();
+    int gettime_reporting_error(struct timespec *ts) throw() __attribute__((warn_unused_result));
+    void add_engine_stats(const copy_engine_stats &stats) throw();
+    void report_copy_stats(void) throw();
+
+    int wait_for_device(const char *source, dev_t device, device_grant *grant, bool *granted) throw() __attribute__((warn_unused_result));
     int copy_regular_file(source_info src_info, const char *dest) throw()  __attribute__((warn_unused_result));
     int copy_using_source_info(source_info src_info, const char *dest) throw();
-    int create_destination_and_copy(source_info src_info, const char *dest) throw();
-    int add_dir_entries_to_todo(DIR *dir, const char *file) throw() __attribute__((warn_unused_result));
-    int possibly_sleep_or_abort(source_info src_info, ssize_t total_written_this_file, destination_file * dest, struct timespec starttime) throw() __attribute__((warn_unused_result));
-    ssize_t copy_file_range(source_info src_info, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size, size_t & total_written_this_file) throw() __attribute__((warn_unused_result));
-    copy_result open_and_lock_file_then_copy_range(source_info src_info, char *buf, size_t buf_size,char *poll_string,size_t poll_string_size) throw() __attribute__((warn_unused_result));
-    copy_result copy_file_range(source_info src_info, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    int create_destination_and_copy(source_info *src_info, const char *dest) throw();
+    void note_complete(source_info *src_info) throw();
+    int add_dir_entries_to_todo(DIR *dir, const char *file, int worker) throw() __attribute__((warn_unused_result));
+    int copy_file_in_chunks(source_info *src_info) throw() __attribute__((warn_unused_result));
+    uint64_t copy_chunks_of_job(copy_job *job, source_info *src_info) throw(); // Returns the number of chunks copied.
+    void help_with_job(copy_job *job, int worker) throw();
+    int copy_chunk(source_info *src_info, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    int recopy_changed_parts(source_info *src_info, copy_engine *engine, const copy_snapshot &snapshot, uint64_t lo, uint64_t hi, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    void find_data(source_info *src_info, uint64_t offset, uint64_t *data_start, uint64_t *data_end) throw();
+    bool skip_hole(source_info *src_info, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    int copy_trailing_hole(source_info *src_info, uint64_t offset, bool *more_data) throw() __attribute__((warn_unused_result));
+    int possibly_sleep_or_abort(source_info src_info, uint64_t n_bytes, uint64_t offset, destination_file * dest) throw() __attribute__((warn_unused_result));
+    copy_result open_and_lock_file_then_copy_range(source_info *src_info, copy_engine *engine, size_t len, char *poll_string,size_t poll_string_size, uint64_t & offset) throw() __attribute__((warn_unused_result));
+    copy_result copy_file_range(source_info *src_info, copy_engine *engine, size_t len, char *poll_string, size_t poll_string_size, uint64_t & offset) throw() __attribute__((warn_unused_result));
+    int take_unchanged_file(source_info *src_info, const char *relative_path, bool *taken) throw() __attribute__((warn_unused_result));
+    int copy_changed_blocks(source_info *src_info, char *buf, size_t len, uint64_t offset, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
 public:
     copier(backup_callbacks *calls, file_hash_table * const table) throw();
+    ~copier(void) throw();
     void set_directories(const char *source, const char *dest) throw();
-    void set_error(int error) throw();
+    void set_error(int error) throw(); // Stop the copy (now, or as soon as it starts), as if a worker had hit the error.
+    void set_shared_error(std::atomic<int> *error) throw(); // Share our first error with other copiers, and stop as soon as any of them has one.
+    void set_chunk_size(uint64_t chunk_size) throw(); // Rounded up to a whole number of copy buffers.
+    void set_manifests(backup_manifest *manifest, const backup_manifest *base, const char *base_dir) throw(); // Make the copies incremental.
+    void set_completed_files(completed_files *completed) throw(); // Note each file whose copy is complete there.
+    void set_stats(backup_stats *stats) throw();                  // Add what we did there.
+    void set_progress(copy_progress *progress) throw();            // Share progress with other copiers.
+    void set_may_call_back(bool may_call_back) throw();            // Pass false if do_copy() won't run on the backup's thread.
+    void set_scheduler(device_scheduler *scheduler) throw();       // Copy each file when its devices have room for it.
+    void set_journal(capture_journal *journal) throw();            // Note in the journal when each file's copy starts.
     int do_copy(void) throw() __attribute__((warn_unused_result)) __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_stripped_file(const char *file) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_full_path(const char *source, const char* dest, const char *file) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_file_data(source_info src_info) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    void add_file_to_todo(const char *file) throw();
+    int copy_stripped_file(const char *file, int worker) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_full_path(const char *source, const char* dest, const char *file, int worker) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_file_data(source_info *src_info) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_dirty_blocks(source_file *file, uint64_t *n_copied) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    bool add_file_to_todo(const char *source_dir, const char *file) throw(); // file is relative to source_dir, and is only taken while we copy that directory.  Returns true if it was taken.
     int open_both_files(const char *source, const char *dest, int *srcfd, int *destfd) throw();
     void cleanup(void) throw();
     bool file_should_be_excluded(const char *file) throw();
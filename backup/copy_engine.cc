@@ -0,0 +1,487 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "copy_engine.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(HAVE_FICLONERANGE)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include <atomic>
+
+static std::atomic<int> forced_method(COPY_METHOD_AUTO);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// method_is_unsupported() -
+//
+// Description:
+//
+//     Returns true if the given error from cloning, copy_file_range() or
+// splice() means that this method can't copy these files, rather than
+// that the copy itself went wrong.  In that case we try again with a
+// slower method, which reports any real error itself.
+//
+static bool method_is_unsupported(int error) throw() {
+    switch (error) {
+    case EINVAL:      // e.g. O_DIRECT files, filesystems that don't support it, or a clone that isn't block aligned.
+    case ENOSYS:      // the kernel is too old.
+    case EOPNOTSUPP:  // the filesystem doesn't support it.
+    case EXDEV:       // the files are on different filesystems.
+    case EBADF:       // the file type doesn't support it.
+        return true;
+    default:
+        return false;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static copy_method fastest_method(void) throw() {
+#if defined(HAVE_COPY_FILE_RANGE)
+    return COPY_METHOD_COPY_FILE_RANGE;
+#elif defined(HAVE_SPLICE)
+    return COPY_METHOD_SPLICE;
+#else
+    return COPY_METHOD_READ_WRITE;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static copy_method first_method(unsigned int io_depth) throw() {
+#if defined(HAVE_FICLONERANGE)
+    (void) io_depth;
+    return COPY_METHOD_CLONE;
+#else
+    return io_depth > 1 ? COPY_METHOD_IO_URING : fastest_method();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static int write_fully(int fd, const char *buf, size_t len, uint64_t offset) throw() {
+    size_t n_wrote = 0;
+    while (n_wrote < len) {
+        ssize_t n = call_real_pwrite(fd, buf + n_wrote, len - n_wrote, offset + n_wrote);
+        if (n < 0) {
+            return errno;
+        }
+        n_wrote += n;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static uint64_t now_usecs(void) throw() {
+    struct timespec ts;
+    ignore(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_engine::copy_engine(char *buf, size_t buf_size, unsigned int io_depth) throw()
+    : m_method(first_method(io_depth)),
+      m_buf(buf),
+      m_buf_size(buf_size),
+      m_io_depth(io_depth < 1 ? 1 : io_depth),
+      m_ring_is_ready(false),
+      m_ring_src_fd(-1),
+      m_ring_dest_fd(-1)
+{
+    m_pipe[0] = -1;
+    m_pipe[1] = -1;
+    const copy_method forced = (copy_method)forced_method.load();
+    if (forced != COPY_METHOD_AUTO) {
+        m_method = forced;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_engine::~copy_engine(void) throw() {
+    this->close_pipe();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copy_engine::force_method(copy_method method) throw() {
+    forced_method = method;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const copy_engine_stats &copy_engine::stats(void) const throw() {
+    return m_stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+char *copy_engine::buffer(void) const throw() {
+    return m_buf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const char *copy_engine::method_name(void) const throw() {
+    switch (m_method) {
+    case COPY_METHOD_CLONE:
+        return "clone";
+    case COPY_METHOD_IO_URING:
+        return "io_uring";
+    case COPY_METHOD_COPY_FILE_RANGE:
+        return "copy_file_range";
+    case COPY_METHOD_SPLICE:
+        return "splice";
+    case COPY_METHOD_READ_WRITE:
+    case COPY_METHOD_AUTO:
+        break;
+    }
+    return "read/write";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy() -
+//
+// Description:
+//
+//     Copies the range with the current method, and falls back to the
+// next method for as long as the current one is unsupported.
+//
+int copy_engine::copy(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+    if (len > m_buf_size) {
+        len = m_buf_size;
+    }
+    while (true) {
+        int r = 0;
+        switch (m_method) {
+        case COPY_METHOD_CLONE:
+            r = this->copy_with_clone(src_fd, dest_fd, offset, len, n_copied);
+            if (r != 0 && method_is_unsupported(r)) {
+                m_method = m_io_depth > 1 ? COPY_METHOD_IO_URING : fastest_method();
+                continue;
+            }
+            return r;
+        case COPY_METHOD_IO_URING:
+            r = this->copy_with_io_uring(src_fd, dest_fd, offset, len, n_copied);
+            if (r != 0 && method_is_unsupported(r)) {
+                m_method = fastest_method();
+                continue;
+            }
+            return r;
+        case COPY_METHOD_COPY_FILE_RANGE:
+            r = this->copy_with_copy_file_range(src_fd, dest_fd, offset, len, n_copied);
+            if (r != 0 && method_is_unsupported(r)) {
+                m_method = COPY_METHOD_SPLICE;
+                continue;
+            }
+            return r;
+        case COPY_METHOD_SPLICE:
+            r = this->copy_with_splice(src_fd, dest_fd, offset, len, n_copied);
+            if (r != 0 && method_is_unsupported(r)) {
+                this->close_pipe();
+                m_method = COPY_METHOD_READ_WRITE;
+                continue;
+            }
+            return r;
+        case COPY_METHOD_READ_WRITE:
+        case COPY_METHOD_AUTO:
+            break;
+        }
+        return this->copy_with_read_write(src_fd, dest_fd, offset, len, n_copied);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_with_clone() -
+//
+// Description:
+//
+//     Makes the range of the destination share the source's blocks.
+// FICLONERANGE won't go past the end of the source, so we stop there
+// ourselves.  Our ranges start on block boundaries, and only the last
+// one in the file may end between them, which the kernel allows.
+//
+int copy_engine::copy_with_clone(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+#if defined(HAVE_FICLONERANGE)
+    struct stat sbuf;
+    if (fstat(src_fd, &sbuf) != 0) {
+        return errno;
+    }
+    if (offset >= (uint64_t)sbuf.st_size) {
+        *n_copied = 0;
+        return 0;
+    }
+    if (len > sbuf.st_size - offset) {
+        len = sbuf.st_size - offset;
+    }
+
+    struct file_clone_range range;
+    range.src_fd = src_fd;
+    range.src_offset = offset;
+    range.src_length = len;
+    range.dest_offset = offset;
+    if (ioctl(dest_fd, FICLONERANGE, &range) != 0) {
+        return errno;
+    }
+    m_stats.m_cloned_bytes += len;
+    *n_copied = len;
+    return 0;
+#else
+    (void) src_fd; (void) dest_fd; (void) offset; (void) len; (void) n_copied;
+    return ENOSYS;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_with_io_uring() -
+//
+// Description:
+//
+//     Splits the range into up to m_io_depth pieces and submits, for
+// each piece, a read linked to a write of the same part of the
+// buffer.  The kernel only starts a write once its read has returned
+// the whole piece, so a short read (the end of the file) cancels its
+// write; we write what was read ourselves and stop at that piece.
+//
+int copy_engine::copy_with_io_uring(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+    if (!m_ring_is_ready) {
+        int r = m_ring.init(2 * m_io_depth, m_buf, m_buf_size);
+        if (r != 0) {
+            // No io_uring here (or we may not use it): copy some other way.
+            return ENOSYS;
+        }
+        m_ring_is_ready = true;
+    }
+    if (src_fd != m_ring_src_fd || dest_fd != m_ring_dest_fd) {
+        int r = m_ring.set_files(src_fd, dest_fd);
+        if (r != 0) {
+            return r;
+        }
+        m_ring_src_fd = src_fd;
+        m_ring_dest_fd = dest_fd;
+    }
+
+    // Keep the pieces page aligned, for O_DIRECT.
+    const size_t align = 4096;
+    size_t piece_size = (len + m_io_depth - 1) / m_io_depth;
+    piece_size = (piece_size + align - 1) / align * align;
+    const unsigned int n_pieces = (len + piece_size - 1) / piece_size;
+
+    const uint64_t start = now_usecs();
+    for (unsigned int i = 0; i < n_pieces; ++i) {
+        const size_t piece_offset = i * piece_size;
+        const size_t piece_len = (len - piece_offset < piece_size) ? len - piece_offset : piece_size;
+        bool queued = m_ring.queue_read(2 * i, m_buf + piece_offset, piece_len, offset + piece_offset, true);
+        queued = queued && m_ring.queue_write(2 * i + 1, m_buf + piece_offset, piece_len, offset + piece_offset);
+        // The ring has room for two requests per piece.
+        check(queued);
+    }
+    int r = m_ring.submit_and_wait(2 * n_pieces);
+    if (r != 0) {
+        return r;
+    }
+    m_stats.m_n_waits++;
+    m_stats.m_in_flight += 2 * n_pieces;
+    if (2 * n_pieces > m_stats.m_max_in_flight) {
+        m_stats.m_max_in_flight = 2 * n_pieces;
+    }
+
+    int32_t read_results[MAX_IO_DEPTH];
+    int32_t write_results[MAX_IO_DEPTH];
+    for (unsigned int n_reaped = 0; n_reaped < 2 * n_pieces; ) {
+        uint64_t user_data;
+        int32_t result;
+        if (!m_ring.next_completion(&user_data, &result)) {
+            // We asked to wait for all of them, but be safe.
+            r = m_ring.submit_and_wait(1);
+            if (r != 0) {
+                return r;
+            }
+            continue;
+        }
+        if (user_data % 2 == 0) {
+            read_results[user_data / 2] = result;
+        } else {
+            write_results[user_data / 2] = result;
+        }
+        n_reaped++;
+    }
+
+    ssize_t total = 0;
+    for (unsigned int i = 0; i < n_pieces; ++i) {
+        const size_t piece_offset = i * piece_size;
+        const size_t piece_len = (len - piece_offset < piece_size) ? len - piece_offset : piece_size;
+        if (read_results[i] < 0) {
+            return -read_results[i];
+        }
+        const size_t n_read = read_results[i];
+        if (n_read < piece_len) {
+            // The end of the file.  The write was cancelled.
+            r = write_fully(dest_fd, m_buf + piece_offset, n_read, offset + piece_offset);
+            if (r != 0) {
+                return r;
+            }
+            total += n_read;
+            break;
+        }
+        if (write_results[i] < 0) {
+            return -write_results[i];
+        }
+        const size_t n_wrote = write_results[i];
+        if (n_wrote < n_read) {
+            r = write_fully(dest_fd, m_buf + piece_offset + n_wrote, n_read - n_wrote, offset + piece_offset + n_wrote);
+            if (r != 0) {
+                return r;
+            }
+        }
+        total += n_read;
+    }
+    m_stats.m_bytes += total;
+    m_stats.m_usecs += now_usecs() - start;
+    *n_copied = total;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copy_engine::copy_with_copy_file_range(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+#if defined(HAVE_COPY_FILE_RANGE)
+    loff_t in_offset = offset;
+    loff_t out_offset = offset;
+    ssize_t n = ::copy_file_range(src_fd, &in_offset, dest_fd, &out_offset, len, 0);
+    if (n < 0) {
+        return errno;
+    }
+    *n_copied = n;
+    return 0;
+#else
+    (void) src_fd; (void) dest_fd; (void) offset; (void) len; (void) n_copied;
+    return ENOSYS;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_with_splice() -
+//
+// Description:
+//
+//     Moves the range into our pipe and then out of it into the
+// destination.  If we fail part way, the pipe may still hold data, so
+// we close it and the next attempt starts with a fresh one.
+//
+int copy_engine::copy_with_splice(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+#if defined(HAVE_SPLICE)
+    if (m_pipe[0] < 0) {
+        int r = pipe2(m_pipe, O_CLOEXEC);
+        if (r != 0) {
+            // Running out of fds is no reason to fail the backup.
+            m_pipe[0] = m_pipe[1] = -1;
+            return ENOSYS;
+        }
+        // The default pipe only holds 64KB.  If we can't make it
+        // bigger, we just move the range in several pieces.
+        ignore(fcntl(m_pipe[1], F_SETPIPE_SZ, (int)m_buf_size));
+    }
+
+    loff_t in_offset = offset;
+    ssize_t n_in = splice(src_fd, &in_offset, m_pipe[1], NULL, len, SPLICE_F_MOVE);
+    if (n_in < 0) {
+        int r = errno;
+        this->close_pipe();
+        return r;
+    }
+
+    loff_t out_offset = offset;
+    ssize_t n_left = n_in;
+    while (n_left > 0) {
+        ssize_t n_out = splice(m_pipe[0], NULL, dest_fd, &out_offset, n_left, SPLICE_F_MOVE);
+        if (n_out < 0) {
+            int r = errno;
+            this->close_pipe();
+            return r;
+        }
+        n_left -= n_out;
+    }
+    *n_copied = n_in;
+    return 0;
+#else
+    (void) src_fd; (void) dest_fd; (void) offset; (void) len; (void) n_copied;
+    return ENOSYS;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copy_engine::copy_with_read_write(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() {
+    ssize_t n_read = call_real_pread(src_fd, m_buf, len, offset);
+    if (n_read < 0) {
+        return errno;
+    }
+
+    int r = write_fully(dest_fd, m_buf, n_read, offset);
+    if (r != 0) {
+        return r;
+    }
+    *n_copied = n_read;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copy_engine::close_pipe(void) throw() {
+    for (int i = 0; i < 2; ++i) {
+        if (m_pipe[i] >= 0) {
+            ignore(call_real_close(m_pipe[i]));
+            m_pipe[i] = -1;
+        }
+    }
+}
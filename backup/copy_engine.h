@@ -0,0 +1,157 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "io_ring.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// The ways that a copy_engine can move bytes from the source file to
+// the destination, fastest first.
+enum copy_method {
+    COPY_METHOD_CLONE,           // FICLONERANGE: the destination shares the source's blocks.  Only works within one filesystem that supports reflinks.
+    COPY_METHOD_IO_URING,        // io_uring: several reads and writes in flight at once.  Only used with an io depth above 1.
+    COPY_METHOD_COPY_FILE_RANGE, // copy_file_range(2): the kernel (or the filesystem) does the whole copy.
+    COPY_METHOD_SPLICE,          // splice(2) through a pipe: the data stays in the page cache.
+    COPY_METHOD_READ_WRITE,      // pread(2) into a user-space buffer, then pwrite(2).
+    COPY_METHOD_AUTO             // Only for force_method(): use the fastest method that works.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_engine_stats:
+//
+// Description:
+//
+//     What the clone and io_uring methods achieved, so that the copier
+// can report them at the end of the backup.
+//
+struct copy_engine_stats {
+    copy_engine_stats() : m_cloned_bytes(0), m_bytes(0), m_usecs(0), m_n_waits(0), m_in_flight(0), m_max_in_flight(0) {};
+    uint64_t m_cloned_bytes;   // bytes that share the source's blocks instead of being copied.
+    uint64_t m_bytes;          // bytes copied with io_uring.
+    uint64_t m_usecs;          // time spent copying them.
+    uint64_t m_n_waits;        // how many times we waited for a batch of requests.
+    uint64_t m_in_flight;      // the sum of the requests in flight at each wait.
+    uint64_t m_max_in_flight;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_engine:
+//
+// Description:
+//
+//     Copies ranges of a source file to the same offsets in the
+// destination file.  The engine starts with the fastest method and
+// falls back to a slower one whenever the kernel or filesystem says it
+// cannot do the copy that way (for example copy_file_range between two
+// filesystems on an old kernel, or splice on an O_DIRECT file).  The
+// read/write method always works, so it is the last resort.
+//
+//     Every engine first tries to clone the range, which only works
+// when the source and the backup are on the same XFS or btrfs (or
+// other reflink-capable) filesystem.  Then no data moves at all.
+// Anywhere else the first clone fails with EXDEV or EOPNOTSUPP and we
+// go on to copy.
+//
+//     With an io depth above 1, the engine first tries io_uring.  It
+// splits each range into as many pieces as the depth, and submits a
+// read of every piece linked to the write of that piece, so up to
+// depth reads and depth writes are in flight at once.  The buffer and
+// both files are registered with the ring.
+//
+//     A failed attempt makes no progress, so the caller's range lock
+// stays valid and the next method simply redoes the same range.
+// Each worker uses its own engine, since the splice pipe can't be
+// shared.
+//
+class copy_engine {
+  public:
+    copy_engine(char *buf, size_t buf_size, unsigned int io_depth) throw();
+    // Effect: Use buf (which must be suitably aligned for O_DIRECT)
+    //  when we have to copy through user space, or through io_uring
+    //  with the given io depth.
+    ~copy_engine(void) throw();
+
+    int copy(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    // Effect: Copy up to len bytes at offset from src_fd to dest_fd,
+    //  setting *n_copied to the number of bytes copied (0 at the end
+    //  of the source file).  Returns 0 or an error number.
+
+    const copy_engine_stats &stats(void) const throw();
+
+    char *buffer(void) const throw();
+    // Effect: Return the buffer the engine copies through, for callers
+    //  that need to look at the data themselves.
+
+    const char *method_name(void) const throw();
+    // Effect: Return the name of the method we are using now (for
+    //  error messages).
+
+    static void force_method(copy_method method) throw();
+    // Effect: Make every new engine start with the given method, or go
+    //  back to the normal behavior with COPY_METHOD_AUTO.  This is
+    //  for tests that need to see (or inject errors into) the copier's
+    //  writes.  It is thread-safe.
+
+  private:
+    int copy_with_clone(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    int copy_with_io_uring(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    int copy_with_copy_file_range(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    int copy_with_splice(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    int copy_with_read_write(int src_fd, int dest_fd, uint64_t offset, size_t len, ssize_t *n_copied) throw() __attribute__((warn_unused_result));
+    void close_pipe(void) throw();
+
+    copy_method m_method;
+    char *m_buf;
+    const size_t m_buf_size;
+    int m_pipe[2];
+
+    // The io_uring method.
+    const unsigned int m_io_depth;
+    io_ring m_ring;
+    bool m_ring_is_ready;
+    int m_ring_src_fd;
+    int m_ring_dest_fd;
+    copy_engine_stats m_stats;
+};
+
+#endif // End of header guardian.
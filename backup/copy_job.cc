@@ -0,0 +1,190 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "check.h"
+#include "copy_job.h"
+#include "mutex.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_job::copy_job(const source_info &info, uint64_t chunk_size) throw()
+    : m_info(info),
+      m_fd(-1),
+      m_chunk_size(chunk_size),
+      m_n_chunks((info.m_size + chunk_size - 1) / chunk_size),
+      m_next_chunk(0),
+      m_n_done(0),
+      m_error(0),
+      m_reference_count(1)
+{
+    {
+        int r = pthread_mutex_init(&m_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_cond, NULL);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_job::~copy_job(void) throw() {
+    if (m_fd >= 0) {
+        // This is our private duplicate, so there is nobody to tell.
+        ignore(call_real_close(m_fd));
+    }
+    {
+        int r = pthread_mutex_destroy(&m_mutex);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_destroy(&m_cond);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copy_job::init(int fd) throw() {
+    m_fd = dup(fd);
+    if (m_fd < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+const source_info &copy_job::info(void) const throw() {
+    return m_info;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// open_source() -
+//
+// Description:
+//
+//     Each worker gets its own fd so that it can reopen the file
+// (when the Direct I/O flags change) without disturbing the others.
+// We duplicate our private fd rather than opening the path, since the
+// file may have been renamed since the copy started.
+//
+int copy_job::open_source(void) const throw() {
+    return dup(m_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool copy_job::claim_chunk(uint64_t *lo, uint64_t *hi) throw() {
+    if (m_error != 0) {
+        return false;
+    }
+    uint64_t k = m_next_chunk++;
+    if (k >= m_n_chunks) {
+        return false;
+    }
+    *lo = k * m_chunk_size;
+    *hi = (k + 1 == m_n_chunks) ? UINT64_MAX : *lo + m_chunk_size;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t copy_job::stop_claims(void) throw() {
+    uint64_t n_claimed = m_next_chunk.exchange(m_n_chunks);
+    return n_claimed < m_n_chunks ? n_claimed : m_n_chunks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copy_job::chunk_done(int error) throw() {
+    if (error != 0) {
+        int expected = 0;
+        m_error.compare_exchange_strong(expected, error);
+    }
+    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
+    m_n_done++;
+    int r = pthread_cond_broadcast(&m_cond);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool copy_job::wait_for_chunks(uint64_t n_claimed, long timeout_ms) throw() {
+    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
+    if (m_n_done < n_claimed) {
+        struct timespec ts;
+        int r = clock_gettime(CLOCK_REALTIME, &ts);
+        check(r==0);
+        ts.tv_sec  += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000 * 1000;
+        if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        r = pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+        check(r==0 || r==ETIMEDOUT);
+    }
+    return m_n_done >= n_claimed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copy_job::get_error(void) const throw() {
+    return m_error;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copy_job::add_reference(void) throw() {
+    m_reference_count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void copy_job::remove_reference(void) throw() {
+    if (--m_reference_count == 0) {
+        delete this;
+    }
+}
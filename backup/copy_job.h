@@ -0,0 +1,111 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef COPY_JOB_H
+#define COPY_JOB_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "copier.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_job:
+//
+// Description:
+//
+//     Tracks the copy of one large file that has been split into
+// chunks so that several copy workers can copy it at once.  Chunk k
+// covers [k*chunk_size, (k+1)*chunk_size), except for the last chunk,
+// which runs to the end of the file (so that it also picks up anything
+// appended while we copy).  Workers claim chunks one at a time, and the
+// worker that split the file waits until every claimed chunk is done
+// before it releases the destination file.
+//
+//     The job is reference counted, since a worker that was asked to
+// help may only get to it after the file is finished.
+//
+class copy_job {
+  public:
+    copy_job(const source_info &info, uint64_t chunk_size) throw();
+    int init(int fd) throw() __attribute__((warn_unused_result));
+    // Effect: Keep a private duplicate of the given source fd for the
+    //  helpers to duplicate.  Returns 0 or an error number.
+
+    const source_info &info(void) const throw();
+    int open_source(void) const throw() __attribute__((warn_unused_result));
+    // Effect: Return a new fd for the source file, or -1 with errno set.
+
+    bool claim_chunk(uint64_t *lo, uint64_t *hi) throw() __attribute__((warn_unused_result));
+    // Effect: Claim the next chunk, returning true and setting [*lo,*hi).
+    //  *hi is UINT64_MAX for the last chunk.  Returns false if there are
+    //  no chunks left to claim, or if the job has failed.
+
+    uint64_t stop_claims(void) throw();
+    // Effect: Don't hand out any more chunks.  Returns how many chunks
+    //  were claimed.
+
+    void chunk_done(int error) throw();
+    // Effect: Record that a claimed chunk is finished.  A nonzero error
+    //  fails the job.
+
+    bool wait_for_chunks(uint64_t n_claimed, long timeout_ms) throw() __attribute__((warn_unused_result));
+    // Effect: Wait (at most timeout_ms) until n_claimed chunks are done.
+    //  Returns true if they are.
+
+    int get_error(void) const throw();
+
+    void add_reference(void) throw();
+    void remove_reference(void) throw(); // deletes the job when the last reference goes away.
+
+  private:
+    ~copy_job(void) throw();
+    source_info m_info;
+    int m_fd;
+    const uint64_t m_chunk_size;
+    const uint64_t m_n_chunks;
+    std::atomic<uint64_t> m_next_chunk;
+    std::atomic<uint64_t> m_n_done;
+    std::atomic<int> m_error;
+    std::atomic<int> m_reference_count;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
+
+#endif // End of header guardian.
@@ -52,8 +52,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 ///////////////////////////////////////////////////////////////////////////////
 //
 description::description() throw()
-: m_offset(0),
-  m_source_file(NULL)
+: m_source_file(NULL)
 {
     int r = pthread_mutex_init(&m_mutex, NULL);
     check(r==0);
@@ -92,21 +91,3 @@ void description::lock(const backtrace bt) throw() {
 void description::unlock(const backtrace bt) throw() {
     pmutex_unlock(&m_mutex, BACKTRACE(&bt));
 }
-
-///////////////////////////////////////////////////////////////////////////////
-//
-void description::increment_offset(ssize_t nbyte) throw() {
-    m_offset += nbyte;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-//
-off_t description::get_offset(void) throw() {    
-    return m_offset;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-//
-void description::lseek(off_t new_offset) throw() {
-    m_offset = new_offset;
-}
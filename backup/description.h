@@ -48,9 +48,8 @@ class source_file;
 
 class description {
 private:
-    off_t m_offset;            // The offset that is moved by read(), write() and lseek().
     source_file *m_source_file;
-    pthread_mutex_t m_mutex;   // A mutex used to make m_offset move atomically when we perform a write (or read).
+    pthread_mutex_t m_mutex;   // Serializes write()s, so that the offset each one reads from the system is where it writes.
 
 public:
     description() throw();
@@ -62,10 +61,6 @@ public:
     source_file * get_source_file(void) const throw();
     void lock(const backtrace bt) throw();
     void unlock(const backtrace bt) throw();
-
-    void lseek(off_t new_offset) throw();        
-    void increment_offset(ssize_t nbyte) throw();
-    off_t get_offset(void) throw(); // return the current offset.
 };
 
 #endif // end of header guardian.
@@ -39,6 +39,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "destination_file.h"
 #include "glassbox.h"
@@ -48,7 +49,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 ///////////////////////////////////////////////////////////////////////////////
 //
 destination_file::destination_file(const int opened_fd, const char * full_path) throw()
-        : m_fd(opened_fd), m_path(strdup(full_path))
+        : m_fd(opened_fd), m_path(strdup(full_path)), m_journal_id(0)
 {};
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -114,6 +115,76 @@ int destination_file::truncate(off_t length) const throw() {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description:
+//
+//     Applies the application's fallocate() to the backup copy, so
+// that a punched hole stays a hole instead of becoming zeros.  If the
+// backup's file system can't punch holes or zero ranges, we write
+// zeros instead; if it can't preallocate, we only extend the file
+// when the application's call would have.
+//
+int destination_file::fallocate(int mode, off_t offset, off_t len) const throw() {
+    int r = call_real_fallocate(m_fd, mode, offset, len);
+    if (r == 0) {
+        return r;
+    }
+
+    r = errno;
+    if (r != EOPNOTSUPP) {
+        the_manager.backup_error(r, "Fallocate of backup file %s failed at %s:%d", m_path, __FILE__, __LINE__);
+        return r;
+    }
+
+    off_t end = offset + len;
+    struct stat sbuf;
+    if (fstat(m_fd, &sbuf) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not stat backup file %s at %s:%d", m_path, __FILE__, __LINE__);
+        return r;
+    }
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        if ((mode & FALLOC_FL_KEEP_SIZE) && end > sbuf.st_size) {
+            end = sbuf.st_size;
+        }
+
+        static const size_t ZERO_SIZE = 64 << 10;
+        char *zeros = (char *) calloc(1, ZERO_SIZE);
+        if (zeros == NULL) {
+            r = errno;
+            the_manager.backup_error(r, "Could not allocate zeros for backup file %s", m_path);
+            return r;
+        }
+
+        r = 0;
+        while (r == 0 && offset < end) {
+            size_t n = (end - offset < (off_t) ZERO_SIZE) ? end - offset : ZERO_SIZE;
+            r = this->pwrite(zeros, n, offset);
+            offset += n;
+        }
+
+        free(zeros);
+        return r;
+    }
+
+    if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) {
+        the_manager.backup_error(r, "Could not collapse or insert a range of backup file %s", m_path);
+        return r;
+    }
+
+    // Plain preallocation only matters for the file's size.
+    r = 0;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > sbuf.st_size) {
+        r = this->truncate(end);
+    }
+
+    return r;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 int destination_file::unlink(void) const throw() {
@@ -164,3 +235,15 @@ int destination_file::get_fd(void) const throw() {
 const char * destination_file::get_path(void) const throw() {
     return m_path;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t destination_file::get_journal_id(void) const throw() {
+    return m_journal_id;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void destination_file::set_journal_id(uint64_t id) throw() {
+    m_journal_id = id;
+}
@@ -37,6 +37,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ifndef DESTINATION_FILE_H
 #define DESTINATION_FILE_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 class destination_file {
@@ -46,13 +47,17 @@ public:
     int close(void) const throw();
     int pwrite(const void *buf, size_t nbyte, off_t offset) const throw();
     int truncate(off_t length) const throw();
+    int fallocate(int mode, off_t offset, off_t len) const throw();
     int unlink(void) const throw();
     int rename(const char *new_path) throw();
     int get_fd(void) const throw();
     const char * get_path(void) const throw();
+    uint64_t get_journal_id(void) const throw();
+    void set_journal_id(uint64_t id) throw();
 private:
     const int m_fd;
     const char * m_path;
+    uint64_t m_journal_id; // how the capture journal names this file, or 0 if it hasn't yet.
 };
 
 #endif // End of header guardian.
@@ -0,0 +1,335 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "check.h"
+#include "device_scheduler.h"
+#include "manager.h"
+#include "mutex.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static uint64_t now_usecs(void) throw() {
+    struct timespec ts;
+    ignore(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+device_queue::device_queue(dev_t device) throw()
+    : m_device(device),
+      m_concurrency(0),
+      m_io_depth(1),
+      m_tuning("default"),
+      m_n_active(0),
+      m_busy_since(0),
+      m_busy_usecs(0),
+      m_n_copies(0),
+      m_n_waits(0),
+      m_wait_usecs(0),
+      m_bytes(0),
+      m_n_ios(0),
+      m_io_usecs(0),
+      m_max_io_usecs(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+device_scheduler::device_scheduler(void) throw() {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+    r = pthread_cond_init(&m_cond, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+device_scheduler::~device_scheduler(void) throw() {
+    for (size_t i = 0; i < m_devices.size(); ++i) {
+        delete m_devices[i];
+    }
+    int r = pthread_cond_destroy(&m_cond);
+    check(r==0);
+    r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// is_rotational() -
+//
+// Description:
+//
+//     Returns 1 if the kernel says the block device is a spinning
+// disk, 0 if it says it isn't, and -1 if we can't tell (e.g. for
+// tmpfs or NFS, which have no block device).  A partition has no
+// queue of its own, so we look at the disk it is part of.
+//
+static int is_rotational(dev_t device) throw() {
+    const char *formats[] = {"/sys/dev/block/%u:%u/queue/rotational",
+                             "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        char path[100];
+        snprintf(path, sizeof(path), formats[i], major(device), minor(device));
+        // This isn't a file of the backup, so there's no need for
+        // call_real_open(), nor for the tests to see us open it.
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        int rotational = -1;
+        if (fscanf(f, "%d", &rotational) != 1) {
+            rotational = -1;
+        }
+        ignore(fclose(f));
+        if (rotational == 0 || rotational == 1) {
+            return rotational;
+        }
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// tune() -
+//
+// Description:
+//
+//     Sets the limits of a device we haven't seen before in this
+// backup, from what the user set for it, or else from what kind of
+// device it is.
+//
+void device_scheduler::tune(device_queue *queue) throw() {
+    unsigned int concurrency = 0;
+    unsigned int io_depth = 0;
+    bool configured = the_manager.get_device_limits(queue->m_device, &concurrency, &io_depth);
+    if (configured && concurrency != 0 && io_depth != 0) {
+        queue->m_tuning = "configured";
+    } else {
+        // Seeks between files cost a spinning disk far more than the
+        // extra workers gain, so it gets one file at a time.
+        const int rotational = is_rotational(queue->m_device);
+        if (concurrency == 0 && rotational == 1) {
+            concurrency = 1;
+        }
+        queue->m_tuning = (rotational == 1) ? "rotational" : (rotational == 0) ? "non-rotational" : "default";
+    }
+    queue->m_concurrency = concurrency;
+    queue->m_io_depth = (io_depth != 0) ? io_depth : the_manager.get_io_depth();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// get_queue() -
+//
+// Description:
+//
+//     Returns the queue of the given device, making it if need be.
+// Call this with m_mutex held.
+//
+device_queue *device_scheduler::get_queue(dev_t device) throw() {
+    for (size_t i = 0; i < m_devices.size(); ++i) {
+        if (m_devices[i]->m_device == device) {
+            return m_devices[i];
+        }
+    }
+    device_queue *queue = new device_queue(device);
+    tune(queue);
+    m_devices.push_back(queue);
+    return queue;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool device_scheduler::has_room(const device_queue *queue) throw() {
+    return queue == NULL || queue->m_concurrency == 0 || queue->m_n_active < queue->m_concurrency;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void device_scheduler::start_on(device_queue *queue, uint64_t now) throw() {
+    if (queue->m_n_active++ == 0) {
+        queue->m_busy_since = now;
+    }
+    queue->m_n_copies++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void device_scheduler::finish_on(device_queue *queue, uint64_t now) throw() {
+    check(queue->m_n_active > 0);
+    if (--queue->m_n_active == 0) {
+        queue->m_busy_usecs += now - queue->m_busy_since;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// start_copy() -
+//
+// Description:
+//
+//     Waits for room on the queues of the source and destination
+// devices, taking both at once so that a copy never holds one while it
+// waits for the other.  We only wait for up to timeout_ms, so that the
+// caller can keep polling, and notice if the backup is stopped.
+//
+bool device_scheduler::start_copy(dev_t source, dev_t dest, long timeout_ms, device_grant *grant) throw() {
+    const uint64_t start = now_usecs();
+    with_mutex_locked ml(&m_mutex);
+    device_queue *source_queue = this->get_queue(source);
+    device_queue *dest_queue = (dest == source) ? NULL : this->get_queue(dest);
+    if (!has_room(source_queue) || !has_room(dest_queue)) {
+        if (!grant->m_waited) {
+            // Count each copy once, however many times it calls us.
+            grant->m_waited = true;
+            source_queue->m_n_waits++;
+        }
+        do {
+            const uint64_t elapsed = now_usecs() - start;
+            if (elapsed >= (uint64_t)timeout_ms * 1000) {
+                source_queue->m_wait_usecs += elapsed;
+                return false;
+            }
+            struct timespec ts;
+            int r = clock_gettime(CLOCK_REALTIME, &ts);
+            check(r==0);
+            const uint64_t left = (uint64_t)timeout_ms * 1000 - elapsed;
+            ts.tv_sec  += left / 1000000;
+            ts.tv_nsec += (left % 1000000) * 1000;
+            if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            r = pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+            check(r==0 || r==ETIMEDOUT);
+        } while (!has_room(source_queue) || !has_room(dest_queue));
+    }
+    const uint64_t now = now_usecs();
+    if (grant->m_waited) {
+        source_queue->m_wait_usecs += now - start;
+    }
+    this->start_on(source_queue, now);
+    grant->m_source = source_queue;
+    grant->m_concurrency = source_queue->m_concurrency;
+    grant->m_io_depth = source_queue->m_io_depth;
+    grant->m_dest = dest_queue;
+    if (dest_queue != NULL) {
+        this->start_on(dest_queue, now);
+        if (dest_queue->m_concurrency != 0 &&
+            (grant->m_concurrency == 0 || dest_queue->m_concurrency < grant->m_concurrency)) {
+            grant->m_concurrency = dest_queue->m_concurrency;
+        }
+        if (dest_queue->m_io_depth < grant->m_io_depth) {
+            grant->m_io_depth = dest_queue->m_io_depth;
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void device_scheduler::finish_copy(const device_grant &grant) throw() {
+    const uint64_t now = now_usecs();
+    with_mutex_locked ml(&m_mutex);
+    this->finish_on(grant.m_source, now);
+    if (grant.m_dest != NULL) {
+        this->finish_on(grant.m_dest, now);
+    }
+    int r = pthread_cond_broadcast(&m_cond);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// note_io() -
+//
+// Description:
+//
+//     Counts the bytes against the source device, which is the one
+// whose throughput the user wants to know about.  The latency is that
+// of reading them and writing them, so it counts for both devices.
+//
+void device_scheduler::note_io(const device_grant &grant, uint64_t n_bytes, uint64_t usecs) throw() {
+    device_queue *queues[2] = {grant.m_source, grant.m_dest};
+    grant.m_source->m_bytes += n_bytes;
+    for (int i = 0; i < 2; ++i) {
+        device_queue *queue = queues[i];
+        if (queue == NULL) {
+            continue;
+        }
+        queue->m_n_ios++;
+        queue->m_io_usecs += usecs;
+        uint64_t max = queue->m_max_io_usecs;
+        while (usecs > max && !queue->m_max_io_usecs.compare_exchange_weak(max, usecs)) {
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void device_scheduler::get_stats(std::vector<tokubackup_device_stats> *stats) throw() {
+    const uint64_t now = now_usecs();
+    with_mutex_locked ml(&m_mutex);
+    stats->clear();
+    for (size_t i = 0; i < m_devices.size(); ++i) {
+        const device_queue *queue = m_devices[i];
+        tokubackup_device_stats device;
+        device.device = queue->m_device;
+        device.tuning = queue->m_tuning;
+        device.concurrency = queue->m_concurrency;
+        device.io_depth = queue->m_io_depth;
+        device.files_copied = queue->m_n_copies;
+        device.bytes_read = queue->m_bytes.load();
+        device.busy_usecs = queue->m_busy_usecs;
+        if (queue->m_n_active > 0) {
+            device.busy_usecs += now - queue->m_busy_since;
+        }
+        device.waits = queue->m_n_waits;
+        device.wait_usecs = queue->m_wait_usecs;
+        device.ios = queue->m_n_ios.load();
+        device.io_usecs = queue->m_io_usecs.load();
+        device.max_io_usecs = queue->m_max_io_usecs.load();
+        stats->push_back(device);
+    }
+}
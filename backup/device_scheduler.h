@@ -0,0 +1,140 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef DEVICE_SCHEDULER_H
+#define DEVICE_SCHEDULER_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+
+// The limits the user set for the copies on one device.  Zero means
+// that we pick the limit ourselves.
+struct device_limits {
+    dev_t m_device;
+    unsigned int m_concurrency;
+    unsigned int m_io_depth;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// device_queue:
+//
+// Description:
+//
+//     The copies of one device: how many may run at once, how many
+// reads (and writes) each may keep in flight, and what they achieved.
+//
+struct device_queue {
+    device_queue(dev_t device) throw();
+    const dev_t m_device;
+    unsigned int m_concurrency;           // files that may be copied at once, or 0 for no limit.
+    unsigned int m_io_depth;              // reads (and writes) in flight per copy.
+    const char *m_tuning;                 // where the limits came from, for the stats.
+
+    // These are protected by the scheduler's mutex.
+    unsigned int m_n_active;              // files being copied now.
+    uint64_t m_busy_since;                // when m_n_active last became nonzero, in usecs.
+    uint64_t m_busy_usecs;                // how long m_n_active has been nonzero, before that.
+    uint64_t m_n_copies;
+    uint64_t m_n_waits;                   // copies that had to wait for room.
+    uint64_t m_wait_usecs;
+
+    // The copies add to these as they go.
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_n_ios;        // reads and writes of one copy buffer.
+    std::atomic<uint64_t> m_io_usecs;
+    std::atomic<uint64_t> m_max_io_usecs;
+};
+
+// What a copy was allowed to do, on the devices it reads and writes.
+struct device_grant {
+    device_grant() : m_source(NULL), m_dest(NULL), m_concurrency(0), m_io_depth(1), m_waited(false) {};
+    device_queue *m_source;
+    device_queue *m_dest;                 // NULL if the destination is on the source's device.
+    unsigned int m_concurrency;           // the smaller limit of the two devices, or 0 for none.
+    unsigned int m_io_depth;              // the smaller depth of the two devices.
+    bool m_waited;                        // the copy has had to wait for room.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// device_scheduler:
+//
+// Description:
+//
+//     Decides when each file of a backup may be copied, and with what
+// queue depth, according to the devices of its source and
+// destination, so that several copy workers don't thrash a spinning
+// disk with seeks, but do keep a fast one busy.  One scheduler is
+// shared by all the copiers of a backup session.
+//
+//     A device's limits are the ones set with
+// tokubackup_set_device_limits(), or else we pick them: one file at a
+// time on a rotational disk, and as many as there are workers on
+// anything else, with the queue depth set with
+// tokubackup_set_io_depth().  A copy holds a place on the queue of its
+// source device and, if it differs, that of its destination device.
+//
+class device_scheduler {
+  private:
+    pthread_mutex_t m_mutex;              // protects m_devices and what the queues count.
+    pthread_cond_t m_cond;                // signaled when a copy finishes.
+    std::vector<device_queue *> m_devices;
+    device_queue *get_queue(dev_t device) throw();
+    static void tune(device_queue *queue) throw();
+    static bool has_room(const device_queue *queue) throw();
+    void start_on(device_queue *queue, uint64_t now) throw();
+    void finish_on(device_queue *queue, uint64_t now) throw();
+  public:
+    device_scheduler(void) throw();
+    ~device_scheduler(void) throw();
+    bool start_copy(dev_t source, dev_t dest, long timeout_ms, device_grant *grant) throw() __attribute__((warn_unused_result));
+    // Effect: Wait up to timeout_ms for room on both devices' queues.  If there is, take it, fill in *grant and return true.
+    void finish_copy(const device_grant &grant) throw();
+    // Effect: Give back the room that start_copy() took, and wake up the copies waiting for it.
+    static void note_io(const device_grant &grant, uint64_t n_bytes, uint64_t usecs) throw();
+    // Effect: Record that one read and write of n_bytes, under the grant, took usecs.
+    void get_stats(std::vector<tokubackup_device_stats> *stats) throw();
+    // Effect: Fill in *stats with what each device did.
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,158 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "dirty_set.h"
+#include "file_hash_table.h"
+#include "mutex.h"
+#include "source_file.h"
+
+#include <sched.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+dirty_set::dirty_set(file_hash_table *table) throw()
+    : m_table(table), m_final(false), m_n_marking(0), m_marked_bytes(0) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+dirty_set::~dirty_set(void) throw() {
+    check(m_files.empty());
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// mark() -
+//
+// Description:
+//
+//     A writer announces itself in m_n_marking before it looks at
+// m_final, and finish_marking() sets m_final before it waits for
+// m_n_marking to drain, so once finish_marking() returns nobody is
+// still marking a block (or listing a file) that the final pass might
+// have looked at already.
+//
+bool dirty_set::mark(source_file *file, uint64_t lo, uint64_t hi) throw() {
+    m_n_marking++;
+    if (m_final) {
+        m_n_marking--;
+        return false;
+    }
+    if (file->mark_dirty(lo, hi)) {
+        // The caller's reference keeps the file in the table, so taking
+        // another doesn't need the table's lock.
+        file->add_reference();
+        with_mutex_locked ml(&m_mutex);
+        m_files.push_back(file);
+    }
+    m_marked_bytes += hi - lo;
+    m_n_marking--;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void dirty_set::finish_marking(void) throw() {
+    m_final = true;
+    while (m_n_marking.load() != 0) {
+        sched_yield();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void dirty_set::get_files(std::vector<source_file *> *files) throw() {
+    with_mutex_locked ml(&m_mutex);
+    *files = m_files;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t dirty_set::dirty_bytes(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    uint64_t n_bytes = 0;
+    for (size_t i = 0; i < m_files.size(); ++i) {
+        n_bytes += m_files[i]->dirty_bytes();
+    }
+    return n_bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// release_files() -
+//
+// Description:
+//
+//     Drops our references.  A file that the application has closed
+// goes out of the table now, closing its backup copy.
+//
+void dirty_set::release_files(void) throw() {
+    check(m_final);
+    std::vector<source_file *> files;
+    {
+        with_mutex_locked ml(&m_mutex);
+        files.swap(m_files);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i]->forget_dirty();
+        m_table->try_to_remove_locked(files[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void dirty_set::note_pass(uint64_t n_copied, bool final) throw() {
+    m_stats.m_n_passes++;
+    m_stats.m_copied_bytes += n_copied;
+    if (final) {
+        m_stats.m_final_bytes += n_copied;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void dirty_set::get_stats(dirty_set_stats *stats) throw() {
+    *stats = m_stats;
+    stats->m_marked_bytes = m_marked_bytes.load();
+}
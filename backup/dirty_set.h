@@ -0,0 +1,101 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef DIRTY_SET_H
+#define DIRTY_SET_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+class file_hash_table;
+class source_file;
+
+const int DIRTY_MAX_PASSES = 8;                        // copy passes over the dirty blocks before the final one, at most.
+const uint64_t DIRTY_FINAL_BYTES = 4 * 1024 * 1024;    // few enough dirty bytes to copy with capture mirroring again.
+
+// What dirty block tracking has done for one backup.
+struct dirty_set_stats {
+    uint64_t m_marked_bytes;  // the bytes of the captured writes that were marked dirty.
+    uint64_t m_n_passes;      // passes over the dirty blocks, including the final one.
+    uint64_t m_copied_bytes;  // the dirty bytes those passes copied.
+    uint64_t m_final_bytes;   // of those, the ones the final pass copied.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// dirty_set:
+//
+// Description:
+//
+//     The files of a backup whose captured writes are only marked in
+// their dirty blocks (see source_file::mark_dirty()), so that the
+// application doesn't write to the backup copy at all.  Once the
+// copier is done, it copies the dirty blocks again, pass after pass,
+// until few enough are left.  Then finish_marking() makes captured
+// writes go into the backup copies again, and a final pass copies what
+// is left.
+//
+//     A listed file keeps a reference, so that it stays in the file
+// hash table (where renames and unlinks find it) and keeps its backup
+// copy open after the application closes it, until release_files().
+//
+class dirty_set {
+  private:
+    file_hash_table * const m_table;
+    pthread_mutex_t m_mutex;               // protects m_files.
+    std::vector<source_file *> m_files;
+    std::atomic<bool> m_final;             // captured writes aren't marked any more.
+    std::atomic<uint64_t> m_n_marking;     // writers between checking m_final and finishing their marks.
+    std::atomic<uint64_t> m_marked_bytes;
+    dirty_set_stats m_stats;               // the rest of them, kept by the copier's thread.
+  public:
+    dirty_set(file_hash_table *table) throw();
+    ~dirty_set(void) throw();
+    bool mark(source_file *file, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    // Effect: Mark [lo,hi) of the file dirty, listing the file if it is new.  The caller holds the range lock and a reference to the file.
+    //  Returns false (having done nothing) once marking has finished, in which case the write must be captured the usual way.
+    void finish_marking(void) throw(); // Stop marking, and wait for anyone still marking.
+    void get_files(std::vector<source_file *> *files) throw();
+    uint64_t dirty_bytes(void) throw();
+    void release_files(void) throw(); // Forget the dirty blocks and drop the references.  Marking must have finished.
+    void note_pass(uint64_t n_copied, bool final) throw();
+    void get_stats(dirty_set_stats *stats) throw();
+};
+
+#endif // End of header guardian.
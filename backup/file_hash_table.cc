@@ -34,226 +34,427 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <string.h>
 #include <pthread.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "source_file.h"
+#include "completed_files.h"
 #include "file_hash_table.h"
 #include "manager.h"
+#include "check.h"
 #include "mutex.h"
+#include "raii-malloc.h"
+#include "real_syscalls.h"
 #include "MurmurHash3.h"
 
 ////////////////////////////////////////////////////////
 //
-pthread_mutex_t file_hash_table::m_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-////////////////////////////////////////////////////////
-//
-file_hash_table::file_hash_table() throw() : m_count(0),
-                                             m_array(new source_file*[1]),
-                                             m_size(1)
-{
-    m_array[0] = NULL;
+file_hash_table::file_hash_table() throw() {
+    for (int i = 0; i < FILE_HASH_TABLE_SHARDS; ++i) {
+        file_hash_table_shard *shard = &m_shards[i];
+        int r = pthread_mutex_init(&shard->m_mutex, NULL);
+        check(r==0);
+        shard->m_array = new source_file*[1];
+        shard->m_array[0] = NULL;
+        shard->m_size = 1;
+        shard->m_old_array = NULL;
+        shard->m_old_size = 0;
+        shard->m_n_moved = 0;
+        shard->m_count = 0;
+    }
 }
 
 ////////////////////////////////////////////////////////
 //
 file_hash_table::~file_hash_table() throw() {
-    for (size_t i=0; i < m_size; i++) {
-        while (source_file *head = m_array[i]) {
-            m_array[i] = head->next();
-            delete head;
+    for (int i = 0; i < FILE_HASH_TABLE_SHARDS; ++i) {
+        file_hash_table_shard *shard = &m_shards[i];
+        this->move_some_buckets(shard, shard->m_old_size);
+        for (size_t j = 0; j < shard->m_size; j++) {
+            while (source_file *head = shard->m_array[j]) {
+                shard->m_array[j] = head->next();
+                delete head;
+            }
         }
+        delete[] shard->m_array;
+        int r = pthread_mutex_destroy(&shard->m_mutex);
+        check(r==0);
     }
-    delete[] m_array;
 }
 
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::get_or_create_locked(const char * const file_name, source_file **file, const int flags) throw() {
-    this->lock();
-    source_file * source = this->get_or_create(file_name);
+    source_file * source = NULL;
+    this->get_or_create_locked(file_name, &source);
     source->set_flags(flags);
-    this->unlock();
     *file = source;
 }
 
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::get_or_create_locked(const char * const file_name, source_file **file) throw() {
-    this->lock();
-    source_file * source = this->get_or_create(file_name);
-    this->unlock();
-    *file = source;
-}
-
-////////////////////////////////////////////////////////
-//
-source_file * file_hash_table::get_or_create(const char * const file_name) {
-    source_file * source = this->get(file_name);
+    const uint64_t h = hash(file_name);
+    file_hash_table_shard *shard = this->shard_of(h);
+    with_mutex_locked ml(&shard->m_mutex, BACKTRACE(NULL));
+    source_file * source = this->find(shard, h, file_name);
     if (source == NULL) {
         source = new source_file(file_name);
-        this->put(source);
+        this->insert(shard, h, source);
     }
 
     source->add_reference();
-    return source;
+    *file = source;
 }
 
 ////////////////////////////////////////////////////////
 //
-source_file* file_hash_table::get(const char * const full_file_path) const throw()
+source_file* file_hash_table::get(const char * const full_file_path) throw()
 {
-    int hash_index = this->hash(full_file_path);
-    source_file *file_found = m_array[hash_index];
-    while (file_found != NULL) {
-        int result = strcmp(full_file_path, file_found->name());
-        if (result == 0) {
-            break;
-        }
+    const uint64_t h = hash(full_file_path);
+    file_hash_table_shard *shard = this->shard_of(h);
+    with_mutex_locked ml(&shard->m_mutex, BACKTRACE(NULL));
+    return this->find(shard, h, full_file_path);
+}
 
-        file_found = file_found->next();
-    }
+////////////////////////////////////////////////////////
+//
+void file_hash_table::put(source_file * const file) throw() {
+    const uint64_t h = hash(file->name());
+    file_hash_table_shard *shard = this->shard_of(h);
+    with_mutex_locked ml(&shard->m_mutex, BACKTRACE(NULL));
+    this->insert(shard, h, file);
+}
 
-    return file_found;
+////////////////////////////////////////////////////////
+//
+void file_hash_table::remove(source_file * const file) throw() {
+    const uint64_t h = hash(file->name());
+    file_hash_table_shard *shard = this->shard_of(h);
+    with_mutex_locked ml(&shard->m_mutex, BACKTRACE(NULL));
+    this->erase(shard, h, file);
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::put(source_file * const file) throw() {
-    int hash_index = this->hash(file->name());
-    this->insert(file, hash_index);
+size_t file_hash_table::size(void) throw() {
+    size_t count = 0;
+    for (int i = 0; i < FILE_HASH_TABLE_SHARDS; ++i) {
+        with_mutex_locked ml(&m_shards[i].m_mutex, BACKTRACE(NULL));
+        count += m_shards[i].m_count;
+    }
+    return count;
 }
 
 ////////////////////////////////////////////////////////
 //
-int file_hash_table::hash(const char * const file) const  throw() {
-    assert(m_size);
+uint64_t file_hash_table::hash(const char * const file) throw() {
     int length = strlen(file);
     uint64_t the_hash[2];
     MurmurHash3_x64_128(file, length, 0, the_hash);
-    return (the_hash[0]+the_hash[1])%m_size;
+    return the_hash[0]+the_hash[1];
+}
+
+////////////////////////////////////////////////////////
+// The low bits of the hash pick the shard, and the rest pick the bucket.
+file_hash_table_shard *file_hash_table::shard_of(uint64_t h) throw() {
+    return &m_shards[h % FILE_HASH_TABLE_SHARDS];
+}
+
+static size_t bucket_of(uint64_t h, size_t size) throw() {
+    return (h / FILE_HASH_TABLE_SHARDS) % size;
+}
+
+////////////////////////////////////////////////////////
+//
+// find() -
+//
+// Description:
+//
+//     Looks a name up in a locked shard.  While the shard is growing,
+// a file whose old bucket hasn't been moved yet is still there.
+//
+source_file *file_hash_table::find(file_hash_table_shard *shard, uint64_t h, const char *name) throw() {
+    if (shard->m_old_array != NULL) {
+        const size_t old_index = bucket_of(h, shard->m_old_size);
+        if (old_index >= shard->m_n_moved) {
+            for (source_file *f = shard->m_old_array[old_index]; f != NULL; f = f->next()) {
+                if (strcmp(name, f->name()) == 0) {
+                    return f;
+                }
+            }
+        }
+    }
+    for (source_file *f = shard->m_array[bucket_of(h, shard->m_size)]; f != NULL; f = f->next()) {
+        if (strcmp(name, f->name()) == 0) {
+            return f;
+        }
+    }
+    return NULL;
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::insert(source_file * const file, int hash_index)  throw()
+void file_hash_table::insert(file_hash_table_shard *shard, uint64_t h, source_file * const file) throw()
         // It's OK to insert the same file repeatedly (in which case the table is not modified)
 {
-    source_file *current = m_array[hash_index];
-    while (current) {
-        if (current == file) return;
-        current = current->next();
+    if (shard->m_old_array != NULL) {
+        const size_t old_index = bucket_of(h, shard->m_old_size);
+        if (old_index >= shard->m_n_moved) {
+            for (source_file *f = shard->m_old_array[old_index]; f != NULL; f = f->next()) {
+                if (f == file) return;
+            }
+        }
+    }
+    const size_t index = bucket_of(h, shard->m_size);
+    for (source_file *f = shard->m_array[index]; f != NULL; f = f->next()) {
+        if (f == file) return;
     }
-    file->set_next(m_array[hash_index]);
-    m_array[hash_index] = file;
-    m_count++;
-    maybe_resize();
+    file->set_next(shard->m_array[index]);
+    shard->m_array[index] = file;
+    shard->m_count++;
+    this->maybe_resize(shard);
+    this->move_some_buckets(shard, 2);
 }
 
-void file_hash_table::maybe_resize(void) throw() {
-    if (m_size < m_count) {
-        source_file **old_array = m_array;
-        size_t old_size = m_size;
-        m_size = m_size + m_count;
-        assert(m_size);
-        m_array = new source_file*[m_size];
-        for (size_t i=0; i<m_size; i++) {
-            m_array[i] = NULL;
-        }
-        for (size_t i=0; i<old_size; i++) {
-            while (1) {
-                source_file *head = old_array[i];
-                if (head==NULL) break;
-                old_array[i] = head->next();
-                int hash_index = this->hash(head->name());
-                head->set_next(m_array[hash_index]);
-                m_array[hash_index] = head;
-            }
+////////////////////////////////////////////////////////
+//
+// maybe_resize() -
+//
+// Description:
+//
+//     Starts growing a shard that has more files than buckets.  If the
+// last growth isn't finished (which takes a burst of inserts), it is
+// finished first.
+//
+void file_hash_table::maybe_resize(file_hash_table_shard *shard) throw() {
+    if (shard->m_size >= shard->m_count) {
+        return;
+    }
+    this->move_some_buckets(shard, shard->m_old_size);
+    shard->m_old_array = shard->m_array;
+    shard->m_old_size = shard->m_size;
+    shard->m_n_moved = 0;
+    shard->m_size = 2 * shard->m_size + 1;
+    shard->m_array = new source_file*[shard->m_size];
+    for (size_t i = 0; i < shard->m_size; i++) {
+        shard->m_array[i] = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+void file_hash_table::move_some_buckets(file_hash_table_shard *shard, size_t n_buckets) throw() {
+    if (shard->m_old_array == NULL) {
+        return;
+    }
+    for (size_t n = 0; n < n_buckets && shard->m_n_moved < shard->m_old_size; n++) {
+        source_file **old_bucket = &shard->m_old_array[shard->m_n_moved];
+        while (source_file *head = *old_bucket) {
+            *old_bucket = head->next();
+            const size_t index = bucket_of(hash(head->name()), shard->m_size);
+            head->set_next(shard->m_array[index]);
+            shard->m_array[index] = head;
         }
-        delete[] old_array;
+        shard->m_n_moved++;
+    }
+    if (shard->m_n_moved == shard->m_old_size) {
+        delete[] shard->m_old_array;
+        shard->m_old_array = NULL;
+        shard->m_old_size = 0;
+        shard->m_n_moved = 0;
     }
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::remove(source_file * const file) throw() {
-    int hash_index = this->hash(file->name());
-    source_file *current = m_array[hash_index];
+static bool unlink_from_bucket(source_file **bucket, source_file * const file) throw() {
     source_file *previous = NULL;
-    while (current != NULL) {
-        int result = strcmp(current->name(), file->name());
-        if (result == 0) {
-            // Remove the entry.
-            source_file *next = current->next();
+    for (source_file *current = *bucket; current != NULL; current = current->next()) {
+        if (current == file) {
             if (previous != NULL) {
-                previous->set_next(next);                
+                previous->set_next(current->next());
             } else {
-                m_array[hash_index] = next;
+                *bucket = current->next();
             }
-            assert(m_count);
-            m_count--;
-            break;
+            return true;
         }
-        
         previous = current;
-        current = current->next();
     }
+    return false;
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::try_to_remove_locked(source_file * const file) throw() {
-    this->lock();
-    this->try_to_remove(file);
-    this->unlock();
+void file_hash_table::erase(file_hash_table_shard *shard, uint64_t h, source_file * const file) throw() {
+    bool found = false;
+    if (shard->m_old_array != NULL) {
+        const size_t old_index = bucket_of(h, shard->m_old_size);
+        if (old_index >= shard->m_n_moved) {
+            found = unlink_from_bucket(&shard->m_old_array[old_index], file);
+        }
+    }
+    if (!found) {
+        found = unlink_from_bucket(&shard->m_array[bucket_of(h, shard->m_size)], file);
+    }
+    if (found) {
+        assert(shard->m_count);
+        shard->m_count--;
+    }
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::try_to_remove(source_file * const file) throw() {
-    file->remove_reference();
-    if (file->get_reference_count() == 0) {
+// try_to_remove_locked() -
+//
+// Description:
+//
+//     Drops a reference to the file.  The last one out takes it out of
+// the table, under its shard's lock so that nobody can find it and
+// take a new reference meanwhile, and then frees it (closing its
+// backup copy) with no lock held.  The name lock keeps the file from
+// being renamed into another shard while we work out which one it is
+// in.
+//
+void file_hash_table::try_to_remove_locked(source_file * const file) throw() {
+    bool last = false;
+    {
+        with_source_file_name_read_lock sfl(file);
+        const uint64_t h = hash(file->name());
+        file_hash_table_shard *shard = this->shard_of(h);
+        with_mutex_locked ml(&shard->m_mutex, BACKTRACE(NULL));
+        file->remove_reference();
+        if (file->get_reference_count() == 0) {
+            this->erase(shard, h, file);
+            last = true;
+        }
+    }
+    if (last) {
         file->try_to_remove_destination();
-        this->remove(file);
         delete file;
     }
 }
 
 ////////////////////////////////////////////////////////
 //
-int file_hash_table::rename_locked(const char * const old_path, const char *new_path, const char *old_dest, const char *dest_path) throw() {
+int file_hash_table::rename_locked(const char * const old_path, const char *new_path, const char *old_dest, const char *dest_path, completed_files *completed, bool *complete) throw() {
     int r = 0;
-    with_file_hash_table_mutex ht(this);
-    source_file * target = this->get_or_create(old_path);
-
-    // This path should only be called during an active backup
-    // session.  So, there MUST be a destination object by this point
-    // in the rename path.
-    r = target->try_to_create_destination_file(old_dest);
-    if (r == 0) {
-        r = this->rename(target, new_path, dest_path);
-        this->try_to_remove(target);
+    source_file * target = NULL;
+    *complete = false;
+    {
+        // The source has already been renamed, so new_path is there.
+        struct stat sbuf;
+        if (stat(new_path, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)) {
+            return this->rename_directory(old_path, new_path, old_dest, dest_path, completed, complete);
+        }
+    }
+    this->get_or_create_locked(old_path, &target);
+    {
+        with_source_file_destination_lock dl(target);
+
+        // This path should only be called during an active backup
+        // session.  So, there MUST be a destination object by this point
+        // in the rename path.
+        r = target->try_to_create_destination_file(old_dest);
+        if (r == 0) {
+            r = this->rename(target, new_path, dest_path);
+        }
+
+        // The copier marks a copy complete, and finishes it, under the
+        // destination lock, so it can't do so between these two checks.
+        if (r == 0) {
+            const bool was_complete = (completed != NULL && completed->rename(old_path, target->name()));
+            *complete = was_complete || target->copy_in_progress();
+        }
     }
+    this->try_to_remove_locked(target);
 
     return r;
 }
 
 ////////////////////////////////////////////////////////
 //
+// rename_directory() -
+//
+// Description:
+//
+//     Renames the backup copy of a renamed directory, if the copier
+// has made it yet, and moves the completed names beneath it.  There
+// is no source_file for a directory.  Finding out whether everything
+// beneath it is in the backup would mean walking the tree inside the
+// application's rename(), so a directory is never complete: the caller
+// hands it to the copier, which skips the files whose copies are
+// already complete.
+//
+int file_hash_table::rename_directory(const char *old_path, const char *new_path, const char *old_dest, const char *dest_path, completed_files *completed, bool *complete) throw() {
+    *complete = false;
+    int r = call_real_rename(old_dest, dest_path);
+    if (r != 0) {
+        r = errno;
+        if (r != ENOENT) {
+            the_manager.backup_error(r, "Could not rename backup directory %s to %s", old_dest, dest_path);
+            return r;
+        }
+        // The copier hasn't made the backup copy yet.
+        r = 0;
+    }
+    if (completed != NULL) {
+        completed->rename(old_path, new_path);
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////
+//
+// rename() -
+//
+// Description:
+//
+//     Moves the target to the shard of its new name.  Both shards are
+// locked while the name changes, so that a lookup of either name sees
+// the file exactly once.  The backup copy is renamed after they have
+// been unlocked.
+//
 int file_hash_table::rename(source_file * target, const char *new_source_name, const char *dest) throw() {
     destination_file * dest_file = NULL;
     with_source_file_name_write_lock sfl(target);
-    
-    // Since we hash on the file name, we have to remove the
-    // soon-to-be-renamed file from the hash table, before we can
-    // actually 'rename' the object itself.
-    this->remove(target);
+
+    // Resolve the new name before any shard is locked.
+    with_object_to_free<char*> full_new_name(call_real_realpath(new_source_name, NULL));
+    if (full_new_name.value == NULL) {
+        int r = errno;
+        the_manager.backup_error(r, "Could not do target->rename to %s", new_source_name);
+        return r;
+    }
+
     {
-        int r = target->rename(new_source_name);
+        const uint64_t old_hash = hash(target->name());
+        const uint64_t new_hash = hash(full_new_name.value);
+        file_hash_table_shard *old_shard = this->shard_of(old_hash);
+        file_hash_table_shard *new_shard = this->shard_of(new_hash);
+        file_hash_table_shard *first = (old_shard < new_shard) ? old_shard : new_shard;
+        file_hash_table_shard *second = (old_shard < new_shard) ? new_shard : old_shard;
+        with_mutex_locked ml1(&first->m_mutex, BACKTRACE(NULL));
+        if (second != first) {
+            pmutex_lock(&second->m_mutex, BACKTRACE(NULL));
+        }
+
+        // Since we hash on the file name, we have to remove the
+        // soon-to-be-renamed file from the hash table, before we can
+        // actually 'rename' the object itself.
+        this->erase(old_shard, old_hash, target);
+        int r = target->rename(full_new_name.value);
+        if (r == 0) {
+            this->insert(new_shard, new_hash, target);
+        }
+        if (second != first) {
+            pmutex_unlock(&second->m_mutex, BACKTRACE(NULL));
+        }
         if (r != 0) {
             // We report our own errors.
             the_manager.backup_error(r, "Could not do target->rename to %s", new_source_name);
@@ -269,20 +470,5 @@ int file_hash_table::rename(source_file * target, const char *new_source_name, c
         return r;
     }
 
-    this->put(target);
     return 0;
 }
-
-////////////////////////////////////////////////////////
-// Description: See file_hash_table.h.
-void file_hash_table::lock(void) throw() {
-    pmutex_lock(&m_mutex);
-}
-
-////////////////////////////////////////////////////////
-// Description: See file_hash_table.h.
-void file_hash_table::unlock(void) throw() {
-    pmutex_unlock(&m_mutex);
-}
-
-
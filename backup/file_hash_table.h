@@ -38,10 +38,37 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <vector>
 
+class completed_files;
 class source_file;
 
+const int FILE_HASH_TABLE_SHARDS = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// file_hash_table_shard:
+//
+// Description:
+//
+//     One of the independently locked parts of a file_hash_table.  A
+// shard grows a bit at a time: when it gets too full it starts a new
+// array twice the size, and each later insert moves a couple of the
+// old array's buckets over, so nobody waits for the whole shard to be
+// rehashed.  Until the move is done a file may be in either array.
+//
+struct file_hash_table_shard {
+    pthread_mutex_t m_mutex;
+    source_file **m_array;
+    size_t m_size;
+    source_file **m_old_array;  // the array we are moving files out of, or NULL.
+    size_t m_old_size;
+    size_t m_n_moved;           // the old array's buckets below this are empty.
+    size_t m_count;
+} __attribute__((aligned(64)));
+
 class file_hash_table {
 public:
     file_hash_table() throw();
@@ -65,52 +92,44 @@ public:
     //  to use the most recently set flag/mode.  Hence the extra
     //  argument to get_or_create_locked.
     //
+    //  Every method locks only the shard (or, for a rename, the two
+    //  shards) of the names involved.  Nothing that calls the system
+    //  holds a shard lock except the realpath() in a rename.  What used
+    //  to be protected by one table-wide mutex (creating and removing
+    //  a source file's backup copy) is protected by the source file's
+    //  own destination lock.
+    //
     void get_or_create_locked(const char * const file_name, source_file **file, const int flags) throw();
     void get_or_create_locked(const char * const file_name, source_file **file) throw();
-    source_file * get_or_create(const char * const file_name);
-    source_file* get(const char *full_file_path) const throw();
-    void put(source_file * const file) throw();
-    int hash(const char * const file) const throw();
-    void insert(source_file * const file, int hash_index) throw(); // you may insert the same file more than once.
+    source_file* get(const char *full_file_path) throw();
+    void put(source_file * const file) throw(); // you may put the same file more than once.
     void remove(source_file * const file) throw();
-    void try_to_remove_locked(source_file * const file) throw();
-    void try_to_remove(source_file * const file) throw();
+    void try_to_remove_locked(source_file * const file) throw(); // Drop a reference, and free the file if it was the last.  The caller must not hold the file's name lock.
+    size_t size(void) throw();
 
     // These methods rename at least the source_file object and
     // reinsert it into our hash table.  If there is a
     // destination_file object, that file is also renamed.
-    int rename_locked(const char *old_src, const char *new_src, const char *new_dst, const char *dst) throw();
+    int rename_locked(const char *old_src, const char *new_src, const char *new_dst, const char *dst, completed_files *completed, bool *complete) throw();
     // Does *not* take ownership of the paths.
+    // Sets *complete if the backup copy already has (or a copy in progress will give it) all of the file's data, according to completed (which may be NULL) and the source_file.
     // Return values and errors:: On success return 0, otherwise return error number (not in errno), having reported the error to the manager.
+    // A renamed directory has no source_file: only its backup copy and the completed names beneath it are renamed, and *complete is never set, so that the copier copies it again.
 
   private:
     // The rename method (without a lock) is private to the file_hash_table.
     int rename(source_file * const target, const char *new_name, const char *dest) throw(); // On success return 0, otherwise return error number (not in errno).
+    int rename_directory(const char *old_src, const char *new_src, const char *old_dst, const char *dst, completed_files *completed, bool *complete) throw(); // Same returns as rename_locked().
 
   private:
-    void lock(void) throw(); // no return results since we assume that mutexes work.
-    void unlock(void) throw();
-    
-    friend class with_file_hash_table_mutex;
-private:
-    size_t m_count;
-    source_file **m_array;
-    size_t m_size;
-    static pthread_mutex_t m_mutex;
-    void maybe_resize(void) throw();
-};
-
-class with_file_hash_table_mutex {
-  private:
-    file_hash_table *ht;
-  public:
-    with_file_hash_table_mutex(file_hash_table *h): ht(h) {
-        ht->lock();
-    }
-    ~with_file_hash_table_mutex(void) {
-        ht->unlock();
-    }
+    file_hash_table_shard m_shards[FILE_HASH_TABLE_SHARDS];
+    static uint64_t hash(const char * const file) throw();
+    file_hash_table_shard *shard_of(uint64_t hash) throw();
+    source_file *find(file_hash_table_shard *shard, uint64_t hash, const char *name) throw();
+    void insert(file_hash_table_shard *shard, uint64_t hash, source_file * const file) throw();
+    void erase(file_hash_table_shard *shard, uint64_t hash, source_file * const file) throw();
+    void move_some_buckets(file_hash_table_shard *shard, size_t n_buckets) throw();
+    void maybe_resize(file_hash_table_shard *shard) throw();
 };
 
-
 #endif // End of header guardian.
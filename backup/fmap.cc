@@ -41,6 +41,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "mutex.h"
 #include "source_file.h"
 
+#include <atomic>
 #include <cstdlib>
 #include <pthread.h>
 #include <stdio.h>
@@ -50,6 +51,28 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 // This mutx protects the file descriptor map
 static pthread_mutex_t get_put_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// The first directory covers this many chunks.
+static const int FMAP_INITIAL_CHUNKS = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static fmap_directory *new_directory(int n_chunks) throw() {
+    fmap_directory *dir = new fmap_directory;
+    dir->m_n_chunks = n_chunks;
+    dir->m_chunks = new std::atomic<fmap_chunk *>[n_chunks];
+    for (int i = 0; i < n_chunks; ++i) {
+        dir->m_chunks[i].store(NULL, std::memory_order_relaxed);
+    }
+    return dir;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void delete_directory(fmap_directory *dir) throw() {
+    delete [] dir->m_chunks;
+    delete dir;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // fmap():
@@ -58,7 +81,10 @@ static pthread_mutex_t get_put_mutex = PTHREAD_MUTEX_INITIALIZER;
 //
 //     Constructor.
 //
-fmap::fmap() throw() {}
+fmap::fmap() throw()
+    : m_directory(new_directory(FMAP_INITIAL_CHUNKS)),
+      m_size(0)
+{}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -66,49 +92,73 @@ fmap::fmap() throw() {}
 //
 // Description: 
 //
-//     Destructor.
+//     Destructor.  The current directory has every chunk.
 //
 fmap::~fmap() throw() {
-    for(std::vector<description *>::size_type i = 0; i < m_map.size(); ++i)
-    {
-        description *file = m_map[i];
-        if (file == NULL) {
+    fmap_directory *dir = m_directory.load();
+    for (int i = 0; i < dir->m_n_chunks; ++i) {
+        fmap_chunk *chunk = dir->m_chunks[i].load();
+        if (chunk == NULL) {
             continue;
         }
-        
-        delete file;
-        m_map[i] = NULL;
+        for (int j = 0; j < FMAP_CHUNK_SIZE; ++j) {
+            delete chunk->m_slots[j].load();
+        }
+        delete chunk;
+    }
+    delete_directory(dir);
+    for (size_t i = 0; i < m_old_directories.size(); ++i) {
+        delete_directory(m_old_directories[i]);
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Description:  See fmap.h.
-void fmap::get(int fd, description** resultp, const backtrace bt) throw() {
+void fmap::get(int fd, description** resultp, const backtrace bt __attribute__((unused))) throw() {
     if (HotBackup::MAP_DBG) { 
         printf("get() called with fd = %d \n", fd);
     }
-    with_fmap_locked ml(BACKTRACE(&bt));
-    description *result = this->get_unlocked(fd);
-    *resultp = result;
+    *resultp = this->get_unlocked(fd);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// get_unlocked():
+//
+// Description:
+//
+//     Looks fd up without a lock.  The acquire loads pair with the
+// release stores in put(), so a description that we find was fully
+// made before it was put.
+//
 description* fmap::get_unlocked(int fd) throw() {
     if (fd < 0) return NULL;
-    description *result;
-    if ((size_t)fd >= m_map.size()) {
-        result = NULL;
-    } else {
-        result = m_map[fd];
+    const fmap_directory *dir = m_directory.load(std::memory_order_acquire);
+    const int chunk_number = fd / FMAP_CHUNK_SIZE;
+    if (chunk_number >= dir->m_n_chunks) {
+        return NULL;
+    }
+    const fmap_chunk *chunk = dir->m_chunks[chunk_number].load(std::memory_order_acquire);
+    if (chunk == NULL) {
+        return NULL;
     }
-    return result;
+    return chunk->m_slots[fd % FMAP_CHUNK_SIZE].load(std::memory_order_acquire);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 void fmap::put(int fd, description *file) throw() {
+    if (fd < 0) {
+        // Don't bother complaining if someone manages to pass a negative fd.
+        return;
+    }
     with_fmap_locked ml(BACKTRACE(NULL));
-    this->grow_array(fd);
-    glass_assert(m_map[fd] == NULL);
-    m_map[fd] = file;
+    fmap_chunk *chunk = this->get_chunk_for_put(fd);
+    std::atomic<description *> &slot = chunk->m_slots[fd % FMAP_CHUNK_SIZE];
+    glass_assert(slot.load(std::memory_order_relaxed) == NULL);
+    slot.store(file, std::memory_order_release);
+    if (m_size.load(std::memory_order_relaxed) <= fd) {
+        m_size.store(fd + 1, std::memory_order_relaxed);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -124,23 +174,21 @@ void fmap::put(int fd, description *file) throw() {
 
 int fmap::erase(int fd, const backtrace bt) throw() {
     with_fmap_locked ml(BACKTRACE(&bt));
-    if ((size_t)fd  >= m_map.size()) {
+    if (fd < 0) {
         return 0;
-    } else {
-        description *description = m_map[fd];
-        m_map[fd] = NULL;
-        {
-            if (description) {
-                // Do this after releasing the lock
-                //                source_file * src_file = description->get_source_file();
-                //if (src_file != NULL) {
-                //  src_file->remove_reference();
-                //}
-                delete description;
-            }
-            return 0;
-        }
     }
+    const fmap_directory *dir = m_directory.load(std::memory_order_relaxed);
+    const int chunk_number = fd / FMAP_CHUNK_SIZE;
+    if (chunk_number >= dir->m_n_chunks) {
+        return 0;
+    }
+    fmap_chunk *chunk = dir->m_chunks[chunk_number].load(std::memory_order_relaxed);
+    if (chunk == NULL) {
+        return 0;
+    }
+    description *description = chunk->m_slots[fd % FMAP_CHUNK_SIZE].exchange(NULL, std::memory_order_acq_rel);
+    delete description;
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -148,30 +196,46 @@ int fmap::erase(int fd, const backtrace bt) throw() {
 // size():
 //
 int fmap::size(void) throw() {
-    return  m_map.size();
+    return m_size.load(std::memory_order_relaxed);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// grow_fds_array():
+// get_chunk_for_put():
 //
 // Description:
 //
-//     Expands the array of file descriptions to include the given file
-// descriptor (fd) index.  This will fill each new spot between the current
-// end of the array and the new index with NULL pointers.  These missing 
-// file descriptors may be used by the parent process, but not part of our
-// backup directory.
+//     Returns the chunk that holds fd, making it (and a bigger
+// directory) if need be.  A new directory is published only after it
+// has all the old one's chunks, so a reader sees every chunk that
+// existed when it loaded the directory.
 // 
 // Requires: the get_put_mutex is held
-void fmap::grow_array(int fd) throw() {
-    if (fd>=0) {
-        while(m_map.size() <= (size_t)fd) {
-            m_map.push_back(NULL);
+fmap_chunk *fmap::get_chunk_for_put(int fd) throw() {
+    fmap_directory *dir = m_directory.load(std::memory_order_relaxed);
+    const int chunk_number = fd / FMAP_CHUNK_SIZE;
+    if (chunk_number >= dir->m_n_chunks) {
+        int n_chunks = dir->m_n_chunks;
+        while (n_chunks <= chunk_number) {
+            n_chunks *= 2;
         }
-    } else {
-        // Don't bother complaining if someone manages to pass a negative fd.
+        fmap_directory *bigger = new_directory(n_chunks);
+        for (int i = 0; i < dir->m_n_chunks; ++i) {
+            bigger->m_chunks[i].store(dir->m_chunks[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        m_old_directories.push_back(dir);
+        m_directory.store(bigger, std::memory_order_release);
+        dir = bigger;
+    }
+    fmap_chunk *chunk = dir->m_chunks[chunk_number].load(std::memory_order_relaxed);
+    if (chunk == NULL) {
+        chunk = new fmap_chunk;
+        for (int i = 0; i < FMAP_CHUNK_SIZE; ++i) {
+            chunk->m_slots[i].store(NULL, std::memory_order_relaxed);
+        }
+        dir->m_chunks[chunk_number].store(chunk, std::memory_order_release);
     }
+    return chunk;
 }
 
 void fmap::lock_fmap(const backtrace bt) throw() {
@@ -183,4 +247,4 @@ void fmap::unlock_fmap(const backtrace bt) throw() {
 }
 
 // Instantiate the templates we need
-template class std::vector<description *>;
+template class std::vector<fmap_directory *>;
@@ -38,6 +38,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 
+#include <atomic>
 #include <vector>
 #include "description.h"
 #include "backup_directory.h"
@@ -45,12 +46,48 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 class backup_directory;
 
-extern template class std::vector<description *>;
+// The table is split into chunks of this many file descriptors.
+const int FMAP_CHUNK_SIZE = 1024;
 
+struct fmap_chunk {
+    std::atomic<description *> m_slots[FMAP_CHUNK_SIZE];
+};
+
+// An array of pointers to chunks, some of which may be NULL.
+struct fmap_directory {
+    int m_n_chunks;
+    std::atomic<fmap_chunk *> *m_chunks;
+};
+
+extern template class std::vector<fmap_directory *>;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// fmap:
+//
+// Description:
+//
+//     Maps file descriptors to their descriptions.  Every intercepted
+// read, write and lseek looks its fd up here, so lookups take no lock:
+// the table is a directory of fixed-size chunks, and a chunk, once
+// made, stays where it is until the fmap is destroyed.  put() and
+// erase() still serialize on the fmap lock.  When the directory is too
+// small, put() publishes a bigger copy (sharing the same chunks) and
+// keeps the old one, since a reader may still be looking at it; the
+// directories only double, so the old ones take no more room than the
+// current one.
+//
+//     A lookup can't find a description that is being deleted by a
+// concurrent erase() unless the application is racing close() against
+// another call on the same fd, which is a bug in the application (the
+// fd could as well be reused by then).
+//
 class fmap
 {
 private:
-    std::vector<description *> m_map;
+    std::atomic<fmap_directory *> m_directory;
+    std::vector<fmap_directory *> m_old_directories; // protected by the fmap lock.
+    std::atomic<int> m_size;                         // one more than the largest fd ever put.
 public:
     fmap() throw();
     ~fmap() throw();
@@ -59,16 +96,16 @@ public:
     // Effect:   Returns pointer (in *result) to the file description object that matches the
     //   given file descriptor.  This will return NULL if the given file
     //   descriptor has not been added to this map.
-    // No errors can occur.
+    // No errors can occur.  Takes no lock.
 
     void put(int fd, description *file) throw();
     // Effect: adds given description pointer to array (acquires a lock)
 
-    description* get_unlocked(int fd) throw(); // use this one instead of get() when you already have the lock.
+    description* get_unlocked(int fd) throw(); // the same as get(), for callers that walk the map with the lock held.
     int erase(int fd, const backtrace bt) throw() __attribute__((warn_unused_result)); // returns 0 or an error number.
-    int size(void) throw();
+    int size(void) throw(); // One more than the largest fd that has been in the map.
 private:
-    void grow_array(int fd) throw();
+    fmap_chunk *get_chunk_for_put(int fd) throw();
     
     // Global locks used when the file descriptor map is updated.   Sometimes the backup system needs to hold the lock for several operations.
     // No errors are countenanced.
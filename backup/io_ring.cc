@@ -0,0 +1,298 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "io_ring.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+io_ring::io_ring(void) throw()
+    : m_fd(-1),
+      m_have_files(false),
+      m_buf(NULL),
+      m_sq_ring(MAP_FAILED),
+      m_sq_ring_size(0),
+      m_cq_ring(MAP_FAILED),
+      m_cq_ring_size(0),
+      m_sqes(MAP_FAILED),
+      m_sqes_size(0),
+      m_sq_head(NULL),
+      m_sq_tail(NULL),
+      m_sq_mask(0),
+      m_sq_entries(0),
+      m_sq_array(NULL),
+      m_cq_head(NULL),
+      m_cq_tail(NULL),
+      m_cq_mask(0),
+      m_cqes(NULL),
+      m_n_queued(0)
+{}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+io_ring::~io_ring(void) throw() {
+    this->destroy();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void io_ring::destroy(void) throw() {
+    if (m_sqes != MAP_FAILED) {
+        ignore(munmap(m_sqes, m_sqes_size));
+        m_sqes = MAP_FAILED;
+    }
+    if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+        ignore(munmap(m_cq_ring, m_cq_ring_size));
+    }
+    m_cq_ring = MAP_FAILED;
+    if (m_sq_ring != MAP_FAILED) {
+        ignore(munmap(m_sq_ring, m_sq_ring_size));
+        m_sq_ring = MAP_FAILED;
+    }
+    if (m_fd >= 0) {
+        ignore(call_real_close(m_fd));
+        m_fd = -1;
+    }
+    m_have_files = false;
+}
+
+#if defined(HAVE_IO_URING)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// init() -
+//
+// Description:
+//
+//     Creates the ring, maps its submission and completion queues, and
+// registers the buffer.  On any failure the ring is torn down again so
+// that the destructor has nothing left to do.
+//
+int io_ring::init(unsigned int entries, char *buf, size_t buf_size) throw() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int r = 0;
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_fd < 0) {
+        m_fd = -1;
+        return errno;
+    }
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_ring_size > m_sq_ring_size) {
+            m_sq_ring_size = m_cq_ring_size;
+        }
+        m_cq_ring_size = m_sq_ring_size;
+    }
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        r = errno;
+        goto out;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED) {
+            r = errno;
+            goto out;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        r = errno;
+        goto out;
+    }
+
+    m_sq_head    = (unsigned int *)((char *)m_sq_ring + params.sq_off.head);
+    m_sq_tail    = (unsigned int *)((char *)m_sq_ring + params.sq_off.tail);
+    m_sq_mask    = *(unsigned int *)((char *)m_sq_ring + params.sq_off.ring_mask);
+    m_sq_entries = *(unsigned int *)((char *)m_sq_ring + params.sq_off.ring_entries);
+    m_sq_array   = (unsigned int *)((char *)m_sq_ring + params.sq_off.array);
+    m_cq_head    = (unsigned int *)((char *)m_cq_ring + params.cq_off.head);
+    m_cq_tail    = (unsigned int *)((char *)m_cq_ring + params.cq_off.tail);
+    m_cq_mask    = *(unsigned int *)((char *)m_cq_ring + params.cq_off.ring_mask);
+    m_cqes       = (char *)m_cq_ring + params.cq_off.cqes;
+
+    {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = buf_size;
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+            r = errno;
+            goto out;
+        }
+        m_buf = buf;
+    }
+
+out:
+    if (r != 0) {
+        this->destroy();
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int io_ring::set_files(int src_fd, int dest_fd) throw() {
+    int fds[2] = {src_fd, dest_fd};
+    if (m_have_files) {
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = 0;
+        update.fds = (uint64_t)(uintptr_t)fds;
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES_UPDATE, &update, 2) < 0) {
+            return errno;
+        }
+    } else {
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES, fds, 2) != 0) {
+            return errno;
+        }
+        m_have_files = true;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool io_ring::queue(uint8_t opcode, int file, uint64_t user_data, char *addr, size_t len, uint64_t offset, uint8_t flags) throw() {
+    const unsigned int tail = *m_sq_tail + m_n_queued;
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        return false;
+    }
+    const unsigned int index = tail & m_sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)m_sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags | IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+    m_sq_array[index] = index;
+    m_n_queued++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool io_ring::queue_read(uint64_t user_data, char *addr, size_t len, uint64_t offset, bool link) throw() {
+    return this->queue(IORING_OP_READ_FIXED, SOURCE_FILE, user_data, addr, len, offset, link ? IOSQE_IO_LINK : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool io_ring::queue_write(uint64_t user_data, char *addr, size_t len, uint64_t offset) throw() {
+    return this->queue(IORING_OP_WRITE_FIXED, DEST_FILE, user_data, addr, len, offset, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int io_ring::submit_and_wait(unsigned int n_to_wait_for) throw() {
+    // Publish the new entries before the kernel can see the new tail.
+    __atomic_store_n(m_sq_tail, *m_sq_tail + m_n_queued, __ATOMIC_RELEASE);
+    unsigned int n_to_submit = m_n_queued;
+    m_n_queued = 0;
+    while (true) {
+        long r = syscall(__NR_io_uring_enter, m_fd, n_to_submit, n_to_wait_for, n_to_wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (r >= 0) {
+            if ((unsigned int)r >= n_to_submit) {
+                return 0;
+            }
+            n_to_submit -= r;
+            continue;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool io_ring::next_completion(uint64_t *user_data, int32_t *result) throw() {
+    const unsigned int head = *m_cq_head;
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)m_cqes)[head & m_cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else // !HAVE_IO_URING
+
+int io_ring::init(unsigned int entries __attribute__((__unused__)), char *buf __attribute__((__unused__)), size_t buf_size __attribute__((__unused__))) throw() {
+    return ENOSYS;
+}
+
+int io_ring::set_files(int src_fd __attribute__((__unused__)), int dest_fd __attribute__((__unused__))) throw() {
+    return ENOSYS;
+}
+
+bool io_ring::queue_read(uint64_t user_data __attribute__((__unused__)), char *addr __attribute__((__unused__)), size_t len __attribute__((__unused__)), uint64_t offset __attribute__((__unused__)), bool link __attribute__((__unused__))) throw() {
+    return false;
+}
+
+bool io_ring::queue_write(uint64_t user_data __attribute__((__unused__)), char *addr __attribute__((__unused__)), size_t len __attribute__((__unused__)), uint64_t offset __attribute__((__unused__))) throw() {
+    return false;
+}
+
+int io_ring::submit_and_wait(unsigned int n_to_wait_for __attribute__((__unused__))) throw() {
+    return ENOSYS;
+}
+
+bool io_ring::next_completion(uint64_t *user_data __attribute__((__unused__)), int32_t *result __attribute__((__unused__))) throw() {
+    return false;
+}
+
+#endif // HAVE_IO_URING
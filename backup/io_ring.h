@@ -0,0 +1,127 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// io_ring:
+//
+// Description:
+//
+//     A minimal io_uring submission and completion ring, driven through
+// the raw system calls so that we don't depend on liburing.  It only
+// knows how to read from and write to two registered files using one
+// registered buffer, which is all the copier needs: the source file is
+// fixed file 0 and the destination is fixed file 1.
+//
+//     Without io_uring support in the build, init() always fails with
+// ENOSYS and the caller copies some other way.
+//
+class io_ring {
+  public:
+    static const int SOURCE_FILE = 0;
+    static const int DEST_FILE   = 1;
+
+    io_ring(void) throw();
+    ~io_ring(void) throw();
+
+    int init(unsigned int entries, char *buf, size_t buf_size) throw() __attribute__((warn_unused_result));
+    // Effect: Set up a ring with room for the given number of requests
+    //  and register buf with it.  Returns 0 or an error number.
+
+    int set_files(int src_fd, int dest_fd) throw() __attribute__((warn_unused_result));
+    // Effect: Register the two files that the next requests use.
+    //  Returns 0 or an error number.
+
+    bool queue_read(uint64_t user_data, char *addr, size_t len, uint64_t offset, bool link) throw() __attribute__((warn_unused_result));
+    bool queue_write(uint64_t user_data, char *addr, size_t len, uint64_t offset) throw() __attribute__((warn_unused_result));
+    // Effect: Queue a read from the source (or a write to the
+    //  destination) of len bytes of the registered buffer at addr.  If
+    //  link is true the next request only starts once the read has
+    //  fully succeeded.  Returns false if the ring is full.
+
+    int submit_and_wait(unsigned int n_to_wait_for) throw() __attribute__((warn_unused_result));
+    // Effect: Submit the queued requests and wait until at least
+    //  n_to_wait_for completions are available.  Returns 0 or an error
+    //  number.
+
+    bool next_completion(uint64_t *user_data, int32_t *result) throw() __attribute__((warn_unused_result));
+    // Effect: Take the oldest completion, if there is one.  The result
+    //  is the number of bytes transferred, or a negated error number.
+
+  private:
+#if defined(HAVE_IO_URING)
+    bool queue(uint8_t opcode, int file, uint64_t user_data, char *addr, size_t len, uint64_t offset, uint8_t flags) throw();
+#endif
+    void destroy(void) throw();
+
+    int m_fd;
+    bool m_have_files;
+    char *m_buf;
+
+    // The mmapped rings.
+    void *m_sq_ring;
+    size_t m_sq_ring_size;
+    void *m_cq_ring;
+    size_t m_cq_ring_size;
+    void *m_sqes;
+    size_t m_sqes_size;
+
+    // Pointers into the rings.
+    unsigned int *m_sq_head;
+    unsigned int *m_sq_tail;
+    unsigned int m_sq_mask;
+    unsigned int m_sq_entries;
+    unsigned int *m_sq_array;
+    unsigned int *m_cq_head;
+    unsigned int *m_cq_tail;
+    unsigned int m_cq_mask;
+    void *m_cqes;
+
+    unsigned int m_n_queued; // queued, but not yet submitted.
+};
+
+#endif // End of header guardian.
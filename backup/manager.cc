@@ -35,6 +35,8 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include "backup_debug.h"
+#include "backup_manifest.h"
+#include "call_gate.h"
 #include "file_hash_table.h"
 #include "glassbox.h"
 #include "manager.h"
@@ -45,6 +47,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "source_file.h"
 #include "directory_set.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -83,9 +86,12 @@ static void print_time(const char *toku_string) throw() {
 }
 
 pthread_mutex_t manager::m_mutex         = PTHREAD_MUTEX_INITIALIZER;
-pthread_rwlock_t manager::m_session_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+brlock manager::m_session_lock;
 pthread_mutex_t manager::m_error_mutex   = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t manager::m_atomic_file_op_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t manager::m_incremental_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t manager::m_device_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t manager::m_open_close_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -103,10 +109,17 @@ manager::manager(void) throw()
       m_keep_capturing(false),
       m_is_capturing(false),
       m_done_copying(false),
+      m_copy_chunk_size(0),
 #endif
       m_backup_is_running(false),
       m_session(NULL),
       m_throttle(ULONG_MAX),
+      m_throttle_burst(0),
+      m_copy_threads(1),
+      m_io_depth(1),
+      m_huge_pages(false),
+      m_capture_journal(false),
+      m_dirty_tracking(false),
       m_an_error_happened(false),
       m_errnum(BACKUP_SUCCESS),
       m_errstring(NULL)
@@ -123,6 +136,9 @@ manager::manager(void) throw()
 
 manager::~manager(void) throw() {
     if (m_errstring) free(m_errstring);
+    for (size_t i = 0; i < m_incremental_bases.size(); ++i) {
+        free(m_incremental_bases[i]);
+    }
 }
 
 // This is a per-thread variable that indicates if we are the thread that can do the backup calls directly (and if so, here they are).
@@ -172,13 +188,22 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
         goto unlock_out;
     }
 
+    // Until now the interposed calls have been going straight to the
+    // system, so find out what files the application has open.
+    the_call_gate.start_tracking();
+    r = this->track_open_files();
+    if (r != 0) {
+        goto idle_out;
+    }
+
     {
-        with_rwlock_wrlocked ms(&m_session_rwlock, BACKTRACE(NULL));
+        with_brlock_wrlocked ms(&m_session_lock, BACKTRACE(NULL));
 
         {
             with_mutex_locked mt(&copier::m_todo_mutex, BACKTRACE(NULL));
             m_session = new backup_session(dirs, calls, &m_table);
         }
+        m_write_lock_stats.reset();
         print_time("Toku Hot Backup: Started:");    
 
         r = this->prepare_directories_for_backup(m_session, BACKTRACE(NULL));
@@ -187,6 +212,7 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
             goto disable_out;
         }
 
+        m_capture_queue.start();
         this->enable_capture();
         this->enable_copy();
     }
@@ -214,21 +240,44 @@ disable_out: // preserves r if r!=0
 
     calls->before_stop_capt_call();
     {
-        with_rwlock_wrlocked ms(&m_session_rwlock, BACKTRACE(NULL));
+        capture_journal *journal = NULL;
+        {
+        with_brlock_wrlocked ms(&m_session_lock, BACKTRACE(NULL));
 
         m_backup_is_running = false;
         this->disable_capture();
         this->disable_descriptions();
         WHEN_GLASSBOX(m_is_capturing = false);
+        // The backup copies aren't done until the queued captures are in them.
+        m_capture_queue.stop();
+        this->report_capture_stats();
+        if (r == 0 && !m_an_error_happened) {
+            r = m_session->write_manifests();
+        }
         print_time("Toku Hot Backup: Finished:");
         // We need to remove any extra renamed files that may have made it
         // to the backup session just after copy finished.
         m_session->cleanup();
+        m_last_stats.set(m_session->get_stats());
+        journal = m_session->release_journal();
         delete m_session;
         m_session = NULL;
+        }
+        // Replay the journal once the application no longer has to
+        // wait for the session lock.
+        if (journal != NULL) {
+            if (r == 0 && !m_an_error_happened) {
+                r = journal->apply();
+            }
+            delete journal;
+        }
     }
     calls->after_stop_capt_call();
 
+idle_out: // preserves r if r!=0
+    the_call_gate.stop_tracking();
+    this->forget_open_files();
+
 unlock_out: // preserves r if r!0
 
     pmutex_unlock(&m_mutex, BACKTRACE(NULL));
@@ -244,6 +293,80 @@ error_out:
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// track_open_files() -
+//
+// Description:
+//
+//     Makes a description for every regular file the application
+// opened while the interposed calls were going straight to the
+// system, using what /proc/self/fd says about them.  Any error is
+// reported and returned.
+//
+int manager::track_open_files(void) throw() {
+    int r = 0;
+    with_rwlock_wrlocked ocl(&m_open_close_rwlock, BACKTRACE(NULL));
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        r = errno;
+        backup_error(r, "Could not list the open files in /proc/self/fd");
+        return r;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') {
+            continue;
+        }
+        const int fd = atoi(e->d_name);
+        if (fd == dirfd(dir) || m_map.get_unlocked(fd) != NULL) {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink == 0) {
+            continue;
+        }
+        char link[64];
+        char path[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        const ssize_t len = readlink(link, path, sizeof(path) - 1);
+        const int flags = fcntl(fd, F_GETFL);
+        if (len < 0 || flags < 0) {
+            continue; // the application closed it.
+        }
+        path[len] = 0;
+        r = this->setup_description_and_source_file(fd, path, flags);
+        if (r != 0) {
+            break;
+        }
+    }
+    closedir(dir);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// forget_open_files() -
+//
+// Description:
+//
+//     Throws away every description, the way close() would, once the
+// interposed calls have gone back to the system.
+//
+void manager::forget_open_files(void) throw() {
+    with_rwlock_wrlocked ocl(&m_open_close_rwlock, BACKTRACE(NULL));
+    const int size = m_map.size();
+    for (int fd = 0; fd < size; ++fd) {
+        description *file = m_map.get_unlocked(fd);
+        if (file == NULL) {
+            continue;
+        }
+        source_file *source = file->get_source_file();
+        int ignore __attribute__((unused)) = m_map.erase(fd, BACKTRACE(NULL));
+        m_table.try_to_remove_locked(source);
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 int manager::prepare_directories_for_backup(backup_session *session, backtrace bt) throw() {
@@ -258,7 +381,7 @@ int manager::prepare_directories_for_backup(backup_session *session, backtrace b
         }
         
         source_file * source = file->get_source_file();
-        with_file_hash_table_mutex mtl(&m_table); // We think this fixes #34.  Also this must before the source_file_name_read_lock.
+        with_source_file_destination_lock dl(source); // We think this fixes #34.  Also this must before the source_file_name_read_lock.
         with_source_file_name_read_lock sfl(source);
 
         if (!session->is_prefix_of_realpath(source->name())) {
@@ -330,6 +453,11 @@ void manager::disable_descriptions(void) throw() {
 //
 int manager::open(int fd, const char *file, int flags) throw() {
     TRACE("entering open() with fd = ", fd);
+    // track_open_files() may have found the file already, if it was
+    // opened while the backup was starting.
+    if (m_map.get_unlocked(fd) != NULL) {
+        return 0;
+    }
     // Skip the given 'file' if it is not a regular file.
     struct stat buf;
     int stat_r = fstat(fd, &buf);
@@ -369,7 +497,7 @@ int manager::open(int fd, const char *file, int flags) throw() {
     m_map.get(fd, &description, BACKTRACE(NULL));
     source = description->get_source_file();
 
-    with_file_hash_table_mutex mtl(&m_table);
+    with_source_file_destination_lock dl(source);
     with_source_file_name_read_lock sfl(source);
 
     // Next, determine the full path of the backup file.
@@ -380,12 +508,20 @@ int manager::open(int fd, const char *file, int flags) throw() {
     
     // Finally, create the backup file and destination_file object.
     if (backup_file_name != NULL) {
+        const bool had_destination = (source->get_destination() != NULL);
         result = source->try_to_create_destination_file(backup_file_name);
         if (result != 0) {
             backup_error(result, "Could not open backup file %s", backup_file_name);
             goto out;
         }
         free((void*)backup_file_name);
+
+        // Nobody else has the file open in this session, so if it is
+        // empty (e.g. we just created it) every byte it gets from now
+        // on will be captured.
+        if (!had_destination && stat_r == 0 && buf.st_size == 0 && source->get_destination() != NULL) {
+            m_session->get_completed_files()->add(source->name());
+        }
     }
 
 out:
@@ -414,7 +550,7 @@ void manager::close(int fd) {
     {
         with_manager_enter_session_and_lock msl(this);
         if (msl.entered) {
-            with_file_hash_table_mutex mtl(&m_table);
+            with_source_file_destination_lock dl(source);
             source->try_to_remove_destination();
         }
     }
@@ -439,6 +575,12 @@ void manager::close(int fd) {
 //     Using the given file descriptor, this method updates the 
 // backup copy of a prevously opened file.
 //     Also does the write itself (the write is in here so that a lock can be obtained to protect the file offset)
+//     The offset is the system's, which we ask for with the
+// description locked, so that writes through the same description
+// can't move it meanwhile.  Reads and seeks don't take that lock (they
+// aren't interposed at all), so an application that reads or seeks an
+// fd while another thread writes to it can't know where its write
+// lands, and neither do we.
 //
 ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
     TRACE("entering write() with fd = ", fd);
@@ -460,18 +602,23 @@ ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
         file = description->get_source_file();
         // We need the range lock before calling real lock so that the write into the source and backup are atomic wrt other writes.
         TRACE("Grabbing file range lock() with fd = ", fd);
-        lock_start = description->get_offset();
-        lock_end   = lock_start + nbyte;
+        const off_t offset = call_real_lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) {
+            this->backup_error(errno, "Could not find the offset of fd %d", fd);
+            ok = false;
+        } else {
+            lock_start = offset;
+            lock_end   = lock_start + nbyte;
 
-        // We want to release the description->lock ASAP, since it's limiting other writes.
-        // We cannot release it before the real write since the real write determines the new m_offset.
-        file->lock_range(lock_start, lock_end);
-        have_range_lock = true;
+            // We want to release the description->lock ASAP, since it's limiting other writes.
+            // We cannot release it before the real write since the real write determines the new offset.
+            file->lock_range(lock_start, lock_end, &m_write_lock_stats);
+            have_range_lock = true;
+        }
     }
     ssize_t n_wrote = call_real_write(fd, buf, nbyte);
-    if (n_wrote>0 && description) { // Don't need OK, just need description
-        // actually wrote something.
-        description->increment_offset(n_wrote);
+    if (n_wrote>0 && have_range_lock) {
+        file->note_write(lock_start, lock_start + n_wrote);
     }
     // Now we can release the description lock, since the offset is calculated.  Release it even if not OK.
     if (have_description_lock) {
@@ -485,7 +632,7 @@ ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
             TRACE("write() captured with fd = ", fd);
             destination_file * dest_file = file->get_destination();
             if (dest_file != NULL) {
-                int r = dest_file->pwrite(buf, nbyte, lock_start);
+                int r = this->capture_write(file, dest_file, buf, nbyte, lock_start);
                 if (r!=0) {
                     // The error has been reported.
                     ok = false;
@@ -503,33 +650,6 @@ ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
     return n_wrote;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// read() -
-//
-// Description:
-//
-//     Do the read.
-//
-ssize_t manager::read(int fd, void *buf, size_t nbyte) throw() {
-    TRACE("entering write() with fd = ", fd);
-    ssize_t r = 0;
-    description *description;
-    m_map.get(fd, &description, BACKTRACE(NULL));
-    if (description == NULL) {
-        r = call_real_read(fd, buf, nbyte);
-    } else {
-        description->lock(BACKTRACE(NULL));
-        r = call_real_read(fd, buf, nbyte);
-        if (r>0) {
-            description->increment_offset(r); //moves the offset
-        }
-        description->unlock(BACKTRACE(NULL));
-    }
-    
-    return r;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // pwrite() -
@@ -555,15 +675,16 @@ ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) thr
 
     source_file * file = description->get_source_file();
 
-    file->lock_range(offset, offset+nbyte);
+    file->lock_range(offset, offset+nbyte, &m_write_lock_stats);
     ssize_t nbytes_written = call_real_pwrite(fd, buf, nbyte, offset);
     int e = 0;
     if (nbytes_written>0) {
+        file->note_write(offset, offset + nbytes_written);
         with_manager_enter_session_and_lock msl(this);
         if (msl.entered) {
             destination_file * dest_file = file->get_destination();
             if (dest_file != NULL) {
-                ignore(dest_file->pwrite(buf, nbyte, offset)); // nothing more to do.  It's been reported.
+                ignore(this->capture_write(file, dest_file, buf, nbyte, offset)); // nothing more to do.  It's been reported.
             }
         }
     } else if (nbytes_written<0) {
@@ -579,34 +700,6 @@ ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) thr
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// seek() -
-//
-// Description: 
-//
-//     Move the backup file descriptor to the new position.  This allows
-// upcoming intercepted writes to be backed up properly.
-//
-off_t manager::lseek(int fd, size_t nbyte, int whence) throw() {
-    TRACE("entering seek() with fd = ", fd);
-    description *description;
-    bool ok = true;
-    {
-        m_map.get(fd, &description, BACKTRACE(NULL));
-        if (description==NULL) ok = false;
-    }
-    if (ok) {
-        description->lock(BACKTRACE(NULL));
-    }
-    off_t new_offset = call_real_lseek(fd, nbyte, whence);
-    if (ok) {
-        description->lseek(new_offset);
-        description->unlock(BACKTRACE(NULL));
-    }
-    return new_offset;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // rename() -
@@ -687,28 +780,40 @@ void manager::capture_rename(const char * full_old_path, const char * newpath)
             // object with the new name.  We must also update the
             // destination_file object because we are inside of a
             // session.
+            bool complete = false;
             r = m_table.rename_locked(full_old_path, 
                                       full_new_path.value,
                                       full_old_destination_path.value,
-                                      full_new_destination_path.value);
+                                      full_new_destination_path.value,
+                                      m_session->get_completed_files(),
+                                      &complete);
 
             if (r != 0) {
                 // Nothing.  The error has been reported in rename_locked.
             } else {
                 // If the copier has already copied or is copying the
-                // file, this will succceed.  If the copier has not yet
-                // created the file this will fail, and it should find it
-                // in its todo list.  However, if we want to be sure that
-                // the new name is in its todo list, we must add it to the
-                // todo list ourselves, just to be sure that it is copied.
+                // file, or everything in it was captured, the renamed
+                // backup copy has all of its data, and captured
+                // changes keep it that way.  Otherwise (and always for
+                // a directory) we must add the new name to the
+                // copier's todo list, just to be sure that it is
+                // copied.  Once the copier is done, nothing takes it,
+                // and the backup copy is as it was.
 
                 // NOTE: If the orignal file name is still in our todo
                 // list, the copier will attempt to copy it, but since
                 // it has already been renamed it will fail with
                 // ENOENT, which we ignore in COPY, and move on to the
-                // next item in the todo list.  Add to the copier's
-                // todo list.
-                m_session->add_to_copy_todo_list(full_new_destination_path.value);
+                // next item in the todo list.
+                bool recopied = false;
+                if (!complete) {
+                    recopied = m_session->add_to_copy_todo_list(full_new_path.value);
+                }
+                completed_files::note_rename(!recopied);
+                m_session->capture_manifest_rename(full_old_destination_path.value, full_new_destination_path.value);
+                if (m_session->get_journal() != NULL) {
+                    ignore(m_session->get_journal()->rename(full_old_destination_path.value, full_new_destination_path.value)); // It's been reported.
+                }
             }
         }
     } else {
@@ -750,8 +855,8 @@ int manager::unlink(const char *path) throw() {
     m_table.get_or_create_locked(full_path.value, &source);
 
     {
-        with_rwlock_rdlocked ms(&m_session_rwlock);
-        with_file_hash_table_mutex mtl(&m_table);
+        with_brlock_rdlocked ms(&m_session_lock);
+        with_source_file_destination_lock dl(source);
 
         if (this->should_capture_unlink_of_file(full_path.value)) {
             // 1. Find source file, unlink it.
@@ -778,11 +883,16 @@ int manager::unlink(const char *path) throw() {
                 int error = errno;
                 this->backup_error(error, "Could not unlink backup copy.");
             }
+            m_session->capture_manifest_unlink(dest->get_path());
+            if (m_session->get_journal() != NULL) {
+                ignore(m_session->get_journal()->unlink(dest->get_path())); // It's been reported.
+            }
+            m_session->get_completed_files()->remove(full_path.value);
         
             // If it does not exist, and if backup is running,
-            // it may be in the todo list. Since we have the hash 
-            // table lock, the copier can't add it, and rename() threads
-            // can't alter the name and re-hash it till we are done.
+            // it may be in the todo list. Since we have the
+            // destination lock, the copier can't create its copy, and
+            // rename() threads can't move it till we are done.
         }
 
         // We have to unlink the source file, regardless of whether ther
@@ -792,9 +902,8 @@ int manager::unlink(const char *path) throw() {
             source->unlink();
             source->try_to_remove_destination();
         }
-
-        m_table.try_to_remove(source);
     }
+    m_table.try_to_remove_locked(source);
 
 free_out:
     return user_error;
@@ -823,7 +932,8 @@ int manager::ftruncate(int fd, off_t length) throw() {
 
     source_file * file = description->get_source_file();
 
-    file->lock_range(length, LLONG_MAX);
+    file->lock_range(length, LLONG_MAX, &m_write_lock_stats);
+    file->begin_resize();
     int user_result = call_real_ftruncate(fd, length);
     int e = 0;
     if (user_result==0) {
@@ -831,15 +941,26 @@ int manager::ftruncate(int fd, off_t length) throw() {
         if (msl.entered) {
             destination_file * dest_file = file->get_destination();
             if (dest_file != NULL) {
+                file->wait_for_captures();
+            }
+            if (dest_file != NULL &&
+                this->capture_manifest_change(file, dest_file, length, LLONG_MAX) == 0) {
                  // the error from truncate been reported, so there's
                  // nothing we can do about that error except to try
                  // to unlock the range.
                 ignore(dest_file->truncate(length));
+                capture_journal *journal = m_session->get_journal();
+                if (journal != NULL) {
+                    // So that the replay drops what earlier writes put past the end.
+                    with_source_file_name_read_lock snl(file);
+                    ignore(journal->truncate(dest_file, length)); // It's been reported.
+                }
             }
         }
     } else {
         e = errno; // save errno
     }
+    file->end_resize();
     ignore(file->unlock_range(length, LLONG_MAX)); // it's been reported, so there's not much more to do
     if (user_result!=0) {
         errno = e; // restore errno
@@ -847,6 +968,203 @@ int manager::ftruncate(int fd, off_t length) throw() {
     return user_result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description:
+//
+//     Performs the application's fallocate() and repeats it on the
+// backup copy.  Collapsing or inserting a range moves everything after
+// it, so those lock the rest of the file.
+//
+int manager::fallocate(int fd, int mode, off_t offset, off_t len) throw() {
+    TRACE("entering fallocate with fd = ", fd);
+    description *description;
+    {
+        m_map.get(fd, &description, BACKTRACE(NULL));
+        if (description == NULL) {
+            int res = call_real_fallocate(fd, mode, offset, len);
+            return res;
+        }
+    }
+
+    source_file * file = description->get_source_file();
+
+    const uint64_t lock_start = offset;
+    const uint64_t lock_end = (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) ? LLONG_MAX : offset + len;
+    file->lock_range(lock_start, lock_end, &m_write_lock_stats);
+    file->begin_resize();
+    int user_result = call_real_fallocate(fd, mode, offset, len);
+    int e = 0;
+    if (user_result==0) {
+        with_manager_enter_session_and_lock msl(this);
+        if (msl.entered) {
+            destination_file * dest_file = file->get_destination();
+            if (dest_file != NULL) {
+                file->wait_for_captures();
+            }
+            if (dest_file != NULL &&
+                this->capture_manifest_change(file, dest_file, lock_start, lock_end) == 0) {
+                // The error has been reported, so all we can do is
+                // unlock the range.
+                ignore(dest_file->fallocate(mode, offset, len));
+                capture_journal *journal = m_session->get_journal();
+                if (journal != NULL) {
+                    // So that the replay drops (or moves) what earlier writes put there.
+                    with_source_file_name_read_lock snl(file);
+                    ignore(journal->fallocate(dest_file, mode, offset, len)); // It's been reported.
+                }
+            }
+        }
+    } else {
+        e = errno; // save errno
+    }
+    file->end_resize();
+    ignore(file->unlock_range(lock_start, lock_end)); // it's been reported, so there's not much more to do
+    if (user_result!=0) {
+        errno = e; // restore errno
+    }
+    return user_result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// capture_write() -
+//
+// Description:
+//
+//     Makes the application's write to [offset,offset+nbyte) of the
+// source file in the backup copy too.  The caller holds that range
+// lock.  If the copier has yet to read all of it, it will copy the new
+// data itself, so we leave it out.  If the backup tracks dirty blocks,
+// we just mark them, and the copier copies them again later.  If the
+// copier has read all of it, the write goes onto the file's capture
+// queue.  Otherwise (the write
+// straddles the copier, or this is an incremental backup, whose
+// manifest reads the source to fill in partly written blocks) we write
+// it now, after any queued writes, so that it can't be overtaken.
+// Returns 0 or an error number, having reported the error.
+//
+int manager::capture_write(source_file *file, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() {
+    const uint64_t lo = offset;
+    const uint64_t hi = offset + nbyte;
+    if (file->copy_will_read(lo, hi)) {
+        capture_queue::note_elided_bytes(nbyte);
+        return 0;
+    }
+    dirty_set *dirty = m_session->get_dirty_set();
+    if (dirty != NULL && dirty->mark(file, lo, hi)) {
+        return 0;
+    }
+    if (m_session->get_journal() != NULL) {
+        return this->journal_write(m_session->get_journal(), file, dest, buf, nbyte, offset);
+    }
+    if (m_session->get_manifest() == NULL && !file->copy_will_read_any(lo, hi) &&
+        m_capture_queue.enqueue(file->captures(), dest, buf, nbyte, offset)) {
+        return 0;
+    }
+    file->wait_for_captures();
+    capture_queue::note_sync_write();
+    int r = this->capture_manifest_change(file, dest, lo, hi);
+    if (r == 0) {
+        r = dest->pwrite(buf, nbyte, offset);
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// journal_write() -
+//
+// Description:
+//
+//     Records a captured write in the capture journal.  The journal is
+// replayed after the copier is done, so it must not hold data for a
+// part of the file that the copier has yet to read: a later write
+// there would be left out, and the replay would put the older data
+// back over what the copier read.  So only the parts the copier has
+// read are recorded.
+//
+int manager::journal_write(capture_journal *journal, source_file *file, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() {
+    std::vector<std::pair<uint64_t, uint64_t> > parts;
+    file->copied_parts(offset, offset + nbyte, &parts);
+    uint64_t n_journaled = 0;
+    with_source_file_name_read_lock snl(file);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        const uint64_t skip = parts[i].first - offset;
+        int r = journal->write(dest, (const char *) buf + skip, parts[i].second - parts[i].first, parts[i].first);
+        if (r != 0) {
+            return r;
+        }
+        n_journaled += parts[i].second - parts[i].first;
+    }
+    capture_queue::note_elided_bytes(nbyte - n_journaled);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// journal_truncate() -
+//
+// Description:
+//
+//     Records a truncate() of a source file by name, which has already
+// been done to its backup copy, so that the replay drops what earlier
+// writes put past the end.  Changes are recorded against a
+// destination_file, so if there is none we make one for the backup
+// copy, unless there is no backup copy yet (in which case the journal
+// holds nothing for it).
+//
+void manager::journal_truncate(capture_journal *journal, source_file *file, const char *dest_path, off_t length) throw() {
+    with_source_file_destination_lock dl(file);
+    if (file->get_destination() == NULL) {
+        int fd = call_real_open(dest_path, O_WRONLY);
+        if (fd < 0) {
+            return;
+        }
+        ignore(call_real_close(fd));
+        if (file->try_to_create_destination_file(dest_path) != 0 || file->get_destination() == NULL) {
+            return;
+        }
+    }
+    {
+        with_source_file_name_read_lock snl(file);
+        ignore(journal->truncate(file->get_destination(), length)); // It's been reported.
+    }
+    file->try_to_remove_destination();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::report_capture_stats(void) throw() {
+    capture_queue_stats stats;
+    capture_queue::get_total_stats(&stats);
+    m_session->get_stats()->add_capture(stats);
+    m_session->get_stats()->add_write_locks(m_write_lock_stats);
+    capture_queue::reset_total_stats();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// capture_manifest_change() -
+//
+// Description:
+//
+//     Tells an incremental backup's manifest that the application has
+// changed [lo,hi) of the source file, before we make the same change
+// to the backup copy.  Requires: we are in the session.
+//
+int manager::capture_manifest_change(source_file *file, destination_file *dest, uint64_t lo, uint64_t hi) throw() {
+    backup_manifest *manifest = m_session->get_manifest();
+    if (manifest == NULL) {
+        return 0;
+    }
+    // Keep a rename from changing the names under us.
+    with_source_file_name_read_lock snl(file);
+    return manifest->capture_change(dest->get_path(), file->name(), dest->get_fd(), lo, hi);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // truncate() -
@@ -866,34 +1184,42 @@ int manager::truncate(const char *path, off_t length) throw() {
         return call_real_truncate(path, length);
     }
 
-    with_rwlock_rdlocked ms(&m_session_rwlock);
+    with_brlock_rdlocked ms(&m_session_lock);
     
     if (m_session != NULL && m_session->is_prefix_of_realpath(full_path.value)) {
         with_object_to_free<char *> destination_file(m_session->translate_prefix_of_realpath(full_path.value));
         // Find and lock the associated source file.
         source_file *file;
-        {
-            with_file_hash_table_mutex mtl(&m_table);
-
-            file = m_table.get(destination_file.value);
-            file->add_reference();
-        }
+        m_table.get_or_create_locked(full_path.value, &file);
         
-        file->lock_range(length, LLONG_MAX);
+        file->lock_range(length, LLONG_MAX, &m_write_lock_stats);
+        file->begin_resize();
         
         user_error = call_real_truncate(full_path.value, length);
         if (user_error == 0 && this->capture_is_enabled()) {
+            file->wait_for_captures();
+            int dest_fd = call_real_open(destination_file.value, O_WRONLY);
+            if (dest_fd >= 0) {
+                backup_manifest *manifest = m_session->get_manifest();
+                if (manifest != NULL) {
+                    ignore(manifest->capture_change(destination_file.value, full_path.value, dest_fd, length, LLONG_MAX));
+                }
+                ignore(call_real_close(dest_fd));
+            }
             r = call_real_truncate(destination_file.value, length);
             if (r != 0) {
                 error = errno;
                 if (error != ENOENT) {
                     the_manager.backup_error(error, "Could not truncate backup file.");
                 }
+            } else if (m_session->get_journal() != NULL) {
+                this->journal_truncate(m_session->get_journal(), file, destination_file.value, length);
             }
         }
 
+        file->end_resize();
         r = file->unlock_range(length, LLONG_MAX);
-        file->remove_reference();
+        m_table.try_to_remove_locked(file);
         if (r != 0) {
             user_error = call_real_truncate(path, length);
             // More RAII-fixed problems (the session rwlock wasn't freed, and the destination_file wasn't freed.
@@ -922,7 +1248,7 @@ free_out:
 //     TBD...
 //
 void manager::mkdir(const char *pathname) throw() {
-    with_rwlock_rdlocked ml(&m_session_rwlock);
+    with_brlock_rdlocked ml(&m_session_lock);
 
     if(m_session != NULL) {
         int r = m_session->capture_mkdir(pathname);
@@ -947,6 +1273,202 @@ unsigned long manager::get_throttle(void) const throw() {
     return m_throttle;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_throttle_burst(unsigned long n_bytes) throw() {
+    m_throttle_burst = n_bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned long manager::get_throttle_burst(void) const throw() {
+    return m_throttle_burst;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// set_copy_threads() -
+//
+// Description:
+//
+//     Sets the number of copy workers used by the next copy.  A copy
+// that is already running keeps the number it started with.
+//
+void manager::set_copy_threads(unsigned int n_threads) throw() {
+    if (n_threads < 1) {
+        n_threads = 1;
+    } else if (n_threads > MAX_COPY_THREADS) {
+        n_threads = MAX_COPY_THREADS;
+    }
+    m_copy_threads = n_threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned int manager::get_copy_threads(void) const throw() {
+    return m_copy_threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// set_io_depth() -
+//
+// Description:
+//
+//     Sets the number of reads (and writes) each copy worker keeps in
+// flight during the next copy.
+//
+void manager::set_io_depth(unsigned int depth) throw() {
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MAX_IO_DEPTH) {
+        depth = MAX_IO_DEPTH;
+    }
+    m_io_depth = depth;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned int manager::get_io_depth(void) const throw() {
+    return m_io_depth;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_huge_pages(bool use_huge_pages) throw() {
+    m_huge_pages = use_huge_pages;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::get_huge_pages(void) const throw() {
+    return m_huge_pages;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_capture_journal(bool use_journal) throw() {
+    m_capture_journal = use_journal;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::get_capture_journal(void) const throw() {
+    return m_capture_journal;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_dirty_tracking(bool track_dirty_blocks) throw() {
+    m_dirty_tracking = track_dirty_blocks;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::get_dirty_tracking(void) const throw() {
+    return m_dirty_tracking;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::get_stats(tokubackup_stats *stats) throw() {
+    m_last_stats.get(stats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned int manager::get_device_stats(tokubackup_device_stats *stats, unsigned int n_stats) throw() {
+    return m_last_stats.get_devices(stats, n_stats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::set_incremental_bases(const char *base_dirs[], int dir_count) throw() {
+    std::vector<char *> bases;
+    for (int i = 0; i < dir_count; ++i) {
+        char *base = NULL;
+        if (base_dirs[i] != NULL) {
+            base = strdup(base_dirs[i]);
+            if (base == NULL) {
+                for (size_t j = 0; j < bases.size(); ++j) {
+                    free(bases[j]);
+                }
+                return ENOMEM;
+            }
+        }
+        bases.push_back(base);
+    }
+
+    with_mutex_locked im(&m_incremental_mutex);
+    m_incremental_bases.swap(bases);
+    for (size_t i = 0; i < bases.size(); ++i) {
+        free(bases[i]);
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::get_incremental_bases(std::vector<char *> *bases) throw() {
+    with_mutex_locked im(&m_incremental_mutex);
+    for (size_t i = 0; i < m_incremental_bases.size(); ++i) {
+        const char *base = m_incremental_bases[i];
+        // If we run out of memory, that directory just gets a full backup.
+        bases->push_back(base ? strdup(base) : NULL);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// set_device_limits() -
+//
+// Description:
+//
+//     Remembers the limits for the copies on the device that holds
+// path, for the backups started afterwards.  Zeros go back to the
+// limits we pick ourselves.  Returns 0, or the error number from
+// stat().
+//
+int manager::set_device_limits(const char *path, unsigned int concurrency, unsigned int io_depth) throw() {
+    struct stat sbuf;
+    if (stat(path, &sbuf) != 0) {
+        return errno;
+    }
+    if (concurrency > MAX_COPY_THREADS) {
+        concurrency = MAX_COPY_THREADS;
+    }
+    if (io_depth > MAX_IO_DEPTH) {
+        io_depth = MAX_IO_DEPTH;
+    }
+
+    with_mutex_locked dm(&m_device_mutex);
+    for (size_t i = 0; i < m_device_limits.size(); ++i) {
+        if (m_device_limits[i].m_device == sbuf.st_dev) {
+            m_device_limits.erase(m_device_limits.begin() + i);
+            break;
+        }
+    }
+    if (concurrency != 0 || io_depth != 0) {
+        device_limits limits = {sbuf.st_dev, concurrency, io_depth};
+        m_device_limits.push_back(limits);
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::get_device_limits(dev_t device, unsigned int *concurrency, unsigned int *io_depth) throw() {
+    with_mutex_locked dm(&m_device_mutex);
+    for (size_t i = 0; i < m_device_limits.size(); ++i) {
+        if (m_device_limits[i].m_device == device) {
+            *concurrency = m_device_limits[i].m_concurrency;
+            *io_depth = m_device_limits[i].m_io_depth;
+            return true;
+        }
+    }
+    return false;
+}
+
 void manager::backup_error_ap(int errnum, const char *format_string, va_list ap) throw() {
     this->disable_capture();
     this->disable_copy();
@@ -1000,11 +1522,11 @@ void manager::set_error_internal(int errnum, const char *format_string, va_list
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-bool manager::try_to_enter_session_and_lock(void) throw() {
-    prwlock_rdlock(&m_session_rwlock);
+bool manager::try_to_enter_session_and_lock(int *slot) throw() {
+    *slot = m_session_lock.rdlock();
 
     if (m_session == NULL) {
-        prwlock_unlock(&m_session_rwlock);
+        m_session_lock.rdunlock(*slot);
         return false;
     }
 
@@ -1013,8 +1535,8 @@ bool manager::try_to_enter_session_and_lock(void) throw() {
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-void manager::exit_session_and_unlock_or_die(void) throw() {
-    prwlock_unlock(&m_session_rwlock);
+void manager::exit_session_and_unlock_or_die(int slot) throw() {
+    m_session_lock.rdunlock(slot);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1061,6 +1583,16 @@ void manager::unlock_file_op(void)
     pmutex_unlock(&m_atomic_file_op_mutex);
 }
 
+void manager::lock_open_close(void)
+{
+    prwlock_rdlock(&m_open_close_rwlock);
+}
+
+void manager::unlock_open_close(void)
+{
+    prwlock_unlock(&m_open_close_rwlock);
+}
+
 bool manager::should_capture_unlink_of_file(const char *file) throw() {
     if (m_session != NULL &&
         this->capture_is_enabled() &&
@@ -1095,4 +1627,16 @@ void manager::set_start_copying(bool start_copying) throw() {
     TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_start_copying, sizeof(m_start_copying));
     m_start_copying = start_copying;
 }
+
+void manager::set_copy_chunk_size(uint64_t chunk_size) throw() {
+    m_copy_chunk_size = chunk_size;
+}
 #endif /*GLASSBOX*/
+
+uint64_t manager::get_copy_chunk_size(void) throw() {
+#ifdef GLASSBOX
+    return m_copy_chunk_size;
+#else
+    return 0;
+#endif
+}
@@ -40,6 +40,9 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup.h"
 #include "backup_directory.h"
+#include "backup_stats.h"
+#include "brlock.h"
+#include "capture_queue.h"
 #include "description.h"
 #include "file_hash_table.h"
 #include "manager_state.h"
@@ -61,6 +64,7 @@ private:
     std::atomic_bool m_keep_capturing; // For test purposes, we can arrange to keep capturing the backup until the client tells us to stop.
     std::atomic_bool m_is_capturing;   // Backup manager sets to true when capturing is running, sets to false when capturing has stopped.   We look at m_start_copying after setting m_is_capturing=true.
     std::atomic_bool m_done_copying;   // Backup manager sets this true when copying is done.  Happens after m_is_captring
+    std::atomic<uint64_t> m_copy_chunk_size; // For test purposes, we can split large files into smaller chunks than usual.
 #endif
 
     volatile bool m_backup_is_running; // true if the backup is running.  This can be accessed without any locks.
@@ -73,9 +77,22 @@ private:
     //bool m_capture_enabled;
 
     backup_session *m_session;
-    static pthread_rwlock_t m_session_rwlock;
+    static brlock m_session_lock;  // Read-locked on every captured call, so it is a big-reader lock.
+    capture_queue m_capture_queue; // Writes captured writes into the backup copies in the background.
 
     std::atomic_ulong m_throttle;
+    std::atomic_ulong m_throttle_burst;
+    std::atomic_uint m_copy_threads;
+    std::atomic_uint m_io_depth;
+    std::atomic_bool m_huge_pages;
+    std::atomic_bool m_capture_journal;
+    std::atomic_bool m_dirty_tracking;
+    static pthread_mutex_t m_incremental_mutex; // Protects m_incremental_bases.
+    std::vector<char *> m_incremental_bases;    // The base backup of each destination directory (NULL for none).  Empty for full backups.
+    static pthread_mutex_t m_device_mutex;      // Protects m_device_limits.
+    std::vector<device_limits> m_device_limits; // The limits the user set for the copies on each device.
+    backup_stats m_last_stats;                  // What the most recent backup to finish did.
+    range_lock_stats m_write_lock_stats;        // What the application's writes did with range locks, since the backup started.
 
     // Error handling.
     static pthread_mutex_t m_error_mutex;     // When testing errors grab this mutex. 
@@ -83,6 +100,7 @@ private:
     volatile int m_errnum;                      // The error number to be passed to the polling function.  This can be read without the mutex.
     char * volatile m_errstring;                 // The error string to be passed to the polling function.  This string is malloc'd and owned by the manager.  This can be read without the mutex.
     static pthread_mutex_t m_atomic_file_op_mutex; // Used to serialize open(), rename() and unlink()  
+    static pthread_rwlock_t m_open_close_rwlock;   // open() and close() read-lock this while the call gate is tracking them, so the descriptions can be rebuilt (write-locked) without a file coming or going.
 public:
     manager(void) throw();
     ~manager(void) throw();
@@ -95,16 +113,33 @@ public:
     void close(int fd); // It has reported the error to the backup manager, and the application doesn't care.
     ssize_t write(int fd, const void *buf, size_t nbyte) throw(); // Actually performs the write on fd (so that a lock can be obtained).
     ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset) throw(); // Actually performs the write on fd (so that a lock can be obtained).
-    ssize_t read(int fd, void *buf, size_t nbyte) throw();        // Actually performs the read (so a lock can be obtained).  Returns the number read.
-    off_t   lseek(int fd, size_t nbyte, int whence) throw();      // Actually performs the seek (so a lock can be obtained).
     int rename(const char *oldpath, const char *newpath) throw();
     int unlink(const char *path) throw();
     int ftruncate(int fd, off_t length) throw();                  // Actually performs the trunate (so a lock can be obtained).
     int truncate(const char *path, off_t length) throw();
+    int fallocate(int fd, int mode, off_t offset, off_t len) throw(); // Actually performs the fallocate (so a lock can be obtained).
     void mkdir(const char *pathname) throw();
     
     void set_throttle(unsigned long bytes_per_second) throw(); // This is thread-safe.
     unsigned long get_throttle(void) const throw();                 // This is thread-safe.
+    void set_throttle_burst(unsigned long n_bytes) throw();         // This is thread-safe.
+    unsigned long get_throttle_burst(void) const throw();           // This is thread-safe.
+    void set_copy_threads(unsigned int n_threads) throw();          // This is thread-safe.
+    unsigned int get_copy_threads(void) const throw();              // This is thread-safe.
+    void set_io_depth(unsigned int depth) throw();                  // This is thread-safe.
+    unsigned int get_io_depth(void) const throw();                  // This is thread-safe.
+    void set_huge_pages(bool use_huge_pages) throw();               // This is thread-safe.
+    bool get_huge_pages(void) const throw();                        // This is thread-safe.
+    void set_capture_journal(bool use_journal) throw();             // This is thread-safe.
+    bool get_capture_journal(void) const throw();                   // This is thread-safe.
+    void set_dirty_tracking(bool track_dirty_blocks) throw();       // This is thread-safe.
+    bool get_dirty_tracking(void) const throw();                    // This is thread-safe.
+    int set_incremental_bases(const char *base_dirs[], int dir_count) throw() __attribute__((warn_unused_result)); // This is thread-safe.
+    void get_incremental_bases(std::vector<char *> *bases) throw(); // Gives the caller malloc'd copies.  This is thread-safe.
+    int set_device_limits(const char *path, unsigned int concurrency, unsigned int io_depth) throw() __attribute__((warn_unused_result)); // This is thread-safe.
+    bool get_device_limits(dev_t device, unsigned int *concurrency, unsigned int *io_depth) throw(); // False if none were set.  This is thread-safe.
+    void get_stats(tokubackup_stats *stats) throw();                // What the most recent backup to finish did.  This is thread-safe.
+    unsigned int get_device_stats(tokubackup_device_stats *stats, unsigned int n_stats) throw(); // And on each device.  This is thread-safe.
 
     void fatal_error(int errnum, const char *format, ...) throw() __attribute__((format(printf,3,4)));
     void backup_error(int errnum, const char *format, ...) throw() __attribute__((format(printf,3,4)));
@@ -126,20 +161,31 @@ public:
     bool is_capturing(void) throw();                         // Is the manager capturing?
     bool is_done_copying(void) throw();                      // Is the manager done copying (true sometime after is_capturing)
     void set_start_copying(bool start_copying) throw();     // Tell the manager not to start copying (by passing false) and then to start copying (by passing true). This is thread safe.
+    void set_copy_chunk_size(uint64_t chunk_size) throw();  // Tell the copier to split large files into chunks of this size (0 means its usual size).
+    uint64_t get_copy_chunk_size(void) throw();             // Always 0 outside of the test build.
     // end of test interface
     void lock_file_op(void);
     void unlock_file_op(void);
+    void lock_open_close(void);
+    void unlock_open_close(void);
 
 private:
     // Backup session control methods.
     void capture_rename(const char *, const char *);
-    bool try_to_enter_session_and_lock(void) throw();
-    void exit_session_and_unlock_or_die(void) throw();
+    bool try_to_enter_session_and_lock(int *slot) throw();
+    void exit_session_and_unlock_or_die(int slot) throw();
+    int track_open_files(void) throw() __attribute__((warn_unused_result));
+    void forget_open_files(void) throw();
     int prepare_directories_for_backup(backup_session *session, const backtrace bt) throw();
     void disable_descriptions(void) throw();
     void set_error_internal(int errnum, const char *format, va_list ap) throw() __attribute__((format(printf,3,0)));
     int setup_description_and_source_file(int fd, const char *file, const int flags) throw();
     bool should_capture_unlink_of_file(const char *file) throw();
+    int capture_manifest_change(source_file *file, destination_file *dest, uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    int capture_write(source_file *file, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    int journal_write(capture_journal *journal, source_file *file, destination_file *dest, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    void journal_truncate(capture_journal *journal, source_file *file, const char *dest_path, off_t length) throw();
+    void report_capture_stats(void) throw();
     friend class with_manager_enter_session_and_lock;
 };
 
@@ -148,13 +194,14 @@ extern manager the_manager;
 class with_manager_enter_session_and_lock {
   private:
     manager *m_manager;
+    int m_slot;
   public:
     const bool  entered;
-    with_manager_enter_session_and_lock(manager *m): m_manager(m), entered(m_manager->try_to_enter_session_and_lock()) {
+    with_manager_enter_session_and_lock(manager *m): m_manager(m), m_slot(0), entered(m_manager->try_to_enter_session_and_lock(&m_slot)) {
     }
     ~with_manager_enter_session_and_lock(void) {
         if (entered) {
-            m_manager->exit_session_and_unlock_or_die();
+            m_manager->exit_session_and_unlock_or_die(m_slot);
         }
     }
 };
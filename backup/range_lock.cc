@@ -0,0 +1,268 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "range_lock.h"
+#include "check.h"
+#include "mutex.h"
+
+#include <errno.h>
+#include <time.h>
+
+struct range_lock_waiter {
+    uint64_t m_lo, m_hi;
+    bool m_granted;
+    pthread_cond_t m_cond;
+    range_lock_waiter *m_prev, *m_next;
+};
+
+static bool ranges_intersect (uint64_t lo0, uint64_t hi0,
+                              uint64_t lo1, uint64_t hi1) throw()
+// Effect: Return true iff [lo0,hi0)  (the half-open interval from lo0 inclusive to hi0 exclusive) intersects [lo1, hi1).
+{
+    if (lo0 >= hi0) return false; // range0 is empty
+    if (lo1 >= hi1) return false; // range1 is empty
+    if (hi0 <= lo1) return false; // range0 is before range1
+    if (hi1 <= lo0) return false; // range1 is before range0
+    return true;
+}
+
+static uint64_t usecs_since(const struct timespec &start) throw() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock_stats::range_lock_stats(void) throw()
+    : m_n_locks(0), m_n_waits(0), m_wait_usecs(0), m_max_waiters(0) {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void range_lock_stats::reset(void) throw() {
+    m_n_locks = 0;
+    m_n_waits = 0;
+    m_wait_usecs = 0;
+    m_max_waiters = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock::range_lock(void) throw()
+    : m_first_waiter(NULL),
+      m_last_waiter(NULL),
+      m_n_waiters(0)
+{
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock::~range_lock(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// intersects_locked() -
+//
+// Description:
+//
+//     The locked ranges don't overlap, so the only one that can
+// intersect [lo,hi) without starting at or after hi is the last one
+// that starts before hi.
+//
+bool range_lock::intersects_locked(uint64_t lo, uint64_t hi) const throw() {
+    if (lo >= hi) {
+        return false;
+    }
+    std::map<uint64_t, uint64_t>::const_iterator it = m_locked.lower_bound(hi);
+    if (it == m_locked.begin()) {
+        return false;
+    }
+    --it;
+    return it->second > lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// intersects_waiter_before() -
+//
+// Description:
+//
+//     Returns true if [lo,hi) intersects the range of a waiter that
+// queued before 'before' (or of any waiter, if 'before' is NULL).
+//
+bool range_lock::intersects_waiter_before(const range_lock_waiter *before, uint64_t lo, uint64_t hi) const throw() {
+    for (const range_lock_waiter *w = m_first_waiter; w != before; w = w->m_next) {
+        if (ranges_intersect(w->m_lo, w->m_hi, lo, hi)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// grant_waiters() -
+//
+// Description:
+//
+//     Called when [lo,hi) has been unlocked.  Only a waiter that
+// overlaps it can have been freed, and it gets its range if nothing
+// else is in its way.
+//
+void range_lock::grant_waiters(uint64_t lo, uint64_t hi) throw() {
+    range_lock_waiter *next = NULL;
+    for (range_lock_waiter *w = m_first_waiter; w != NULL; w = next) {
+        next = w->m_next;
+        if (!ranges_intersect(w->m_lo, w->m_hi, lo, hi) ||
+            this->intersects_locked(w->m_lo, w->m_hi) ||
+            this->intersects_waiter_before(w, w->m_lo, w->m_hi)) {
+            continue;
+        }
+        m_locked[w->m_lo] = w->m_hi;
+        if (w->m_prev != NULL) {
+            w->m_prev->m_next = w->m_next;
+        } else {
+            m_first_waiter = w->m_next;
+        }
+        if (w->m_next != NULL) {
+            w->m_next->m_prev = w->m_prev;
+        } else {
+            m_last_waiter = w->m_prev;
+        }
+        m_n_waiters--;
+        w->m_granted = true;
+        int r = pthread_cond_signal(&w->m_cond);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// lock() -
+//
+// Description:
+//
+//     Locks [lo,hi), waiting until no locked range and no earlier
+// waiter is in the way.
+//
+void range_lock::lock(uint64_t lo, uint64_t hi, range_lock_stats *stats) throw() {
+    if (stats != NULL) {
+        stats->m_n_locks++;
+    }
+    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
+    if (lo >= hi) {
+        m_locked_empty.insert(lo);
+        return;
+    }
+    if (!this->intersects_locked(lo, hi) && !this->intersects_waiter_before(NULL, lo, hi)) {
+        m_locked[lo] = hi;
+        return;
+    }
+
+    range_lock_waiter w;
+    w.m_lo = lo;
+    w.m_hi = hi;
+    w.m_granted = false;
+    {
+        int r = pthread_cond_init(&w.m_cond, NULL);
+        check(r==0);
+    }
+    w.m_prev = m_last_waiter;
+    w.m_next = NULL;
+    if (m_last_waiter != NULL) {
+        m_last_waiter->m_next = &w;
+    } else {
+        m_first_waiter = &w;
+    }
+    m_last_waiter = &w;
+    m_n_waiters++;
+    if (stats != NULL) {
+        uint64_t most = stats->m_max_waiters.load();
+        while (m_n_waiters > most && !stats->m_max_waiters.compare_exchange_weak(most, m_n_waiters)) {
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!w.m_granted) {
+        int r = pthread_cond_wait(&w.m_cond, &m_mutex);
+        check(r==0);
+    }
+    if (stats != NULL) {
+        stats->m_n_waits++;
+        stats->m_wait_usecs += usecs_since(start);
+    }
+    {
+        int r = pthread_cond_destroy(&w.m_cond);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int range_lock::unlock(uint64_t lo, uint64_t hi) throw() {
+    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
+    if (lo >= hi) {
+        std::multiset<uint64_t>::iterator it = m_locked_empty.find(lo);
+        if (it == m_locked_empty.end()) {
+            return EINVAL;
+        }
+        m_locked_empty.erase(it);
+        return 0;
+    }
+    std::map<uint64_t, uint64_t>::iterator it = m_locked.find(lo);
+    if (it == m_locked.end() || it->second != hi) {
+        return EINVAL;
+    }
+    m_locked.erase(it);
+    this->grant_waiters(lo, hi);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool range_lock::would_block_unlocked(uint64_t lo, uint64_t hi) const throw() {
+    return this->intersects_locked(lo, hi);
+}
+
+template class std::map<uint64_t, uint64_t>;
+template class std::multiset<uint64_t>;
@@ -0,0 +1,99 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <set>
+
+// What some lockers of range locks have done.  Each locker says where
+// to count, so that a backup session counts only its own.
+struct range_lock_stats {
+    range_lock_stats(void) throw();
+    void reset(void) throw();
+    std::atomic<uint64_t> m_n_locks;      // ranges locked.
+    std::atomic<uint64_t> m_n_waits;      // of those, the ones that had to wait.
+    std::atomic<uint64_t> m_wait_usecs;   // the time spent waiting, summed over those.
+    std::atomic<uint64_t> m_max_waiters;  // the most lockers waiting on one file at once.
+};
+
+struct range_lock_waiter;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// range_lock:
+//
+// Description:
+//
+//     Locks half-open byte ranges [lo,hi) of one file.  The locked
+// ranges never overlap, so they are kept sorted by their low ends, and
+// finding the one a new range might run into takes one lookup.  Empty
+// ranges never block anyone, and are only kept so that unlocking them
+// can be checked.
+//
+//     A locker that has to wait queues up behind everybody, and is
+// granted its range only when it overlaps neither a locked range nor
+// the range of anyone who queued before it.  So lockers of
+// overlapping ranges get them in the order they asked, and a stream of
+// small writes can't starve a big one.  Each waiter sleeps on its own
+// condition variable, and unlock() wakes only the waiters it grants.
+//
+class range_lock {
+  private:
+    pthread_mutex_t m_mutex;
+    std::map<uint64_t, uint64_t> m_locked;     // lo -> hi of each locked non-empty range.
+    std::multiset<uint64_t> m_locked_empty;    // lo of each locked empty range.
+    range_lock_waiter *m_first_waiter;         // the queue of waiters, oldest first.
+    range_lock_waiter *m_last_waiter;
+    uint64_t m_n_waiters;
+
+    bool intersects_locked(uint64_t lo, uint64_t hi) const throw();
+    bool intersects_waiter_before(const range_lock_waiter *before, uint64_t lo, uint64_t hi) const throw();
+    void grant_waiters(uint64_t lo, uint64_t hi) throw();
+  public:
+    range_lock(void) throw();
+    ~range_lock(void) throw();
+    void lock(uint64_t lo, uint64_t hi, range_lock_stats *stats) throw(); // Counts in *stats, unless it is NULL.
+    int unlock(uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result)); // Returns EINVAL if [lo,hi) isn't locked.
+    bool would_block_unlocked(uint64_t lo, uint64_t hi) const throw(); // Does [lo,hi) intersect a locked range?  Takes no lock, so only for tests.
+};
+
+#endif // End of header guardian.
@@ -151,6 +151,12 @@ ssize_t call_real_read(int fildes, const void *buf, size_t nbyte) throw() {
     return real_read(fildes, buf, nbyte);
 }
 
+ssize_t call_real_pread(int fildes, void *buf, size_t nbyte, off_t offset) throw() {
+    static ssize_t (*real_pread)(int fildes, void *buf, size_t nbyte, off_t offset) = NULL;
+    dlsym_set(&real_pread, "pread");
+    return real_pread(fildes, buf, nbyte, offset);
+}
+
 static pwrite_fun_t real_pwrite = NULL;
 
 ssize_t call_real_pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) throw() {
@@ -190,6 +196,19 @@ ftruncate_fun_t register_ftruncate(ftruncate_fun_t f) throw() {
     return r;
 }
 
+static int (*real_fallocate)(int fd, int mode, off_t offset, off_t len) = NULL;
+int call_real_fallocate(int fd, int mode, off_t offset, off_t len) throw() {
+    dlsym_set(&real_fallocate, "fallocate");
+    return real_fallocate(fd, mode, offset, len);
+}
+
+fallocate_fun_t register_fallocate(fallocate_fun_t f) throw() {
+    dlsym_set(&real_fallocate, "fallocate");
+    fallocate_fun_t r = real_fallocate;
+    real_fallocate = f;
+    return r;
+}
+
 int call_real_truncate(const char *path, off_t length) throw() {
     static int (*real_truncate)(const char *path, off_t length) = NULL;
     dlsym_set(&real_truncate, "truncate");
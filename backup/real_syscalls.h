@@ -47,8 +47,10 @@ int call_real_close(int fd) throw()  __attribute__((warn_unused_result));
 ssize_t call_real_write(int fd, const void *buf, size_t nbyte) throw() __attribute__((warn_unused_result));
 ssize_t call_real_read(int fildes, const void *buf, size_t nbyte) throw() __attribute__((warn_unused_result));
 ssize_t call_real_pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+ssize_t call_real_pread(int fildes, void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
 off_t call_real_lseek(int fd, off_t offset, int whence) throw() __attribute__((warn_unused_result));
 int call_real_ftruncate(int fildes, off_t length) throw() __attribute__((warn_unused_result));
+int call_real_fallocate(int fd, int mode, off_t offset, off_t len) throw() __attribute__((warn_unused_result));
 int call_real_truncate(const char *path, off_t length) throw() __attribute__((__nonnull__ (1)))  __attribute__((warn_unused_result));
 int call_real_unlink(const char *path) throw() __attribute__((__nonnull__ (1)))  __attribute__((warn_unused_result));
 int call_real_rename(const char* oldpath, const char* newpath) throw() __attribute__((warn_unused_result));
@@ -73,6 +75,9 @@ lseek_fun_t register_lseek(lseek_fun_t new_lseek) throw();
 typedef int (*ftruncate_fun_t)(int, off_t);
 ftruncate_fun_t register_ftruncate(ftruncate_fun_t new_ftruncate) throw();
 
+typedef int (*fallocate_fun_t)(int, int, off_t, off_t);
+fallocate_fun_t register_fallocate(fallocate_fun_t new_fallocate) throw();
+
 typedef int (*unlink_fun_t)(const char *);
 unlink_fun_t register_unlink(unlink_fun_t new_unlink) throw();
 
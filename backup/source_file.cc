@@ -35,13 +35,16 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "backup_debug.h"
+#include "capture_journal.h"
 #include "check.h"
 #include "manager.h"
 #include "mutex.h"
@@ -63,44 +66,60 @@ source_file::source_file(const char *path) throw()
    m_reference_count(0),
    m_unlinked(false),
    m_destination_file(NULL),
-   m_flags(0)
+   m_flags(0),
+   m_n_copies(0),
+   m_block_versions(NULL),
+   m_resizes(0),
+   m_n_resizing(0),
+   m_n_optimistic(0),
+   m_n_dirty_blocks(0),
+   m_dirty_listed(false)
 {
     {
-        int r = pthread_mutex_init(&m_mutex, NULL);
+        int r = pthread_rwlock_init(&m_name_rwlock, NULL);
         check(r==0);
     }
     {
-        int r = pthread_cond_init(&m_cond, NULL);
+        int r = pthread_mutex_init(&m_fd_mutex, NULL);
         check(r==0);
     }
     {
-        int r = pthread_rwlock_init(&m_name_rwlock, NULL);
+        int r = pthread_mutex_init(&m_destination_mutex, NULL);
         check(r==0);
     }
     {
-        int r = pthread_mutex_init(&m_fd_mutex, NULL);
+        int r = pthread_mutex_init(&m_copy_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_mutex_init(&m_dirty_mutex, NULL);
         check(r==0);
     }
 }
 
 source_file::~source_file(void) throw() {
+    this->wait_for_captures();
     if (m_full_path != NULL) {
         free(m_full_path);
         m_full_path = NULL;
         {
-            int r = pthread_mutex_destroy(&m_mutex);
+            int r = pthread_rwlock_destroy(&m_name_rwlock);
             check(r==0);
         }
         {
-            int r = pthread_cond_destroy(&m_cond);
+            int r = pthread_mutex_destroy(&m_fd_mutex);
             check(r==0);
         }
         {
-            int r = pthread_rwlock_destroy(&m_name_rwlock);
+            int r = pthread_mutex_destroy(&m_destination_mutex);
             check(r==0);
         }
         {
-            int r = pthread_mutex_destroy(&m_fd_mutex);
+            int r = pthread_mutex_destroy(&m_copy_mutex);
+            check(r==0);
+        }
+        {
+            int r = pthread_mutex_destroy(&m_dirty_mutex);
             check(r==0);
         }
     }
@@ -109,6 +128,7 @@ source_file::~source_file(void) throw() {
         delete m_destination_file;
         m_destination_file = NULL;
     }
+    delete [] m_block_versions.load();
 }
 
 ////////////////////////////////////////////////////////
@@ -129,62 +149,441 @@ void source_file::set_next(source_file *next_source) throw() {
     m_next = next_source;
 }
 
-static bool ranges_intersect (uint64_t lo0, uint64_t hi0,
-                              uint64_t lo1, uint64_t hi1) throw()
-// Effect: Return true iff [lo0,hi0)  (the half-open interval from lo0 inclusive to hi0 exclusive) intersects [lo1, hi1).
-{
-    if (lo0 >= hi0) return false; // range0 is empty
-    if (lo1 >= hi1) return false; // range1 is empty
-    if (hi0 <= lo1) return false; // range0 is before range1
-    if (hi1 <= lo0) return false; // range1 is before range0
-    return true;
+bool source_file::lock_range_would_block_unlocked(uint64_t lo, uint64_t hi) const throw() {
+    return m_range_lock.would_block_unlocked(lo, hi);
 }
 
-bool source_file::lock_range_would_block_unlocked(uint64_t lo, uint64_t hi) const throw() {
-    size_t size = m_locked_ranges.size();    
-    for (size_t i = 0; i<size; i++) {
-        if (ranges_intersect(m_locked_ranges[i].lo, m_locked_ranges[i].hi,
-                             lo, hi)) {
+////////////////////////////////////////////////////////
+//
+void source_file::lock_range(uint64_t lo, uint64_t hi, range_lock_stats *stats) throw() {
+    m_range_lock.lock(lo, hi, stats);
+}
+
+
+////////////////////////////////////////////////////////
+//
+int source_file::unlock_range(uint64_t lo, uint64_t hi) throw() {
+    int r = m_range_lock.unlock(lo, hi);
+    if (r != 0) {
+        // No such range.
+        the_manager.fatal_error(r, "Range doesn't exist at %s:%d", __FILE__, __LINE__);
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////
+//
+// start_copy() -
+//
+// Description:
+//
+//     Says that a copy of the whole file is about to start.  If
+// another copy is already running we leave its ranges alone: the new
+// copy will read what it hasn't, so they are still right, and what
+// the old copy has read must still be captured.
+//
+//     Otherwise writes made before now were captured for the whole
+// file, and some may still be queued.  The copy will read newer data
+// than theirs, and later writes to those bytes are left out, so they
+// must be in the backup copy before the copy reads anything.  We lock
+// the whole file first, so that a writer that looked before we marked
+// it uncopied has queued its write by the time we wait.  Likewise a
+// capture journal may hold such writes, so we note in it that the copy
+// starts, and its replay leaves out what it recorded before.
+//
+void source_file::start_copy(capture_journal *journal, range_lock_stats *stats) throw() {
+    bool first_copy;
+    {
+        with_mutex_locked ml(&m_copy_mutex);
+        first_copy = (m_n_copies.fetch_add(1) == 0);
+        if (first_copy) {
+            m_uncopied.clear();
+            m_uncopied[0] = UINT64_MAX;
+        }
+    }
+    if (first_copy) {
+        this->lock_range(0, LLONG_MAX, stats);
+        this->wait_for_captures();
+        if (journal != NULL && m_destination_file != NULL) {
+            with_source_file_name_read_lock snl(this);
+            ignore(journal->start_copy(m_destination_file)); // It's been reported.
+        }
+        ignore(this->unlock_range(0, LLONG_MAX));
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+// mark_copied() -
+//
+// Description:
+//
+//     Takes [lo,hi) out of the ranges still to be read.  The caller
+// has read it (or found a hole there) with the range locked, so any
+// later write to it must be captured.
+//
+void source_file::mark_copied(uint64_t lo, uint64_t hi) throw() {
+    if (lo >= hi || m_n_copies.load() == 0) {
+        return;
+    }
+    with_mutex_locked ml(&m_copy_mutex);
+    std::map<uint64_t, uint64_t>::iterator it = m_uncopied.upper_bound(lo);
+    if (it != m_uncopied.begin()) {
+        --it;
+    }
+    while (it != m_uncopied.end() && it->first < hi) {
+        const uint64_t range_lo = it->first;
+        const uint64_t range_hi = it->second;
+        if (range_hi <= lo) {
+            ++it;
+            continue;
+        }
+        it = m_uncopied.erase(it);
+        if (range_lo < lo) {
+            m_uncopied[range_lo] = lo;
+        }
+        if (hi < range_hi) {
+            m_uncopied[hi] = range_hi;
+            break;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::finish_copy(void) throw() {
+    with_mutex_locked ml(&m_copy_mutex);
+    check(m_n_copies.load() > 0);
+    if (m_n_copies.fetch_sub(1) == 1) {
+        m_uncopied.clear();
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+bool source_file::copy_in_progress(void) const throw() {
+    return m_n_copies.load() != 0;
+}
+
+////////////////////////////////////////////////////////
+//
+// copy_will_read() -
+//
+// Description:
+//
+//     Returns true if a copy in progress has yet to read all of
+// [lo,hi), in which case it will read whatever the application has
+// just written there, and the write needn't be captured.  A write
+// that is only partly ahead of the copy is captured in full.  The
+// caller holds the range lock, so the copy can't get there meanwhile.
+//
+bool source_file::copy_will_read(uint64_t lo, uint64_t hi) throw() {
+    if (m_n_copies.load() == 0) {
+        return false;
+    }
+    with_mutex_locked ml(&m_copy_mutex);
+    std::map<uint64_t, uint64_t>::const_iterator it = m_uncopied.upper_bound(lo);
+    if (it == m_uncopied.begin()) {
+        return false;
+    }
+    --it;
+    return (it->first <= lo && hi <= it->second);
+}
+
+////////////////////////////////////////////////////////
+//
+bool source_file::copy_will_read_any(uint64_t lo, uint64_t hi) throw() {
+    if (m_n_copies.load() == 0) {
+        return false;
+    }
+    with_mutex_locked ml(&m_copy_mutex);
+    std::map<uint64_t, uint64_t>::const_iterator it = m_uncopied.upper_bound(lo);
+    if (it != m_uncopied.begin()) {
+        std::map<uint64_t, uint64_t>::const_iterator before = it;
+        --before;
+        if (before->second > lo) {
             return true;
         }
     }
-    return false;
+    return (it != m_uncopied.end() && it->first < hi);
 }
 
 ////////////////////////////////////////////////////////
 //
-void source_file::lock_range(uint64_t lo, uint64_t hi) throw() {
-    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
-    while (this->lock_range_would_block_unlocked(lo, hi)) {
-        int r = pthread_cond_wait(&m_cond, &m_mutex);
-        check(r==0);
+void source_file::copied_parts(uint64_t lo, uint64_t hi, std::vector<std::pair<uint64_t, uint64_t> > *parts) throw() {
+    parts->clear();
+    if (m_n_copies.load() == 0) {
+        parts->push_back(std::make_pair(lo, hi));
+        return;
+    }
+    with_mutex_locked ml(&m_copy_mutex);
+    std::map<uint64_t, uint64_t>::const_iterator it = m_uncopied.upper_bound(lo);
+    if (it != m_uncopied.begin()) {
+        std::map<uint64_t, uint64_t>::const_iterator before = it;
+        --before;
+        if (before->second > lo) {
+            lo = before->second;
+        }
+    }
+    for (; lo < hi; ++it) {
+        const uint64_t end = (it == m_uncopied.end() || it->first > hi) ? hi : it->first;
+        if (lo < end) {
+            parts->push_back(std::make_pair(lo, end));
+        }
+        if (it == m_uncopied.end()) {
+            break;
+        }
+        lo = it->second;
     }
-    // Got here, we don't intersect any of the ranges.
-    struct range new_range = {lo,hi};
-    m_locked_ranges.push_back((struct range)new_range);
 }
 
+////////////////////////////////////////////////////////
+//
+// note_write() -
+//
+// Description:
+//
+//     Bumps the version of each block of [lo,hi).  Until some copy of
+// the file has taken a snapshot there are no counters, and nothing to
+// do: the copy hadn't started to read when this write reached the
+// source, so it will see it.
+//
+void source_file::note_write(uint64_t lo, uint64_t hi) throw() {
+    std::atomic<uint64_t> *versions = m_block_versions.load();
+    if (versions == NULL || lo >= hi) {
+        return;
+    }
+    const uint64_t first = lo / VERSION_BLOCK_SIZE;
+    uint64_t last = (hi - 1) / VERSION_BLOCK_SIZE;
+    if (last - first >= VERSION_STRIPES) {
+        last = first + VERSION_STRIPES - 1;
+    }
+    for (uint64_t block = first; block <= last; ++block) {
+        versions[block % VERSION_STRIPES]++;
+    }
+}
 
 ////////////////////////////////////////////////////////
 //
-int source_file::unlock_range(uint64_t lo, uint64_t hi) throw() {
-    with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
-    size_t size = m_locked_ranges.size();
-    for (size_t i=0; i<size; i++) {
-        if (m_locked_ranges[i].lo == lo &&
-            m_locked_ranges[i].hi == hi) {
-            m_locked_ranges[i] = m_locked_ranges[size-1];
-            m_locked_ranges.pop_back();
-            {
-                int r = pthread_cond_broadcast(&m_cond);
-                check(r==0);
+// start_optimistic_copy() -
+//
+// Description:
+//
+//     We count ourselves in before looking for resizes, and a resize
+// counts itself in before waiting for optimistic copies to finish, so
+// either we see the resize and copy with the range lock, or the resize
+// waits until our copy is in the backup copy before changing it.
+//
+bool source_file::start_optimistic_copy(uint64_t lo, uint64_t hi, copy_snapshot *snapshot) throw() {
+    m_n_optimistic++;
+    if (m_n_resizing.load() != 0) {
+        m_n_optimistic--;
+        return false;
+    }
+    std::atomic<uint64_t> *versions = m_block_versions.load();
+    if (versions == NULL) {
+        with_mutex_locked ml(&m_copy_mutex);
+        versions = m_block_versions.load();
+        if (versions == NULL) {
+            versions = new std::atomic<uint64_t>[VERSION_STRIPES];
+            for (uint64_t i = 0; i < VERSION_STRIPES; ++i) {
+                versions[i] = 0;
             }
-            return 0;
+            m_block_versions = versions;
+        }
+    }
+    snapshot->m_resizes = m_resizes.load();
+    const uint64_t first = lo / VERSION_BLOCK_SIZE;
+    const uint64_t n_blocks = (hi - 1) / VERSION_BLOCK_SIZE + 1 - first;
+    snapshot->m_versions.resize(n_blocks);
+    for (uint64_t i = 0; i < n_blocks; ++i) {
+        snapshot->m_versions[i] = versions[(first + i) % VERSION_STRIPES].load();
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::finish_optimistic_copy(void) throw() {
+    m_n_optimistic--;
+}
+
+////////////////////////////////////////////////////////
+//
+// changed_parts() -
+//
+// Description:
+//
+//     Returns the runs of blocks whose versions have moved on since the
+// snapshot, cut down to [lo,hi).  After a resize it all may have
+// changed.  A block may be reported because a write to another block
+// that shares its counter bumped it, which only costs a copy.
+//
+void source_file::changed_parts(uint64_t lo, uint64_t hi, const copy_snapshot &snapshot, std::vector<std::pair<uint64_t, uint64_t> > *parts) throw() {
+    parts->clear();
+    if (lo >= hi) {
+        return;
+    }
+    if (m_resizes.load() != snapshot.m_resizes) {
+        parts->push_back(std::make_pair(lo, hi));
+        return;
+    }
+    const std::atomic<uint64_t> *versions = m_block_versions.load();
+    const uint64_t first = lo / VERSION_BLOCK_SIZE;
+    const uint64_t last = (hi - 1) / VERSION_BLOCK_SIZE;
+    for (uint64_t block = first; block <= last && block - first < snapshot.m_versions.size(); ++block) {
+        if (versions[block % VERSION_STRIPES].load() == snapshot.m_versions[block - first]) {
+            continue;
+        }
+        const uint64_t part_lo = (block == first) ? lo : block * VERSION_BLOCK_SIZE;
+        const uint64_t part_hi = (block == last) ? hi : (block + 1) * VERSION_BLOCK_SIZE;
+        if (!parts->empty() && parts->back().second == part_lo) {
+            parts->back().second = part_hi;
+        } else {
+            parts->push_back(std::make_pair(part_lo, part_hi));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::begin_resize(void) throw() {
+    m_n_resizing++;
+    m_resizes++;
+    while (m_n_optimistic.load() != 0) {
+        sched_yield();
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::end_resize(void) throw() {
+    m_n_resizing--;
+}
+
+////////////////////////////////////////////////////////
+//
+// mark_dirty() -
+//
+// Description:
+//
+//     Sets the bits of every block that [lo,hi) touches.  The bitmap
+// grows to cover the highest block written.
+//
+bool source_file::mark_dirty(uint64_t lo, uint64_t hi) throw() {
+    if (lo >= hi) {
+        return false;
+    }
+    const uint64_t first = lo / DIRTY_BLOCK_SIZE;
+    const uint64_t last = (hi - 1) / DIRTY_BLOCK_SIZE;
+    with_mutex_locked ml(&m_dirty_mutex);
+    if (m_dirty_blocks.size() <= last / 64) {
+        m_dirty_blocks.resize(last / 64 + 1, 0);
+    }
+    for (uint64_t block = first; block <= last; ++block) {
+        const uint64_t bit = 1ULL << (block % 64);
+        uint64_t &word = m_dirty_blocks[block / 64];
+        if ((word & bit) == 0) {
+            word |= bit;
+            m_n_dirty_blocks++;
+        }
+    }
+    const bool newly_listed = !m_dirty_listed;
+    m_dirty_listed = true;
+    return newly_listed;
+}
+
+////////////////////////////////////////////////////////
+//
+// next_dirty() -
+//
+// Description:
+//
+//     Finds the first run of dirty blocks that starts at or after
+// from, skipping clean words a word at a time, and returns it in
+// [*lo,*hi), cut off at max_length bytes (which must be a multiple of
+// DIRTY_BLOCK_SIZE).  Returns false if there are none.
+//
+bool source_file::next_dirty(uint64_t from, uint64_t max_length, uint64_t *lo, uint64_t *hi) throw() {
+    with_mutex_locked ml(&m_dirty_mutex);
+    if (m_n_dirty_blocks == 0) {
+        return false;
+    }
+    const uint64_t n_blocks = m_dirty_blocks.size() * 64;
+    uint64_t block = (from + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+    while (block < n_blocks) {
+        const uint64_t word = m_dirty_blocks[block / 64] >> (block % 64);
+        if (word == 0) {
+            block = (block / 64 + 1) * 64;
+            continue;
         }
+        block += __builtin_ctzll(word);
+        break;
+    }
+    if (block >= n_blocks) {
+        return false;
     }
-    // No such range.
-    the_manager.fatal_error(EINVAL, "Range doesn't exist at %s:%d", __FILE__, __LINE__);
-    return EINVAL;
+    const uint64_t max_blocks = max_length / DIRTY_BLOCK_SIZE;
+    uint64_t end = block + 1;
+    while (end < n_blocks && end - block < max_blocks &&
+           (m_dirty_blocks[end / 64] & (1ULL << (end % 64))) != 0) {
+        end++;
+    }
+    *lo = block * DIRTY_BLOCK_SIZE;
+    *hi = end * DIRTY_BLOCK_SIZE;
+    return true;
+}
+
+////////////////////////////////////////////////////////
+//
+// clear_dirty() -
+//
+// Description:
+//
+//     Clears the blocks of [lo,hi), which must be whole blocks.  The
+// caller is about to read them from the source with the range locked,
+// so a write that lands there once the lock is released sets them
+// again.
+//
+void source_file::clear_dirty(uint64_t lo, uint64_t hi) throw() {
+    with_mutex_locked ml(&m_dirty_mutex);
+    const uint64_t n_blocks = m_dirty_blocks.size() * 64;
+    for (uint64_t block = lo / DIRTY_BLOCK_SIZE; block < hi / DIRTY_BLOCK_SIZE && block < n_blocks; ++block) {
+        const uint64_t bit = 1ULL << (block % 64);
+        uint64_t &word = m_dirty_blocks[block / 64];
+        if ((word & bit) != 0) {
+            word &= ~bit;
+            m_n_dirty_blocks--;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+uint64_t source_file::dirty_bytes(void) throw() {
+    with_mutex_locked ml(&m_dirty_mutex);
+    return m_n_dirty_blocks * DIRTY_BLOCK_SIZE;
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::forget_dirty(void) throw() {
+    with_mutex_locked ml(&m_dirty_mutex);
+    m_dirty_blocks.clear();
+    m_n_dirty_blocks = 0;
+    m_dirty_listed = false;
+}
+
+////////////////////////////////////////////////////////
+//
+capture_list *source_file::captures(void) throw() {
+    return &m_captures;
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::wait_for_captures(void) throw() {
+    m_captures.wait_until_empty();
 }
 
 ////////////////////////////////////////////////////////
@@ -209,10 +608,12 @@ void source_file::name_unlock(void) throw() {
 //
 int source_file::rename(const char * new_name) throw() {
     int r = 0;
-    free(m_full_path);
-    m_full_path = call_real_realpath(new_name, NULL);
-    if (m_full_path == NULL) {
-        r = errno;
+    char *full_path = strdup(new_name);
+    if (full_path == NULL) {
+        r = ENOMEM;
+    } else {
+        free(m_full_path);
+        m_full_path = full_path;
     }
 
     return r;
@@ -270,6 +671,7 @@ void source_file::try_to_remove_destination(void) throw() {
         return;
     }
 
+    this->wait_for_captures();
     ignore(m_destination_file->close());
     delete m_destination_file;
     m_destination_file = NULL;
@@ -333,6 +735,20 @@ bool source_file::given_flags_are_different(const int flags)
     return true;
 }
 
+////////////////////////////////////////////////////////
+//
+void source_file::destination_lock(void) throw()
+{
+    pmutex_lock(&m_destination_mutex);
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::destination_unlock(void) throw()
+{
+    pmutex_unlock(&m_destination_mutex);
+}
+
 ////////////////////////////////////////////////////////
 //
 void source_file::fd_lock(void) throw()
@@ -346,6 +762,3 @@ void source_file::fd_unlock(void) throw()
 {
     pmutex_unlock(&m_fd_mutex);
 }
-
-// Instantiate the templates we need
-template class std::vector<range>;
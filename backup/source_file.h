@@ -39,12 +39,26 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include <stdint.h>
 #include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
 
+#include "capture_queue.h"
 #include "destination_file.h"
 #include "description.h"
+#include "range_lock.h"
 
-struct range {
-    uint64_t lo, hi;
+class capture_journal;
+
+const uint64_t DIRTY_BLOCK_SIZE = 4096; // what one bit of a file's dirty blocks covers.
+const uint64_t VERSION_BLOCK_SIZE = 4096; // what one version counter covers.
+const uint64_t VERSION_STRIPES = 1024;    // version counters per file.  Blocks that many apart share one.
+
+// What an optimistic copy saw before it copied a range without the
+// range lock (see source_file::start_optimistic_copy()).
+struct copy_snapshot {
+    uint64_t m_resizes;
+    std::vector<uint64_t> m_versions; // one for each block of the range.
 };
 
 class source_file {
@@ -55,8 +69,8 @@ public:
     source_file *next(void) const throw();
     void set_next(source_file *next) throw();
 
-    void lock_range(uint64_t lo, uint64_t  hi) throw();
-    // Effect: Lock the range specified by [lo,hi) (that is lo inclusive to hi exclusive).   Blocks until no locked range intersects [lo,hi).  Use hi==LLONG_MAX to specify the whole file.  No errors can happen (the only possible errors are pthread mutex errors or memory allcoation errors, in which case it's better just to abort).
+    void lock_range(uint64_t lo, uint64_t  hi, range_lock_stats *stats) throw();
+    // Effect: Lock the range specified by [lo,hi) (that is lo inclusive to hi exclusive), counting in *stats unless it is NULL.   Blocks until no locked range intersects [lo,hi), and no one who asked earlier is waiting for a range that intersects it.  Use hi==LLONG_MAX to specify the whole file.  No errors can happen (the only possible errors are pthread mutex errors or memory allcoation errors, in which case it's better just to abort).
 
     int unlock_range(uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
     // Effect: Unlock the specified range.  Requires that the range is locked (if we notice a problem we'll return EINVAL).  Return 0 or an error number.
@@ -71,7 +85,7 @@ public:
     void name_read_lock(void) throw();
     void name_unlock(void) throw();
   public:
-    int rename(const char * new_name) throw(); // return 0 on success, error number on failure (doesn't set errno)
+    int rename(const char * new_name) throw(); // new_name must be a full path.  return 0 on success, error number on failure (doesn't set errno)
 
     // Note: These three methods are not inherintly thread safe.
     // They must be protected with a mutex.
@@ -84,12 +98,58 @@ public:
     // Methods to manage the lifetime of the destination file
     // corresponding to this source file object.  The lifetime of the
     // destination file should be scoped to a particular backup
-    // session object lifetime.
+    // session object lifetime.  Hold the destination lock (see
+    // with_source_file_destination_lock) around them.
     destination_file * get_destination(void) const throw();
     void set_destination(destination_file * destination) throw();
     void try_to_remove_destination(void) throw();
     int try_to_create_destination_file(const char*) throw();
 
+    // The copier's progress, so that a captured write to a part of
+    // the file that the copier is still going to read needn't go into
+    // the backup copy.  Each copy of the file is bracketed by
+    // start_copy() and finish_copy(), and marks what it has read with
+    // mark_copied().  mark_copied() and copy_will_read() must be
+    // called with [lo,hi) range locked.
+    void start_copy(capture_journal *journal, range_lock_stats *stats) throw(); // journal, if not NULL, is told that the copy starts.
+    void mark_copied(uint64_t lo, uint64_t hi) throw();
+    void finish_copy(void) throw();
+    bool copy_in_progress(void) const throw();                  // Is a copy between start_copy() and finish_copy()?
+    bool copy_will_read(uint64_t lo, uint64_t hi) throw();      // Has some copy yet to read all of [lo,hi)?
+    bool copy_will_read_any(uint64_t lo, uint64_t hi) throw();  // Has some copy yet to read any of [lo,hi)?
+    void copied_parts(uint64_t lo, uint64_t hi, std::vector<std::pair<uint64_t, uint64_t> > *parts) throw(); // The parts of [lo,hi) that no copy has yet to read.
+
+    // Captured writes waiting to go into the backup copy.  Anything
+    // else that changes the backup copy must wait for them first.
+    capture_list *captures(void) throw();
+    void wait_for_captures(void) throw();
+
+    // Version counters, so that the copier can copy a range without
+    // holding its range lock, and then check, with it, whether any
+    // block changed meanwhile.  Writers call note_write() after
+    // writing the source, with the range locked.  Anything else that
+    // changes the size of the file, or a range of the backup copy,
+    // calls begin_resize() and end_resize() around that (also with the
+    // range locked), and waits for optimistic copies to finish first.
+    void note_write(uint64_t lo, uint64_t hi) throw();
+    bool start_optimistic_copy(uint64_t lo, uint64_t hi, copy_snapshot *snapshot) throw() __attribute__((warn_unused_result));
+    // Effect: Take a snapshot of the versions of [lo,hi).  Returns false (and the copy must hold the range lock after all) if a resize is going on.
+    void finish_optimistic_copy(void) throw(); // Call once the copy is in the backup copy, before locking the range.
+    void changed_parts(uint64_t lo, uint64_t hi, const copy_snapshot &snapshot, std::vector<std::pair<uint64_t, uint64_t> > *parts) throw();
+    // Effect: Find the parts of [lo,hi) that may have changed since the snapshot.  Requires [lo,hi) range locked.
+    void begin_resize(void) throw();
+    void end_resize(void) throw();
+
+    // The blocks that have changed since the copier read them, when
+    // the backup tracks dirty blocks instead of capturing writes (see
+    // dirty_set).  mark_dirty() and clear_dirty() must be called with
+    // [lo,hi) range locked.
+    bool mark_dirty(uint64_t lo, uint64_t hi) throw(); // Returns true if the file wasn't listed as dirty, and now is.
+    bool next_dirty(uint64_t from, uint64_t max_length, uint64_t *lo, uint64_t *hi) throw(); // Find the first dirty run at or after from, at most max_length long.
+    void clear_dirty(uint64_t lo, uint64_t hi) throw();
+    uint64_t dirty_bytes(void) throw();
+    void forget_dirty(void) throw();  // Clear every block, and take the file off the list.
+
     // This method allows us to change the Direct I/O related flags
     // on the given source file.
     void set_flags(const int flags);
@@ -97,6 +157,10 @@ public:
     bool locked_direct_io_flag_is_set(void);
     bool given_flags_are_different(const int flags);
 
+private: // Use the RAII-style with_source_file_destination_lock to grab the lock.  It comes before the name lock.
+    void destination_lock(void) throw();
+    void destination_unlock(void) throw();
+
 private: // Fd locking using RAII-style object with_source_file_fd_lock to grab the lock.
     void fd_lock(void) throw();
     void fd_unlock(void) throw();
@@ -107,9 +171,7 @@ private:
     pthread_rwlock_t m_name_rwlock;
     std::atomic_uint m_reference_count;
 
-    pthread_mutex_t  m_mutex;
-    pthread_cond_t   m_cond;
-    std::vector<struct range> m_locked_ranges;
+    range_lock m_range_lock;
 
     bool m_unlinked;
     destination_file * m_destination_file;
@@ -117,9 +179,28 @@ private:
     pthread_mutex_t  m_fd_mutex;
     int m_flags;
 
+    pthread_mutex_t  m_destination_mutex; // protects m_destination_file and m_unlinked.
+
+    pthread_mutex_t  m_copy_mutex;          // protects m_uncopied.
+    std::atomic<int> m_n_copies;            // copies in progress.  While it is zero, m_uncopied is empty.
+    std::map<uint64_t, uint64_t> m_uncopied; // disjoint [lo,hi) ranges that some copy in progress has yet to read.
+
+    capture_list m_captures;
+
+    std::atomic<std::atomic<uint64_t> *> m_block_versions; // VERSION_STRIPES counters, made by the first optimistic copy (under m_copy_mutex).
+    std::atomic<uint64_t> m_resizes;      // resizes begun.
+    std::atomic<int> m_n_resizing;        // resizes in progress.
+    std::atomic<int> m_n_optimistic;      // copies in progress without the range lock.
+
+    pthread_mutex_t m_dirty_mutex;        // protects the dirty blocks.
+    std::vector<uint64_t> m_dirty_blocks; // one bit per DIRTY_BLOCK_SIZE bytes of the file.
+    uint64_t m_n_dirty_blocks;
+    bool m_dirty_listed;                  // on a dirty_set's list of files.
+
     friend class with_source_file_name_write_lock;
     friend class with_source_file_name_read_lock;
     friend class with_source_file_fd_lock;
+    friend class with_source_file_destination_lock;
 };
 
 class with_source_file_name_write_lock {
@@ -146,6 +227,18 @@ class with_source_file_name_read_lock {
     }
 };
 
+class with_source_file_destination_lock {
+  private:
+    source_file *m_source_file;
+  public:
+    with_source_file_destination_lock(source_file *sf) : m_source_file(sf) {
+        m_source_file->destination_lock();
+    }
+    ~with_source_file_destination_lock(void) {
+        m_source_file->destination_unlock();
+    }
+};
+
 class with_source_file_fd_lock {
   private:
     source_file *m_source_file;
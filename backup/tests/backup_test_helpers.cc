@@ -36,15 +36,19 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include <fcntl.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "backup_helgrind.h"
 
 #include "backup_test_helpers.h"
 #include "backup_internal.h"
 #include "backup_callbacks.h"
+#include "backup_manifest.h"
 
 const char * const DEFAULT_TERM = "\033[0m";
 const char * const RED_TERM = "\033[31m";
@@ -85,6 +89,92 @@ int openf(int flags, int mode, const char *formatstring, ...) {
     return r;
 }
 
+void overwrite(const char *dir, const char *name, off_t offset, const char *data) {
+    int fd = openf(O_WRONLY, 0, "%s/%s", dir, name);
+    check(fd >= 0);
+    ssize_t n = pwrite(fd, data, strlen(data), offset);
+    check(n == (ssize_t)strlen(data));
+    int r = close(fd);
+    check(r == 0);
+}
+
+off_t allocated_bytes(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    struct stat sbuf;
+    int r = stat(path, &sbuf);
+    check(r == 0);
+    return sbuf.st_blocks * 512;
+}
+
+int create_file(const char *dir, const char *name, size_t size) {
+    int fd = openf(O_CREAT | O_RDWR, 0777, "%s/%s", dir, name);
+    check(fd >= 0);
+    char buf[4096];
+    memset(buf, name[0], sizeof(buf));
+    for (size_t n = 0; n < size; n += sizeof(buf)) {
+        ssize_t r = write(fd, buf, sizeof(buf));
+        check(r == (ssize_t) sizeof(buf));
+    }
+    return fd;
+}
+
+void *write_until_copied(void *hot_v) {
+    const hot_file *hot = (const hot_file *) hot_v;
+    const size_t block = 4096;
+    char buf[block];
+    unsigned int seed = 1;
+    for (int i = 0; !hot->m_done(); i++) {
+        memset(buf, 'a' + i % 26, sizeof(buf));
+        if (hot->m_truncate_every != 0 && i % hot->m_truncate_every == hot->m_truncate_every - 1) {
+            int r = ftruncate(hot->m_fd, hot->m_size - (rand_r(&seed) % 64) * block - 17);
+            check(r == 0);
+            continue;
+        }
+        const off_t offset = (rand_r(&seed) % (hot->m_size / block)) * block + (i % 7) * 100;
+        ssize_t r = pwrite(hot->m_fd, buf, sizeof(buf), offset);
+        check(r == (ssize_t) sizeof(buf));
+        if (hot->m_after_write != NULL) {
+            hot->m_after_write(i, buf);
+        }
+        if (i % 16 == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void restore_file(const char *full, const char *incr, const char *restore, const char *name, const manifest_file *file) {
+    if (file == NULL) {
+        check(systemf("cp %s/%s %s/%s", incr, name, restore, name) == 0);
+        return;
+    }
+    // A file that is new since the full backup has all its blocks present.
+    check(systemf("cp %s/%s %s/%s 2>/dev/null || touch %s/%s", full, name, restore, name, restore, name) == 0);
+    int in_fd = openf(O_RDONLY, 0, "%s/%s", incr, name);
+    check(in_fd >= 0);
+    int out_fd = openf(O_WRONLY, 0, "%s/%s", restore, name);
+    check(out_fd >= 0);
+    char *buf = (char *) malloc(MANIFEST_BLOCK_SIZE);
+    check(buf != NULL);
+    for (uint64_t block = 0; block < file->m_flags.size(); ++block) {
+        if (!(file->m_flags[block] & MANIFEST_BLOCK_PRESENT)) {
+            continue;
+        }
+        ssize_t n = pread(in_fd, buf, MANIFEST_BLOCK_SIZE, block * MANIFEST_BLOCK_SIZE);
+        check(n >= 0);
+        ssize_t n_wrote = pwrite(out_fd, buf, n, block * MANIFEST_BLOCK_SIZE);
+        check(n_wrote == n);
+    }
+    int r = ftruncate(out_fd, file->m_size);
+    check(r == 0);
+    free(buf);
+    r = close(in_fd);
+    check(r == 0);
+    r = close(out_fd);
+    check(r == 0);
+}
+
 void setup_destination(void) {
     char *dst = get_dst();
     systemf("rm -rf %s", dst);
@@ -289,6 +379,19 @@ void finish_backup_thread(pthread_t thread) {
     delete(extra);
 }
 
+void backup_with_copy_threads(int n_threads, struct tokubackup_stats *stats) {
+    char *src = get_src();
+    check(tokubackup_set_device_limits(src, n_threads, 0) == 0);
+    tokubackup_set_copy_threads(n_threads);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    tokubackup_set_copy_threads(1);
+    check(tokubackup_set_device_limits(src, 0, 0) == 0);
+    free(src);
+    tokubackup_get_stats(stats);
+}
+
 static const char *test_name = NULL;
 
 char *get_dst(int dir_index) {
@@ -89,12 +89,45 @@ int simple_poll_fun(float progress, const char *progress_string, void *poll_extr
 
 void finish_backup_thread(pthread_t thread); // wait for backup to finish (pass the thread provided by start_backup_thread()
 
+void backup_with_copy_threads(int n_threads, struct tokubackup_stats *stats);
+// Effect: back up the source to the destination with n_threads copy threads,
+//  letting all of them copy even if the source is on a rotational disk, and
+//  fill in *stats with what the backup did.
+
 bool backup_thread_is_done(void); // Tell me that finish_backup_thread is done.
 
 
 int systemf(const char *formatstring, ...) __attribute__((format (printf, 1, 2))); // Effect: run system() on the snprintf of the args.  Return the exit code.
 int openf(int flags, int mode, const char *formatstring, ...)  __attribute__((format(printf, 3, 4))); // Effect: run open(s, flags, mode) where s is gotten by formatting the string.
 
+void overwrite(const char *dir, const char *name, off_t offset, const char *data); // Effect: write the string data at offset of the file dir/name.
+off_t allocated_bytes(const char *dir, const char *name); // Return the disk space that dir/name uses.
+
+int create_file(const char *dir, const char *name, size_t size);
+// Effect: create dir/name, size bytes long (a multiple of 4096), filled with
+//  the name's first letter.  Return the file descriptor, open for reading
+//  and writing.
+
+// What write_until_copied() writes to.
+struct hot_file {
+    int m_fd;
+    size_t m_size;                                  // the file's size.
+    int m_truncate_every;                           // every this many writes, truncate the file a little instead (0 for never).
+    bool (*m_done)(void);                           // stop once this is true (e.g. backup_done_copying).
+    void (*m_after_write)(int i, const char *buf);  // if not NULL, called after each write.
+};
+void *write_until_copied(void *hot_file);
+// Effect: keep making 4096-byte writes (not always block aligned, so that
+//  they straddle blocks) at random offsets of the hot_file until it is
+//  done.  Run it with pthread_create().
+
+class manifest_file;
+void restore_file(const char *full, const char *incr, const char *restore, const char *name, const manifest_file *file);
+// Effect: restore the file name into the restore directory the way its
+//  incremental backup's manifest entry (file) says: the full backup's copy,
+//  with the incremental backup's present blocks on top.  If file is NULL the
+//  incremental backup's copy is complete, and we just copy it.
+
 char *get_src(int dir_index = 0); // returns a malloc'd string for the source directory.  If you call twice you get two different strings.  Requires that the main program defined BACKUP_NAME to be something unique across tests.
 char *get_dst(int dir_index = 0); // returns a malloc'd string for the destination directory.
 
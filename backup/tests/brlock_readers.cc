@@ -0,0 +1,113 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "brlock.h"
+
+// Readers, some of them nesting, take a brlock while a writer takes
+// it over and over.  No reader may be inside while the writer is, and
+// nobody may deadlock.
+
+static const int N_READERS = 8;
+static const int N_WRITES = 2000;
+
+static brlock the_lock;
+static std::atomic<int> n_readers_inside(0);
+static std::atomic<bool> writer_inside(false);
+static std::atomic<bool> writer_done(false);
+static std::atomic<int> n_wrong(0);
+
+static void *read_lock(void *arg) {
+    long me = (long) arg;
+    long n = 0;
+    while (!writer_done.load()) {
+        if (n % 16 == 0) {
+            usleep(1); // the rwlocks prefer readers, so give the writer a chance.
+        }
+        with_brlock_rdlocked rl(&the_lock);
+        n_readers_inside++;
+        if (writer_inside.load()) {
+            n_wrong++;
+        }
+        if (n % 3 == me % 3) {
+            with_brlock_rdlocked nested(&the_lock);
+            if (writer_inside.load()) {
+                n_wrong++;
+            }
+        }
+        n_readers_inside--;
+        n++;
+    }
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    pthread_t readers[N_READERS];
+    for (long i = 0; i < N_READERS; ++i) {
+        int r = pthread_create(&readers[i], NULL, read_lock, (void *) i);
+        check(r == 0);
+    }
+    for (int i = 0; i < N_WRITES; ++i) {
+        {
+            with_brlock_wrlocked wl(&the_lock, BACKTRACE(NULL));
+            writer_inside = true;
+            if (n_readers_inside.load() != 0) {
+                n_wrong++;
+            }
+            writer_inside = false;
+        }
+        usleep(1);
+    }
+    writer_done = true;
+    for (int i = 0; i < N_READERS; ++i) {
+        int r = pthread_join(readers[i], NULL);
+        check(r == 0);
+    }
+    if (n_wrong.load() != 0) {
+        printf("%d times a reader and the writer were both inside\n", n_wrong.load());
+        fail();
+        return 1;
+    }
+    pass();
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+#include "buffer_pool.h"
+
+const size_t BUFFER_SIZE = 1024 * 1024;
+const size_t POLL_STRING_SIZE = 2000;
+
+static void check_buffer(copy_buffer *buffer) {
+    check(buffer != NULL);
+    check(buffer->m_size == BUFFER_SIZE);
+    check(((uintptr_t)buffer->m_data) % 4096 == 0);
+    check(buffer->m_poll_string_size == POLL_STRING_SIZE);
+    check(buffer->m_poll_string >= buffer->m_data + buffer->m_size);
+    // Every byte must be usable.
+    memset(buffer->m_data, 'a', buffer->m_size);
+    memset(buffer->m_poll_string, 'b', buffer->m_poll_string_size);
+}
+
+static void reuse_test(void) {
+    buffer_pool pool(BUFFER_SIZE, POLL_STRING_SIZE);
+    pool.set_n_workers(2);
+    buffer_pool_stats stats;
+
+    // One worker copying one file after another only ever needs one buffer.
+    copy_buffer *first = pool.get(0);
+    check_buffer(first);
+    pool.put(0, first);
+    for (int i = 0; i < 10; ++i) {
+        copy_buffer *buffer = pool.get(0);
+        check(buffer == first);
+        check_buffer(buffer);
+        pool.put(0, buffer);
+    }
+    pool.get_stats(&stats);
+    check(stats.m_hits == 10);
+    check(stats.m_misses == 1);
+    check(stats.m_footprint >= BUFFER_SIZE + POLL_STRING_SIZE);
+    check(stats.m_peak_footprint == stats.m_footprint);
+
+    // Buffers beyond what a worker keeps for itself go to the other workers.
+    copy_buffer *buffers[3];
+    for (int i = 0; i < 3; ++i) {
+        buffers[i] = pool.get(0);
+        check_buffer(buffers[i]);
+    }
+    for (int i = 0; i < 3; ++i) {
+        pool.put(0, buffers[i]);
+    }
+    pool.reset_stats();
+    copy_buffer *other = pool.get(1);
+    check_buffer(other);
+    pool.put(1, other);
+    pool.get_stats(&stats);
+    check(stats.m_hits == 1);
+    check(stats.m_misses == 0);
+    check(stats.m_peak_footprint == stats.m_footprint);
+
+    // Dropping a worker keeps its buffer around for the others.
+    pool.set_n_workers(1);
+    pool.reset_stats();
+    other = pool.get(0);
+    check_buffer(other);
+    pool.get_stats(&stats);
+    check(stats.m_hits == 1);
+    check(stats.m_misses == 0);
+    pool.put(0, other);
+
+    pass();
+    printf(": reuse_test()\n");
+}
+
+static void huge_page_test(void) {
+    // Works whether or not the system has huge pages.
+    buffer_pool pool(BUFFER_SIZE, POLL_STRING_SIZE);
+    pool.set_n_workers(1);
+    pool.set_huge_pages(true);
+    copy_buffer *buffer = pool.get(0);
+    check_buffer(buffer);
+    pool.put(0, buffer);
+    buffer_pool_stats stats;
+    pool.get_stats(&stats);
+    check(stats.m_misses == 1);
+    check(stats.m_huge <= 1);
+    pass();
+    printf(": huge_page_test()\n");
+}
+
+// A backup of several files with one copy thread reuses its buffer
+// for each file after the first, and reports that in its stats.
+static void backup_test(void) {
+    const int N_FILES = 4;
+    char *src = get_src();
+    setup_source();
+    setup_destination();
+    for (int i = 0; i < N_FILES; i++) {
+        char name[20];
+        snprintf(name, sizeof(name), "file%d", i);
+        check(close(create_file(src, name, 3 * BUFFER_SIZE)) == 0);
+    }
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+
+    tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    printf("Copy buffers were reused %lu times and allocated %lu times, using at most %lu bytes\n", stats.buffer_reuses, stats.buffer_allocations, stats.buffer_peak_bytes);
+    check(stats.buffer_allocations >= 1);
+    check(stats.buffer_reuses >= (unsigned long) N_FILES - 1);
+    check(stats.buffer_peak_bytes >= BUFFER_SIZE);
+    check(stats.huge_page_buffers == 0);
+    free(src);
+    pass();
+    printf(": backup_test()\n");
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    reuse_test();
+    huge_page_test();
+    backup_test();
+    return 0;
+}
@@ -0,0 +1,165 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Queue captured writes to a file that is open before the backup
+// starts, while the copier is held back and the capture threads are
+// paused.  Then let the copier start on the file, overwrite what the
+// queued writes wrote before it reads anything, and only let the
+// capture threads go once it has had time to finish.  The queued
+// writes are older than what the copier reads, so the backup must
+// still match the source.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "capture_queue.h"
+
+static const size_t HOT_SIZE = 16 << 20;
+static const size_t EARLY_SIZE = 256 * 1024;
+static const int N_EARLY = 8; // Few enough to fit in the file's queue.
+static const size_t EARLY_END = (N_EARLY + 1) * (EARLY_SIZE / 2);
+static int hot_fd = -1;
+
+static int verify(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    int r = systemf("diff -rq %s %s", src, dst);
+    free(src);
+    free(dst);
+    if (!WIFEXITED(r)) return -1;
+    if (WEXITSTATUS(r)!=0) return -1;
+    return 0;
+}
+
+// Overwrite everything the early writes wrote.  This waits for the
+// copier if it has the file locked.
+static void *overwrite_early_writes(void *arg __attribute__((unused))) {
+    char *buf = (char *) malloc(EARLY_END);
+    check(buf != NULL);
+    memset(buf, 'z', EARLY_END);
+    ssize_t n = pwrite(hot_fd, buf, EARLY_END, 0);
+    check(n == (ssize_t) EARLY_END);
+    free(buf);
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    hot_fd = create_file(src, "hot", HOT_SIZE);
+    free(src);
+
+    capture_queue::reset_total_stats();
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+    HotBackup::toggle_pause_point(HotBackup::CAPTURE_QUEUE_WRITE);
+    backup_set_start_copying(false);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) {
+        sched_yield();
+    }
+
+    // The copier hasn't started on the file, so these are all queued.
+    {
+        char *buf = (char *) malloc(EARLY_SIZE);
+        check(buf != NULL);
+        for (int i = 0; i < N_EARLY; i++) {
+            memset(buf, 'A' + i, EARLY_SIZE);
+            ssize_t n = pwrite(hot_fd, buf, EARLY_SIZE, i * (EARLY_SIZE / 2));
+            check(n == (ssize_t) EARLY_SIZE);
+        }
+        free(buf);
+    }
+    capture_queue_stats stats;
+    capture_queue::get_total_stats(&stats);
+
+    backup_set_start_copying(true);
+    sleep(1);
+    pthread_t writer;
+    {
+        int r = pthread_create(&writer, NULL, overwrite_early_writes, NULL);
+        check(r == 0);
+    }
+    sleep(1);
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+    // Give the copier time to get through the file if it doesn't wait
+    // for the queued writes.
+    sleep(4);
+    HotBackup::toggle_pause_point(HotBackup::CAPTURE_QUEUE_WRITE);
+    {
+        int r = pthread_join(writer, NULL);
+        check(r == 0);
+    }
+    finish_backup_thread(thread);
+    check(close(hot_fd) == 0);
+
+    int result = 0;
+    printf("Queued %lu writes before the copy started\n", stats.m_n_writes);
+    if (stats.m_n_writes != (uint64_t) N_EARLY) {
+        result = 1;
+    }
+    // The backup reports them, and whatever was queued after them.
+    struct tokubackup_stats backup_stats;
+    tokubackup_get_stats(&backup_stats);
+    if (backup_stats.captured_writes < (unsigned long) N_EARLY ||
+        backup_stats.captured_bytes < N_EARLY * EARLY_SIZE ||
+        backup_stats.captured_max_bytes < EARLY_SIZE) {
+        printf("The backup reports %lu captured writes of %lu bytes, at most %lu queued\n",
+               backup_stats.captured_writes, backup_stats.captured_bytes, backup_stats.captured_max_bytes);
+        result = 1;
+    }
+    if (verify() != 0) {
+        result = 1;
+    }
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": capture_before_copy\n");
+    return result;
+}
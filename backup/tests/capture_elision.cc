@@ -0,0 +1,144 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Writes to parts of a file that the copier hasn't read yet are left
+// out of the backup copy, since the copier will read them.  Check how
+// a source_file keeps track of what is still to be read, and then
+// write all over a file while a slow backup copies it, both ahead of
+// the copier and behind it, and make sure the backup is right.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "source_file.h"
+
+static void test_copy_progress(void) {
+    source_file file("/some/file");
+    check(!file.copy_will_read(0, 10));
+
+    file.start_copy(NULL, NULL);
+    check(file.copy_will_read(0, 10));
+    check(file.copy_will_read(1000, LLONG_MAX));
+    file.mark_copied(0, 100);
+    check(!file.copy_will_read(0, 10));
+    check(!file.copy_will_read(90, 110));
+    check(file.copy_will_read(100, 110));
+    // A hole skipped further on.
+    file.mark_copied(200, 300);
+    check(file.copy_will_read(150, 200));
+    check(!file.copy_will_read(150, 201));
+    check(!file.copy_will_read(250, 260));
+    check(file.copy_will_read(300, 1000));
+
+    // A second copy doesn't forget what the first has read.
+    file.start_copy(NULL, NULL);
+    check(!file.copy_will_read(0, 10));
+    file.finish_copy();
+    check(file.copy_will_read(300, 1000));
+
+    file.mark_copied(0, UINT64_MAX);
+    check(!file.copy_will_read(300, 1000));
+    file.finish_copy();
+    check(!file.copy_will_read(0, 10));
+}
+
+static const int BUFSIZE = 4096;
+static const int NBUFS   = 1024;
+
+static void test_writes_during_copy(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_source();
+    setup_destination();
+    setup_dirs();
+
+    char buf[BUFSIZE];
+    memset(buf, 'a', sizeof(buf));
+    int fd = openf(O_RDWR | O_CREAT, 0777, "%s/f", src);
+    check(fd >= 0);
+    for (int i = 0; i < NBUFS; i++) {
+        ssize_t r = write(fd, buf, sizeof(buf));
+        check(r == sizeof(buf));
+    }
+
+    // Two seconds' worth of copying.
+    tokubackup_throttle_backup(BUFSIZE * NBUFS / 2);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    unsigned int seed = 1;
+    for (int i = 0; i < 400; i++) {
+        memset(buf, 'b' + i % 20, sizeof(buf));
+        const off_t offset = (off_t)(rand_r(&seed) % (NBUFS * 4)) * (BUFSIZE / 4);
+        ssize_t r = pwrite(fd, buf, BUFSIZE / 2, offset);
+        check(r == BUFSIZE / 2);
+        usleep(3000);
+    }
+    {
+        int r = close(fd);
+        check(r == 0);
+    }
+    finish_backup_thread(thread);
+    tokubackup_throttle_backup(ULONG_MAX);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    check(WIFEXITED(r) && WEXITSTATUS(r) == 0);
+    // Most of the writes landed ahead of the copier.
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    printf("Left %lu of %lu captured bytes out\n", stats.captured_elided_bytes, stats.captured_elided_bytes + stats.captured_bytes);
+    check(stats.captured_elided_bytes > 0);
+    // The writes took range locks, and so did the copy.
+    check(stats.write_range_locks > 0 && stats.write_range_locks <= 400);
+    check(stats.copy_range_locks > 0);
+    free(src);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_copy_progress();
+    test_writes_during_copy();
+    pass();
+    printf(": capture_elision\n");
+    return 0;
+}
@@ -0,0 +1,206 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// With the capture journal turned on, make changes of each kind after
+// the copier is done, and check that they reach the backup when the
+// journal is replayed, and that the journal is gone afterwards.  Then
+// change a file before the copier starts on it, and truncate it, punch
+// a hole in it and write to it ahead of the copier: the replay must
+// not undo what the copier read.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "capture_journal.h"
+
+static int verify(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    int r = systemf("diff -rq %s %s", src, dst);
+    free(src);
+    free(dst);
+    if (!WIFEXITED(r)) return -1;
+    if (WEXITSTATUS(r)!=0) return -1;
+    return 0;
+}
+
+static int changes_after_copy(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    int a = create_file(src, "a", 1 << 16);
+    int b = create_file(src, "b", 1 << 16);
+    int c = create_file(src, "c", 1 << 16);
+    int e = create_file(src, "e", 1 << 16);
+
+    tokubackup_set_capture_journal(1);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_done_copying()) {
+        sched_yield();
+    }
+
+    {
+        int r = pwrite(a, "Cruel World\n", 12, 1 << 20);
+        check(r == 12);
+        r = pwrite(a, "Hello World\n", 12, 100);
+        check(r == 12);
+        r = ftruncate(b, 1000);
+        check(r == 0);
+        r = fallocate(b, 0, 0, 1 << 14);
+        check(r == 0);
+        char old_name[1000], new_name[1000];
+        snprintf(old_name, sizeof(old_name), "%s/c", src);
+        snprintf(new_name, sizeof(new_name), "%s/d", src);
+        r = rename(old_name, new_name);
+        check(r == 0);
+        r = pwrite(c, "Renamed\n", 8, 5000);
+        check(r == 8);
+        r = pwrite(e, "Gone\n", 5, 0);
+        check(r == 5);
+        char name[1000];
+        snprintf(name, sizeof(name), "%s/e", src);
+        r = unlink(name);
+        check(r == 0);
+    }
+
+    // The changes are going into the journal.
+    struct stat st;
+    {
+        char name[1000];
+        snprintf(name, sizeof(name), "%s/%s", dst, CAPTURE_JOURNAL_NAME);
+        int r = stat(name, &st);
+        check(r == 0);
+    }
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_capture_journal(0);
+    check(close(a) == 0);
+    check(close(b) == 0);
+    check(close(c) == 0);
+    check(close(e) == 0);
+
+    int result = 0;
+    {
+        char name[1000];
+        snprintf(name, sizeof(name), "%s/%s", dst, CAPTURE_JOURNAL_NAME);
+        int r = stat(name, &st);
+        if (r == 0 || errno != ENOENT) {
+            printf("The capture journal %s is still there\n", name);
+            result = 1;
+        }
+    }
+    if (verify() != 0) {
+        result = 1;
+    }
+    free(src);
+    free(dst);
+    return result;
+}
+
+static int changes_ahead_of_copier(void) {
+    const size_t size = 1 << 20;
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    int fd = create_file(src, "f", size);
+    free(src);
+
+    tokubackup_set_capture_journal(1);
+    backup_set_start_copying(false);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) {
+        sched_yield();
+    }
+    char buf[4096];
+    memset(buf, 'X', sizeof(buf));
+    ssize_t n = pwrite(fd, buf, sizeof(buf), 0);
+    check(n == (ssize_t) sizeof(buf));
+
+    // Let the copier start on the file, but hold it before it reads.
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+    backup_set_start_copying(true);
+    sleep(2);
+    int r = ftruncate(fd, size / 2);
+    check(r == 0);
+    memset(buf, 'Y', sizeof(buf));
+    n = pwrite(fd, buf, sizeof(buf), size / 2 + 100000);
+    check(n == (ssize_t) sizeof(buf));
+    r = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100000, 100000);
+    check(r == 0);
+    memset(buf, 'Z', sizeof(buf));
+    n = pwrite(fd, buf, sizeof(buf), 150000);
+    check(n == (ssize_t) sizeof(buf));
+    memset(buf, 'W', sizeof(buf));
+    n = pwrite(fd, buf, sizeof(buf), 0);
+    check(n == (ssize_t) sizeof(buf));
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+
+    finish_backup_thread(thread);
+    tokubackup_set_capture_journal(0);
+    check(close(fd) == 0);
+    return verify();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    int result = changes_after_copy();
+    if (changes_ahead_of_copier() != 0) {
+        printf("The replay undid changes made ahead of the copier\n");
+        result = 1;
+    }
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": capture_journal\n");
+    return result;
+}
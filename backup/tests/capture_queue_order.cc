@@ -0,0 +1,128 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Queue many overlapping writes to one file, more than its queue
+// holds at once, and make sure that they reach the file in the order
+// they were queued, and that the writers had to wait for room.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "capture_queue.h"
+#include "destination_file.h"
+
+static const int N_WRITES = 200;
+static const size_t WRITE_SIZE = 256 * 1024;
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_destination();
+    char *dst = get_dst();
+    char path[1000];
+    snprintf(path, sizeof(path), "%s/queued", dst);
+    int fd = open(path, O_RDWR | O_CREAT, 0777);
+    check(fd >= 0);
+
+    capture_queue::reset_total_stats();
+    {
+        destination_file dest(fd, path);
+        capture_list list;
+        capture_queue queue;
+        queue.start();
+        char *buf = (char *) malloc(WRITE_SIZE);
+        check(buf != NULL);
+        for (int i = 0; i < N_WRITES; i++) {
+            memset(buf, 'a' + i % 26, WRITE_SIZE);
+            // Each write overlaps half of the one before.
+            const off_t offset = (i % 4) * (WRITE_SIZE / 2);
+            bool queued = queue.enqueue(&list, &dest, buf, WRITE_SIZE, offset);
+            check(queued);
+        }
+        list.wait_until_empty();
+        queue.stop();
+        free(buf);
+    }
+
+    // What the last write to each half-write left there.
+    char *got = (char *) malloc(WRITE_SIZE / 2);
+    check(got != NULL);
+    int result = 0;
+    for (int part = 0; part < 5; part++) {
+        int last = -1;
+        for (int i = 0; i < N_WRITES; i++) {
+            const int first_part = i % 4;
+            if (part == first_part || part == first_part + 1) {
+                last = i;
+            }
+        }
+        ssize_t n = pread(fd, got, WRITE_SIZE / 2, part * (WRITE_SIZE / 2));
+        check(n == (ssize_t)(WRITE_SIZE / 2));
+        for (size_t j = 0; j < WRITE_SIZE / 2; j++) {
+            if (got[j] != 'a' + last % 26) {
+                printf("Byte %lu of part %d is %c, not %c\n", j, part, got[j], 'a' + last % 26);
+                result = 1;
+                break;
+            }
+        }
+    }
+    free(got);
+    {
+        int r = close(fd);
+        check(r == 0);
+    }
+
+    capture_queue_stats stats;
+    capture_queue::get_total_stats(&stats);
+    if (stats.m_n_writes != (uint64_t)N_WRITES || stats.m_max_bytes > CAPTURE_LIST_MAX_BYTES) {
+        printf("Queued %lu writes, at most %lu bytes\n", stats.m_n_writes, stats.m_max_bytes);
+        result = 1;
+    }
+    printf("%lu of %d writes waited for room\n", stats.m_n_stalls, N_WRITES);
+    free(dst);
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": capture_queue_order\n");
+    return result;
+}
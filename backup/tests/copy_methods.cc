@@ -0,0 +1,91 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backup_test_helpers.h"
+#include "copy_engine.h"
+
+// Copy the same files with each of the copy engine's methods, and
+// check that every one of them produces an identical backup.  Methods
+// that this system doesn't support fall back to a slower one, so the
+// backup must be identical either way.
+
+const char *BACKUP_NAME = __FILE__;
+
+static int copy_with_method(copy_method method, const char *name) {
+    char *src = get_src();
+    char *dst = get_dst();
+
+    setup_source();
+    setup_destination();
+    check(systemf("dd if=/dev/urandom of=%s/big bs=1024 count=5000 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/odd bs=1 count=12345 2>/dev/null", src) == 0);
+    check(systemf("echo hello > %s/small", src) == 0);
+    check(systemf("touch %s/empty", src) == 0);
+
+    copy_engine::force_method(method);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    copy_engine::force_method(COPY_METHOD_AUTO);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    if (r != 0) {
+        fail();
+    } else {
+        pass();
+    }
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    printf(": copy_with_method(%s)\n", name);
+    return r;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    int r = 0;
+    r |= copy_with_method(COPY_METHOD_CLONE, "clone");
+    r |= copy_with_method(COPY_METHOD_COPY_FILE_RANGE, "copy_file_range");
+    r |= copy_with_method(COPY_METHOD_SPLICE, "splice");
+    r |= copy_with_method(COPY_METHOD_READ_WRITE, "read/write");
+    r |= copy_with_method(COPY_METHOD_AUTO, "auto");
+    return r != 0;
+}
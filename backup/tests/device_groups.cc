@@ -0,0 +1,233 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+// The directories of a backup whose sources are on different devices
+// are copied at the same time.  Put one source directory, and its
+// destination, in /dev/shm, which is usually a device of its own (so
+// that the device scheduler doesn't make them take turns on one
+// destination device), throttle the backup so that the
+// copies are slow, and check that both destination files were growing
+// at once.  Then abort a backup while it waits for the other device's
+// copy, and check that the copy stops right away.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const size_t MB = 1 << 20;
+static const size_t FILE_SIZE = 2 * MB;
+static const int N_DIRS = 2;
+
+static char *srcs[N_DIRS];
+static char *dsts[N_DIRS];
+static bool saw_both = false;
+
+static char *shm_path(const char *suffix) {
+    char s[PATH_MAX];
+    int r = snprintf(s, sizeof(s), "/dev/shm/device_groups_%d.%s", getpid(), suffix);
+    check(r < (int)sizeof(s));
+    char *result = strdup(s);
+    check(result);
+    return result;
+}
+
+static bool same_device(const char *a, const char *b) {
+    struct stat sa, sb;
+    int r = stat(a, &sa);
+    check(r == 0);
+    r = stat(b, &sb);
+    check(r == 0);
+    return sa.st_dev == sb.st_dev;
+}
+
+static size_t copied_size(int i) {
+    struct stat sbuf;
+    char path[PATH_MAX];
+    int r = snprintf(path, sizeof(path), "%s/data", dsts[i]);
+    check(r < (int)sizeof(path));
+    if (stat(path, &sbuf) != 0) {
+        return 0;
+    }
+    return sbuf.st_size;
+}
+
+static int watch_poll(float progress, const char *string, void *extra __attribute__((unused))) {
+    check(string != NULL);
+    check(progress >= 0);
+    bool both = true;
+    for (int i = 0; i < N_DIRS; ++i) {
+        const size_t size = copied_size(i);
+        if (size == 0 || size >= FILE_SIZE) {
+            both = false;
+        }
+    }
+    if (both) {
+        saw_both = true;
+    }
+    return 0;
+}
+
+static void expect_no_error(int error_number, const char *error_string, void *extra __attribute__((unused))) {
+    fprintf(stderr, "Unexpected backup error %d: %s\n", error_number, error_string);
+    abort();
+}
+
+static int abort_while_waiting(float progress __attribute__((unused)), const char *string, void *extra __attribute__((unused))) {
+    if (strstr(string, "Waiting for the copy of") != NULL) {
+        return ECANCELED;
+    }
+    return 0;
+}
+
+static void expect_abort(int error_number, const char *error_string, void *extra __attribute__((unused))) {
+    if (error_number != ECANCELED) {
+        fprintf(stderr, "Unexpected backup error %d: %s\n", error_number, error_string);
+        abort();
+    }
+}
+
+// The first directory is empty, so the backup's thread soon waits for
+// the second, whose copy would take ten seconds.
+static int test_abort(void) {
+    setup_directory(srcs[0]);
+    for (int i = 0; i < N_DIRS; ++i) {
+        setup_directory(dsts[i]);
+    }
+    tokubackup_throttle_backup(FILE_SIZE / 10);
+    const char *src_dirs[N_DIRS];
+    const char *dst_dirs[N_DIRS];
+    for (int i = 0; i < N_DIRS; ++i) {
+        src_dirs[i] = strdup(srcs[i]);
+        dst_dirs[i] = strdup(dsts[i]);
+    }
+    const time_t start = time(NULL);
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread, src_dirs, dst_dirs, abort_while_waiting, NULL, expect_abort, NULL, ECANCELED);
+    finish_backup_thread(thread);
+    const time_t elapsed = time(NULL) - start;
+    tokubackup_throttle_backup(ULONG_MAX);
+    if (elapsed > 5) {
+        printf("The aborted backup took %ld seconds to stop.\n", (long) elapsed);
+        return -1;
+    }
+    return 0;
+}
+
+static void fill(const char *dir) {
+    int fd = openf(O_CREAT | O_WRONLY, 0777, "%s/data", dir);
+    check(fd >= 0);
+    char buf[4096];
+    for (size_t n = 0; n < FILE_SIZE; n += sizeof(buf)) {
+        memset(buf, 'a' + (n / MB) % 26, sizeof(buf));
+        ssize_t r = write(fd, buf, sizeof(buf));
+        check(r == (ssize_t) sizeof(buf));
+    }
+    int r = close(fd);
+    check(r == 0);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    srcs[0] = get_src(0);
+    srcs[1] = shm_path("source");
+    setup_directory(srcs[0]);
+    setup_directory(srcs[1]);
+    bool separate = !same_device(srcs[0], srcs[1]);
+    if (!separate) {
+        // No second device here, so just check the copy.
+        systemf("rm -rf %s", srcs[1]);
+        free(srcs[1]);
+        srcs[1] = get_src(1);
+        setup_directory(srcs[1]);
+    }
+    for (int i = 0; i < N_DIRS; ++i) {
+        dsts[i] = (i == 1 && separate) ? shm_path("backup") : get_dst(i);
+        setup_directory(dsts[i]);
+        fill(srcs[i]);
+    }
+
+    // Slow enough that each copy takes about a second.
+    tokubackup_throttle_backup(2 * MB);
+    set_dir_count(N_DIRS);
+    const char *src_dirs[N_DIRS];
+    const char *dst_dirs[N_DIRS];
+    for (int i = 0; i < N_DIRS; ++i) {
+        src_dirs[i] = strdup(srcs[i]);
+        dst_dirs[i] = strdup(dsts[i]);
+    }
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread, src_dirs, dst_dirs, watch_poll, NULL, expect_no_error, NULL, BACKUP_SUCCESS);
+    finish_backup_thread(thread);
+    tokubackup_throttle_backup(ULONG_MAX);
+
+    int result = 0;
+    if (separate && !saw_both) {
+        printf("The two devices were not copied at the same time.\n");
+        result = -1;
+    }
+    for (int i = 0; i < N_DIRS; ++i) {
+        int r = systemf("diff -r %s %s", srcs[i], dsts[i]);
+        if (!WIFEXITED(r) || WEXITSTATUS(r) != 0) {
+            result = -1;
+        }
+    }
+    if (separate && test_abort() != 0) {
+        result = -1;
+    }
+    if (separate) {
+        systemf("rm -rf %s %s", srcs[1], dsts[1]);
+    }
+    for (int i = 0; i < N_DIRS; ++i) {
+        free(srcs[i]);
+        free(dsts[i]);
+    }
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": device_groups\n");
+    return result;
+}
@@ -0,0 +1,153 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+// The device scheduler lets as many copies run on a device as its
+// limits allow, and makes the others wait.  Check that the limits set
+// with tokubackup_set_device_limits() are the ones it uses, that a copy
+// to another device gets the smaller limits of the two, and that a
+// backup with more copy workers than its device allows is right.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "device_scheduler.h"
+
+static dev_t device_of(const char *path) {
+    struct stat sbuf;
+    int r = stat(path, &sbuf);
+    check(r == 0);
+    return sbuf.st_dev;
+}
+
+static void test_limits(const char *src) {
+    const dev_t device = device_of(src);
+    check(tokubackup_set_device_limits("/no/such/directory", 1, 1) == ENOENT);
+    check(tokubackup_set_device_limits(src, 2, 3) == 0);
+    {
+        device_scheduler scheduler;
+        device_grant first, second, third;
+        check(scheduler.start_copy(device, device, 10, &first));
+        check(first.m_concurrency == 2 && first.m_io_depth == 3);
+        check(first.m_dest == NULL);
+        check(scheduler.start_copy(device, device, 10, &second));
+        // The third has to wait until one of the others is done.
+        check(!scheduler.start_copy(device, device, 10, &third));
+        check(third.m_waited);
+        scheduler.finish_copy(first);
+        check(scheduler.start_copy(device, device, 10, &third));
+        scheduler.finish_copy(second);
+        scheduler.finish_copy(third);
+
+        // Another device, if there is one, brings its own limits.
+        const dev_t other = device_of("/dev/shm");
+        if (other != device) {
+            check(tokubackup_set_device_limits("/dev/shm", 5, 1) == 0);
+            device_grant across;
+            check(scheduler.start_copy(other, device, 10, &across));
+            check(across.m_dest != NULL);
+            check(across.m_concurrency == 2 && across.m_io_depth == 1);
+            device_scheduler::note_io(across, 4096, 10);
+            check(across.m_source->m_bytes == 4096);
+            check(across.m_dest->m_bytes == 0 && across.m_dest->m_n_ios == 1);
+            scheduler.finish_copy(across);
+            check(tokubackup_set_device_limits("/dev/shm", 0, 0) == 0);
+        }
+        std::vector<tokubackup_device_stats> stats;
+        scheduler.get_stats(&stats);
+        check(stats.size() >= 1);
+        check(stats[0].device == device && stats[0].files_copied >= 3 && stats[0].waits == 1);
+        check(strcmp(stats[0].tuning, "configured") == 0);
+    }
+    check(tokubackup_set_device_limits(src, 0, 0) == 0);
+}
+
+static int test_backup(const char *src, const char *dst) {
+    setup_source();
+    setup_destination();
+    for (int i = 0; i < 8; ++i) {
+        check(systemf("dd if=/dev/urandom of=%s/file%d bs=1024 count=%d 2>/dev/null", src, i, 500 + 100 * i) == 0);
+    }
+    check(tokubackup_set_device_limits(src, 1, 0) == 0);
+    tokubackup_set_copy_threads(4);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    tokubackup_set_copy_threads(1);
+    check(tokubackup_set_device_limits(src, 0, 0) == 0);
+
+    // The backup says what it did on the source's device.
+    struct tokubackup_device_stats stats[4];
+    const unsigned int n_devices = tokubackup_get_device_stats(stats, 4);
+    check(n_devices >= 1 && n_devices <= 4);
+    bool found = false;
+    for (unsigned int i = 0; i < n_devices; ++i) {
+        printf("Device %lx (%s): %lu files, %lu bytes, %lu waits\n",
+               stats[i].device, stats[i].tuning, stats[i].files_copied, stats[i].bytes_read, stats[i].waits);
+        if (stats[i].device == device_of(src)) {
+            check(stats[i].concurrency == 1);
+            check(stats[i].files_copied >= 8);
+            check(stats[i].bytes_read >= 8 * 500 * 1024);
+            check(stats[i].ios > 0 && stats[i].max_io_usecs <= stats[i].io_usecs);
+            found = true;
+        }
+    }
+    check(found);
+    return systemf("diff -r %s %s", src, dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_source();
+    test_limits(src);
+    int result = test_backup(src, dst);
+    free(src);
+    free(dst);
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": device_scheduler\n");
+    return result;
+}
@@ -0,0 +1,163 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// With dirty block tracking turned on, keep writing all over a file
+// while a throttled backup copies it, and rename and close another
+// dirty file while its dirty blocks are being copied.  The backup must
+// match the source, and the writes must have been marked rather than
+// captured.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+static const size_t HOT_SIZE = 16 << 20;
+static const size_t BLOCK = 4096;
+static int hot_fd = -1;
+static int moved_fd = -1;
+static bool renamed = false;
+
+static int verify(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    int r = systemf("diff -r %s %s", src, dst);
+    free(src);
+    free(dst);
+    if (!WIFEXITED(r)) return -1;
+    if (WEXITSTATUS(r)!=0) return -1;
+    return 0;
+}
+
+// Also keep writing to the other file until it is renamed.
+static void write_moved(int i, const char *buf) {
+    if (i % 64 == 0 && !renamed) {
+        ssize_t r = pwrite(moved_fd, buf, 100, (i / 64) % 16 * BLOCK);
+        check(r == 100);
+    }
+}
+
+static int rename_while_copying_dirty_blocks(float progress __attribute__((unused)), const char *progress_string, void *extra __attribute__((unused))) {
+    if (!renamed && strncmp(progress_string, "Copying the dirty blocks", 24) == 0) {
+        char *src = get_src();
+        char old_name[1000], new_name[1000];
+        snprintf(old_name, sizeof(old_name), "%s/moved", src);
+        snprintf(new_name, sizeof(new_name), "%s/moved_again", src);
+        ssize_t n = pwrite(moved_fd, "Moved\n", 6, 3 * BLOCK);
+        check(n == 6);
+        int r = rename(old_name, new_name);
+        check(r == 0);
+        r = close(moved_fd);
+        check(r == 0);
+        renamed = true;
+        free(src);
+    }
+    return 0;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    hot_fd = create_file(src, "hot", HOT_SIZE);
+    moved_fd = create_file(src, "moved", 16 * BLOCK);
+    int cold_fd = create_file(src, "cold", 2 * HOT_SIZE);
+    check(close(cold_fd) == 0);
+    free(src);
+
+    tokubackup_set_dirty_tracking(1);
+    tokubackup_throttle_backup(32 << 20);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread, get_src(), get_dst(),
+                                  rename_while_copying_dirty_blocks, NULL,
+                                  dummy_error, NULL,
+                                  0);
+    pthread_t writer;
+    hot_file hot = {hot_fd, HOT_SIZE, 0, backup_done_copying, write_moved};
+    {
+        int r = pthread_create(&writer, NULL, write_until_copied, &hot);
+        check(r == 0);
+    }
+    while (!backup_done_copying()) {
+        sched_yield();
+    }
+    {
+        int r = pthread_join(writer, NULL);
+        check(r == 0);
+    }
+    // Writes after the final pass go into the backup copy as usual.
+    {
+        ssize_t n = pwrite(hot_fd, "After the copy\n", 15, HOT_SIZE / 2);
+        check(n == 15);
+    }
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_dirty_tracking(0);
+    tokubackup_throttle_backup(ULONG_MAX);
+    check(close(hot_fd) == 0);
+    if (!renamed) {
+        check(close(moved_fd) == 0);
+    }
+
+    int result = 0;
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    printf("Marked %lu bytes of %lu files dirty, copied %lu in %lu passes (%lu in the final one)\n",
+           stats.dirty_marked_bytes, stats.dirty_files, stats.dirty_copied_bytes, stats.dirty_passes, stats.dirty_final_bytes);
+    if (stats.dirty_marked_bytes == 0 || stats.dirty_passes == 0 || stats.dirty_files == 0 ||
+        stats.dirty_final_bytes > stats.dirty_copied_bytes) {
+        result = 1;
+    }
+    if (verify() != 0) {
+        result = 1;
+    }
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": dirty_tracking\n");
+    return result;
+}
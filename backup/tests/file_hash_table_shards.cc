@@ -0,0 +1,120 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <atomic>
+
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "file_hash_table.h"
+#include "source_file.h"
+
+// Several threads add names to a file hash table (making its shards
+// grow several times), look them up, and take them out again, while
+// all of them also take and drop references on one shared name.  Each
+// thread must always find its own names, and the table must end up
+// empty.
+
+static const int N_THREADS = 4;
+static const int N_FILES = 5000;
+static const char *SHARED_NAME = "/shared/file";
+
+static file_hash_table the_table;
+static std::atomic<int> n_wrong(0);
+
+static void *use_table(void *arg) {
+    const long t = (long) arg;
+    source_file **files = new source_file*[N_FILES];
+    char name[100];
+    for (int i = 0; i < N_FILES; ++i) {
+        snprintf(name, sizeof(name), "/thread%ld/file%d", t, i);
+        the_table.get_or_create_locked(name, &files[i]);
+        if (i % 100 == 0) {
+            source_file *shared = NULL;
+            the_table.get_or_create_locked(SHARED_NAME, &shared);
+            the_table.try_to_remove_locked(shared);
+        }
+    }
+    for (int i = 0; i < N_FILES; ++i) {
+        snprintf(name, sizeof(name), "/thread%ld/file%d", t, i);
+        if (the_table.get(name) != files[i]) {
+            n_wrong++;
+        }
+    }
+    for (int i = 0; i < N_FILES; ++i) {
+        the_table.try_to_remove_locked(files[i]);
+    }
+    for (int i = 0; i < N_FILES; i += 97) {
+        snprintf(name, sizeof(name), "/thread%ld/file%d", t, i);
+        if (the_table.get(name) != NULL) {
+            n_wrong++;
+        }
+    }
+    delete[] files;
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    pthread_t threads[N_THREADS];
+    for (long i = 0; i < N_THREADS; ++i) {
+        int r = pthread_create(&threads[i], NULL, use_table, (void *) i);
+        check(r == 0);
+    }
+    for (int i = 0; i < N_THREADS; ++i) {
+        int r = pthread_join(threads[i], NULL);
+        check(r == 0);
+    }
+
+    int result = 0;
+    if (n_wrong.load() != 0) {
+        printf("Threads found %d wrong files\n", n_wrong.load());
+        result = 1;
+    }
+    if (the_table.size() != 0) {
+        printf("The table still has %zu files\n", the_table.size());
+        result = 1;
+    }
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": file_hash_table_shards\n");
+    return result;
+}
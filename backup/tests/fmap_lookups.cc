@@ -0,0 +1,133 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "description.h"
+#include "fmap.h"
+
+// Readers look file descriptors up in an fmap without a lock while a
+// writer puts descriptions at fds that make it grow its directory
+// several times.  A reader must find either nothing or the right
+// description (whose source file we set to a made-up pointer that
+// encodes its fd).
+
+static const int N_READERS = 4;
+static const int MAX_FD = 300000;
+static const int FD_STEP = 997;
+
+static fmap the_map;
+
+static source_file *fake_source_file(int fd) {
+    return (source_file *)(intptr_t)(fd + 1);
+}
+static std::atomic<bool> writer_done(false);
+static std::atomic<int> n_wrong(0);
+
+static void *read_map(void *arg) {
+    unsigned int seed = (unsigned int)(long) arg;
+    long n_found = 0;
+    while (!writer_done.load()) {
+        int fd = rand_r(&seed) % MAX_FD;
+        description *d = the_map.get_unlocked(fd);
+        if (d != NULL) {
+            n_found++;
+            if (d->get_source_file() != fake_source_file(fd)) {
+                n_wrong++;
+            }
+        }
+    }
+    return (void *) n_found;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    pthread_t readers[N_READERS];
+    for (long i = 0; i < N_READERS; ++i) {
+        int r = pthread_create(&readers[i], NULL, read_map, (void *) i);
+        check(r == 0);
+    }
+
+    for (int fd = 0; fd < MAX_FD; fd += FD_STEP) {
+        description *d = new description;
+        d->set_source_file(fake_source_file(fd));
+        the_map.put(fd, d);
+        sched_yield();
+    }
+    writer_done = true;
+    for (int i = 0; i < N_READERS; ++i) {
+        void *result;
+        int r = pthread_join(readers[i], &result);
+        check(r == 0);
+    }
+
+    int result = 0;
+    if (n_wrong.load() != 0) {
+        printf("Readers found %d wrong descriptions\n", n_wrong.load());
+        result = 1;
+    }
+    for (int fd = 0; fd < MAX_FD + FD_STEP; ++fd) {
+        description *d = the_map.get_unlocked(fd);
+        if ((fd % FD_STEP == 0 && fd < MAX_FD) != (d != NULL)) {
+            printf("fd %d is %s the map\n", fd, d ? "wrongly in" : "missing from");
+            result = 1;
+            break;
+        }
+    }
+    if (the_map.size() != (MAX_FD - 1) / FD_STEP * FD_STEP + 1) {
+        printf("The map's size is %d\n", the_map.size());
+        result = 1;
+    }
+    for (int fd = 0; fd < MAX_FD; fd += FD_STEP) {
+        int r = the_map.erase(fd, BACKTRACE(NULL));
+        check(r == 0);
+        check(the_map.get_unlocked(fd) == NULL);
+    }
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": fmap_lookups\n");
+    return result;
+}
@@ -0,0 +1,144 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "call_gate.h"
+
+// A file that was opened and written while no backup was running
+// must be found when the backup starts, at the right offset, and its
+// writes during the backup must be captured.  A thread blocked in a
+// read() from a pipe must not hold up the start of the backup.
+
+static const int SIZE = 100;
+
+static void *read_pipe(void *arg) {
+    int fd = *(int *) arg;
+    char c;
+    ssize_t r = read(fd, &c, 1);
+    check(r == 1);
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f", src);
+
+    // No backup: the gate is idle, and the write and lseek go straight to the system.
+    check(!the_call_gate.is_tracking());
+    int fd = open(path, O_CREAT | O_RDWR, 0777);
+    check(fd >= 0);
+    char buf[SIZE];
+    memset(buf, 'a', SIZE);
+    ssize_t wr = write(fd, buf, SIZE);
+    check(wr == SIZE);
+    off_t o = lseek(fd, SIZE / 2, SEEK_SET);
+    check(o == SIZE / 2);
+
+    int pipe_fds[2];
+    int r = pipe(pipe_fds);
+    check(r == 0);
+    pthread_t reader;
+    r = pthread_create(&reader, NULL, read_pipe, &pipe_fds[0]);
+    check(r == 0);
+    usleep(100000); // let the reader block.
+
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) {
+        sched_yield();
+    }
+    check(the_call_gate.is_tracking());
+    while (!backup_done_copying()) {
+        usleep(10000);
+    }
+
+    // These must be captured, the first at the offset we seeked to before the backup.
+    memset(buf, 'b', 10);
+    wr = write(fd, buf, 10);
+    check(wr == 10);
+    memset(buf, 'c', 10);
+    wr = pwrite(fd, buf, 10, SIZE + 10);
+    check(wr == 10);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    check(!the_call_gate.is_tracking());
+
+    wr = write(pipe_fds[1], "x", 1);
+    check(wr == 1);
+    r = pthread_join(reader, NULL);
+    check(r == 0);
+
+    int result = 0;
+    char cmd[2 * PATH_MAX + 20];
+    snprintf(cmd, sizeof(cmd), "diff -r %s %s", src, dst);
+    if (system(cmd) != 0) {
+        result = 1;
+    }
+    ssize_t n = pread(fd, buf, SIZE, 0);
+    check(n == SIZE);
+    if (buf[SIZE / 2] != 'b' || buf[SIZE / 2 + 10] != 'a') {
+        result = 1;
+    }
+    if (result == 0) {
+        pass();
+    } else {
+        fail();
+    }
+
+    r = close(fd);
+    check(r == 0);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return result;
+}
@@ -0,0 +1,147 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_manifest.h"
+#include "backup_test_helpers.h"
+
+// Make a full backup with a manifest, change a few blocks of the
+// source (one of them while the incremental backup is capturing),
+// and make an incremental backup against the first one.  The
+// incremental backup must hold little more than the changed blocks,
+// and restoring it on top of the full backup must give the source.
+
+const char *BACKUP_NAME = __FILE__;
+
+static const char *FILES[] = {"big", "grows", "small", "new"};
+static const int N_FILES = sizeof(FILES) / sizeof(FILES[0]);
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    char *src = get_src();
+    char *full = get_dst();
+    char incr[PATH_MAX], restore[PATH_MAX];
+    snprintf(incr, sizeof(incr), "%s.incremental", full);
+    snprintf(restore, sizeof(restore), "%s.restore", full);
+
+    setup_source();
+    setup_destination();
+    check(systemf("rm -rf %s %s && mkdir %s %s", incr, restore, incr, restore) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/big bs=1M count=3 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/grows bs=1000 count=200 2>/dev/null", src) == 0);
+    check(systemf("echo hello > %s/small", src) == 0);
+
+    // A full backup that leaves a manifest.
+    const char *no_base[1] = {NULL};
+    int r = tokubackup_set_incremental_base(no_base, 1);
+    check(r == 0);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+
+    // Change the source a little.
+    overwrite(src, "big", 1000000, "changed");
+    check(systemf("dd if=/dev/urandom bs=1000 count=10 2>/dev/null >> %s/grows", src) == 0);
+    check(systemf("echo brand new > %s/new", src) == 0);
+
+    // The incremental backup.  Once it has copied everything, change
+    // part of a block that it left out.
+    const char *base[1] = {full};
+    r = tokubackup_set_incremental_base(base, 1);
+    check(r == 0);
+    backup_set_keep_capturing(true);
+    start_backup_thread(&thread, strdup(incr));
+    while (!backup_is_capturing()) {
+        usleep(1000);
+    }
+    while (!backup_done_copying()) {
+        usleep(1000);
+    }
+    overwrite(src, "big", 2500000, "captured");
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    r = tokubackup_set_incremental_base(NULL, 0);
+    check(r == 0);
+
+    int result = 0;
+    // Most of big was left out, but not the block that changed.
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    if (stats.changed_bytes == 0 || stats.unchanged_bytes < 2 * 1024 * 1024) {
+        printf("The incremental backup left out %lu unchanged bytes and copied %lu changed ones\n",
+               stats.unchanged_bytes, stats.changed_bytes);
+        result = 1;
+    }
+    // Two changed blocks, the grown tail, and a little slack.
+    if (allocated_bytes(incr, "big") > 4 * (off_t)MANIFEST_BLOCK_SIZE) {
+        printf("The incremental backup of big uses %ld bytes\n", allocated_bytes(incr, "big"));
+        result = 1;
+    }
+
+    backup_manifest manifest;
+    r = manifest.read(incr);
+    check(r == 0);
+    check(manifest.base_dir() != NULL && strcmp(manifest.base_dir(), full) == 0);
+    for (int i = 0; i < N_FILES; ++i) {
+        restore_file(full, incr, restore, FILES[i], manifest.find(FILES[i]));
+    }
+    if (systemf("diff -r %s %s", src, restore) != 0) {
+        printf("The restored backup differs from the source\n");
+        result = 1;
+    }
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": %s\n", BACKUP_NAME);
+
+    check(systemf("rm -rf %s %s", incr, restore) == 0);
+    cleanup_dirs();
+    free(src);
+    free(full);
+    return result;
+}
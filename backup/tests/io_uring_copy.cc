@@ -0,0 +1,102 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+// Back up files with several reads and writes in flight per copy
+// thread, and check that the backup is identical to the source, and
+// that more than one request really was in flight.  The odd-sized file
+// makes the last batch end with a short read.  Without io_uring the
+// copier falls back to the other methods, which must give the same
+// result.
+
+const char *BACKUP_NAME = __FILE__;
+
+static int io_uring_copy(unsigned int io_depth, unsigned int n_threads) {
+    char *src = get_src();
+    char *dst = get_dst();
+
+    setup_source();
+    setup_destination();
+    check(systemf("dd if=/dev/urandom of=%s/big bs=1024 count=6000 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/odd bs=1 count=1234567 2>/dev/null", src) == 0);
+    check(systemf("echo hello > %s/small", src) == 0);
+    check(systemf("touch %s/empty", src) == 0);
+
+    tokubackup_set_io_depth(io_depth);
+    struct tokubackup_stats stats;
+    backup_with_copy_threads(n_threads, &stats);
+    tokubackup_set_io_depth(1);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    if (stats.io_uring_bytes == 0) {
+        printf("io_uring isn't available, so the copy didn't use it\n");
+    } else {
+        printf("io_uring copied %lu bytes with %.1f requests in flight on average (at most %lu)\n",
+               stats.io_uring_bytes,
+               stats.io_uring_waits > 0 ? (double) stats.io_uring_in_flight / stats.io_uring_waits : 0.0,
+               stats.io_uring_max_in_flight);
+        if (stats.io_uring_max_in_flight < 2 || stats.io_uring_max_in_flight > 2 * io_depth ||
+            stats.io_uring_in_flight <= stats.io_uring_waits) {
+            r = -1;
+        }
+    }
+    if (r != 0) {
+        fail();
+    } else {
+        pass();
+    }
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    printf(": io_uring_copy(depth=%u, threads=%u)\n", io_depth, n_threads);
+    return r;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    int r = 0;
+    r |= io_uring_copy(8, 1);
+    r |= io_uring_copy(3, 4);
+    r |= io_uring_copy(MAX_IO_DEPTH, 2);
+    return r != 0;
+}
@@ -0,0 +1,124 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+// Copy files that are large enough to be split into chunks, and check
+// that they were split, that workers other than the one that split a
+// file copied some of its chunks, and that the chunks add up to an
+// identical backup.  One file ends in a partial chunk, one is an exact
+// number of chunks, and one is just too small to be split.  Another is
+// written all over while a slow backup copies it, so that the writes
+// race with the range locks of chunks being copied by several workers,
+// and the backup must still match.
+
+const char *BACKUP_NAME = __FILE__;
+
+const int N_THREADS = 4;
+const uint64_t CHUNK_SIZE = 2 * 1024 * 1024;
+const size_t HOT_SIZE = 16 * 1024 * 1024;
+
+static int large_file_chunks(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+
+    setup_source();
+    setup_destination();
+    check(systemf("dd if=/dev/urandom of=%s/partial bs=1024 count=21000 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/exact bs=1M count=8 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/small bs=1024 count=3000 2>/dev/null", src) == 0);
+    const int hot_fd = create_file(src, "hot", HOT_SIZE);
+
+    // Let every worker copy, even if the disk is a rotational one, and
+    // slowly enough that the writer has time to write.
+    check(tokubackup_set_device_limits(src, N_THREADS, 0) == 0);
+    tokubackup_set_copy_threads(N_THREADS);
+    backup_set_copy_chunk_size(CHUNK_SIZE);
+    tokubackup_throttle_backup(16 * 1024 * 1024);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    pthread_t writer;
+    hot_file hot = {hot_fd, HOT_SIZE, 0, backup_done_copying, NULL};
+    check(pthread_create(&writer, NULL, write_until_copied, &hot) == 0);
+    while (!backup_done_copying()) {
+        sched_yield();
+    }
+    check(pthread_join(writer, NULL) == 0);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_throttle_backup(ULONG_MAX);
+    backup_set_copy_chunk_size(0);
+    tokubackup_set_copy_threads(1);
+    check(tokubackup_set_device_limits(src, 0, 0) == 0);
+    check(close(hot_fd) == 0);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    // partial is 11 chunks, exact 4 and hot 8.
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    printf("Split %lu files into %lu chunks, %lu of them copied by helpers\n",
+           stats.chunked_files, stats.chunks, stats.helper_chunks);
+    if (stats.chunked_files != 3 || stats.chunks != 23 || stats.helper_chunks == 0 || stats.copy_threads_used < 2) {
+        r = -1;
+    }
+    if (r != 0) {
+        fail();
+    } else {
+        pass();
+    }
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    printf(": large_file_chunks()\n");
+    return r;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    return large_file_chunks() != 0;
+}
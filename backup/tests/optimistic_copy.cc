@@ -0,0 +1,179 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// The copier copies a range without its range lock, and then copies
+// again whatever was written meanwhile.  Check the version counters
+// that tell it what was written, and that a resize waits for an
+// optimistic copy.  Then write and truncate all over a file while a
+// slow backup copies it, and make sure the backup is right.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "source_file.h"
+
+static const uint64_t MB = 1 << 20;
+static std::atomic<bool> resized(false);
+
+static void *resize(void *arg) {
+    source_file *file = (source_file *) arg;
+    file->begin_resize();
+    resized = true;
+    file->end_resize();
+    return NULL;
+}
+
+static void test_versions(void) {
+    source_file file("/some/file");
+    std::vector<std::pair<uint64_t, uint64_t> > parts;
+    copy_snapshot snapshot;
+
+    // No copy has looked yet, so a write has nothing to bump.
+    file.note_write(0, 100);
+    check(file.start_optimistic_copy(0, MB, &snapshot));
+    check(snapshot.m_versions.size() == MB / VERSION_BLOCK_SIZE);
+    file.finish_optimistic_copy();
+    file.changed_parts(0, MB, snapshot, &parts);
+    check(parts.empty());
+
+    // A write to two blocks of the range, and one beyond it that
+    // shares a counter with a third block.
+    file.note_write(2 * VERSION_BLOCK_SIZE + 10, 3 * VERSION_BLOCK_SIZE + 10);
+    file.note_write((VERSION_STRIPES + 7) * VERSION_BLOCK_SIZE, (VERSION_STRIPES + 7) * VERSION_BLOCK_SIZE + 1);
+    file.changed_parts(0, MB, snapshot, &parts);
+    check(parts.size() == 2);
+    check(parts[0].first == 2 * VERSION_BLOCK_SIZE && parts[0].second == 4 * VERSION_BLOCK_SIZE);
+    check(parts[1].first == 7 * VERSION_BLOCK_SIZE && parts[1].second == 8 * VERSION_BLOCK_SIZE);
+    // Only what the copy got to.
+    file.changed_parts(100, 3 * VERSION_BLOCK_SIZE, snapshot, &parts);
+    check(parts.size() == 1);
+    check(parts[0].first == 2 * VERSION_BLOCK_SIZE && parts[0].second == 3 * VERSION_BLOCK_SIZE);
+
+    // A resize waits for the optimistic copy to be done.
+    check(file.start_optimistic_copy(0, MB, &snapshot));
+    pthread_t thread;
+    int r = pthread_create(&thread, NULL, resize, &file);
+    check(r == 0);
+    usleep(100000);
+    check(!resized);
+    file.finish_optimistic_copy();
+    r = pthread_join(thread, NULL);
+    check(r == 0);
+    check(resized);
+    // And then everything the copy did must be done again.
+    file.changed_parts(0, MB, snapshot, &parts);
+    check(parts.size() == 1 && parts[0].first == 0 && parts[0].second == MB);
+
+    // No optimistic copies during a resize.
+    file.begin_resize();
+    check(!file.start_optimistic_copy(0, MB, &snapshot));
+    file.end_resize();
+    check(file.start_optimistic_copy(0, MB, &snapshot));
+    file.finish_optimistic_copy();
+}
+
+static const size_t HOT_SIZE = 16 * MB;
+static int hot_fd = -1;
+
+static int verify(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    int r = systemf("diff -r %s %s", src, dst);
+    free(src);
+    free(dst);
+    if (!WIFEXITED(r)) return -1;
+    if (WEXITSTATUS(r)!=0) return -1;
+    return 0;
+}
+
+static int test_writes_during_copy(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    hot_fd = create_file(src, "hot", HOT_SIZE);
+    free(src);
+
+    tokubackup_throttle_backup(16 * MB);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    pthread_t writer;
+    hot_file hot = {hot_fd, HOT_SIZE, 500, backup_done_copying, NULL};
+    int r = pthread_create(&writer, NULL, write_until_copied, &hot);
+    check(r == 0);
+    while (!backup_done_copying()) {
+        sched_yield();
+    }
+    r = pthread_join(writer, NULL);
+    check(r == 0);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_throttle_backup(ULONG_MAX);
+    r = close(hot_fd);
+    check(r == 0);
+
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    printf("Copied %lu bytes without the range lock and %lu again, and %lu ranges with it\n",
+           stats.optimistic_bytes, stats.recopied_bytes, stats.locked_copies);
+    if (stats.optimistic_bytes == 0 || stats.optimistic_bytes > HOT_SIZE) {
+        return -1;
+    }
+    return verify();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_versions();
+    int result = test_writes_during_copy();
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": optimistic_copy\n");
+    return result;
+}
@@ -0,0 +1,100 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+// Copy a tree of many directories and files with several copy
+// workers, and check that the backup is identical to the source, that
+// more than one worker copied files, and that idle workers stole work
+// from busy ones.
+
+const char *BACKUP_NAME = __FILE__;
+
+const int N_DIRS = 16;
+const int N_FILES_PER_DIR = 8;
+const int N_THREADS = 4;
+
+static void setup_tree(const char *src) {
+    for (int i = 0; i < N_DIRS; ++i) {
+        check(systemf("mkdir -p %s/dir%d/sub", src, i) == 0);
+        for (int j = 0; j < N_FILES_PER_DIR; ++j) {
+            // Sizes range from a few bytes to a few megabytes, so that
+            // some workers are busy with big files while others steal.
+            int kbytes = (i * N_FILES_PER_DIR + j) % 5 == 0 ? 3000 : j;
+            check(systemf("dd if=/dev/urandom of=%s/dir%d/file%d bs=1024 count=%d 2>/dev/null", src, i, j, kbytes) == 0);
+            check(systemf("echo %d.%d > %s/dir%d/sub/small%d", i, j, src, i, j) == 0);
+        }
+    }
+}
+
+static int parallel_copy(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+
+    setup_source();
+    setup_destination();
+    setup_tree(src);
+
+    struct tokubackup_stats stats;
+    backup_with_copy_threads(N_THREADS, &stats);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    printf("%lu of %lu copy threads copied files, and they stole %lu files\n",
+           stats.copy_threads_used, stats.copy_threads, stats.work_steals);
+    if (stats.copy_threads != (unsigned long) N_THREADS || stats.copy_threads_used < 2 || stats.work_steals == 0) {
+        r = -1;
+    }
+    if (r != 0) {
+        fail();
+    } else {
+        pass();
+    }
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    printf(": parallel_copy()\n");
+    return r;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    return parallel_copy() != 0;
+}
@@ -0,0 +1,156 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "backup_test_helpers.h"
+#include "range_lock.h"
+
+// Lockers of overlapping ranges must get them in the order they asked,
+// even when a later one could have gone ahead of an earlier waiter.
+// Then many threads lock random ranges, and no two may hold
+// overlapping ones.
+
+static range_lock the_lock;
+static range_lock_stats the_stats;
+static std::atomic<int> order(0);
+static std::atomic<int> a_got(0), b_got(0);
+
+struct request {
+    uint64_t lo, hi;
+    std::atomic<int> *got;
+};
+
+static void *lock_and_hold(void *arg) {
+    request *req = (request *) arg;
+    the_lock.lock(req->lo, req->hi, &the_stats);
+    *req->got = ++order;
+    usleep(10000);
+    int r = the_lock.unlock(req->lo, req->hi);
+    check(r == 0);
+    return NULL;
+}
+
+static const int N_THREADS = 8;
+static const int N_BYTES = 256;
+static const int N_LOCKS = 2000;
+static std::atomic<int> owner[N_BYTES];
+static std::atomic<int> n_overlaps(0);
+
+static void *lock_randomly(void *arg) {
+    const int me = (int)(long) arg + 1;
+    unsigned int seed = me;
+    for (int i = 0; i < N_LOCKS; ++i) {
+        uint64_t lo = rand_r(&seed) % N_BYTES;
+        uint64_t hi = lo + rand_r(&seed) % (N_BYTES - lo + 1);
+        the_lock.lock(lo, hi, NULL);
+        for (uint64_t b = lo; b < hi; ++b) {
+            int expected = 0;
+            if (!owner[b].compare_exchange_strong(expected, me)) {
+                n_overlaps++;
+            }
+        }
+        for (uint64_t b = lo; b < hi; ++b) {
+            owner[b] = 0;
+        }
+        int r = the_lock.unlock(lo, hi);
+        check(r == 0);
+    }
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    int result = 0;
+    the_lock.lock(0, 10, &the_stats);
+    request a = {5, 20, &a_got};
+    request b = {15, 25, &b_got};
+    pthread_t ta, tb;
+    int r = pthread_create(&ta, NULL, lock_and_hold, &a);
+    check(r == 0);
+    usleep(50000); // let a queue up.
+    r = pthread_create(&tb, NULL, lock_and_hold, &b);
+    check(r == 0);
+    usleep(50000);
+    // [15,25) isn't locked, but a asked for part of it first.
+    if (b_got != 0) {
+        printf("b went ahead of a\n");
+        result = 1;
+    }
+    r = the_lock.unlock(0, 10);
+    check(r == 0);
+    r = pthread_join(ta, NULL);
+    check(r == 0);
+    r = pthread_join(tb, NULL);
+    check(r == 0);
+    if (a_got != 1 || b_got != 2) {
+        printf("a got its range %d-th and b %d-th\n", a_got.load(), b_got.load());
+        result = 1;
+    }
+    check(the_lock.unlock(0, 10) == EINVAL);
+
+    if (the_stats.m_n_locks != 3 || the_stats.m_n_waits != 2 || the_stats.m_max_waiters != 2) {
+        printf("stats: %lu locks, %lu waits, at most %lu waiters\n",
+               the_stats.m_n_locks.load(), the_stats.m_n_waits.load(), the_stats.m_max_waiters.load());
+        result = 1;
+    }
+
+    pthread_t threads[N_THREADS];
+    for (long i = 0; i < N_THREADS; ++i) {
+        r = pthread_create(&threads[i], NULL, lock_randomly, (void *) i);
+        check(r == 0);
+    }
+    for (int i = 0; i < N_THREADS; ++i) {
+        r = pthread_join(threads[i], NULL);
+        check(r == 0);
+    }
+    if (n_overlaps != 0) {
+        printf("%d bytes were locked twice\n", n_overlaps.load());
+        result = 1;
+    }
+
+    if (result == 0) {
+        pass();
+    } else {
+        fail();
+    }
+    return result;
+}
@@ -49,7 +49,7 @@ std::atomic_int stepc = {0};
 static const uint64_t doit_lo = 5, doit_hi = 10;
 static void* doit(void* ignore) {
 
-    sf.lock_range(doit_lo, doit_hi);
+    sf.lock_range(doit_lo, doit_hi, NULL);
     stepa = 1;
 
 
@@ -76,7 +76,7 @@ static void thread_test_block(void) {
     while (!stepa) sched_yield(); // wait for stepa to finish.
     // Now 5,10 is blocked
     stepc = 1; // let him go ahead and run
-    sf.lock_range(9,12);
+    sf.lock_range(9,12, NULL);
     check(stepb==1); // must have gotten to stepb in the doit function.(
     
     {
@@ -105,7 +105,7 @@ static void thread_test_noblock(void) {
     while (!stepa) sched_yield(); // wait for stepa to finish
     // Now 5,10 is blocked.
     // this will deadlock of the lock blocks.
-    sf.lock_range(12,15);
+    sf.lock_range(12,15, NULL);
     
     stepc = 1;
     
@@ -125,7 +125,7 @@ static void thread_test_noblock(void) {
 int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
 
     // test a single range that covers everything
-    sf.lock_range(0, LLONG_MAX);
+    sf.lock_range(0, LLONG_MAX, NULL);
     check( sf.lock_range_would_block_unlocked(0, 1));
     check(!sf.lock_range_would_block_unlocked(0, 0));
     check( sf.lock_range_would_block_unlocked(10, 100));
@@ -136,8 +136,8 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
 
 
     // Test two ranges that are adjacent.
-    sf.lock_range(10, 20);
-    sf.lock_range(20, 30);
+    sf.lock_range(10, 20, NULL);
+    sf.lock_range(20, 30, NULL);
     check(!sf.lock_range_would_block_unlocked(0, 10));
     for (int i=10; i<30; i++) {
         for (int j=i+1; j<=30; j++) {
@@ -149,8 +149,8 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
     {   int r = sf.unlock_range(20, 30);            check(r==0); }
 
     // test two ranges with a gap in between.
-    sf.lock_range(10, 20);
-    sf.lock_range(30, 40);
+    sf.lock_range(10, 20, NULL);
+    sf.lock_range(30, 40, NULL);
     for (int i=0; i<50; i++) {
         for (int j=i; j<50; j++) {
             bool expect_block =
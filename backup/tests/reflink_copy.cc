@@ -0,0 +1,119 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+// Back up a directory to another directory on the same XFS filesystem,
+// which supports reflinks, and check that the backup's file shares its
+// blocks with the source instead of being a copy.  We make the
+// filesystem in a file and mount it with a loop device, so the test
+// only does something when run as root with mkfs.xfs installed.
+
+const char *BACKUP_NAME = __FILE__;
+
+static const char *IMAGE = "reflink_copy.xfs";
+static const char *MOUNT = "reflink_copy.mnt";
+
+static bool mount_xfs(void) {
+    if (geteuid() != 0 || systemf("which mkfs.xfs >/dev/null 2>&1") != 0) {
+        return false;
+    }
+    ignore(systemf("umount %s 2>/dev/null", MOUNT));
+    check(systemf("rm -rf %s %s && mkdir %s", IMAGE, MOUNT, MOUNT) == 0);
+    check(systemf("truncate -s 512M %s", IMAGE) == 0);
+    if (systemf("mkfs.xfs -q -m reflink=1 %s", IMAGE) != 0) {
+        return false;
+    }
+    return systemf("mount -o loop %s %s", IMAGE, MOUNT) == 0;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    if (!mount_xfs()) {
+        pass();
+        printf(": %s skipped, since we can't make an XFS filesystem here\n", BACKUP_NAME);
+        ignore(systemf("rm -rf %s %s", IMAGE, MOUNT));
+        return 0;
+    }
+
+    char src[100], dst[100];
+    snprintf(src, sizeof(src), "%s/source", MOUNT);
+    snprintf(dst, sizeof(dst), "%s/backup", MOUNT);
+    check(systemf("mkdir %s %s", src, dst) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/big bs=1M count=20 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/odd bs=1 count=12345 2>/dev/null", src) == 0);
+
+    const char *srcs[1] = {src};
+    const char *dsts[1] = {dst};
+    int r = tokubackup_create_backup(srcs, dsts, 1,
+                                     simple_poll_fun, NULL,
+                                     dummy_error, NULL,
+                                     NULL, NULL);
+    check(r == 0);
+
+    int result = 0;
+    if (systemf("diff -r %s %s", src, dst) != 0) {
+        printf("The backup differs from the source\n");
+        result = 1;
+    }
+    // filefrag marks extents that are shared with another file.
+    if (systemf("filefrag -v %s/big | grep -q shared", dst) != 0) {
+        printf("The backup was copied instead of cloned\n");
+        result = 1;
+    }
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    if (stats.cloned_bytes < (20 << 20)) {
+        printf("The backup says it cloned only %lu bytes\n", stats.cloned_bytes);
+        result = 1;
+    }
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": %s\n", BACKUP_NAME);
+
+    check(systemf("umount %s", MOUNT) == 0);
+    check(systemf("rm -rf %s %s", IMAGE, MOUNT) == 0);
+    return result;
+}
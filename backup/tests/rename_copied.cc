@@ -0,0 +1,164 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Renaming a file whose backup copy already has all of its data (the
+// copier has copied it, is copying it, or the file was created during
+// the backup) only renames the backup copy.  Check how the names move,
+// and then rename files in each of those states during a slow backup,
+// and make sure that none of them is copied again and that the backup
+// is right.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "completed_files.h"
+
+static void test_names(void) {
+    completed_files files;
+    files.add("/d/a");
+    files.add("/d/sub/x");
+    files.add("/d/sub/y");
+    files.add("/d/subway");
+
+    check(files.rename("/d/a", "/d/b"));
+    check(!files.contains("/d/a"));
+    check(files.contains("/d/b"));
+
+    // A file that isn't complete replaces whatever it is renamed over.
+    check(!files.rename("/d/c", "/d/b"));
+    check(!files.contains("/d/b"));
+
+    // The files of a renamed directory move with it.
+    check(!files.rename("/d/sub", "/e/sub"));
+    check(files.contains("/e/sub/x"));
+    check(files.contains("/e/sub/y"));
+    check(!files.contains("/d/sub/x"));
+    check(files.contains("/d/subway"));
+
+    files.remove("/e/sub/x");
+    check(!files.contains("/e/sub/x"));
+}
+
+static const int BUFSIZE = 4096;
+static const int NBUFS   = 2048;
+
+static void rename_in_src(const char *src, const char *from, const char *to) {
+    char old_name[PATH_MAX], new_name[PATH_MAX];
+    snprintf(old_name, sizeof(old_name), "%s/%s", src, from);
+    snprintf(new_name, sizeof(new_name), "%s/%s", src, to);
+    int r = rename(old_name, new_name);
+    check(r == 0);
+}
+
+static void test_renames_during_backup(void) {
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_source();
+    setup_destination();
+
+    char buf[BUFSIZE];
+    memset(buf, 'a', sizeof(buf));
+    {
+        int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/big", src);
+        check(fd >= 0);
+        for (int i = 0; i < NBUFS; i++) {
+            ssize_t r = write(fd, buf, sizeof(buf));
+            check(r == sizeof(buf));
+        }
+        int r = close(fd);
+        check(r == 0);
+    }
+
+    completed_files::reset_total_stats();
+    // Four seconds' worth of copying.
+    tokubackup_throttle_backup(BUFSIZE * NBUFS / 4);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+
+    // While the copier is copying it.
+    sleep(1);
+    rename_in_src(src, "big", "big2");
+
+    // Once it has copied it.
+    completed_files_stats stats;
+    do {
+        usleep(10000);
+        completed_files::get_total_stats(&stats);
+    } while (stats.m_n_completed == 0);
+    rename_in_src(src, "big2", "big3");
+
+    // A file made during the backup.
+    {
+        int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/new", src);
+        check(fd >= 0);
+        memset(buf, 'b', sizeof(buf));
+        ssize_t r = write(fd, buf, sizeof(buf));
+        check(r == sizeof(buf));
+        r = close(fd);
+        check(r == 0);
+    }
+    rename_in_src(src, "new", "new2");
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_throttle_backup(ULONG_MAX);
+
+    completed_files::get_total_stats(&stats);
+    check(stats.m_n_renames_kept == 3);
+    check(stats.m_n_renames_recopied == 0);
+
+    int r = systemf("diff -r %s %s", src, dst);
+    check(WIFEXITED(r) && WEXITSTATUS(r) == 0);
+    free(src);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_names();
+    test_renames_during_backup();
+    pass();
+    printf(": rename_copied\n");
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+
+// Rename directories during a backup.  One is renamed before the
+// copier has copied any of it, so the copier must copy it under its new
+// name.  The other is renamed once the copier has copied everything,
+// so only its backup copy is renamed.  Either way the backup must
+// match the source.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "completed_files.h"
+
+static const size_t FILE_SIZE = 64 * 1024;
+
+static void make_dir(const char *src, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", src, name);
+    int r = mkdir(path, 0777);
+    check(r == 0);
+}
+
+static void make_file(const char *src, const char *name) {
+    int fd = create_file(src, name, FILE_SIZE);
+    int r = close(fd);
+    check(r == 0);
+}
+
+static void rename_in_src(const char *src, const char *from, const char *to) {
+    char old_name[PATH_MAX], new_name[PATH_MAX];
+    snprintf(old_name, sizeof(old_name), "%s/%s", src, from);
+    snprintf(new_name, sizeof(new_name), "%s/%s", src, to);
+    int r = rename(old_name, new_name);
+    check(r == 0);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_source();
+    setup_destination();
+
+    make_dir(src, "early");
+    make_dir(src, "early/sub");
+    make_file(src, "early/a");
+    make_file(src, "early/sub/b");
+    make_dir(src, "late");
+    make_dir(src, "late/sub");
+    make_file(src, "late/c");
+    make_file(src, "late/sub/d");
+
+    completed_files::reset_total_stats();
+    backup_set_keep_capturing(true);
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+    pthread_t thread;
+    start_backup_thread(&thread);
+
+    // The copier can't finish a file while it is paused.
+    sleep(1);
+    rename_in_src(src, "early", "early2");
+    HotBackup::toggle_pause_point(HotBackup::COPIER_BEFORE_READ);
+
+    while (!backup_done_copying()) {
+        usleep(10000);
+    }
+    rename_in_src(src, "late", "late2");
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+
+    completed_files_stats stats;
+    completed_files::get_total_stats(&stats);
+    int result = 0;
+    printf("%lu directory renames kept, %lu recopied\n", stats.m_n_renames_kept, stats.m_n_renames_recopied);
+    if (stats.m_n_renames_kept != 1 || stats.m_n_renames_recopied != 1) {
+        result = 1;
+    }
+    int r = systemf("diff -r %s %s", src, dst);
+    if (!WIFEXITED(r) || WEXITSTATUS(r) != 0) {
+        result = 1;
+    }
+    free(src);
+    free(dst);
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": rename_directory\n");
+    return result;
+}
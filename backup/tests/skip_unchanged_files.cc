@@ -0,0 +1,179 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_manifest.h"
+#include "backup_test_helpers.h"
+
+// Make a full backup of files that haven't changed for a while, then an
+// incremental one after changing only some of them.  The unchanged
+// files must be taken from the full backup without being read, even
+// though one of them is written while the incremental backup is
+// capturing, and the incremental backup must still restore to the
+// source.
+
+const char *BACKUP_NAME = __FILE__;
+
+static const char *FILES[] = {"cold", "written", "hot", "new"};
+static const int N_FILES = sizeof(FILES) / sizeof(FILES[0]);
+
+// The bytes this process has read so far, from /proc/self/io.
+static unsigned long long bytes_read(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    check(f != NULL);
+    unsigned long long rchar = 0;
+    int n = fscanf(f, "rchar: %llu", &rchar);
+    check(n == 1);
+    int r = fclose(f);
+    check(r == 0);
+    return rchar;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    char *src = get_src();
+    char *full = get_dst();
+    char incr[PATH_MAX], restore[PATH_MAX];
+    snprintf(incr, sizeof(incr), "%s.incremental", full);
+    snprintf(restore, sizeof(restore), "%s.restore", full);
+
+    setup_source();
+    setup_destination();
+    check(systemf("rm -rf %s %s && mkdir %s %s", incr, restore, incr, restore) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/cold bs=1M count=4 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/written bs=1M count=4 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/hot bs=1000 count=100 2>/dev/null", src) == 0);
+    // Files changed just before a backup starts don't get fingerprints.
+    sleep(2);
+
+    // A full backup that leaves a manifest with fingerprints.
+    const char *no_base[1] = {NULL};
+    int r = tokubackup_set_incremental_base(no_base, 1);
+    check(r == 0);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+
+    int result = 0;
+    backup_manifest full_manifest;
+    r = full_manifest.read(full);
+    check(r == 0);
+    for (int i = 0; i < 3; ++i) {
+        char path[PATH_MAX + 100];
+        snprintf(path, sizeof(path), "%s/%s", src, FILES[i]);
+        struct stat sbuf;
+        r = stat(path, &sbuf);
+        check(r == 0);
+        const manifest_file *file = full_manifest.find(FILES[i]);
+        check(file != NULL);
+        if (file->m_fingerprint.m_ino != sbuf.st_ino || file->m_fingerprint.m_size != (uint64_t)sbuf.st_size) {
+            printf("The full backup has the wrong fingerprint for %s\n", FILES[i]);
+            result = 1;
+        }
+    }
+
+    // Change the source a little.
+    check(systemf("dd if=/dev/urandom bs=1000 count=10 2>/dev/null >> %s/hot", src) == 0);
+    check(systemf("echo brand new > %s/new", src) == 0);
+
+    // The incremental backup.  Once it has copied everything, change
+    // part of a block of a file it took from the full backup.
+    const char *base[1] = {full};
+    r = tokubackup_set_incremental_base(base, 1);
+    check(r == 0);
+    backup_set_keep_capturing(true);
+    const unsigned long long read_before = bytes_read();
+    start_backup_thread(&thread, strdup(incr));
+    while (!backup_is_capturing()) {
+        usleep(1000);
+    }
+    while (!backup_done_copying()) {
+        usleep(1000);
+    }
+    const unsigned long long n_read = bytes_read() - read_before;
+    overwrite(src, "written", 3000000, "captured");
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    r = tokubackup_set_incremental_base(NULL, 0);
+    check(r == 0);
+
+    // Only the hot file (and the manifests) should have been read.
+    if (n_read > 1000000) {
+        printf("The incremental backup read %llu bytes\n", n_read);
+        result = 1;
+    }
+    struct tokubackup_stats stats;
+    tokubackup_get_stats(&stats);
+    if (stats.taken_files != 2 || stats.taken_bytes != 8 * 1024 * 1024) {
+        printf("The incremental backup took %lu files (%lu bytes) from the full one\n", stats.taken_files, stats.taken_bytes);
+        result = 1;
+    }
+
+    backup_manifest manifest;
+    r = manifest.read(incr);
+    check(r == 0);
+    for (int i = 0; i < N_FILES; ++i) {
+        const manifest_file *file = manifest.find(FILES[i]);
+        check(file != NULL);
+        restore_file(full, incr, restore, FILES[i], file);
+    }
+    if (systemf("diff -r %s %s", src, restore) != 0) {
+        printf("The restored backup differs from the source\n");
+        result = 1;
+    }
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": %s\n", BACKUP_NAME);
+
+    check(systemf("rm -rf %s %s", incr, restore) == 0);
+    cleanup_dirs();
+    free(src);
+    free(full);
+    return result;
+}
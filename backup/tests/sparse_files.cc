@@ -0,0 +1,143 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+// Back up sparse files, and punch a hole in a file while the backup is
+// capturing.  The backup must have the same contents as the source, and
+// it must not use more disk space than the source does, i.e. the holes
+// must still be holes.
+
+const char *BACKUP_NAME = __FILE__;
+
+static const off_t MB = 1 << 20;
+
+static int check_file(const char *src, const char *dst, const char *name) {
+    int r = systemf("cmp %s/%s %s/%s", src, name, dst, name);
+    if (r != 0) {
+        printf("%s differs\n", name);
+        return 1;
+    }
+    off_t src_bytes = allocated_bytes(src, name);
+    off_t dst_bytes = allocated_bytes(dst, name);
+    // Allow for a few blocks of difference in how the file systems
+    // round the data extents.
+    if (dst_bytes > src_bytes + 64 * 1024) {
+        printf("%s uses %ld bytes in the backup but only %ld in the source\n", name, dst_bytes, src_bytes);
+        return 1;
+    }
+    return 0;
+}
+
+static int sparse_backup(uint64_t chunk_size) {
+    char *src = get_src();
+    char *dst = get_dst();
+
+    setup_source();
+    setup_destination();
+    // A file that starts with a hole and ends with one.
+    check(systemf("truncate -s 20M %s/sparse", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/sparse bs=64k seek=16 count=1 conv=notrunc 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/sparse bs=64k seek=160 count=1 conv=notrunc 2>/dev/null", src) == 0);
+    // A file that is nothing but a hole.
+    check(systemf("truncate -s 5M %s/hole", src) == 0);
+    // A file that we punch a hole in during the backup.
+    check(systemf("dd if=/dev/urandom of=%s/punched bs=1M count=4 2>/dev/null", src) == 0);
+
+    backup_set_copy_chunk_size(chunk_size);
+    tokubackup_set_copy_threads(chunk_size ? 4 : 1);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    // The previous backup's done-copying flag stays set until this one
+    // starts capturing.
+    while (!backup_is_capturing()) {
+        usleep(1000);
+    }
+    while (!backup_done_copying()) {
+        usleep(1000);
+    }
+
+    int fd = openf(O_RDWR, 0, "%s/punched", src);
+    check(fd >= 0);
+    int r = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, MB, 2 * MB);
+    if (r != 0) {
+        // Nothing to capture if this file system can't punch holes.
+        check(errno == EOPNOTSUPP);
+    }
+    r = close(fd);
+    check(r == 0);
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    backup_set_copy_chunk_size(0);
+    tokubackup_set_copy_threads(1);
+
+    int result = 0;
+    result |= check_file(src, dst, "sparse");
+    result |= check_file(src, dst, "hole");
+    result |= check_file(src, dst, "punched");
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": sparse_backup(chunk_size=%lu)\n", chunk_size);
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    return result;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    int r = 0;
+    r |= sparse_backup(0);
+    r |= sparse_backup(MB);
+    return r != 0;
+}
@@ -42,6 +42,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup_test_helpers.h"
 #include "backup_internal.h"
+#include "copy_engine.h"
 #include "real_syscalls.h"
 
 static pwrite_fun_t original_pwrite;
@@ -51,6 +52,14 @@ static ssize_t my_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
     return original_pwrite(fd, buf, nbyte, offset);
 }
 
+// The copier writes with pwrite, so once the application has written
+// its data we make every pwrite fail.
+static ssize_t my_failing_pwrite(int fd, const void *buf __attribute__((__unused__)), size_t nbyte, off_t offset) {
+    fprintf(stderr, "Doing pwrite(%d, %ld, %ld)\n", fd, nbyte, offset); // ok to do a write, since we aren't further interposing writes in this test.
+    errno = ENOSPC;
+    return -1;
+}
+
 static write_fun_t  original_write;
 static ssize_t my_write(int fd, const void *buf, size_t nbyte) {
     fprintf(stderr, "Doing write(%d, %p, %ld)\n", fd, buf, nbyte); // ok to do a write, since we aren't further interposing writes in this test.
@@ -76,6 +85,7 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
 
     original_pwrite = register_pwrite(my_pwrite);
     original_write  = register_write(my_write);
+    copy_engine::force_method(COPY_METHOD_READ_WRITE); // so that the copier's writes go through my_pwrite.
 
     backup_set_keep_capturing(true);
     pthread_t thread;
@@ -92,6 +102,7 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
         int r = close(fd);
         check(r==0);
     }
+    register_pwrite(my_failing_pwrite);
 
     start_backup_thread_with_funs(&thread,
                                   get_src(), get_dst(),
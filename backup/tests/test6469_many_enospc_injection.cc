@@ -43,6 +43,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup_test_helpers.h"
 #include "backup_internal.h"
+#include "copy_engine.h"
 #include "real_syscalls.h"
 
 static bool disable_injections = true;
@@ -145,6 +146,7 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
     src = get_src();
     original_pwrite = register_pwrite(my_pwrite);
     original_write  = register_write(my_write);
+    copy_engine::force_method(COPY_METHOD_READ_WRITE); // so that the copier's writes go through my_pwrite.
 
     injection_pattern.push_back(0);
     testit();
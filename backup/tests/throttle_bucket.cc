@@ -0,0 +1,141 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+// Every copy worker of a backup takes what it reads out of one token
+// bucket, so the throttle holds for the backup as a whole, however
+// small its files are.  Check the bucket's arithmetic, and then that a
+// backup of many small files with several workers keeps to the
+// throttle, less the burst.
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "token_bucket.h"
+
+static const uint64_t KB = 1024;
+static const uint64_t MB = 1024 * KB;
+
+static void test_bucket(void) {
+    {
+        token_bucket bucket;
+        // Without a throttle, nothing waits.
+        bucket.take(100 * MB, ULONG_MAX, 0);
+        check(bucket.usecs_to_wait(ULONG_MAX, 0) == 0);
+        // Half a second's worth of debt.
+        bucket.take(512 * KB, MB, 0);
+        uint64_t usecs = bucket.usecs_to_wait(MB, 0);
+        check(usecs > 400000 && usecs <= 500001);
+        // Which is never paid off if the throttle is 0.
+        check(bucket.usecs_to_wait(0, 0) == UINT64_MAX);
+        // And is paid off twice as fast at twice the rate.
+        usecs = bucket.usecs_to_wait(2 * MB, 0);
+        check(usecs > 150000 && usecs <= 250001);
+    }
+    {
+        token_bucket bucket;
+        // After a rest, the bucket holds the burst, but no more.
+        usleep(200000);
+        check(bucket.usecs_to_wait(MB, 100 * KB) == 0);
+        bucket.take(100 * KB, MB, 100 * KB);
+        check(bucket.usecs_to_wait(MB, 100 * KB) == 0);
+        bucket.take(100 * KB, MB, 100 * KB);
+        const uint64_t usecs = bucket.usecs_to_wait(MB, 100 * KB);
+        check(usecs > 50000 && usecs <= 100001);
+    }
+}
+
+static int test_small_files(void) {
+    const int N_FILES = 64;
+    const int FILE_KB = 32;
+    const unsigned long THROTTLE = MB;
+    const unsigned long BURST = 512 * KB;
+
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_source();
+    setup_destination();
+    for (int i = 0; i < N_FILES; ++i) {
+        check(systemf("dd if=/dev/zero of=%s/f%d bs=1024 count=%d 2>/dev/null", src, i, FILE_KB) == 0);
+    }
+
+    // Let every worker copy, even if the disk is a rotational one.
+    check(tokubackup_set_device_limits(src, 4, 0) == 0);
+    tokubackup_set_copy_threads(4);
+    tokubackup_throttle_backup(THROTTLE);
+    tokubackup_set_throttle_burst(BURST);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tokubackup_set_throttle_burst(0);
+    tokubackup_throttle_backup(ULONG_MAX);
+    tokubackup_set_copy_threads(1);
+    check(tokubackup_set_device_limits(src, 0, 0) == 0);
+
+    const double td = tdiff(start, end);
+    const double expected = (N_FILES * FILE_KB * KB - BURST) / (double)THROTTLE;
+    printf("time used     == %6.3fs\n", td);
+    printf("time expected >= %6.3fs\n", expected);
+    int result = 0;
+    if (td < expected) {
+        result = -1;
+    }
+    if (systemf("diff -r %s %s", src, dst) != 0) {
+        result = -1;
+    }
+    free(src);
+    free(dst);
+    return result;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_bucket();
+    int result = test_small_files();
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": throttle_bucket\n");
+    return result;
+}
@@ -0,0 +1,162 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_manifest.h"
+#include "backup_test_helpers.h"
+
+// A backup made with a manifest verifies against it, including blocks
+// written by capture, and damage to a backup copy or to the manifest
+// itself is found.
+
+const char *BACKUP_NAME = __FILE__;
+
+static int expect_verify(const char *dir, int expected, const char *what) {
+    int r = tokubackup_verify_backup(dir);
+    if (r != expected) {
+        printf("Verifying %s gave %d instead of %d\n", what, r, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// The manifest can be used in place: map it and look at the header.
+static int check_mapped_manifest(const char *dir, uint64_t n_files) {
+    int fd = openf(O_RDONLY, 0, "%s/%s", dir, MANIFEST_NAME);
+    check(fd >= 0);
+    struct stat sbuf;
+    int r = fstat(fd, &sbuf);
+    check(r == 0);
+    void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    check(map != MAP_FAILED);
+    const manifest_header *header = (const manifest_header *) map;
+    const manifest_entry *entries = (const manifest_entry *) (header + 1);
+    int result = 0;
+    if (header->m_n_files != n_files || header->m_size != (uint64_t)sbuf.st_size || sbuf.st_size % 8 != 0) {
+        printf("The manifest's header is wrong\n");
+        result = 1;
+    }
+    for (uint64_t i = 0; result == 0 && i < header->m_n_files; ++i) {
+        if (entries[i].m_checksums_offset % 8 != 0 ||
+            (i > 0 && strncmp((const char *) map + entries[i - 1].m_path_offset, (const char *) map + entries[i].m_path_offset, entries[i].m_path_len) >= 0)) {
+            printf("Entry %lu of the manifest is misplaced\n", i);
+            result = 1;
+        }
+    }
+    r = munmap(map, sbuf.st_size);
+    check(r == 0);
+    r = close(fd);
+    check(r == 0);
+    return result;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    char *src = get_src();
+    char *dst = get_dst();
+    char incr[PATH_MAX];
+    snprintf(incr, sizeof(incr), "%s.incremental", dst);
+
+    setup_source();
+    setup_destination();
+    check(systemf("rm -rf %s && mkdir %s", incr, incr) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/a bs=1M count=2 2>/dev/null", src) == 0);
+    check(systemf("dd if=/dev/urandom of=%s/b bs=1000 count=100 2>/dev/null", src) == 0);
+    check(systemf("echo hello > %s/c", src) == 0);
+
+    // A full backup with a manifest, with a write captured after the copy.
+    const char *no_base[1] = {NULL};
+    int r = tokubackup_set_incremental_base(no_base, 1);
+    check(r == 0);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) {
+        usleep(1000);
+    }
+    while (!backup_done_copying()) {
+        usleep(1000);
+    }
+    overwrite(src, "a", 100000, "captured");
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+
+    int result = 0;
+    result |= expect_verify(dst, 0, "the full backup");
+    result |= check_mapped_manifest(dst, 3);
+
+    // An incremental backup of a small change.
+    overwrite(src, "a", 1500000, "changed");
+    const char *base[1] = {dst};
+    r = tokubackup_set_incremental_base(base, 1);
+    check(r == 0);
+    start_backup_thread(&thread, strdup(incr));
+    finish_backup_thread(thread);
+    r = tokubackup_set_incremental_base(NULL, 0);
+    check(r == 0);
+    result |= expect_verify(incr, 0, "the incremental backup");
+
+    // Damage.
+    overwrite(dst, "b", 5000, "oops");
+    result |= expect_verify(dst, EBADMSG, "a damaged backup copy");
+    overwrite(incr, MANIFEST_NAME, 100, "oops");
+    result |= expect_verify(incr, EBADMSG, "a damaged manifest");
+    result |= expect_verify(src, ENOENT, "a directory without a manifest");
+
+    if (result != 0) {
+        fail();
+    } else {
+        pass();
+    }
+    printf(": %s\n", BACKUP_NAME);
+
+    check(systemf("rm -rf %s", incr) == 0);
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    return result;
+}
@@ -0,0 +1,119 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "mutex.h"
+#include "token_bucket.h"
+
+#include <limits.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static uint64_t now_usecs(void) throw() {
+    struct timespec ts;
+    ignore(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+token_bucket::token_bucket(void) throw()
+    : m_tokens(0),
+      m_last_fill(0)   // so that the first fill fills it to the burst.
+{
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+token_bucket::~token_bucket(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// fill() -
+//
+// Description:
+//
+//     Adds the tokens that the rate has earned since we last did, but
+// never more than the burst.  Without a throttle the bucket is kept
+// full, so that setting one later doesn't start with a debt.  Call
+// this with m_mutex held.
+//
+void token_bucket::fill(unsigned long rate, uint64_t burst, uint64_t now) throw() {
+    if (rate == ULONG_MAX) {
+        m_tokens = burst;
+    } else if (now > m_last_fill) {
+        m_tokens += (double)rate * (now - m_last_fill) / 1e6;
+        if (m_tokens > burst) {
+            m_tokens = burst;
+        }
+    }
+    m_last_fill = now;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void token_bucket::take(uint64_t n_bytes, unsigned long rate, uint64_t burst) throw() {
+    const uint64_t now = now_usecs();
+    with_mutex_locked ml(&m_mutex);
+    this->fill(rate, burst, now);
+    if (rate != ULONG_MAX) {
+        m_tokens -= n_bytes;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t token_bucket::usecs_to_wait(unsigned long rate, uint64_t burst) throw() {
+    const uint64_t now = now_usecs();
+    with_mutex_locked ml(&m_mutex);
+    this->fill(rate, burst, now);
+    if (m_tokens >= 0) {
+        return 0;
+    }
+    if (rate == 0) {
+        return UINT64_MAX;
+    }
+    // Round up, so that we don't wake up a moment too soon.
+    return (uint64_t)(-m_tokens * 1e6 / rate) + 1;
+}
@@ -0,0 +1,78 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// token_bucket:
+//
+// Description:
+//
+//     Throttles the reads of a whole backup, however many copiers and
+// workers do them.  The bucket fills at the throttle's rate, up to
+// the burst, and every byte the copy reads takes a token out of it.
+// A read is never refused: the bucket goes into debt instead, and
+// whoever reads next waits until the debt has been paid off.  So the
+// backup as a whole reads at the rate, with a burst after it has read
+// less than that.
+//
+//     The rate and burst are passed in every time, rather than kept,
+// since the user may change them while the backup runs.  A rate of
+// ULONG_MAX is no throttle at all, and a rate of 0 lets nothing more
+// be read until it changes.
+//
+class token_bucket {
+  private:
+    pthread_mutex_t m_mutex;      // protects the rest.
+    double m_tokens;              // bytes that may be read now.  Negative if the reads are ahead of the rate.
+    uint64_t m_last_fill;         // when we last added to m_tokens, in usecs.
+    void fill(unsigned long rate, uint64_t burst, uint64_t now) throw();
+  public:
+    token_bucket(void) throw();
+    ~token_bucket(void) throw();
+    void take(uint64_t n_bytes, unsigned long rate, uint64_t burst) throw();
+    // Effect: Take n_bytes worth of tokens, going into debt if there aren't enough.
+    uint64_t usecs_to_wait(unsigned long rate, uint64_t burst) throw();
+    // Effect: Return how long it will be until the debt is paid off, at this rate.  UINT64_MAX if it never will be.
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,168 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "check.h"
+#include "copy_job.h"
+#include "mutex.h"
+#include "work_queue.h"
+
+#include <stdlib.h>
+
+template class std::vector<work_queue::worker_deque *>;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_task::copy_task(char *name, copy_job *job) throw()
+    : m_name(name),
+      m_job(job)
+{}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_task::~copy_task(void) throw() {
+    free(m_name);
+    if (m_job != NULL) {
+        m_job->remove_reference();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+work_queue::work_queue(void) throw()
+{}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+work_queue::~work_queue(void) throw() {
+    this->destroy_deques();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::destroy_deques(void) throw() {
+    this->clear();
+    for (size_t i = 0; i < m_deques.size(); ++i) {
+        int r = pthread_mutex_destroy(&m_deques[i]->m_mutex);
+        check(r==0);
+        delete m_deques[i];
+    }
+    m_deques.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_n_workers() -
+//
+// Description:
+//
+//     Sizes the queue for a copy with the given number of workers.
+// The copier may be reused for several directory pairs, and each may
+// run with a different number of workers.
+//
+void work_queue::set_n_workers(int n_workers) throw() {
+    check(n_workers > 0);
+    this->destroy_deques();
+    for (int i = 0; i < n_workers; ++i) {
+        worker_deque *d = new worker_deque;
+        int r = pthread_mutex_init(&d->m_mutex, NULL);
+        check(r==0);
+        m_deques.push_back(d);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int work_queue::n_workers(void) const throw() {
+    return m_deques.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::push(int worker, copy_task *task) throw() {
+    worker_deque *d = m_deques[worker];
+    with_mutex_locked ml(&d->m_mutex, BACKTRACE(NULL));
+    d->m_items.push_back(task);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_task *work_queue::pop(int worker) throw() {
+    worker_deque *d = m_deques[worker];
+    with_mutex_locked ml(&d->m_mutex, BACKTRACE(NULL));
+    if (d->m_items.empty()) {
+        return NULL;
+    }
+    copy_task *task = d->m_items.front();
+    d->m_items.pop_front();
+    return task;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// steal() -
+//
+// Description:
+//
+//     Takes work from the back of another worker's deque.  The owner
+// works from the front, so the thief and the owner only contend for
+// the same item when the victim's deque is nearly empty.
+//
+copy_task *work_queue::steal(int worker) throw() {
+    const int n = m_deques.size();
+    for (int i = 1; i < n; ++i) {
+        worker_deque *d = m_deques[(worker + i) % n];
+        with_mutex_locked ml(&d->m_mutex, BACKTRACE(NULL));
+        if (!d->m_items.empty()) {
+            copy_task *task = d->m_items.back();
+            d->m_items.pop_back();
+            return task;
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::clear(void) throw() {
+    for (size_t i = 0; i < m_deques.size(); ++i) {
+        worker_deque *d = m_deques[i];
+        with_mutex_locked ml(&d->m_mutex, BACKTRACE(NULL));
+        while (!d->m_items.empty()) {
+            delete d->m_items.front();
+            d->m_items.pop_front();
+        }
+    }
+}
@@ -0,0 +1,118 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+class copy_job;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_task:
+//
+// Description:
+//
+//     One unit of work for a copy worker.  Either m_name is a file or
+// directory to copy (a malloc'd path relative to the source
+// directory), or m_job is a large file whose chunks the worker should
+// help to copy.
+//
+struct copy_task {
+    copy_task(char *name, copy_job *job) throw();
+    ~copy_task(void) throw(); // frees the name and drops our reference to the job.
+    char *m_name;
+    copy_job *m_job;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// work_queue:
+//
+// Description:
+//
+//     The per-worker deques used by the copier's worker pool.  Each
+// worker pushes the work it discovers (for example the entries of a
+// directory it just opened) onto the back of its own deque and takes
+// work from the front, which preserves the breadth-first order of the
+// single-threaded copier.  A worker whose own deque is empty steals
+// from the back of some other worker's deque, so that workers do not
+// all serialize on one queue mutex.
+//
+//     The queue takes ownership of the tasks pushed onto it; whoever
+// pops a task owns it again.
+//
+class work_queue {
+  public:
+    work_queue(void) throw();
+    ~work_queue(void) throw();
+
+    void set_n_workers(int n_workers) throw();
+    // Effect: Create one (empty) deque for each worker.  Any tasks
+    //  left over from a previous use of the queue are freed.
+    //  Requires: no worker is using the queue.
+
+    int n_workers(void) const throw();
+
+    void push(int worker, copy_task *task) throw();
+    // Effect: Add item to the back of the given worker's deque.
+
+    copy_task *pop(int worker) throw() __attribute__((warn_unused_result));
+    // Effect: Remove and return the item at the front of the given
+    //  worker's deque.  Returns NULL if that deque is empty.
+
+    copy_task *steal(int worker) throw() __attribute__((warn_unused_result));
+    // Effect: Remove and return an item from the back of some other
+    //  worker's deque, trying the workers after the given one in turn.
+    //  Returns NULL if every other deque is empty.
+
+    void clear(void) throw();
+    // Effect: Free every task still in the queue.
+
+  private:
+    struct worker_deque {
+        pthread_mutex_t m_mutex;
+        std::deque<copy_task *> m_items;
+    };
+    std::vector<worker_deque *> m_deques;
+    void destroy_deques(void) throw();
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,72 @@
+/* A speedtest using multithreaded lseek as the inner loop, to see how
+ * seeking scales with the number of threads.  Each thread seeks its
+ * own file.  The backup library doesn't interpose lseek(), so the two
+ * versions should be just as fast. */
+
+/* Link with, and without the backuplib, and compare performance */
+#define _FILE_OFFSET_BITS 64 
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+const int max_threads = 64;
+const int n_seeks_per_thread = 1000000;
+
+static void* runseeks(void *fdp) {
+    int fd = *(int*)fdp;
+    for (int i=0; i<n_seeks_per_thread; i++) {
+        off_t r = lseek(fd, i, SEEK_SET);
+        assert(r==i);
+    }
+    return fdp;
+}
+
+static double now(void) {
+    struct timespec ts;
+    int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(r==0);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main (int argc __attribute__((unused)), char *argv[]  __attribute__((unused))) {
+    int fds[max_threads];
+    for (int i=0; i<max_threads; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), "speedtest.lseek.%d", i);
+        fds[i] = open(name, O_RDWR|O_CREAT, 0777);
+        assert(fds[i]>=0);
+    }
+    printf("threads  seeks/s (all threads)  seeks/s (per thread)\n");
+    for (int n_threads=1; n_threads<=max_threads; n_threads*=2) {
+        pthread_t threads[n_threads];
+        double start = now();
+        for (int i=0; i<n_threads; i++) {
+            int r = pthread_create(&threads[i], NULL, runseeks, &fds[i]);
+            assert(r==0);
+        }
+        for (int i=0; i<n_threads; i++) {
+            void *v;
+            int r = pthread_join(threads[i], &v);
+            assert(r==0);
+            assert((int*)v == &fds[i]);
+        }
+        double seconds = now() - start;
+        double total = (double)n_threads * n_seeks_per_thread / seconds;
+        printf("%7d  %21.0f  %20.0f\n", n_threads, total, total / n_threads);
+    }
+    for (int i=0; i<max_threads; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), "speedtest.lseek.%d", i);
+        int r = close(fds[i]);
+        assert(r==0);
+        r = unlink(name);
+        assert(r==0);
+    }
+    return 0;
+}
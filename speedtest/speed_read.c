@@ -0,0 +1,161 @@
+/* A speedtest using multithreaded read and lseek as the inner loop,
+ * while a backup is running.  The backup library doesn't interpose
+ * read() or lseek(), so reading should be as fast with it as without
+ * it.  A big file, copied at a crawl, keeps the backup going while we
+ * read; each thread reads its own file in the backup's source
+ * directory, seeking back to the start at the end of it. */
+
+/* Link with, and without the backuplib, and compare performance */
+#define _FILE_OFFSET_BITS 64 
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* From backup.h, which is C++.  They are weak, so that the plain
+ * version links without the backuplib, and runs without a backup. */
+extern int tokubackup_create_backup(const char *source_dirs[], const char *dest_dirs[], int dir_count,
+                                    int (*poll_fun)(float, const char *, void *), void *poll_extra,
+                                    void (*error_fun)(int, const char *, void *), void *error_extra,
+                                    int (*check_fun)(const char *, void *), void *exclude_copy_extra,
+                                    void (*bsc_fun)(void *), void *bsc_extra,
+                                    void (*asc_fun)(void *), void *asc_extra) __attribute__((weak));
+extern void tokubackup_throttle_backup(unsigned long bytes_per_second) __attribute__((weak));
+
+#define SRC "speedtest.read.src"
+#define DST "speedtest.read.dst"
+
+#define MAX_THREADS 64
+const int n_reads_per_thread = 200000;
+const int blocksize = 4096;
+const int blocks_per_file = 256;
+const int big_file_blocks = 4096;
+
+static volatile int backup_started = 0;
+
+static int poll_fun(float progress __attribute__((unused)), const char *progress_string __attribute__((unused)), void *extra __attribute__((unused))) {
+    backup_started = 1;
+    return 0;
+}
+
+static void error_fun(int error_number, const char *error_string, void *extra __attribute__((unused))) {
+    fprintf(stderr, "backup error %d: %s\n", error_number, error_string);
+}
+
+static void *run_backup(void *arg __attribute__((unused))) {
+    const char *srcs[1] = {SRC};
+    const char *dsts[1] = {DST};
+    int r = tokubackup_create_backup(srcs, dsts, 1, poll_fun, NULL, error_fun, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    assert(r==0);
+    return NULL;
+}
+
+static void fill_file(const char *name, int n_blocks) {
+    char buf[blocksize];
+    memset(buf, 'a', sizeof(buf));
+    int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0777);
+    assert(fd>=0);
+    for (int i=0; i<n_blocks; i++) {
+        ssize_t r = write(fd, buf, sizeof(buf));
+        assert(r==blocksize);
+    }
+    int r = close(fd);
+    assert(r==0);
+}
+
+static void* runreads(void *fdp) {
+    int fd = *(int*)fdp;
+    char buf[blocksize];
+    for (int i=0; i<n_reads_per_thread; i++) {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r==0) {
+            off_t o = lseek(fd, 0, SEEK_SET);
+            assert(o==0);
+            r = read(fd, buf, sizeof(buf));
+        }
+        assert(r==blocksize);
+    }
+    return fdp;
+}
+
+static double now(void) {
+    struct timespec ts;
+    int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(r==0);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main (int argc __attribute__((unused)), char *argv[]  __attribute__((unused))) {
+    int r = system("rm -rf " SRC " " DST);
+    assert(r==0);
+    r = mkdir(SRC, 0777);
+    assert(r==0);
+    r = mkdir(DST, 0777);
+    assert(r==0);
+    fill_file(SRC "/big", big_file_blocks);
+    for (int i=0; i<MAX_THREADS; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), SRC "/data.%d", i);
+        fill_file(name, blocks_per_file);
+    }
+
+    pthread_t backup_thread;
+    const int with_backup = (tokubackup_create_backup != NULL);
+    if (with_backup) {
+        tokubackup_throttle_backup(blocksize);
+        r = pthread_create(&backup_thread, NULL, run_backup, NULL);
+        assert(r==0);
+        while (!backup_started) {
+            usleep(1000);
+        }
+    }
+
+    /* Opened during the backup, so that the backup tracks them. */
+    int fds[MAX_THREADS];
+    for (int i=0; i<MAX_THREADS; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), SRC "/data.%d", i);
+        fds[i] = open(name, O_RDONLY);
+        assert(fds[i]>=0);
+    }
+    printf("%s\n", with_backup ? "during a backup" : "without the backuplib");
+    printf("threads  reads/s (all threads)  reads/s (per thread)\n");
+    for (int n_threads=1; n_threads<=MAX_THREADS; n_threads*=2) {
+        pthread_t threads[n_threads];
+        double start = now();
+        for (int i=0; i<n_threads; i++) {
+            r = pthread_create(&threads[i], NULL, runreads, &fds[i]);
+            assert(r==0);
+        }
+        for (int i=0; i<n_threads; i++) {
+            void *v;
+            r = pthread_join(threads[i], &v);
+            assert(r==0);
+            assert((int*)v == &fds[i]);
+        }
+        double seconds = now() - start;
+        double total = (double)n_threads * n_reads_per_thread / seconds;
+        printf("%7d  %21.0f  %20.0f\n", n_threads, total, total / n_threads);
+    }
+    for (int i=0; i<MAX_THREADS; i++) {
+        r = close(fds[i]);
+        assert(r==0);
+    }
+
+    if (with_backup) {
+        tokubackup_throttle_backup(ULONG_MAX);
+        r = pthread_join(backup_thread, NULL);
+        assert(r==0);
+    }
+    r = system("rm -rf " SRC " " DST);
+    assert(r==0);
+    return 0;
+}